@@ -46,19 +46,20 @@ void filtered( const cv::Mat points, bool (*function)(pt), std::vector<int> &ind
 template<class pt>
 void filter( const cv::Mat points, const cv::Mat descriptors, bool (*function)(pt), cv::Mat &new_points, cv::Mat &new_descriptors  )
 {
+    // Descriptors are copied by whole rows, whatever their size; for the map
+    // itself see src/cloudquery.hpp
     std::vector<pt> r_pts;
-    std::vector<uchar> r_dsc;
-    cv::MatConstIterator_<uchar> dsc_it = descriptors.begin<uchar>();
+    cv::Mat r_dsc;
     cv::MatConstIterator_<pt> pts_it = points.begin<pt>();
     cv::MatConstIterator_<pt> end = points.end<pt>();
-    for( ; pts_it != end; pts_it++, dsc_it++ ) {
+    for( int row = 0; pts_it != end; pts_it++, row++ ) {
         if(function((*pts_it))) {
             r_pts.push_back(*pts_it);
-            r_dsc.push_back(*dsc_it);
+            r_dsc.push_back(descriptors.row(row));
         }
     }
-    new_points = cv::Mat(r_pts);
-    new_descriptors = cv::Mat(r_dsc);
+    new_points = cv::Mat(r_pts, true);
+    new_descriptors = r_dsc;
 }
 // Function for filtering 2D points
 bool f2(cv::Point2f p)
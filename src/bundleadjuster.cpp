@@ -0,0 +1,453 @@
+#include "bundleadjuster.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+#define BA_EPSILON 1e-12
+// A point behind a camera costs as much as an observation this many pixels off
+#define BA_BEHIND_PIXELS 1000.0
+
+BundleAdjuster::BundleAdjuster(const cv::Matx33d &K)
+{
+    this->K = K;
+    this->huber = 2.5;
+    this->max_iterations = 10;
+    this->time_budget = 20.0;
+    this->threads = defaultThreadCount();
+    this->with_jacobians = false;
+    this->iterations = 0;
+    this->initial_cost = 0.0;
+    this->final_cost = 0.0;
+}
+
+void BundleAdjuster::setHuberThreshold(double pixels)
+{
+    this->huber = pixels;
+}
+
+void BundleAdjuster::setMaxIterations(int n)
+{
+    this->max_iterations = n;
+}
+
+void BundleAdjuster::setTimeBudget(double milliseconds)
+{
+    this->time_budget = milliseconds;
+}
+
+void BundleAdjuster::setThreads(int n)
+{
+    this->threads = n;
+}
+
+/**
+ * Remove all cameras, points and observations. Buffers keep their capacity.
+ **/
+void BundleAdjuster::clear()
+{
+    poses.clear();
+    fixed.clear();
+    points.clear();
+    obs_camera.clear();
+    obs_point.clear();
+    obs_measurement.clear();
+}
+
+int BundleAdjuster::addCamera(const cv::Matx34d &pose, bool fixed)
+{
+    this->poses.push_back(pose);
+    this->fixed.push_back(fixed);
+    return poses.size() - 1;
+}
+
+int BundleAdjuster::addPoint(const cv::Point3d &point)
+{
+    points.push_back(point);
+    return points.size() - 1;
+}
+
+/**
+ * Point point was seen by camera camera at pixel measurement.
+ **/
+void BundleAdjuster::addObservation(int camera, int point, const cv::Point2d &measurement)
+{
+    obs_camera.push_back(camera);
+    obs_point.push_back(point);
+    obs_measurement.push_back(measurement);
+}
+
+/**
+ * Residual, Huber weight and (if requested) Jacobians of observations
+ * [begin, end). Every observation writes only its own slots, so ranges can
+ * be evaluated concurrently.
+ **/
+void BundleAdjuster::evaluateRange(void *context, int begin, int end)
+{
+    BundleAdjuster *ba = (BundleAdjuster *) context;
+    const double fx = ba->K(0,0), fy = ba->K(1,1);
+    const double cx = ba->K(0,2), cy = ba->K(1,2);
+
+    for ( int o = begin; o < end; o++ ) {
+        const cv::Matx34d &P = ba->poses[ba->obs_camera[o]];
+        const cv::Point3d &X = ba->points[ba->obs_point[o]];
+        const cv::Point2d &z = ba->obs_measurement[o];
+
+        double xc = P(0,0) * X.x + P(0,1) * X.y + P(0,2) * X.z + P(0,3);
+        double yc = P(1,0) * X.x + P(1,1) * X.y + P(1,2) * X.z + P(1,3);
+        double zc = P(2,0) * X.x + P(2,1) * X.y + P(2,2) * X.z + P(2,3);
+
+        if ( zc < BA_EPSILON ) {
+            // Behind the camera: no usable information, but not free either,
+            // or steps that push points behind cameras would lower the cost
+            ba->residuals[o] = cv::Matx21d(0, 0);
+            ba->weights[o] = 0.0;
+            ba->costs[o] = 2.0 * ba->huber * BA_BEHIND_PIXELS - ba->huber * ba->huber;
+            ba->behind[o] = 1;
+            if ( ba->with_jacobians ) {
+                ba->camera_jacobians[o] = cv::Matx<double, 2, 6>::zeros();
+                ba->point_jacobians[o] = cv::Matx23d::zeros();
+            }
+            continue;
+        }
+
+        ba->behind[o] = 0;
+        double iz = 1.0 / zc;
+        double u = xc * iz, v = yc * iz;
+        double ru = fx * u + cx - z.x;
+        double rv = fy * v + cy - z.y;
+        double norm = sqrt(ru * ru + rv * rv);
+
+        // Huber: quadratic up to the threshold, linear beyond
+        double weight = 1.0;
+        double cost = norm * norm;
+        if ( norm > ba->huber ) {
+            weight = ba->huber / norm;
+            cost = 2.0 * ba->huber * norm - ba->huber * ba->huber;
+        }
+
+        ba->residuals[o] = cv::Matx21d(ru, rv);
+        ba->weights[o] = weight;
+        ba->costs[o] = cost;
+
+        if ( !ba->with_jacobians ) {
+            continue;
+        }
+
+        // Derivative of the projection w.r.t. the camera point
+        cv::Matx23d Jproj( fx * iz, 0, -fx * u * iz,
+                           0, fy * iz, -fy * v * iz );
+
+        // Camera point w.r.t. [w | v]: [-[Xc]x | I]
+        const double jpose[18] = {   0,  zc, -yc, 1, 0, 0,
+                                   -zc,   0,  xc, 0, 1, 0,
+                                    yc, -xc,   0, 0, 0, 1 };
+        cv::Matx<double, 3, 6> Jpose( jpose );
+        cv::Matx33d R( P(0,0), P(0,1), P(0,2),
+                       P(1,0), P(1,1), P(1,2),
+                       P(2,0), P(2,1), P(2,2) );
+
+        ba->camera_jacobians[o] = Jproj * Jpose;
+        ba->point_jacobians[o] = Jproj * R;
+    }
+}
+
+/**
+ * Evaluate all observations and return the total robust cost.
+ **/
+double BundleAdjuster::evaluate(bool jacobians)
+{
+    with_jacobians = jacobians;
+    parallelFor( obs_camera.size(), evaluateRange, this, threads );
+
+    double total = 0.0;
+    for ( size_t o = 0; o < costs.size(); o++ ) {
+        total += costs[o];
+    }
+    return total;
+}
+
+/**
+ * Sort observations by point and number the free cameras.
+ **/
+void BundleAdjuster::buildIndex()
+{
+    int n_points = points.size();
+    int n_obs = obs_point.size();
+
+    point_obs_start.assign( n_points + 1, 0 );
+    for ( int o = 0; o < n_obs; o++ ) {
+        point_obs_start[obs_point[o] + 1]++;
+    }
+    for ( int j = 0; j < n_points; j++ ) {
+        point_obs_start[j + 1] += point_obs_start[j];
+    }
+    point_obs.resize( n_obs );
+    std::vector<int> fill( point_obs_start.begin(), point_obs_start.end() - 1 );
+    for ( int o = 0; o < n_obs; o++ ) {
+        point_obs[fill[obs_point[o]]++] = o;
+    }
+
+    camera_index.resize( poses.size() );
+    int free_cameras = 0;
+    for ( size_t i = 0; i < poses.size(); i++ ) {
+        camera_index[i] = fixed[i] ? -1 : free_cameras++;
+    }
+}
+
+/**
+ * Solve the damped normal equations for the current Jacobians through the
+ * reduced camera system and apply the update to poses and points.
+ **/
+bool BundleAdjuster::solveStep(double lambda, int free_cameras)
+{
+    int n_points = points.size();
+    int n_obs = obs_camera.size();
+
+    // Accumulate camera blocks U, point blocks V and the coupling blocks W
+    U.assign( free_cameras, cv::Matx66d::zeros() );
+    bc.assign( free_cameras, cv::Matx61d::zeros() );
+    V_inv.resize( n_points );
+    bp.assign( n_points, cv::Matx31d::zeros() );
+    W.resize( n_obs );
+
+    V.assign( n_points, cv::Matx33d::zeros() );
+
+    for ( int o = 0; o < n_obs; o++ ) {
+        double w = weights[o];
+        const cv::Matx<double, 2, 6> &Jc = camera_jacobians[o];
+        const cv::Matx23d &Jp = point_jacobians[o];
+        const cv::Matx21d &r = residuals[o];
+        int j = obs_point[o];
+        int c = camera_index[obs_camera[o]];
+
+        V[j] += Jp.t() * Jp * w;
+        bp[j] -= Jp.t() * r * w;
+        if ( c >= 0 ) {
+            U[c] += Jc.t() * Jc * w;
+            bc[c] -= Jc.t() * r * w;
+            W[o] = Jc.t() * Jp * w;
+        }
+    }
+
+    // Marquardt damping
+    for ( int c = 0; c < free_cameras; c++ ) {
+        for ( int k = 0; k < 6; k++ ) {
+            U[c](k,k) += lambda * std::max( U[c](k,k), 1e-6 );
+        }
+    }
+    for ( int j = 0; j < n_points; j++ ) {
+        for ( int k = 0; k < 3; k++ ) {
+            V[j](k,k) += lambda * std::max( V[j](k,k), 1e-6 );
+        }
+        V_inv[j] = V[j].inv( cv::DECOMP_CHOLESKY );
+    }
+
+    // Reduced camera system S * dc = s
+    int dim = 6 * free_cameras;
+    cv::Mat S = cv::Mat::zeros( dim, dim, CV_64F );
+    cv::Mat s = cv::Mat::zeros( dim, 1, CV_64F );
+
+    for ( int c = 0; c < free_cameras; c++ ) {
+        for ( int r = 0; r < 6; r++ ) {
+            for ( int k = 0; k < 6; k++ ) {
+                S.at<double>(6*c + r, 6*c + k) += U[c](r,k);
+            }
+            s.at<double>(6*c + r) += bc[c](r);
+        }
+    }
+
+    for ( int j = 0; j < n_points; j++ ) {
+        for ( int a = point_obs_start[j]; a < point_obs_start[j+1]; a++ ) {
+            int oa = point_obs[a];
+            int ca = camera_index[obs_camera[oa]];
+            if ( ca < 0 ) {
+                continue;
+            }
+            cv::Matx<double, 6, 3> WV = W[oa] * V_inv[j];
+
+            cv::Matx61d correction = WV * bp[j];
+            for ( int r = 0; r < 6; r++ ) {
+                s.at<double>(6*ca + r) -= correction(r);
+            }
+
+            for ( int b = point_obs_start[j]; b < point_obs_start[j+1]; b++ ) {
+                int ob = point_obs[b];
+                int cb = camera_index[obs_camera[ob]];
+                if ( cb < 0 ) {
+                    continue;
+                }
+                cv::Matx66d block = WV * W[ob].t();
+                for ( int r = 0; r < 6; r++ ) {
+                    double *row = S.ptr<double>(6*ca + r) + 6*cb;
+                    for ( int k = 0; k < 6; k++ ) {
+                        row[k] -= block(r,k);
+                    }
+                }
+            }
+        }
+    }
+
+    cv::Mat dc;
+    if ( dim > 0 && !cv::solve( S, s, dc, cv::DECOMP_CHOLESKY ) ) {
+        return false;
+    }
+
+    // Update cameras
+    for ( size_t i = 0; i < poses.size(); i++ ) {
+        int c = camera_index[i];
+        if ( c < 0 ) {
+            continue;
+        }
+        const double *d = dc.ptr<double>(6*c);
+        cv::Matx33d dR;
+        cv::Rodrigues( cv::Matx31d(d[0], d[1], d[2]), dR );
+
+        cv::Matx34d &P = poses[i];
+        cv::Matx33d R( P(0,0), P(0,1), P(0,2),
+                       P(1,0), P(1,1), P(1,2),
+                       P(2,0), P(2,1), P(2,2) );
+        cv::Matx31d t( P(0,3), P(1,3), P(2,3) );
+        R = dR * R;
+        t = dR * t + cv::Matx31d(d[3], d[4], d[5]);
+        P = cv::Matx34d( R(0,0), R(0,1), R(0,2), t(0),
+                         R(1,0), R(1,1), R(1,2), t(1),
+                         R(2,0), R(2,1), R(2,2), t(2) );
+    }
+
+    // Back-substitute points: dp = V^-1 (bp - sum W^T dc)
+    for ( int j = 0; j < n_points; j++ ) {
+        cv::Matx31d rhs = bp[j];
+        for ( int a = point_obs_start[j]; a < point_obs_start[j+1]; a++ ) {
+            int o = point_obs[a];
+            int c = camera_index[obs_camera[o]];
+            if ( c < 0 ) {
+                continue;
+            }
+            cv::Matx61d dci( dc.ptr<double>(6*c) );
+            rhs -= W[o].t() * dci;
+        }
+        cv::Matx31d dp = V_inv[j] * rhs;
+        points[j].x += dp(0);
+        points[j].y += dp(1);
+        points[j].z += dp(2);
+    }
+    return true;
+}
+
+/**
+ * Run Levenberg-Marquardt until convergence, the iteration limit or the time
+ * budget. Returns true if the cost went down.
+ **/
+bool BundleAdjuster::optimize()
+{
+    double start = (double) cv::getTickCount();
+    double ticks_per_ms = cv::getTickFrequency() / 1000.0;
+
+    iterations = 0;
+    int n_obs = obs_camera.size();
+    residuals.resize( n_obs );
+    camera_jacobians.resize( n_obs );
+    point_jacobians.resize( n_obs );
+    weights.resize( n_obs );
+    costs.resize( n_obs );
+    behind.resize( n_obs );
+
+    buildIndex();
+    int free_cameras = 0;
+    for ( size_t i = 0; i < camera_index.size(); i++ ) {
+        free_cameras += camera_index[i] >= 0;
+    }
+
+    double cost = evaluate( true );
+    initial_cost = final_cost = cost;
+    if ( n_obs == 0 ) {
+        return false;
+    }
+
+    double lambda = 1e-3;
+    while ( iterations < max_iterations ) {
+        if ( ((double) cv::getTickCount() - start) / ticks_per_ms > time_budget ) {
+            break;
+        }
+        iterations++;
+
+        saved_poses = poses;
+        saved_points = points;
+        saved_behind = behind;
+
+        if ( !solveStep( lambda, free_cameras ) ) {
+            lambda *= 10.0;
+            continue;
+        }
+
+        // Steps that take a point behind a camera that saw it in front are
+        // rejected whatever they do to the cost
+        double new_cost = evaluate( false );
+        bool flipped = false;
+        for ( int o = 0; o < n_obs && !flipped; o++ ) {
+            flipped = behind[o] && !saved_behind[o];
+        }
+        if ( new_cost < cost && !flipped ) {
+            bool converged = (cost - new_cost) < 1e-6 * cost;
+            cost = new_cost;
+            lambda = std::max( lambda / 10.0, 1e-7 );
+            if ( converged ) {
+                break;
+            }
+            evaluate( true );
+        } else {
+            poses.swap( saved_poses );
+            points.swap( saved_points );
+            // Jacobians are still those of the restored state, residuals are not
+            evaluate( false );
+            lambda *= 10.0;
+            if ( lambda > 1e8 ) {
+                break;
+            }
+        }
+    }
+
+    final_cost = cost;
+    return final_cost < initial_cost;
+}
+
+cv::Matx34d BundleAdjuster::getCamera(int camera) const
+{
+    return poses[camera];
+}
+
+cv::Point3d BundleAdjuster::getPoint(int point) const
+{
+    return points[point];
+}
+
+int BundleAdjuster::cameraCount() const
+{
+    return poses.size();
+}
+
+int BundleAdjuster::pointCount() const
+{
+    return points.size();
+}
+
+int BundleAdjuster::observationCount() const
+{
+    return obs_camera.size();
+}
+
+int BundleAdjuster::iterationCount() const
+{
+    return iterations;
+}
+
+double BundleAdjuster::initialCost() const
+{
+    return initial_cost;
+}
+
+double BundleAdjuster::finalCost() const
+{
+    return final_cost;
+}
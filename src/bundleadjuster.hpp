@@ -0,0 +1,99 @@
+#ifndef BUNDLEADJUSTER_H
+#define BUNDLEADJUSTER_H
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+/**
+ * Sparse Levenberg-Marquardt bundle adjustment of camera poses and 3d points.
+ *
+ * Cameras are [R|t] world to camera poses (6 parameters, updated on the left
+ * like in the PnP tracker), points are 3d world positions. Reprojection
+ * errors are in pixels and weighted with a Huber kernel. Each step solves the
+ * reduced camera system (Schur complement of the block diagonal point part)
+ * and back-substitutes the point updates, so the cost is dominated by the
+ * number of observations, not by the number of points.
+ *
+ * Residuals and Jacobians are evaluated on several threads. Optimization
+ * stops after a maximum number of iterations or when the time budget is used
+ * up, whichever comes first.
+ **/
+class BundleAdjuster
+{
+    cv::Matx33d K;
+
+    // Problem
+    std::vector<cv::Matx34d> poses;
+    std::vector<unsigned char> fixed;
+    std::vector<cv::Point3d> points;
+    std::vector<int> obs_camera;
+    std::vector<int> obs_point;
+    std::vector<cv::Point2d> obs_measurement;
+
+    // Per observation evaluation
+    std::vector<cv::Matx21d> residuals;
+    std::vector<cv::Matx<double, 2, 6> > camera_jacobians;
+    std::vector<cv::Matx23d> point_jacobians;
+    std::vector<double> weights;
+    std::vector<double> costs;
+    std::vector<unsigned char> behind;   // point behind the camera
+    bool with_jacobians;
+
+    // Normal equations
+    std::vector<int> camera_index;       // column block in reduced system, -1 if fixed
+    std::vector<int> point_obs_start;    // observations sorted by point (CSR)
+    std::vector<int> point_obs;
+    std::vector<cv::Matx66d> U;
+    std::vector<cv::Matx61d> bc;
+    std::vector<cv::Matx33d> V;
+    std::vector<cv::Matx33d> V_inv;
+    std::vector<cv::Matx31d> bp;
+    std::vector<cv::Matx<double, 6, 3> > W;
+
+    // Backup for rejected steps
+    std::vector<cv::Matx34d> saved_poses;
+    std::vector<cv::Point3d> saved_points;
+    std::vector<unsigned char> saved_behind;
+
+    double huber;
+    int max_iterations;
+    double time_budget;
+    int threads;
+
+    int iterations;
+    double initial_cost;
+    double final_cost;
+
+    static void evaluateRange(void *context, int begin, int end);
+    double evaluate(bool jacobians);
+    void buildIndex();
+    bool solveStep(double lambda, int free_cameras);
+
+public:
+    BundleAdjuster(const cv::Matx33d &K);
+
+    void setHuberThreshold(double pixels);
+    void setMaxIterations(int n);
+    void setTimeBudget(double milliseconds);
+    void setThreads(int n);
+
+    void clear();
+    int addCamera(const cv::Matx34d &pose, bool fixed);
+    int addPoint(const cv::Point3d &point);
+    void addObservation(int camera, int point, const cv::Point2d &measurement);
+
+    bool optimize();
+
+    cv::Matx34d getCamera(int camera) const;
+    cv::Point3d getPoint(int point) const;
+
+    int cameraCount() const;
+    int pointCount() const;
+    int observationCount() const;
+    int iterationCount() const;
+    double initialCost() const;
+    double finalCost() const;
+};
+
+#endif // BUNDLEADJUSTER_H
@@ -2,225 +2,1386 @@
 #define CLOUD_H
 #include <opencv2/core/core.hpp>
 #include <opencv2/features2d/features2d.hpp>
+#include <algorithm>
+#include <cmath>
+#include <set>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <utility>
 #include <vector>
-#include "pcl-1.6/pcl/visualization/cloud_viewer.h"
+#include "observationtable.hpp"
+#include "vocabulary.hpp"
+#include "voxelindex.hpp"
 
+// Descriptor rows per storage chunk
+#define CLOUD_CHUNK_ROWS 1024
+
+/**
+ * Per point type properties used by Cloud: the coordinate type, the number of
+ * coordinates, and conversion from and to separate coordinate columns.
+ **/
+template <class point> struct CloudPoint;
+
+template <> struct CloudPoint<cv::Point3f>
+{
+    typedef float scalar;
+    enum { dimensions = 3 };
+    static scalar get(const cv::Point3f &p, int axis) { return axis == 0 ? p.x : axis == 1 ? p.y : p.z; }
+    static cv::Point3f make(scalar x, scalar y, scalar z) { return cv::Point3f(x, y, z); }
+};
+
+template <> struct CloudPoint<cv::Point3d>
+{
+    typedef double scalar;
+    enum { dimensions = 3 };
+    static scalar get(const cv::Point3d &p, int axis) { return axis == 0 ? p.x : axis == 1 ? p.y : p.z; }
+    static cv::Point3d make(scalar x, scalar y, scalar z) { return cv::Point3d(x, y, z); }
+};
+
+template <> struct CloudPoint<cv::Point2d>
+{
+    typedef double scalar;
+    enum { dimensions = 2 };
+    static scalar get(const cv::Point2d &p, int axis) { return axis == 0 ? p.x : p.y; }
+    static cv::Point2d make(scalar x, scalar y, scalar) { return cv::Point2d(x, y); }
+};
+
+template <class point> class Cloud;
+template <class point> class CloudSnapshot;
+
+/**
+ * What changed in a Cloud, passed to its listener with the id concerned.
+ **/
+enum CloudChange {
+    CLOUD_ADDED,        // a new point was stored
+    CLOUD_MOVED,        // a point was moved, by fusion or set_point
+    CLOUD_REMOVED,      // a point was removed (remove, remove_frame, cull)
+    CLOUD_RESET         // all points were dropped or replaced (clear, restore), id is -1
+};
+
+/**
+ * Called by a Cloud after every change to its points. context is passed
+ * through untouched.
+ **/
+typedef void (*CloudListener)(void *context, int change, int id);
+
+/**
+ * Ids [first, end) added to a Cloud with the same frame number. Ids in the
+ * range may have been removed since, check Cloud::contains.
+ **/
+struct CloudRange
+{
+    int frame_nr;
+    int first;
+    int end;
+};
+
+/**
+ * Read-only view on the storage of a Cloud or a CloudSnapshot, indexed by
+ * slot. Nothing is copied: the view points into the storage itself.
+ *
+ * A view on a Cloud is invalidated by add, remove, remove_frame and clear
+ * (Cloud::valid tells), after which it must not be used. set_point does not
+ * invalidate it, the new coordinates are seen through the view. Callers that
+ * need the data to stay put while the map changes take a CloudSnapshot.
+ **/
+template <class point> class CloudView
+{
+    public:
+        typedef typename CloudPoint<point>::scalar scalar;
+
+        CloudView();
+
+        int size() const;
+        bool empty() const;
+        unsigned long revision() const;
+
+        const scalar *column(int axis) const;
+        const int *ids() const;
+        const int *frames() const;
+
+        point get_point(int slot) const;
+        int id(int slot) const;
+        int frame(int slot) const;
+        cv::Mat get_descriptor(int slot) const;
+        const unsigned char *descriptor_rows(int slot, int &rows) const;
+    private:
+        friend class Cloud<point>;
+        friend class CloudSnapshot<point>;
+
+        int count;
+        const scalar *columns[3];
+        const int *slot_ids;
+        const int *slot_frames;
+        const cv::Mat *chunks;
+        int chunk_rows;
+        unsigned long view_revision;
+};
+
+/**
+ * Map store: points with a descriptor and the frame they were added in.
+ *
+ * Storage is structure-of-arrays: one column per coordinate, a frame column
+ * and descriptors in fixed size chunks, so adding a point never copies the
+ * existing ones. Every point gets an id that stays valid until the point is
+ * removed; its slot (position in the columns) may change. Removal moves the
+ * last point into the freed slot (swap-and-pop) and updates the id -> slot
+ * table, so add and remove take constant time whatever the size of the map.
+ *
+ * The get_* functions return all points in slot order; get_ids gives the id
+ * of each slot. Functions taking an int id refer to point ids. To read the
+ * map without copying it use view(); frame_ranges finds the points added in
+ * one frame without going over the whole map.
+ *
+ * Every change that moves or reallocates storage bumps the revision. The
+ * matrix of all descriptors is cached per revision, so get_descriptors only
+ * copies after the map changed.
+ *
+ * With enable_index the cloud keeps a VoxelIndex over its points for radius
+ * and nearest neighbour queries. With set_fusion on top of that, add does
+ * not store a point that lies within the fusion radius of a stored one with
+ * a close enough descriptor, but merges it: the stored point moves to the
+ * weighted mean and its weight (the number of points merged into it) grows.
+ * add then returns the id of the stored point. Fusion moves points like
+ * set_point does, so it keeps views valid.
+ *
+ * observations() is the table of which frames see which points. Callers
+ * fill it in; removing a point drops its observations.
+ * choose_descriptor replaces the descriptor of a point by the medoid of its
+ * observed descriptors, so one descriptor per point stands for all views.
+ *
+ * Every point keeps how often it was predicted to be visible, how often it
+ * was actually found (matched) and the last frame it was found in; callers
+ * report these with mark_visible and mark_found. cull removes, in one batch,
+ * the points found in too small a fraction of the frames that should have
+ * seen them, those not found for too long, and when the cloud is over its
+ * point ceiling the stalest points until it is 10% below it.
+ *
+ * add_listener registers a function that is told about every point added,
+ * moved or removed, e.g. to send the changes to another process or to a
+ * viewer; there may be several. insert
+ * stores a point under an id handed out elsewhere, for such a copy.
+ **/
 template <class point> class Cloud
 {
     public:
-        void remove(int index);
-        void remove(int, point &p, cv::KeyPoint &kp, uchar &d, int &f);
-        void remove_last(int);
-        void remove_frame(int);
-        void add(std::vector<point>, std::vector<cv::KeyPoint>, cv::Mat, int frame_nr);
-        void replace(std::vector<point>, std::vector<cv::KeyPoint> kpts, cv::Mat, int frame_nr);
-        //void get(int frame,
-        //        typename std::vector<point>::iterator &p_begin,
-        //        typename std::vector<point>::iterator &p_end,
-        //        cv::Mat &d);
-        void get_points(std::vector<point> &pts);
-        void get_keypoints(std::vector<cv::KeyPoint> &kpts);
-        void get_descriptors(cv::Mat &dscs);
-        void get_frames(std::vector<int> &fs);
-        void show_cloud(pcl::visualization::CloudViewer &viewer, int seconds);
+        typedef typename CloudPoint<point>::scalar scalar;
+
         Cloud();
-        Cloud(std::vector<point> pt, std::vector<cv::KeyPoint> kp, cv::Mat dscr);
         ~Cloud();
+
+        int add(const point &p, const cv::Mat &descriptor, int frame_nr);
+        int add(const std::vector<point> &pts, const cv::Mat &dscs, int frame_nr);
+        int add(const std::vector<point> &pts, const cv::Mat &dscs, int frame_nr,
+                std::vector<int> &ids);
+        bool insert(int id, const point &p, const cv::Mat &descriptor, int frame_nr);
+        bool remove(int id);
+        void remove_frame(int frame_nr);
+        void clear();
+
+        void mark_visible(int id);
+        void mark_found(int id, int frame_nr);
+        int get_visible(int id) const;
+        int get_found(int id) const;
+        int get_last_seen(int id) const;
+        void set_culling(double min_found_ratio, int min_visible, int max_age, int max_points);
+        int cull(int frame_nr, std::vector<int> *removed = NULL, std::vector<Observation> *observations = NULL);
+
+        void restore(int n, const scalar *const coordinates[3], const int *ids, const int *point_frames,
+                     const int *statistics, const cv::Mat &descriptors);
+
+        int size() const;
+        int id_count() const;
+        bool contains(int id) const;
+        int slot(int id) const;
+        int id(int slot) const;
+
+        point get_point(int id) const;
+        void set_point(int id, const point &p);
+        int get_frame(int id) const;
+        int get_weight(int id) const;
+        cv::Mat get_descriptor(int id) const;
+        bool choose_descriptor(int id, const cv::Mat &samples);
+        const scalar *column(int axis) const;
+
+        void enable_index(double voxel_size);
+        void set_fusion(double radius, double max_descriptor_distance);
+        bool indexed() const;
+        int radius_search(const point &p, double radius, std::vector<int> &ids) const;
+        int nearest(const point &p, int k, double max_radius,
+                    std::vector<std::pair<int, double> > &results) const;
+
+        ObservationTable &observations();
+        const ObservationTable &observations() const;
+
+        void add_listener(CloudListener listener, void *context);
+        void remove_listener(CloudListener listener, void *context);
+
+        unsigned long revision() const;
+        CloudView<point> view() const;
+        bool valid(const CloudView<point> &v) const;
+        void snapshot(CloudSnapshot<point> &snap) const;
+        std::pair<const CloudRange *, const CloudRange *> frame_ranges(int frame_nr) const;
+
+        void get_points(std::vector<point> &pts) const;
+        void get_ids(std::vector<int> &ids) const;
+        void get_descriptors(cv::Mat &dscs) const;
+        void get_frames(std::vector<int> &fs) const;
+    private:
+        std::vector<scalar> columns[3];
+        std::vector<int> frames;
+        std::vector<int> weights;
+        std::vector<int> visible;
+        std::vector<int> found;
+        std::vector<int> last_seen;
+        std::vector<int> slot_ids;      // slot -> id
+        std::vector<int> id_slots;      // id -> slot, -1 once removed
+
+        std::vector<cv::Mat> chunks;
+        int descriptor_cols;
+        int descriptor_type;
+
+        std::vector<CloudRange> ranges;     // sorted on frame_nr, then first
+        unsigned long current_revision;
+
+        mutable cv::Mat descriptor_cache;
+        mutable unsigned long cache_revision;
+
+        bool has_index;
+        VoxelIndex spatial_index;
+        double fusion_radius;
+        double fusion_distance;
+        mutable std::vector<int> candidates;
+
+        ObservationTable observation_table;
+
+        std::vector<std::pair<CloudListener, void *> > listeners;
+
+        unsigned char *descriptor_row(int slot) const;
+        void add_range(int id, int frame_nr);
+        int append(const point &p, const cv::Mat &descriptor, int frame_nr, int id = -1);
+        void notify(int change, int id);
+        void remove_observed(int id, std::vector<Observation> *observations);
+        int fusion_target(const point &p, const cv::Mat &descriptor, const std::set<int> *taken) const;
+        void fuse(int id, const point &p, int frame_nr);
+
+        double min_found_ratio;
+        int min_visible;
+        int max_age;
+        int max_points;
+        double descriptor_distance(int slot, const cv::Mat &descriptor) const;
+        double row_distance(const unsigned char *a, const unsigned char *b) const;
+        static cv::Point3d index_point(const point &p);
+};
+
+/**
+ * Copy of a Cloud at one revision, which stays valid whatever happens to the
+ * cloud afterwards. The descriptor matrix is shared with the cache of the
+ * cloud (it is never written to once built), so only the coordinate, id and
+ * frame columns are copied.
+ **/
+template <class point> class CloudSnapshot
+{
+    public:
+        typedef typename CloudPoint<point>::scalar scalar;
+
+        CloudSnapshot();
+        CloudSnapshot(const CloudSnapshot &other);
+        CloudSnapshot &operator=(const CloudSnapshot &other);
+
+        int size() const;
+        unsigned long revision() const;
+        const CloudView<point> &view() const;
+        const cv::Mat &descriptors() const;
     private:
-        std::vector<point> points;
-        std::vector<cv::KeyPoint> keypoints;
-        cv::Mat descriptors;
+        friend class Cloud<point>;
+
+        std::vector<scalar> columns[3];
+        std::vector<int> ids;
         std::vector<int> frames;
-        void vec2cloud(std::vector<cv::Point3d> point_vector,
-                pcl::PointCloud<pcl::PointXYZ>::Ptr cloud);
-        void vec2cloud(std::vector<cv::Point2d> point_vector,
-              pcl::PointCloud<pcl::PointXYZ>::Ptr cloud);
+        cv::Mat descriptor_matrix;
+        CloudView<point> snapshot_view;
+
+        void bind(unsigned long revision);
 };
 
+template <class point>
+CloudView<point>::CloudView()
+{
+    this->count = 0;
+    this->columns[0] = this->columns[1] = this->columns[2] = NULL;
+    this->slot_ids = NULL;
+    this->slot_frames = NULL;
+    this->chunks = NULL;
+    this->chunk_rows = CLOUD_CHUNK_ROWS;
+    this->view_revision = 0;
+}
+
+template <class point>
+int CloudView<point>::size() const
+{
+    return count;
+}
+
+template <class point>
+bool CloudView<point>::empty() const
+{
+    return count == 0;
+}
+
+template <class point>
+unsigned long CloudView<point>::revision() const
+{
+    return view_revision;
+}
+
+/**
+ * Coordinate column (0: x, 1: y, 2: z), size() values.
+ **/
+template <class point>
+const typename CloudView<point>::scalar *CloudView<point>::column(int axis) const
+{
+    return columns[axis];
+}
+
+template <class point>
+const int *CloudView<point>::ids() const
+{
+    return slot_ids;
+}
+
+template <class point>
+const int *CloudView<point>::frames() const
+{
+    return slot_frames;
+}
+
+template <class point>
+point CloudView<point>::get_point(int slot) const
+{
+    return CloudPoint<point>::make( columns[0][slot], columns[1][slot],
+                                    CloudPoint<point>::dimensions > 2 ? columns[2][slot] : 0 );
+}
+
+template <class point>
+int CloudView<point>::id(int slot) const
+{
+    return slot_ids[slot];
+}
+
+template <class point>
+int CloudView<point>::frame(int slot) const
+{
+    return slot_frames[slot];
+}
+
+/**
+ * Descriptor of a slot, a header on the stored row.
+ **/
+template <class point>
+cv::Mat CloudView<point>::get_descriptor(int slot) const
+{
+    if ( chunks == NULL ) {
+        return cv::Mat();
+    }
+    return chunks[slot / chunk_rows].row(slot % chunk_rows);
+}
+
+/**
+ * Descriptor row of a slot, in place. rows is set to the number of slots
+ * from slot on whose rows follow it directly in memory (to the end of its
+ * chunk), so that they can be copied at once.
+ **/
+template <class point>
+const unsigned char *CloudView<point>::descriptor_rows(int slot, int &rows) const
+{
+    if ( chunks == NULL ) {
+        rows = 0;
+        return NULL;
+    }
+    const cv::Mat &chunk = chunks[slot / chunk_rows];
+    int row = slot % chunk_rows;
+    rows = chunk.isContinuous() ? std::min( chunk.rows, count - (slot - row) ) - row : 1;
+    return chunk.ptr(row);
+}
+
+template <class point>
+CloudSnapshot<point>::CloudSnapshot()
+{
+}
+
+template <class point>
+CloudSnapshot<point>::CloudSnapshot(const CloudSnapshot &other)
+{
+    *this = other;
+}
+
+template <class point>
+CloudSnapshot<point> &CloudSnapshot<point>::operator=(const CloudSnapshot &other)
+{
+    if ( this != &other ) {
+        for ( int axis = 0; axis < 3; axis++ ) {
+            columns[axis] = other.columns[axis];
+        }
+        ids = other.ids;
+        frames = other.frames;
+        descriptor_matrix = other.descriptor_matrix;
+        bind( other.revision() );
+    }
+    return *this;
+}
+
+/**
+ * Point the view at the copied columns.
+ **/
+template <class point>
+void CloudSnapshot<point>::bind(unsigned long revision)
+{
+    CloudView<point> v;
+    v.count = ids.size();
+    for ( int axis = 0; axis < 3; axis++ ) {
+        v.columns[axis] = columns[axis].empty() ? NULL : &columns[axis][0];
+    }
+    v.slot_ids = ids.empty() ? NULL : &ids[0];
+    v.slot_frames = frames.empty() ? NULL : &frames[0];
+    v.chunks = descriptor_matrix.empty() ? NULL : &descriptor_matrix;
+    v.chunk_rows = std::max( descriptor_matrix.rows, 1 );
+    v.view_revision = revision;
+    snapshot_view = v;
+}
+
+template <class point>
+int CloudSnapshot<point>::size() const
+{
+    return snapshot_view.size();
+}
+
+template <class point>
+unsigned long CloudSnapshot<point>::revision() const
+{
+    return snapshot_view.revision();
+}
+
+template <class point>
+const CloudView<point> &CloudSnapshot<point>::view() const
+{
+    return snapshot_view;
+}
+
+/**
+ * All descriptors, row i belongs to slot i.
+ **/
+template <class point>
+const cv::Mat &CloudSnapshot<point>::descriptors() const
+{
+    return descriptor_matrix;
+}
+
    template <class point>
 Cloud<point>::Cloud()
 {
+    descriptor_cols = 0;
+    descriptor_type = CV_8U;
+    current_revision = 1;
+    cache_revision = 0;
+    has_index = false;
+    fusion_radius = 0;
+    fusion_distance = 0;
+    min_found_ratio = 0;
+    min_visible = 0;
+    max_age = 0;
+    max_points = 0;
+}
 
+template <class point>
+Cloud<point>::~Cloud()
+{
 }
 
-   template <class point>
-Cloud<point>::Cloud(std::vector<point> ps, std::vector<cv::KeyPoint> kp, cv::Mat ds)
+template <class point>
+unsigned char *Cloud<point>::descriptor_row(int slot) const
 {
-   points = ps;
-   keypoints = kp;
-   descriptors = ds;
+    return (unsigned char *) chunks[slot / CLOUD_CHUNK_ROWS].ptr(slot % CLOUD_CHUNK_ROWS);
 }
 
-   template <class point>
-void Cloud<point>::remove(int index, point &p, cv::KeyPoint &kp, uchar &d, int &f)
+/**
+ * Record id as added in frame_nr, extending the last range of that frame
+ * when the id follows it directly.
+ **/
+template <class point>
+void Cloud<point>::add_range(int id, int frame_nr)
+{
+    std::vector<CloudRange>::iterator it = ranges.end();
+    if ( !ranges.empty() && ranges.back().frame_nr > frame_nr ) {
+        // Out of order frame number, the common case is appending
+        it = ranges.begin();
+        while ( it != ranges.end() && it->frame_nr <= frame_nr ) {
+            it++;
+        }
+    }
+    if ( it != ranges.begin() && (it - 1)->frame_nr == frame_nr && (it - 1)->end == id ) {
+        (it - 1)->end = id + 1;
+        return;
+    }
+    CloudRange range;
+    range.frame_nr = frame_nr;
+    range.first = id;
+    range.end = id + 1;
+    ranges.insert( it, range );
+}
+
+template <class point>
+cv::Point3d Cloud<point>::index_point(const point &p)
+{
+    return cv::Point3d( CloudPoint<point>::get(p, 0), CloudPoint<point>::get(p, 1),
+                        CloudPoint<point>::dimensions > 2 ? CloudPoint<point>::get(p, 2) : 0 );
+}
+
+/**
+ * Add a point with its descriptor (a single row, the first one fixes the
+ * descriptor size and type). Returns the id of the new point, or with fusion
+ * on possibly that of the stored point it was merged into.
+ **/
+template <class point>
+int Cloud<point>::add(const point &p, const cv::Mat &descriptor, int frame_nr)
+{
+    int target = fusion_target( p, descriptor, NULL );
+    if ( target >= 0 ) {
+        fuse( target, p, frame_nr );
+        return target;
+    }
+    return append( p, descriptor, frame_nr );
+}
+
+/**
+ * Add points with descriptor dscs.row(i) for pts[i]; ids[i] becomes the id
+ * pts[i] was stored or merged under. A stored point takes in at most one
+ * point per call. Returns the number of points that were stored as new.
+ **/
+template <class point>
+int Cloud<point>::add(const std::vector<point> &pts, const cv::Mat &dscs, int frame_nr,
+                      std::vector<int> &ids)
 {
-   p = points.erase(points.begin()+index);
-   kp = keypoints.erase(keypoints.begin()+index);
-   cv::hconcat(descriptors.colRange(0, index),
-               descriptors.colRange(index+1, descriptors.rows),
-               descriptors);
-   f = frames.erase(frames.begin()+index);
+    ids.resize( pts.size() );
+    std::set<int> taken;
+    int added = 0;
+    for ( size_t i = 0; i < pts.size(); i++ ) {
+        cv::Mat descriptor = (int) i < dscs.rows ? dscs.row(i) : cv::Mat();
+        int target = fusion_target( pts[i], descriptor, &taken );
+        if ( target >= 0 ) {
+            fuse( target, pts[i], frame_nr );
+            ids[i] = target;
+        } else {
+            ids[i] = append( pts[i], descriptor, frame_nr );
+            added++;
+        }
+        taken.insert( ids[i] );
+    }
+    return added;
 }
 
+/**
+ * Same, for callers that do not need the ids.
+ **/
 template <class point>
-void Cloud<point>::remove(int index)
+int Cloud<point>::add(const std::vector<point> &pts, const cv::Mat &dscs, int frame_nr)
 {
-   points.erase(points.begin()+index);
-   keypoints.erase(keypoints.begin()+index);
-   //descriptors.erase(descriptors.begin()+index);
-   cv::hconcat(descriptors.colRange(0, index),
-               descriptors.colRange(index+1, descriptors.rows),
-               descriptors);
-   frames.erase(frames.begin()+index);
+    std::vector<int> ids;
+    return add( pts, dscs, frame_nr, ids );
 }
 
+/**
+ * Store a new point under id, or under the next free id if id is -1.
+ * Returns its id.
+ **/
 template <class point>
-void Cloud<point>::replace(std::vector<point> pts,
-                           std::vector<cv::KeyPoint> kpts,
-                           cv::Mat dscs,
-                           int frame_nr)
+int Cloud<point>::append(const point &p, const cv::Mat &descriptor, int frame_nr, int id)
 {
-   points = pts;
-   dscs.copyTo(descriptors);
-   keypoints = kpts;
-   std::vector<int> fs(pts.size(), frame_nr);
-   frames = fs;
+    int slot = size();
+    for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+        columns[axis].push_back( CloudPoint<point>::get(p, axis) );
+    }
+    frames.push_back( frame_nr );
+    weights.push_back( 1 );
+    visible.push_back( 1 );
+    found.push_back( 1 );
+    last_seen.push_back( frame_nr );
+
+    if ( id < 0 ) {
+        id = id_slots.size();
+        id_slots.push_back( slot );
+    } else {
+        id_slots[id] = slot;
+    }
+    slot_ids.push_back( id );
+    add_range( id, frame_nr );
+    current_revision++;
+    if ( has_index ) {
+        spatial_index.insert( id, index_point(p) );
+    }
+
+    if ( descriptor_cols == 0 && !descriptor.empty() ) {
+        descriptor_cols = descriptor.cols;
+        descriptor_type = descriptor.type();
+    }
+    if ( descriptor_cols > 0 ) {
+        if ( slot / CLOUD_CHUNK_ROWS >= (int) chunks.size() ) {
+            chunks.push_back( cv::Mat::zeros( CLOUD_CHUNK_ROWS, descriptor_cols, descriptor_type ) );
+        }
+        unsigned char *row = descriptor_row( slot );
+        size_t row_size = chunks[0].cols * chunks[0].elemSize();
+        if ( descriptor.cols == descriptor_cols && descriptor.type() == descriptor_type ) {
+            memcpy( row, descriptor.ptr(0), row_size );
+        } else {
+            memset( row, 0, row_size );
+        }
+    }
+    notify( CLOUD_ADDED, id );
+    return id;
 }
 
+/**
+ * Store a point under a given id, for a cloud that mirrors another one (the
+ * other cloud hands out the ids, in increasing order). There is no fusion.
+ * Returns false if the id is in use.
+ **/
 template <class point>
-void Cloud<point>::add(std::vector<point> pts, std::vector<cv::KeyPoint>, cv::Mat dscs, int frame_nr)
+bool Cloud<point>::insert(int id, const point &p, const cv::Mat &descriptor, int frame_nr)
 {
-   points.insert(points.end(), pts.begin(), pts.end());
-   //descriptors.insert(descriptors.end(), dscs.begin(), dscs.end());
-   if(descriptors.empty()) {
-       dscs.copyTo(descriptors);
-   } else {
-       cv::vconcat(descriptors, dscs, descriptors);
-   }
+    if ( id < 0 || contains(id) ) {
+        return false;
+    }
+    if ( id >= (int) id_slots.size() ) {
+        id_slots.resize( id + 1, -1 );
+    }
+    append( p, descriptor, frame_nr, id );
+    return true;
+}
 
-   std::vector<int> fs(pts.size(), frame_nr);
-   frames.insert(frames.end(), fs.begin(), fs.end());
+template <class point>
+void Cloud<point>::notify(int change, int id)
+{
+    for ( size_t n = 0; n < listeners.size(); n++ ) {
+        listeners[n].first( listeners[n].second, change, id );
+    }
 }
 
+/**
+ * Stored point that p should be merged into, -1 if none (or fusion is off):
+ * the one with the closest descriptor among those within the fusion radius,
+ * skipping the ids in taken.
+ **/
 template <class point>
-void Cloud<point>::remove_last(int n)
+int Cloud<point>::fusion_target(const point &p, const cv::Mat &descriptor, const std::set<int> *taken) const
 {
-   if (n <= 0) {
-      return;
-   }
-   points.erase(points.begin()+n);
-   keypoints.erase(keypoints.begin()+n);
-   descriptors = descriptors(cv::Range(0, 0), cv::Range(n, 1));
-   frames.erase(frames.begin()+n);
+    if ( !has_index || fusion_radius <= 0 ) {
+        return -1;
+    }
+    spatial_index.radiusSearch( index_point(p), fusion_radius, candidates );
+    int best = -1;
+    double best_distance = fusion_distance;
+    for ( size_t c = 0; c < candidates.size(); c++ ) {
+        if ( taken != NULL && taken->count( candidates[c] ) ) {
+            continue;
+        }
+        double d = descriptor_distance( id_slots[candidates[c]], descriptor );
+        if ( d <= best_distance ) {
+            best = candidates[c];
+            best_distance = d;
+        }
+    }
+    return best;
 }
 
+/**
+ * Merge p into stored point id: weighted mean, the stored point has the
+ * weight of all points merged into it so far. Counts as finding it again.
+ **/
 template <class point>
-void Cloud<point>::get_points(std::vector<point> &pts)
+void Cloud<point>::fuse(int id, const point &p, int frame_nr)
 {
-    pts = points;
+    int slot = id_slots[id];
+    double w = weights[slot];
+    for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+        columns[axis][slot] = (scalar) ( (w * columns[axis][slot] + CloudPoint<point>::get(p, axis)) / (w + 1) );
+    }
+    weights[slot]++;
+    visible[slot]++;
+    mark_found( id, frame_nr );
+    spatial_index.move( id, index_point( get_point(id) ) );
+    notify( CLOUD_MOVED, id );
 }
 
+/**
+ * Hamming distance for binary descriptors, L2 for float ones. Without
+ * (matching) descriptors every point counts as similar.
+ **/
 template <class point>
-void Cloud<point>::get_descriptors(cv::Mat &dscs)
+double Cloud<point>::descriptor_distance(int slot, const cv::Mat &descriptor) const
 {
-    dscs = descriptors;
+    if ( descriptor_cols == 0 || descriptor.cols != descriptor_cols || descriptor.type() != descriptor_type ) {
+        return 0;
+    }
+    return row_distance( descriptor_row(slot), descriptor.ptr(0) );
 }
 
 template <class point>
-void Cloud<point>::get_frames(std::vector<int> &fs)
+double Cloud<point>::row_distance(const unsigned char *a, const unsigned char *b) const
 {
-    fs = frames;
+    if ( descriptor_type == CV_8U ) {
+        return HammingDistance( a, b, descriptor_cols );
+    }
+    const float *fa = (const float *) a;
+    const float *fb = (const float *) b;
+    double sum = 0;
+    for ( int c = 0; c < descriptor_cols; c++ ) {
+        sum += (fa[c] - fb[c]) * (fa[c] - fb[c]);
+    }
+    return std::sqrt( sum );
+}
+
+/**
+ * Remove a point by id: the last point takes its slot.
+ **/
+template <class point>
+bool Cloud<point>::remove(int id)
+{
+    if ( !contains(id) ) {
+        return false;
+    }
+    int slot = id_slots[id];
+    int last = size() - 1;
+    if ( slot != last ) {
+        for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+            columns[axis][slot] = columns[axis][last];
+        }
+        frames[slot] = frames[last];
+        weights[slot] = weights[last];
+        visible[slot] = visible[last];
+        found[slot] = found[last];
+        last_seen[slot] = last_seen[last];
+        slot_ids[slot] = slot_ids[last];
+        id_slots[slot_ids[slot]] = slot;
+        if ( descriptor_cols > 0 ) {
+            memcpy( descriptor_row(slot), descriptor_row(last), chunks[0].cols * chunks[0].elemSize() );
+        }
+    }
+    for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+        columns[axis].pop_back();
+    }
+    frames.pop_back();
+    weights.pop_back();
+    visible.pop_back();
+    found.pop_back();
+    last_seen.pop_back();
+    slot_ids.pop_back();
+    id_slots[id] = -1;
+    current_revision++;
+    if ( has_index ) {
+        spatial_index.remove( id );
+    }
+    observation_table.removePoint( id );
+
+    // Keep at most one empty chunk around
+    if ( (int) chunks.size() > (last + CLOUD_CHUNK_ROWS - 1) / CLOUD_CHUNK_ROWS + 1 ) {
+        chunks.pop_back();
+    }
+    notify( CLOUD_REMOVED, id );
+    return true;
+}
+
+template <class point>
+void Cloud<point>::remove_frame(int frame_nr)
+{
+    std::pair<const CloudRange *, const CloudRange *> found = frame_ranges( frame_nr );
+    if ( found.first == found.second ) {
+        return;
+    }
+    for ( const CloudRange *range = found.first; range != found.second; range++ ) {
+        for ( int id = range->first; id < range->end; id++ ) {
+            remove( id );
+        }
+    }
+    std::vector<CloudRange>::iterator begin = ranges.begin() + (found.first - &ranges[0]);
+    ranges.erase( begin, begin + (found.second - found.first) );
+}
+
+/**
+ * Remove all points. Ids are not reused.
+ **/
+template <class point>
+void Cloud<point>::clear()
+{
+    for ( int slot = size() - 1; slot >= 0; slot-- ) {
+        id_slots[slot_ids[slot]] = -1;
+    }
+    for ( int axis = 0; axis < 3; axis++ ) {
+        columns[axis].clear();
+    }
+    frames.clear();
+    weights.clear();
+    visible.clear();
+    found.clear();
+    last_seen.clear();
+    slot_ids.clear();
+    chunks.clear();
+    spatial_index.clear();
+    observation_table.clear();
+    ranges.clear();
+    descriptor_cache = cv::Mat();
+    current_revision++;
+    notify( CLOUD_RESET, -1 );
+}
+
+/**
+ * The point was predicted to be in view (e.g. it passed frustum culling).
+ **/
+template <class point>
+void Cloud<point>::mark_visible(int id)
+{
+    if ( contains(id) ) {
+        visible[id_slots[id]]++;
+    }
+}
+
+/**
+ * The point was matched in frame frame_nr.
+ **/
+template <class point>
+void Cloud<point>::mark_found(int id, int frame_nr)
+{
+    if ( contains(id) ) {
+        int slot = id_slots[id];
+        found[slot]++;
+        last_seen[slot] = std::max( last_seen[slot], frame_nr );
+    }
+}
+
+template <class point>
+int Cloud<point>::get_visible(int id) const
+{
+    return visible[id_slots[id]];
+}
+
+template <class point>
+int Cloud<point>::get_found(int id) const
+{
+    return found[id_slots[id]];
+}
+
+template <class point>
+int Cloud<point>::get_last_seen(int id) const
+{
+    return last_seen[id_slots[id]];
+}
+
+/**
+ * What cull removes: points predicted visible at least min_visible times
+ * but found in less than min_found_ratio of those, points not found in the
+ * last max_age frames, and the stalest points while there are more than
+ * max_points. A value of 0 turns a rule off; all are off by default.
+ **/
+template <class point>
+void Cloud<point>::set_culling(double min_found_ratio, int min_visible, int max_age, int max_points)
+{
+    this->min_found_ratio = min_found_ratio;
+    this->min_visible = min_visible;
+    this->max_age = max_age;
+    this->max_points = max_points;
+}
+
+/**
+ * Remove point id, appending its observations to observations first unless
+ * that is NULL.
+ **/
+template <class point>
+void Cloud<point>::remove_observed(int id, std::vector<Observation> *observations)
+{
+    if ( observations != NULL ) {
+        for ( int r = observation_table.firstOfPoint(id); r >= 0; r = observation_table.nextOfPoint(r) ) {
+            observations->push_back( observation_table.get(r) );
+        }
+    }
+    remove( id );
 }
 
+/**
+ * Remove the points that fail the culling rules as of frame frame_nr.
+ * Returns how many were removed, their ids are appended to removed and
+ * the observations they had to observations (either may be NULL), e.g. to
+ * take them out of a CovisibilityGraph.
+ **/
 template <class point>
-void Cloud<point>::get_keypoints(std::vector<cv::KeyPoint>& kpts)
+int Cloud<point>::cull(int frame_nr, std::vector<int> *removed, std::vector<Observation> *observations)
 {
-    kpts = keypoints;
+    std::vector<int> doomed;
+    int n = size();
+    for ( int slot = 0; slot < n; slot++ ) {
+        bool poor = min_visible > 0 && visible[slot] >= min_visible &&
+                    found[slot] < min_found_ratio * visible[slot];
+        bool stale = max_age > 0 && frame_nr - last_seen[slot] > max_age;
+        if ( poor || stale ) {
+            doomed.push_back( slot_ids[slot] );
+        }
+    }
+    for ( size_t d = 0; d < doomed.size(); d++ ) {
+        remove_observed( doomed[d], observations );
+    }
+    int count = doomed.size();
+    if ( removed != NULL ) {
+        removed->insert( removed->end(), doomed.begin(), doomed.end() );
+    }
+
+    if ( max_points > 0 && size() > max_points ) {
+        // Least recently found first, then lowest found ratio
+        n = size();
+        std::vector<std::pair<std::pair<int, double>, int> > ranked( n );
+        for ( int slot = 0; slot < n; slot++ ) {
+            ranked[slot] = std::make_pair( std::make_pair( last_seen[slot], (double) found[slot] / visible[slot] ),
+                                           slot_ids[slot] );
+        }
+        int excess = n - (max_points - max_points / 10);
+        std::nth_element( ranked.begin(), ranked.begin() + excess, ranked.end() );
+        for ( int r = 0; r < excess; r++ ) {
+            remove_observed( ranked[r].second, observations );
+            if ( removed != NULL ) {
+                removed->push_back( ranked[r].second );
+            }
+        }
+        count += excess;
+    }
+    return count;
 }
 
+/**
+ * Replace the contents by n points given as columns (e.g. from a map file):
+ * coordinates, ids, frames, optionally statistics (weight, visible, found,
+ * last seen per point) and a descriptor matrix with one row per point. Ids
+ * keep their values. Observations are left to the caller.
+ **/
 template <class point>
-void Cloud<point>::get(int frame,
-        typename std::vector<point> &p,
-        typename std::vector<KeyPoint> &k,
-        cv::Mat &d)
+void Cloud<point>::restore(int n, const scalar *const coordinates[3], const int *ids, const int *point_frames,
+                           const int *statistics, const cv::Mat &descriptors)
 {
-    std::vector<int>::iterator f = frames.begin();
-    std::vector<point>::iterator p_begin;
-    std::vector<KeyPoint>::iterator k_begin;
-    int i = 0;
-    cv::Range d_begin, d_end;
-    for(; f != frames.end(); f++, i++) {
-        if (*f == frame) {
-            p_begin = points.begin() + i;
-            k_begin = keypoints.begin() + i;
-            d_begin = cv::Range(i, 0);
-            break;
+    clear();
+    for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+        columns[axis].assign( coordinates[axis], coordinates[axis] + n );
+    }
+    frames.assign( point_frames, point_frames + n );
+    slot_ids.assign( ids, ids + n );
+    weights.resize( n );
+    visible.resize( n );
+    found.resize( n );
+    last_seen.resize( n );
+    for ( int slot = 0; slot < n; slot++ ) {
+        weights[slot] = statistics != NULL ? statistics[4 * slot] : 1;
+        visible[slot] = statistics != NULL ? statistics[4 * slot + 1] : 1;
+        found[slot] = statistics != NULL ? statistics[4 * slot + 2] : 1;
+        last_seen[slot] = statistics != NULL ? statistics[4 * slot + 3] : point_frames[slot];
+    }
+
+    int max_id = -1;
+    for ( int slot = 0; slot < n; slot++ ) {
+        max_id = std::max( max_id, ids[slot] );
+    }
+    id_slots.assign( max_id + 1, -1 );
+    for ( int slot = 0; slot < n; slot++ ) {
+        id_slots[ids[slot]] = slot;
+    }
+
+    // Frame ranges from the (frame, id) pairs
+    std::vector<std::pair<int, int> > added( n );
+    for ( int slot = 0; slot < n; slot++ ) {
+        added[slot] = std::make_pair( point_frames[slot], ids[slot] );
+    }
+    std::sort( added.begin(), added.end() );
+    for ( int i = 0; i < n; i++ ) {
+        if ( !ranges.empty() && ranges.back().frame_nr == added[i].first && ranges.back().end == added[i].second ) {
+            ranges.back().end++;
+        } else {
+            CloudRange range;
+            range.frame_nr = added[i].first;
+            range.first = added[i].second;
+            range.end = added[i].second + 1;
+            ranges.push_back( range );
+        }
+    }
+
+    descriptor_cols = descriptors.cols;
+    descriptor_type = descriptors.type();
+    if ( descriptor_cols > 0 && descriptors.rows >= n ) {
+        size_t row_size = descriptor_cols * descriptors.elemSize();
+        for ( int start = 0; start < n; start += CLOUD_CHUNK_ROWS ) {
+            chunks.push_back( cv::Mat::zeros( CLOUD_CHUNK_ROWS, descriptor_cols, descriptor_type ) );
+            int rows = std::min( CLOUD_CHUNK_ROWS, n - start );
+            if ( descriptors.isContinuous() ) {
+                memcpy( chunks.back().ptr(0), descriptors.ptr(start), rows * row_size );
+            } else {
+                for ( int r = 0; r < rows; r++ ) {
+                    memcpy( chunks.back().ptr(r), descriptors.ptr(start + r), row_size );
+                }
+            }
         }
+    } else {
+        descriptor_cols = 0;
     }
-    for(; f != frames.end(); f++, i++) {
-        if (*f != frame) {
-            p = std::vector<point>(p_begin, points.begin() + i);
-            k = std::vector<KeyPoint>(k_begin, points.begin() + i);
-            d_end = cv::Range(i, 1);
-            return;
+
+    if ( has_index ) {
+        for ( int slot = 0; slot < n; slot++ ) {
+            spatial_index.insert( slot_ids[slot], index_point( get_point( slot_ids[slot] ) ) );
         }
     }
-    p = std::vector<point>(p_begin, points.end());
-    k = std::vector<KeyPoint>(k_begin, keypoints.end());
-    d = descriptors(d_begin, d_end);
+    current_revision++;
 }
 
 template <class point>
-Cloud<point>::~Cloud()
+int Cloud<point>::size() const
 {
+    return frames.size();
 }
 
+/**
+ * One past the largest id handed out, for tables indexed by id.
+ **/
 template <class point>
-void Cloud<point>::show_cloud(pcl::visualization::CloudViewer &viewer,
-      int seconds)
+int Cloud<point>::id_count() const
 {
-    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud
-       (new pcl::PointCloud<pcl::PointXYZ>);
-    vec2cloud(points, cloud);
-    viewer.showCloud(cloud);
-    sleep(seconds);
+    return id_slots.size();
 }
 
 template <class point>
-void Cloud<point>::vec2cloud(std::vector<cv::Point3d> point_vector,
-      pcl::PointCloud<pcl::PointXYZ>::Ptr cloud)
+bool Cloud<point>::contains(int id) const
 {
-    cloud->width  = 1;
-    cloud->height = point_vector.size();
-    cloud->points.resize( cloud->height );
+    return id >= 0 && id < (int) id_slots.size() && id_slots[id] >= 0;
+}
+
+template <class point>
+int Cloud<point>::slot(int id) const
+{
+    return contains(id) ? id_slots[id] : -1;
+}
+
+template <class point>
+int Cloud<point>::id(int slot) const
+{
+    return slot_ids[slot];
+}
 
-    cv::Point3d pt;
-    for(int i = 0; i != cloud->height; i++) {
-        pt = point_vector[i];
+template <class point>
+point Cloud<point>::get_point(int id) const
+{
+    int slot = id_slots[id];
+    return CloudPoint<point>::make( columns[0][slot], columns[1][slot],
+                                    CloudPoint<point>::dimensions > 2 ? columns[2][slot] : 0 );
+}
 
-        cloud->points[i].x = pt.x;
-        cloud->points[i].y = pt.y;
-        cloud->points[i].z = pt.z;
+template <class point>
+void Cloud<point>::set_point(int id, const point &p)
+{
+    int slot = id_slots[id];
+    for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+        columns[axis][slot] = CloudPoint<point>::get(p, axis);
+    }
+    if ( has_index ) {
+        spatial_index.move( id, index_point(p) );
     }
+    notify( CLOUD_MOVED, id );
 }
 
 template <class point>
-void Cloud<point>::vec2cloud(std::vector<cv::Point2d> point_vector,
-      pcl::PointCloud<pcl::PointXYZ>::Ptr cloud)
+int Cloud<point>::get_frame(int id) const
 {
-    cloud->width  = 1;
-    cloud->height = point_vector.size();
-    cloud->points.resize( cloud->height );
+    return frames[id_slots[id]];
+}
 
-    cv::Point2d pt;
-    for(int i = 0; i != cloud->height; i++) {
-        pt = point_vector[i];
+/**
+ * Number of points merged into a point, itself included.
+ **/
+template <class point>
+int Cloud<point>::get_weight(int id) const
+{
+    return weights[id_slots[id]];
+}
 
-        cloud->points[i].x = pt.x;
-        cloud->points[i].y = pt.y;
+/**
+ * Keep a voxel hash over the points, voxel_size in map units (a small
+ * multiple of the fusion radius works well).
+ **/
+template <class point>
+void Cloud<point>::enable_index(double voxel_size)
+{
+    has_index = true;
+    spatial_index.setVoxelSize( voxel_size );
+    for ( int slot = 0; slot < size(); slot++ ) {
+        spatial_index.insert( slot_ids[slot], index_point( get_point( slot_ids[slot] ) ) );
     }
 }
 
+/**
+ * Merge added points into stored ones within radius whose descriptor
+ * distance is at most max_descriptor_distance. A radius of 0 turns it off.
+ * Needs enable_index.
+ **/
+template <class point>
+void Cloud<point>::set_fusion(double radius, double max_descriptor_distance)
+{
+    fusion_radius = radius;
+    fusion_distance = max_descriptor_distance;
+}
+
+template <class point>
+bool Cloud<point>::indexed() const
+{
+    return has_index;
+}
+
+/**
+ * Ids of the points within radius of p. Needs enable_index.
+ **/
+template <class point>
+int Cloud<point>::radius_search(const point &p, double radius, std::vector<int> &ids) const
+{
+    if ( !has_index ) {
+        ids.clear();
+        return 0;
+    }
+    return spatial_index.radiusSearch( index_point(p), radius, ids );
+}
+
+/**
+ * The k points closest to p within max_radius as (id, distance), closest
+ * first. Needs enable_index.
+ **/
+template <class point>
+int Cloud<point>::nearest(const point &p, int k, double max_radius,
+                          std::vector<std::pair<int, double> > &results) const
+{
+    if ( !has_index ) {
+        results.clear();
+        return 0;
+    }
+    return spatial_index.nearest( index_point(p), k, max_radius, results );
+}
+
+/**
+ * Descriptor of a point, a header on the stored row (not a copy).
+ **/
+template <class point>
+cv::Mat Cloud<point>::get_descriptor(int id) const
+{
+    if ( descriptor_cols == 0 ) {
+        return cv::Mat();
+    }
+    int slot = id_slots[id];
+    return chunks[slot / CLOUD_CHUNK_ROWS].row(slot % CLOUD_CHUNK_ROWS);
+}
+
+/**
+ * Make the descriptor of a point the medoid of its current descriptor and
+ * the rows of samples (other observations of it): the one with the smallest
+ * summed distance to all the others, so a single descriptor stands for all
+ * views of the point. Returns whether it changed. Views see the new
+ * descriptor; the descriptor matrix is rebuilt on the next get_descriptors.
+ **/
+template <class point>
+bool Cloud<point>::choose_descriptor(int id, const cv::Mat &samples)
+{
+    if ( !contains(id) || descriptor_cols == 0 || samples.empty() ||
+         samples.cols != descriptor_cols || samples.type() != descriptor_type ) {
+        return false;
+    }
+    std::vector<const unsigned char *> rows( 1, descriptor_row( id_slots[id] ) );
+    for ( int r = 0; r < samples.rows; r++ ) {
+        rows.push_back( samples.ptr(r) );
+    }
+    int best = 0;
+    double best_sum = -1;
+    for ( size_t a = 0; a < rows.size(); a++ ) {
+        double sum = 0;
+        for ( size_t b = 0; b < rows.size(); b++ ) {
+            sum += a != b ? row_distance( rows[a], rows[b] ) : 0;
+        }
+        if ( best_sum < 0 || sum < best_sum ) {
+            best = a;
+            best_sum = sum;
+        }
+    }
+    if ( best == 0 ) {
+        return false;
+    }
+    memcpy( descriptor_row( id_slots[id] ), rows[best], descriptor_cols * chunks[0].elemSize() );
+    // Snapshots may share the cached matrix, so it is dropped, not patched
+    descriptor_cache = cv::Mat();
+    return true;
+}
+
+/**
+ * Coordinate column (0: x, 1: y, 2: z), size() values in slot order.
+ **/
+template <class point>
+const typename Cloud<point>::scalar *Cloud<point>::column(int axis) const
+{
+    return columns[axis].empty() ? NULL : &columns[axis][0];
+}
+
+/**
+ * Changes with every add or remove, not with set_point.
+ **/
+template <class point>
+unsigned long Cloud<point>::revision() const
+{
+    return current_revision;
+}
+
+/**
+ * View on the current storage, see CloudView for when it becomes invalid.
+ **/
+template <class point>
+CloudView<point> Cloud<point>::view() const
+{
+    CloudView<point> v;
+    v.count = size();
+    for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+        v.columns[axis] = column(axis);
+    }
+    v.slot_ids = slot_ids.empty() ? NULL : &slot_ids[0];
+    v.slot_frames = frames.empty() ? NULL : &frames[0];
+    v.chunks = chunks.empty() ? NULL : &chunks[0];
+    v.chunk_rows = CLOUD_CHUNK_ROWS;
+    v.view_revision = current_revision;
+    return v;
+}
+
+template <class point>
+bool Cloud<point>::valid(const CloudView<point> &v) const
+{
+    return v.revision() == current_revision;
+}
+
+/**
+ * Stable copy of the current contents.
+ **/
+template <class point>
+void Cloud<point>::snapshot(CloudSnapshot<point> &snap) const
+{
+    for ( int axis = 0; axis < 3; axis++ ) {
+        snap.columns[axis] = columns[axis];
+    }
+    snap.ids = slot_ids;
+    snap.frames = frames;
+    get_descriptors( snap.descriptor_matrix );
+    snap.bind( current_revision );
+}
+
+/**
+ * Id ranges added in frame_nr, as [begin, end) pointers into the range table.
+ * They are valid until the next add, remove_frame or clear.
+ **/
+template <class point>
+std::pair<const CloudRange *, const CloudRange *> Cloud<point>::frame_ranges(int frame_nr) const
+{
+    if ( ranges.empty() ) {
+        return std::make_pair( (const CloudRange *) NULL, (const CloudRange *) NULL );
+    }
+    const CloudRange *begin = &ranges[0];
+    const CloudRange *end = begin + ranges.size();
+    // Binary search on frame_nr
+    const CloudRange *lo = begin, *hi = end;
+    while ( lo < hi ) {
+        const CloudRange *mid = lo + (hi - lo) / 2;
+        if ( mid->frame_nr < frame_nr ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const CloudRange *last = lo;
+    while ( last != end && last->frame_nr == frame_nr ) {
+        last++;
+    }
+    return std::make_pair( lo, last );
+}
+
+template <class point>
+ObservationTable &Cloud<point>::observations()
+{
+    return observation_table;
+}
+
+template <class point>
+const ObservationTable &Cloud<point>::observations() const
+{
+    return observation_table;
+}
+
+/**
+ * Call listener with context after every change to the points, until it is
+ * removed. It is called from inside the changing function, so it must not
+ * change the cloud itself; reading it is fine. restore reports a single
+ * CLOUD_RESET.
+ **/
+template <class point>
+void Cloud<point>::add_listener(CloudListener listener, void *context)
+{
+    listeners.push_back( std::make_pair( listener, context ) );
+}
+
+template <class point>
+void Cloud<point>::remove_listener(CloudListener listener, void *context)
+{
+    listeners.erase( std::remove( listeners.begin(), listeners.end(), std::make_pair( listener, context ) ),
+                     listeners.end() );
+}
+
+template <class point>
+void Cloud<point>::get_points(std::vector<point> &pts) const
+{
+    int n = size();
+    pts.resize( n );
+    for ( int slot = 0; slot < n; slot++ ) {
+        pts[slot] = CloudPoint<point>::make( columns[0][slot], columns[1][slot],
+                                             CloudPoint<point>::dimensions > 2 ? columns[2][slot] : 0 );
+    }
+}
+
+template <class point>
+void Cloud<point>::get_ids(std::vector<int> &ids) const
+{
+    ids = slot_ids;
+}
+
+/**
+ * All descriptors in one matrix, row i belongs to slot i. The matrix is
+ * shared with a cache that is rebuilt (into new memory) only after the map
+ * changed, so it must be treated as read-only.
+ **/
+template <class point>
+void Cloud<point>::get_descriptors(cv::Mat &dscs) const
+{
+    int n = size();
+    if ( n == 0 || descriptor_cols == 0 ) {
+        dscs = cv::Mat();
+        return;
+    }
+    if ( cache_revision != current_revision || descriptor_cache.empty() ) {
+        cv::Mat fresh( n, descriptor_cols, descriptor_type );
+        size_t row_size = chunks[0].cols * chunks[0].elemSize();
+        for ( int start = 0; start < n; start += CLOUD_CHUNK_ROWS ) {
+            int rows = std::min( CLOUD_CHUNK_ROWS, n - start );
+            // Chunks are continuous, copy them a block at a time
+            memcpy( fresh.ptr(start), chunks[start / CLOUD_CHUNK_ROWS].ptr(0), rows * row_size );
+        }
+        descriptor_cache = fresh;
+        cache_revision = current_revision;
+    }
+    dscs = descriptor_cache;
+}
+
+template <class point>
+void Cloud<point>::get_frames(std::vector<int> &fs) const
+{
+    fs = frames;
+}
+
 #endif
@@ -0,0 +1,605 @@
+#ifndef CLOUDQUERY_H
+#define CLOUDQUERY_H
+#include <opencv2/core/core.hpp>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "cloud.hpp"
+#include "observationtable.hpp"
+#include "parallel.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Slots a predicate is evaluated over at a time, a multiple of 64
+#define QUERY_BLOCK 1024
+
+/**
+ * Set of slots of a CloudView, one bit per slot in 64 bit words.
+ *
+ * Selections over the same view combine word by word (&=, |=, invert).
+ * next_run walks the selected slots as runs of consecutive ones, which is
+ * what query_gather copies at once.
+ **/
+class Selection
+{
+    public:
+        Selection();
+
+        void reset(int n, bool selected = false);
+        int size() const;
+        int count() const;
+        bool empty() const;
+
+        bool test(int slot) const;
+        void set(int slot);
+        void unset(int slot);
+
+        Selection &operator&=(const Selection &other);
+        Selection &operator|=(const Selection &other);
+        void invert();
+
+        bool next_run(int &begin, int &end) const;
+        void get_slots(std::vector<int> &slots) const;
+
+        uint64_t *words();
+        const uint64_t *words() const;
+    private:
+        std::vector<uint64_t> bits;
+        int n;
+
+        void clear_tail();
+};
+
+/**
+ * Predicates on the slots of a CloudView. Each has
+ *
+ *     template <class point>
+ *     void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const;
+ *
+ * which sets mask[i] to 1 when slot begin + i passes and to 0 when not, for
+ * n <= QUERY_BLOCK slots. The loops run straight down the columns of the
+ * view without branches, so the compiler turns them into vector code.
+ * Predicates are combined with query_and, query_or and query_not into new
+ * predicate types, so a whole query is one inlined function per block.
+ **/
+
+/**
+ * Points inside the axis aligned box [low, high] (both ends included).
+ **/
+struct QueryBox
+{
+    double low[3];
+    double high[3];
+
+    QueryBox(const cv::Point3d &low, const cv::Point3d &high)
+    {
+        this->low[0] = low.x;
+        this->low[1] = low.y;
+        this->low[2] = low.z;
+        this->high[0] = high.x;
+        this->high[1] = high.y;
+        this->high[2] = high.z;
+    }
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        typedef typename CloudPoint<point>::scalar scalar;
+        memset( mask, 1, n );
+        for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+            const scalar *c = view.column( axis ) + begin;
+            scalar lo = low[axis], hi = high[axis];
+            for ( int i = 0; i < n; i++ ) {
+                mask[i] &= ( c[i] >= lo ) & ( c[i] <= hi );
+            }
+        }
+    }
+};
+
+/**
+ * Points added in frames first to last (both included).
+ **/
+struct QueryFrames
+{
+    int first;
+    int last;
+
+    QueryFrames(int first, int last)
+    {
+        this->first = first;
+        this->last = last;
+    }
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        const int *f = view.frames() + begin;
+        for ( int i = 0; i < n; i++ ) {
+            mask[i] = ( f[i] >= first ) & ( f[i] <= last );
+        }
+    }
+};
+
+/**
+ * Points seen in min to max frames according to an observation table (the
+ * one of the cloud the view is on).
+ **/
+struct QueryObservations
+{
+    const ObservationTable *table;
+    int min;
+    int max;
+
+    QueryObservations(const ObservationTable &table, int min, int max = INT_MAX)
+    {
+        this->table = &table;
+        this->min = min;
+        this->max = max;
+    }
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        // The counts are indexed by id, so this one reads them one by one
+        const int *ids = view.ids() + begin;
+        for ( int i = 0; i < n; i++ ) {
+            int count = table->observationCount( ids[i] );
+            mask[i] = ( count >= min ) & ( count <= max );
+        }
+    }
+};
+
+/**
+ * Points between min_distance and max_distance from the camera centre of a
+ * pose (world to camera).
+ **/
+struct QueryDistance
+{
+    double centre[3];
+    double min_squared;
+    double max_squared;
+
+    QueryDistance(const cv::Matx44d &pose, double max_distance, double min_distance = 0.0)
+    {
+        // Camera centre: -R^T * t
+        for ( int axis = 0; axis < 3; axis++ ) {
+            centre[axis] = -( pose(0,axis) * pose(0,3) + pose(1,axis) * pose(1,3) + pose(2,axis) * pose(2,3) );
+        }
+        this->min_squared = min_distance * min_distance;
+        this->max_squared = max_distance * max_distance;
+    }
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        typedef typename CloudPoint<point>::scalar scalar;
+        double squared[QUERY_BLOCK];
+        for ( int i = 0; i < n; i++ ) {
+            squared[i] = 0.0;
+        }
+        for ( int axis = 0; axis < CloudPoint<point>::dimensions; axis++ ) {
+            const scalar *c = view.column( axis ) + begin;
+            double o = centre[axis];
+            for ( int i = 0; i < n; i++ ) {
+                double d = c[i] - o;
+                squared[i] += d * d;
+            }
+        }
+        for ( int i = 0; i < n; i++ ) {
+            mask[i] = ( squared[i] >= min_squared ) & ( squared[i] <= max_squared );
+        }
+    }
+};
+
+/**
+ * Points in front of a camera (K, pose world to camera) that project into
+ * an image of image_size, give or take margin pixels.
+ **/
+struct QueryFrustum
+{
+    double M[3][4];         // K * pose
+    double low[2];
+    double high[2];
+
+    QueryFrustum(const cv::Matx33d &K, const cv::Matx34d &pose, cv::Size image_size, double margin)
+    {
+        cv::Matx34d projection = K * pose;
+        for ( int r = 0; r < 3; r++ ) {
+            for ( int c = 0; c < 4; c++ ) {
+                M[r][c] = projection(r,c);
+            }
+        }
+        low[0] = low[1] = -margin;
+        high[0] = image_size.width + margin;
+        high[1] = image_size.height + margin;
+    }
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        typedef typename CloudPoint<point>::scalar scalar;
+        const scalar *x = view.column(0) + begin;
+        const scalar *y = view.column(1) + begin;
+        const scalar *z = view.column(2) + begin;
+        for ( int i = 0; i < n; i++ ) {
+            // u = a / w and v = b / w, compared without dividing since w > 0
+            double a = M[0][0] * x[i] + M[0][1] * y[i] + M[0][2] * z[i] + M[0][3];
+            double b = M[1][0] * x[i] + M[1][1] * y[i] + M[1][2] * z[i] + M[1][3];
+            double w = M[2][0] * x[i] + M[2][1] * y[i] + M[2][2] * z[i] + M[2][3];
+            mask[i] = ( w > 1e-9 ) & ( a >= low[0] * w ) & ( a <= high[0] * w ) &
+                      ( b >= low[1] * w ) & ( b <= high[1] * w );
+        }
+    }
+};
+
+/**
+ * Whether any of n mask bytes is set.
+ **/
+inline bool QueryAny(const unsigned char *mask, int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        if ( mask[i] ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <class A, class B> struct QueryAnd
+{
+    A a;
+    B b;
+
+    QueryAnd(const A &a, const B &b) : a( a ), b( b ) {}
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        a.evaluate( view, begin, n, mask );
+        if ( !QueryAny( mask, n ) ) {
+            // Nothing left for b to reject
+            return;
+        }
+        unsigned char other[QUERY_BLOCK];
+        b.evaluate( view, begin, n, other );
+        for ( int i = 0; i < n; i++ ) {
+            mask[i] &= other[i];
+        }
+    }
+};
+
+template <class A, class B> struct QueryOr
+{
+    A a;
+    B b;
+
+    QueryOr(const A &a, const B &b) : a( a ), b( b ) {}
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        a.evaluate( view, begin, n, mask );
+        unsigned char other[QUERY_BLOCK];
+        b.evaluate( view, begin, n, other );
+        for ( int i = 0; i < n; i++ ) {
+            mask[i] |= other[i];
+        }
+    }
+};
+
+template <class A> struct QueryNot
+{
+    A a;
+
+    QueryNot(const A &a) : a( a ) {}
+
+    template <class point>
+    void evaluate(const CloudView<point> &view, int begin, int n, unsigned char *mask) const
+    {
+        a.evaluate( view, begin, n, mask );
+        for ( int i = 0; i < n; i++ ) {
+            mask[i] ^= 1;
+        }
+    }
+};
+
+template <class A, class B>
+QueryAnd<A, B> query_and(const A &a, const B &b)
+{
+    return QueryAnd<A, B>( a, b );
+}
+
+template <class A, class B>
+QueryOr<A, B> query_or(const A &a, const B &b)
+{
+    return QueryOr<A, B>( a, b );
+}
+
+template <class A>
+QueryNot<A> query_not(const A &a)
+{
+    return QueryNot<A>( a );
+}
+
+/**
+ * Pack n mask bytes (0 or 1) into bits, mask[i] going to bit i % 64 of
+ * words[i / 64]. The words are overwritten; bits beyond n are cleared.
+ **/
+inline void QueryPack(const unsigned char *mask, int n, uint64_t *words)
+{
+    int i = 0;
+    for ( ; i + 64 <= n; i += 64 ) {
+#ifdef __SSE2__
+        // 0 - 1 sets all bits of a byte, movemask takes its top bit
+        __m128i zero = _mm_setzero_si128();
+        uint64_t word = 0;
+        for ( int part = 0; part < 4; part++ ) {
+            __m128i bytes = _mm_loadu_si128( (const __m128i *) (mask + i + 16 * part) );
+            word |= (uint64_t) (unsigned) _mm_movemask_epi8( _mm_sub_epi8( zero, bytes ) ) << (16 * part);
+        }
+        words[i / 64] = word;
+#else
+        uint64_t word = 0;
+        for ( int b = 0; b < 64; b++ ) {
+            word |= (uint64_t) mask[i + b] << b;
+        }
+        words[i / 64] = word;
+#endif
+    }
+    if ( i < n ) {
+        uint64_t word = 0;
+        for ( int b = 0; i + b < n; b++ ) {
+            word |= (uint64_t) mask[i + b] << b;
+        }
+        words[i / 64] = word;
+    }
+}
+
+template <class point, class predicate> struct QueryJob
+{
+    const CloudView<point> *view;
+    const predicate *query;
+    Selection *selection;
+};
+
+/**
+ * Evaluate blocks [begin, end) of a QueryJob. Every block covers whole
+ * words of the selection, so blocks can be done in parallel.
+ **/
+template <class point, class predicate>
+void QueryBlocks(void *context, int begin, int end)
+{
+    QueryJob<point, predicate> *job = (QueryJob<point, predicate> *) context;
+    unsigned char mask[QUERY_BLOCK];
+    int size = job->view->size();
+    for ( int block = begin; block < end; block++ ) {
+        int first = block * QUERY_BLOCK;
+        int n = std::min( QUERY_BLOCK, size - first );
+        job->query->evaluate( *job->view, first, n, mask );
+        QueryPack( mask, n, job->selection->words() + first / 64 );
+    }
+}
+
+/**
+ * Select the slots of view that pass query. Large views are cut in blocks
+ * evaluated on up to threads threads (see parallelFor). Returns the number
+ * of slots selected.
+ **/
+template <class point, class predicate>
+int query_select(const CloudView<point> &view, const predicate &query, Selection &selection, int threads = 1)
+{
+    selection.reset( view.size() );
+    QueryJob<point, predicate> job;
+    job.view = &view;
+    job.query = &query;
+    job.selection = &selection;
+    int blocks = ( view.size() + QUERY_BLOCK - 1 ) / QUERY_BLOCK;
+    parallelFor( blocks, QueryBlocks<point, predicate>, &job, threads );
+    return selection.count();
+}
+
+/**
+ * Copy what is selected out of view: points, ids and descriptor rows, in
+ * slot order. Any of the outputs may be NULL. Consecutive slots are copied
+ * as one run, descriptors by whole rows (of any size and type).
+ **/
+template <class point>
+void query_gather(const CloudView<point> &view, const Selection &selection, std::vector<point> *points,
+                  std::vector<int> *ids, cv::Mat *descriptors)
+{
+    typedef typename CloudPoint<point>::scalar scalar;
+    int n = selection.count();
+    if ( points != NULL ) {
+        points->resize( n );
+    }
+    if ( ids != NULL ) {
+        ids->resize( n );
+    }
+    if ( descriptors != NULL ) {
+        if ( n == 0 ) {
+            descriptors->release();
+        } else {
+            int first = 0, end = 0;
+            selection.next_run( first, end );
+            cv::Mat row = view.get_descriptor( first );
+            descriptors->create( n, row.cols, row.type() );
+        }
+    }
+
+    int begin = 0, end = 0, row = 0;
+    while ( selection.next_run( begin, end ) ) {
+        int length = end - begin;
+        if ( points != NULL ) {
+            const scalar *x = view.column(0) + begin;
+            const scalar *y = view.column(1) + begin;
+            const scalar *z = CloudPoint<point>::dimensions > 2 ? view.column(2) + begin : NULL;
+            for ( int i = 0; i < length; i++ ) {
+                (*points)[row + i] = CloudPoint<point>::make( x[i], y[i], z != NULL ? z[i] : 0 );
+            }
+        }
+        if ( ids != NULL ) {
+            memcpy( &(*ids)[row], view.ids() + begin, length * sizeof(int) );
+        }
+        if ( descriptors != NULL && !descriptors->empty() ) {
+            size_t row_bytes = descriptors->cols * descriptors->elemSize();
+            for ( int slot = begin; slot < end; ) {
+                int rows;
+                const unsigned char *source = view.descriptor_rows( slot, rows );
+                rows = std::min( rows, end - slot );
+                memcpy( descriptors->ptr( row + slot - begin ), source, rows * row_bytes );
+                slot += rows;
+            }
+        }
+        row += length;
+    }
+}
+
+inline Selection::Selection()
+{
+    this->n = 0;
+}
+
+/**
+ * Make room for n slots, all selected or none.
+ **/
+inline void Selection::reset(int n, bool selected)
+{
+    this->n = n;
+    bits.assign( ( n + 63 ) / 64, selected ? ~(uint64_t) 0 : 0 );
+    clear_tail();
+}
+
+inline void Selection::clear_tail()
+{
+    if ( n % 64 != 0 ) {
+        bits.back() &= ( (uint64_t) 1 << (n % 64) ) - 1;
+    }
+}
+
+inline int Selection::size() const
+{
+    return n;
+}
+
+inline int Selection::count() const
+{
+    int total = 0;
+    for ( size_t w = 0; w < bits.size(); w++ ) {
+        total += __builtin_popcountll( bits[w] );
+    }
+    return total;
+}
+
+inline bool Selection::empty() const
+{
+    for ( size_t w = 0; w < bits.size(); w++ ) {
+        if ( bits[w] != 0 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool Selection::test(int slot) const
+{
+    return ( bits[slot / 64] >> (slot % 64) ) & 1;
+}
+
+inline void Selection::set(int slot)
+{
+    bits[slot / 64] |= (uint64_t) 1 << (slot % 64);
+}
+
+inline void Selection::unset(int slot)
+{
+    bits[slot / 64] &= ~( (uint64_t) 1 << (slot % 64) );
+}
+
+/**
+ * Keep what is selected in both; other must be over the same view.
+ **/
+inline Selection &Selection::operator&=(const Selection &other)
+{
+    for ( size_t w = 0; w < bits.size(); w++ ) {
+        bits[w] &= other.bits[w];
+    }
+    return *this;
+}
+
+inline Selection &Selection::operator|=(const Selection &other)
+{
+    for ( size_t w = 0; w < bits.size(); w++ ) {
+        bits[w] |= other.bits[w];
+    }
+    return *this;
+}
+
+inline void Selection::invert()
+{
+    for ( size_t w = 0; w < bits.size(); w++ ) {
+        bits[w] = ~bits[w];
+    }
+    if ( !bits.empty() ) {
+        clear_tail();
+    }
+}
+
+/**
+ * The next run [begin, end) of selected slots from end on; start with
+ * begin = end = 0. Returns false when there are no more.
+ **/
+inline bool Selection::next_run(int &begin, int &end) const
+{
+    int w = end / 64;
+    if ( w >= (int) bits.size() ) {
+        return false;
+    }
+    // Find the next one
+    uint64_t word = bits[w] & ( ~(uint64_t) 0 << (end % 64) );
+    while ( word == 0 ) {
+        if ( ++w >= (int) bits.size() ) {
+            return false;
+        }
+        word = bits[w];
+    }
+    begin = w * 64 + __builtin_ctzll( word );
+    // Then the next zero after it
+    word = ~bits[w] & ( ~(uint64_t) 0 << (begin % 64) );
+    while ( word == 0 ) {
+        if ( ++w >= (int) bits.size() ) {
+            end = n;
+            return true;
+        }
+        word = ~bits[w];
+    }
+    end = std::min( w * 64 + __builtin_ctzll( word ), n );
+    return true;
+}
+
+/**
+ * All selected slots, in order.
+ **/
+inline void Selection::get_slots(std::vector<int> &slots) const
+{
+    slots.clear();
+    for ( size_t w = 0; w < bits.size(); w++ ) {
+        for ( uint64_t word = bits[w]; word != 0; word &= word - 1 ) {
+            slots.push_back( w * 64 + __builtin_ctzll( word ) );
+        }
+    }
+}
+
+inline uint64_t *Selection::words()
+{
+    return bits.empty() ? NULL : &bits[0];
+}
+
+inline const uint64_t *Selection::words() const
+{
+    return bits.empty() ? NULL : &bits[0];
+}
+
+#endif // CLOUDQUERY_H
@@ -0,0 +1,265 @@
+#include "compactcloud.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <utility>
+
+// Steps per block along an axis
+#define COMPACT_STEPS 65536.0
+
+CompactCloud::CompactCloud(double block_size)
+{
+    this->block_size = block_size;
+}
+
+/**
+ * Replace the contents by n points given as columns (e.g. from a map file or
+ * a CloudView), with a descriptor matrix holding one row per point. Ids keep
+ * their values. point_frames and statistics are not stored; they are taken
+ * so a map file restores into a CompactCloud the same way as into a Cloud.
+ **/
+void CompactCloud::restore(int n, const double *const coordinates[3], const int *ids, const int *,
+                           const int *, const cv::Mat &descriptors)
+{
+    clear();
+
+    // Block of every point, then the points in block order
+    std::vector<std::pair<std::pair<int, int>, std::pair<int, int> > > order( n );
+    for ( int i = 0; i < n; i++ ) {
+        int bx = (int) std::floor( coordinates[0][i] / block_size );
+        int by = (int) std::floor( coordinates[1][i] / block_size );
+        int bz = (int) std::floor( coordinates[2][i] / block_size );
+        order[i] = std::make_pair( std::make_pair( bx, by ), std::make_pair( bz, i ) );
+    }
+    std::sort( order.begin(), order.end() );
+
+    offsets.resize( 3 * n );
+    slot_ids.resize( n );
+    int max_id = -1;
+    for ( int slot = 0; slot < n; slot++ ) {
+        int i = order[slot].second.second;
+        int corner[3] = { order[slot].first.first, order[slot].first.second, order[slot].second.first };
+        if ( blocks.empty() || blocks.back().x != corner[0] || blocks.back().y != corner[1] ||
+             blocks.back().z != corner[2] ) {
+            CompactBlock block;
+            block.x = corner[0];
+            block.y = corner[1];
+            block.z = corner[2];
+            block.first = slot;
+            block.count = 0;
+            blocks.push_back( block );
+        }
+        blocks.back().count++;
+
+        for ( int axis = 0; axis < 3; axis++ ) {
+            double step = ( coordinates[axis][i] / block_size - corner[axis] ) * COMPACT_STEPS;
+            offsets[3 * slot + axis] = (uint16_t) std::min( std::max( step, 0.0 ), COMPACT_STEPS - 1 );
+        }
+        slot_ids[slot] = ids[i];
+        max_id = std::max( max_id, ids[i] );
+    }
+    id_slots.assign( max_id + 1, -1 );
+    for ( int slot = 0; slot < n; slot++ ) {
+        id_slots[slot_ids[slot]] = slot;
+    }
+
+    if ( descriptors.cols > 0 && descriptors.rows >= n ) {
+        descriptor_matrix.create( n, descriptors.cols, descriptors.type() );
+        size_t row_size = descriptors.cols * descriptors.elemSize();
+        for ( int slot = 0; slot < n; slot++ ) {
+            memcpy( descriptor_matrix.ptr(slot), descriptors.ptr( order[slot].second.second ), row_size );
+        }
+    }
+}
+
+void CompactCloud::clear()
+{
+    std::vector<CompactBlock>().swap( blocks );
+    std::vector<uint16_t>().swap( offsets );
+    std::vector<int>().swap( slot_ids );
+    std::vector<int>().swap( id_slots );
+    descriptor_matrix = cv::Mat();
+    observation_table.clear();
+}
+
+int CompactCloud::size() const
+{
+    return slot_ids.size();
+}
+
+/**
+ * One past the largest id in the map, for tables indexed by id.
+ **/
+int CompactCloud::id_count() const
+{
+    return id_slots.size();
+}
+
+bool CompactCloud::contains(int id) const
+{
+    return id >= 0 && id < (int) id_slots.size() && id_slots[id] >= 0;
+}
+
+int CompactCloud::slot(int id) const
+{
+    return contains(id) ? id_slots[id] : -1;
+}
+
+int CompactCloud::id(int slot) const
+{
+    return slot_ids[slot];
+}
+
+/**
+ * Block holding slot: the last one starting at or before it.
+ **/
+int CompactCloud::block_of(int slot) const
+{
+    int low = 0, high = blocks.size() - 1;
+    while ( low < high ) {
+        int middle = (low + high + 1) / 2;
+        if ( blocks[middle].first <= slot ) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+cv::Point3d CompactCloud::decode(int slot, const CompactBlock &block) const
+{
+    const uint16_t *q = &offsets[3 * slot];
+    return cv::Point3d( ( block.x + (q[0] + 0.5) / COMPACT_STEPS ) * block_size,
+                        ( block.y + (q[1] + 0.5) / COMPACT_STEPS ) * block_size,
+                        ( block.z + (q[2] + 0.5) / COMPACT_STEPS ) * block_size );
+}
+
+cv::Point3d CompactCloud::get_point(int id) const
+{
+    int slot = id_slots[id];
+    return decode( slot, blocks[block_of(slot)] );
+}
+
+cv::Mat CompactCloud::get_descriptor(int id) const
+{
+    return descriptor_matrix.row( id_slots[id] );
+}
+
+/**
+ * All descriptors, row n for slot n.
+ **/
+const cv::Mat &CompactCloud::descriptors() const
+{
+    return descriptor_matrix;
+}
+
+int CompactCloud::block_count() const
+{
+    return blocks.size();
+}
+
+double CompactCloud::get_block_size() const
+{
+    return block_size;
+}
+
+/**
+ * Bytes taken by the points (observations not included).
+ **/
+size_t CompactCloud::memory() const
+{
+    return blocks.size() * sizeof(CompactBlock) + offsets.size() * sizeof(uint16_t) +
+           ( slot_ids.size() + id_slots.size() ) * sizeof(int) +
+           descriptor_matrix.total() * descriptor_matrix.elemSize();
+}
+
+/**
+ * Ids of the points inside the box [low, high]. Returns their number.
+ **/
+int CompactCloud::box_search(const cv::Point3d &low, const cv::Point3d &high, std::vector<int> &ids) const
+{
+    ids.clear();
+    for ( size_t b = 0; b < blocks.size(); b++ ) {
+        const CompactBlock &block = blocks[b];
+        if ( (block.x + 1) * block_size < low.x || block.x * block_size > high.x ||
+             (block.y + 1) * block_size < low.y || block.y * block_size > high.y ||
+             (block.z + 1) * block_size < low.z || block.z * block_size > high.z ) {
+            continue;
+        }
+        for ( int slot = block.first; slot < block.first + block.count; slot++ ) {
+            cv::Point3d X = decode( slot, block );
+            if ( X.x >= low.x && X.x <= high.x && X.y >= low.y && X.y <= high.y &&
+                 X.z >= low.z && X.z <= high.z ) {
+                ids.push_back( slot_ids[slot] );
+            }
+        }
+    }
+    return ids.size();
+}
+
+bool CompactCloud::in_view(const cv::Matx33d &K, const cv::Matx34d &pose, cv::Size image_size,
+                           double margin, const cv::Point3d &X) const
+{
+    cv::Matx31d x = K * ( pose * cv::Matx41d( X.x, X.y, X.z, 1.0 ) );
+    if ( x(2) <= 0 ) {
+        return false;
+    }
+    double u = x(0) / x(2), v = x(1) / x(2);
+    return u >= -margin && u <= image_size.width + margin &&
+           v >= -margin && v <= image_size.height + margin;
+}
+
+/**
+ * Ids of the points in front of a camera with intrinsics K at the world to
+ * camera pose that project into the image, give or take margin pixels.
+ * Blocks are culled as a whole by their bounding sphere first, so only the
+ * points of blocks in view are decoded. Returns their number.
+ **/
+int CompactCloud::frustum_search(const cv::Matx33d &K, const cv::Matx34d &pose, cv::Size image_size,
+                                 double margin, std::vector<int> &ids) const
+{
+    ids.clear();
+    double radius = block_size * std::sqrt( 3.0 ) / 2;
+    for ( size_t b = 0; b < blocks.size(); b++ ) {
+        const CompactBlock &block = blocks[b];
+        cv::Matx31d center = pose * cv::Matx41d( (block.x + 0.5) * block_size, (block.y + 0.5) * block_size,
+                                                 (block.z + 0.5) * block_size, 1.0 );
+        if ( center(2) + radius <= 0 ) {
+            continue;
+        }
+        if ( center(2) > radius ) {
+            // The normalized coordinates of the sphere stay within
+            // r (1 + |c / z|) / (z - r) of those of its center, per axis:
+            // off the optical axis it spreads further than on it
+            double x = center(0) / center(2), y = center(1) / center(2);
+            double spread_x = radius * ( 1 + std::fabs( x ) ) / ( center(2) - radius );
+            double spread_y = radius * ( 1 + std::fabs( y ) ) / ( center(2) - radius );
+            cv::Matx31d projected = K * cv::Matx31d( x, y, 1.0 );
+            double u = projected(0), v = projected(1);
+            double extent_u = K(0,0) * spread_x + std::fabs( K(0,1) ) * spread_y + margin;
+            double extent_v = K(1,1) * spread_y + margin;
+            if ( u < -extent_u || u > image_size.width + extent_u ||
+                 v < -extent_v || v > image_size.height + extent_v ) {
+                continue;
+            }
+        }
+        for ( int slot = block.first; slot < block.first + block.count; slot++ ) {
+            if ( in_view( K, pose, image_size, margin, decode( slot, block ) ) ) {
+                ids.push_back( slot_ids[slot] );
+            }
+        }
+    }
+    return ids.size();
+}
+
+ObservationTable &CompactCloud::observations()
+{
+    return observation_table;
+}
+
+const ObservationTable &CompactCloud::observations() const
+{
+    return observation_table;
+}
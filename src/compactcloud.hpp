@@ -0,0 +1,83 @@
+#ifndef COMPACTCLOUD_H
+#define COMPACTCLOUD_H
+
+#include <opencv2/core/core.hpp>
+
+#include "observationtable.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Cube of space in a CompactCloud, corner at (x, y, z) * block size, holding
+ * slots [first, first + count).
+ **/
+typedef struct {
+    int x;
+    int y;
+    int z;
+    int first;
+    int count;
+} CompactBlock;
+
+/**
+ * Read-only map in a fraction of the memory of a Cloud, for localizing
+ * against a map that is not extended any more.
+ *
+ * Space is cut into cubic blocks and every point is stored as three 16 bit
+ * offsets from the corner of its block, so coordinates are exact to
+ * block_size / 2^17 (8 micrometer for 1 m blocks). Points are sorted by
+ * block, which makes a region query decode only the blocks that overlap it.
+ * Each point keeps its id and a single descriptor (the representative it was
+ * saved with); frame numbers, statistics and the spatial index of a Cloud
+ * are not kept. Slots are positions in block order and do not change.
+ *
+ * The member names follow Cloud, so code reading a map works on either.
+ **/
+class CompactCloud
+{
+    double block_size;
+    std::vector<CompactBlock> blocks;
+    std::vector<uint16_t> offsets;      // x, y, z per slot
+    std::vector<int> slot_ids;          // slot -> id
+    std::vector<int> id_slots;          // id -> slot, -1 if not in the map
+    cv::Mat descriptor_matrix;          // row per slot
+
+    ObservationTable observation_table;
+
+    int block_of(int slot) const;
+    cv::Point3d decode(int slot, const CompactBlock &block) const;
+    bool in_view(const cv::Matx33d &K, const cv::Matx34d &pose, cv::Size image_size,
+                 double margin, const cv::Point3d &X) const;
+
+public:
+    CompactCloud(double block_size = 1.0);
+
+    void restore(int n, const double *const coordinates[3], const int *ids, const int *point_frames,
+                 const int *statistics, const cv::Mat &descriptors);
+    void clear();
+
+    int size() const;
+    int id_count() const;
+    bool contains(int id) const;
+    int slot(int id) const;
+    int id(int slot) const;
+
+    cv::Point3d get_point(int id) const;
+    cv::Mat get_descriptor(int id) const;
+    const cv::Mat &descriptors() const;
+
+    int block_count() const;
+    double get_block_size() const;
+    size_t memory() const;
+
+    int box_search(const cv::Point3d &low, const cv::Point3d &high, std::vector<int> &ids) const;
+    int frustum_search(const cv::Matx33d &K, const cv::Matx34d &pose, cv::Size image_size,
+                       double margin, std::vector<int> &ids) const;
+
+    ObservationTable &observations();
+    const ObservationTable &observations() const;
+};
+
+#endif // COMPACTCLOUD_H
@@ -0,0 +1,180 @@
+#include "covisibilitygraph.hpp"
+
+#include <algorithm>
+
+static bool heavier(const std::pair<int, int> &a, const std::pair<int, int> &b)
+{
+    return a.second > b.second;
+}
+
+CovisibilityGraph::CovisibilityGraph()
+{
+}
+
+void CovisibilityGraph::clear()
+{
+    nodes.clear();
+    frames.clear();
+    edges.clear();
+}
+
+int CovisibilityGraph::node(int frame_nr) const
+{
+    return frame_nr >= 0 && frame_nr < (int) nodes.size() ? nodes[frame_nr] : -1;
+}
+
+/**
+ * Add keyframe frame_nr, or recount its edges when it is there already (its
+ * observations changed). Every other keyframe that sees one of its points
+ * gets an edge weighted by the number of points they share.
+ **/
+void CovisibilityGraph::update(int frame_nr, const ObservationTable &observations)
+{
+    if ( frame_nr < 0 ) {
+        return;
+    }
+    int n = node( frame_nr );
+    if ( n < 0 ) {
+        if ( frame_nr >= (int) nodes.size() ) {
+            nodes.resize( frame_nr + 1, -1 );
+        }
+        n = frames.size();
+        nodes[frame_nr] = n;
+        frames.push_back( frame_nr );
+        edges.push_back( std::map<int, int>() );
+    }
+
+    counts.clear();
+    for ( int r = observations.firstOfFrame(frame_nr); r >= 0; r = observations.nextOfFrame(r) ) {
+        int point_id = observations.get(r).point_id;
+        for ( int o = observations.firstOfPoint(point_id); o >= 0; o = observations.nextOfPoint(o) ) {
+            int other = node( observations.get(o).frame_nr );
+            if ( other >= 0 && other != n ) {
+                counts[other]++;
+            }
+        }
+    }
+
+    // Drop the old edges on both sides, then link the new ones
+    for ( std::map<int, int>::iterator it = edges[n].begin(); it != edges[n].end(); it++ ) {
+        edges[it->first].erase( n );
+    }
+    edges[n] = counts;
+    for ( std::map<int, int>::iterator it = counts.begin(); it != counts.end(); it++ ) {
+        edges[it->first][n] = it->second;
+    }
+}
+
+/**
+ * Take the points of observations (all observations each of them had) out
+ * of the weights, e.g. after culling dropped them from the table: every two
+ * keyframes that both saw a point share one point less. Costs in the order
+ * of the observations given, no keyframe is recounted.
+ **/
+void CovisibilityGraph::removeObservations(const std::vector<Observation> &observations)
+{
+    std::vector<std::pair<int, int> > seen;     // (point id, node)
+    for ( size_t o = 0; o < observations.size(); o++ ) {
+        int n = node( observations[o].frame_nr );
+        if ( n >= 0 ) {
+            seen.push_back( std::make_pair( observations[o].point_id, n ) );
+        }
+    }
+    std::sort( seen.begin(), seen.end() );
+    for ( size_t begin = 0; begin < seen.size(); ) {
+        size_t end = begin;
+        while ( end < seen.size() && seen[end].first == seen[begin].first ) {
+            end++;
+        }
+        for ( size_t a = begin; a < end; a++ ) {
+            for ( size_t b = a + 1; b < end; b++ ) {
+                if ( seen[a].second != seen[b].second ) {
+                    weaken( seen[a].second, seen[b].second );
+                    weaken( seen[b].second, seen[a].second );
+                }
+            }
+        }
+        begin = end;
+    }
+}
+
+/**
+ * One shared point less from a to b, dropping the edge at none.
+ **/
+void CovisibilityGraph::weaken(int a, int b)
+{
+    std::map<int, int>::iterator it = edges[a].find( b );
+    if ( it != edges[a].end() && --it->second <= 0 ) {
+        edges[a].erase( it );
+    }
+}
+
+bool CovisibilityGraph::contains(int frame_nr) const
+{
+    return node(frame_nr) >= 0;
+}
+
+int CovisibilityGraph::size() const
+{
+    return frames.size();
+}
+
+/**
+ * Number of map points both keyframes see, 0 if not linked.
+ **/
+int CovisibilityGraph::weight(int frame_a, int frame_b) const
+{
+    int a = node( frame_a ), b = node( frame_b );
+    if ( a < 0 || b < 0 ) {
+        return 0;
+    }
+    std::map<int, int>::const_iterator it = edges[a].find( b );
+    return it == edges[a].end() ? 0 : it->second;
+}
+
+/**
+ * Keyframes sharing at least min_weight points with frame_nr as (frame,
+ * weight), heaviest first.
+ **/
+void CovisibilityGraph::neighbours(int frame_nr, int min_weight,
+                                   std::vector<std::pair<int, int> > &result) const
+{
+    result.clear();
+    int n = node( frame_nr );
+    if ( n < 0 ) {
+        return;
+    }
+    for ( std::map<int, int>::const_iterator it = edges[n].begin(); it != edges[n].end(); it++ ) {
+        if ( it->second >= min_weight ) {
+            result.push_back( std::make_pair( frames[it->first], it->second ) );
+        }
+    }
+    std::sort( result.begin(), result.end(), heavier );
+}
+
+/**
+ * The keyframes around frame_nr: itself, its neighbours heaviest first, then
+ * their neighbours, and so on, at most max_keyframes of them.
+ **/
+void CovisibilityGraph::localKeyframes(int frame_nr, int max_keyframes, int min_weight,
+                                       std::vector<int> &keyframes) const
+{
+    keyframes.clear();
+    if ( !contains(frame_nr) || max_keyframes <= 0 ) {
+        return;
+    }
+    std::vector<int> visited( frames.size(), 0 );
+    std::vector<std::pair<int, int> > next;
+    keyframes.push_back( frame_nr );
+    visited[node(frame_nr)] = 1;
+    for ( size_t k = 0; k < keyframes.size() && (int) keyframes.size() < max_keyframes; k++ ) {
+        neighbours( keyframes[k], min_weight, next );
+        for ( size_t i = 0; i < next.size() && (int) keyframes.size() < max_keyframes; i++ ) {
+            int m = node( next[i].first );
+            if ( !visited[m] ) {
+                visited[m] = 1;
+                keyframes.push_back( next[i].first );
+            }
+        }
+    }
+}
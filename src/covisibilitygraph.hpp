@@ -0,0 +1,48 @@
+#ifndef COVISIBILITYGRAPH_H
+#define COVISIBILITYGRAPH_H
+
+#include "observationtable.hpp"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+/**
+ * Keyframes linked by the number of map points they both see.
+ *
+ * Edge weights are counted from an ObservationTable. update() (re)counts the
+ * edges of one keyframe from the observations of its points, so inserting a
+ * keyframe costs the number of observations of the points it sees, not the
+ * size of the map. Points removed from the map afterwards are taken out of
+ * the weights with removeObservations. The graph is what decides which part
+ * of the map is near the camera: the neighbours of the keyframe the camera
+ * is at.
+ **/
+class CovisibilityGraph
+{
+    std::vector<int> nodes;                     // frame number -> node, -1 if none
+    std::vector<int> frames;                    // node -> frame number
+    std::vector<std::map<int, int> > edges;     // node -> (neighbour node -> weight)
+
+    std::map<int, int> counts;
+
+    int node(int frame_nr) const;
+    void weaken(int a, int b);
+
+public:
+    CovisibilityGraph();
+
+    void clear();
+    void update(int frame_nr, const ObservationTable &observations);
+    void removeObservations(const std::vector<Observation> &observations);
+
+    bool contains(int frame_nr) const;
+    int size() const;
+    int weight(int frame_a, int frame_b) const;
+    void neighbours(int frame_nr, int min_weight,
+                    std::vector<std::pair<int, int> > &result) const;
+    void localKeyframes(int frame_nr, int max_keyframes, int min_weight,
+                        std::vector<int> &keyframes) const;
+};
+
+#endif // COVISIBILITYGRAPH_H
@@ -0,0 +1,230 @@
+#include "exporter.hpp"
+
+#include <math.h>
+#include <iostream>
+#include <sstream>
+
+RunExporter::RunExporter()
+{
+    this->trajectory = NULL;
+    this->format = TRAJECTORY_TUM;
+    this->running = false;
+    this->stopping = false;
+    pthread_mutex_init( &lock, NULL );
+    pthread_cond_init( &wake, NULL );
+}
+
+RunExporter::~RunExporter()
+{
+    close();
+    pthread_cond_destroy( &wake );
+    pthread_mutex_destroy( &lock );
+}
+
+/**
+ * Write the poses to path in format (a TrajectoryFormat). Call before start.
+ **/
+bool RunExporter::openTrajectory(const std::string &path, int format)
+{
+    trajectory = fopen( path.c_str(), "w" );
+    this->format = format;
+    return trajectory != NULL;
+}
+
+/**
+ * Write the maps to prefix_<frame>.ply. Call before start.
+ **/
+void RunExporter::setMapPrefix(const std::string &prefix)
+{
+    map_prefix = prefix;
+}
+
+bool RunExporter::start()
+{
+    if ( !running ) {
+        stopping = false;
+        running = pthread_create( &thread, NULL, run, this ) == 0;
+    }
+    return running;
+}
+
+/**
+ * Write everything queued, then stop the writer thread and close the files.
+ **/
+void RunExporter::close()
+{
+    if ( running ) {
+        pthread_mutex_lock( &lock );
+        stopping = true;
+        pthread_cond_signal( &wake );
+        pthread_mutex_unlock( &lock );
+        pthread_join( thread, NULL );
+        running = false;
+    }
+    if ( trajectory != NULL ) {
+        fclose( trajectory );
+        trajectory = NULL;
+    }
+}
+
+/**
+ * Queue the pose (world to camera) of the frame at timestamp.
+ **/
+void RunExporter::addPose(double timestamp, const cv::Matx44d &pose)
+{
+    if ( trajectory == NULL || !running ) {
+        return;
+    }
+    PoseRecord record;
+    record.timestamp = timestamp;
+    record.pose = pose;
+    pthread_mutex_lock( &lock );
+    poses.push_back( record );
+    pthread_cond_signal( &wake );
+    pthread_mutex_unlock( &lock );
+}
+
+/**
+ * Queue a copy of the points of cloud, to be written as the map at
+ * frame_nr.
+ **/
+void RunExporter::addMap(const Cloud<cv::Point3d> &cloud, int frame_nr)
+{
+    if ( map_prefix.empty() || !running ) {
+        return;
+    }
+    CloudView<cv::Point3d> view = cloud.view();
+    MapRecord *record = new MapRecord;
+    record->frame_nr = frame_nr;
+    record->coordinates.resize( 3 * view.size() );
+    for ( int axis = 0; axis < 3; axis++ ) {
+        const double *column = view.column( axis );
+        for ( int n = 0; n < view.size(); n++ ) {
+            record->coordinates[3 * n + axis] = column[n];
+        }
+    }
+    pthread_mutex_lock( &lock );
+    maps.push_back( record );
+    pthread_cond_signal( &wake );
+    pthread_mutex_unlock( &lock );
+}
+
+void *RunExporter::run(void *argument)
+{
+    RunExporter *exporter = (RunExporter *) argument;
+    std::vector<PoseRecord> poses;
+    std::vector<MapRecord *> maps;
+    for ( ;; ) {
+        pthread_mutex_lock( &exporter->lock );
+        while ( exporter->poses.empty() && exporter->maps.empty() && !exporter->stopping ) {
+            pthread_cond_wait( &exporter->wake, &exporter->lock );
+        }
+        bool stopping = exporter->stopping;
+        poses.swap( exporter->poses );
+        maps.swap( exporter->maps );
+        pthread_mutex_unlock( &exporter->lock );
+
+        if ( !poses.empty() ) {
+            exporter->writePoses( poses );
+            poses.clear();
+        }
+        for ( size_t m = 0; m < maps.size(); m++ ) {
+            std::ostringstream path;
+            path << exporter->map_prefix << "_" << maps[m]->frame_nr << ".ply";
+            if ( !WritePly( path.str(), maps[m]->coordinates ) ) {
+                std::cerr << "Can not write map " << path.str() << "." << std::endl;
+            }
+            delete maps[m];
+        }
+        maps.clear();
+        if ( stopping ) {
+            // The queues were taken after the last add
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Format records as lines of the trajectory file; the poses written are the
+ * inverse (camera to world) of the poses queued.
+ **/
+void RunExporter::writePoses(const std::vector<PoseRecord> &records)
+{
+    for ( size_t r = 0; r < records.size(); r++ ) {
+        const cv::Matx44d &P = records[r].pose;
+        // Camera to world: R^T and -R^T * t
+        cv::Matx33d R( P(0,0), P(1,0), P(2,0),
+                       P(0,1), P(1,1), P(2,1),
+                       P(0,2), P(1,2), P(2,2) );
+        cv::Vec3d t = -( R * cv::Vec3d( P(0,3), P(1,3), P(2,3) ) );
+
+        if ( format == TRAJECTORY_KITTI ) {
+            fprintf( trajectory, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+                     R(0,0), R(0,1), R(0,2), t(0),
+                     R(1,0), R(1,1), R(1,2), t(1),
+                     R(2,0), R(2,1), R(2,2), t(2) );
+            continue;
+        }
+        double qw, qx, qy, qz;
+        double trace = R(0,0) + R(1,1) + R(2,2);
+        if ( trace > 0 ) {
+            double s = 2.0 * sqrt( trace + 1.0 );
+            qw = 0.25 * s;
+            qx = ( R(2,1) - R(1,2) ) / s;
+            qy = ( R(0,2) - R(2,0) ) / s;
+            qz = ( R(1,0) - R(0,1) ) / s;
+        } else if ( R(0,0) > R(1,1) && R(0,0) > R(2,2) ) {
+            double s = 2.0 * sqrt( 1.0 + R(0,0) - R(1,1) - R(2,2) );
+            qw = ( R(2,1) - R(1,2) ) / s;
+            qx = 0.25 * s;
+            qy = ( R(0,1) + R(1,0) ) / s;
+            qz = ( R(0,2) + R(2,0) ) / s;
+        } else if ( R(1,1) > R(2,2) ) {
+            double s = 2.0 * sqrt( 1.0 + R(1,1) - R(0,0) - R(2,2) );
+            qw = ( R(0,2) - R(2,0) ) / s;
+            qx = ( R(0,1) + R(1,0) ) / s;
+            qy = 0.25 * s;
+            qz = ( R(1,2) + R(2,1) ) / s;
+        } else {
+            double s = 2.0 * sqrt( 1.0 + R(2,2) - R(0,0) - R(1,1) );
+            qw = ( R(1,0) - R(0,1) ) / s;
+            qx = ( R(0,2) + R(2,0) ) / s;
+            qy = ( R(1,2) + R(2,1) ) / s;
+            qz = 0.25 * s;
+        }
+        fprintf( trajectory, "%.6f %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+                 records[r].timestamp, t(0), t(1), t(2), qx, qy, qz, qw );
+    }
+    fflush( trajectory );
+}
+
+/**
+ * Write coordinates (x, y, z per point) to path as a binary little endian
+ * PLY file, through path.tmp so that the file is complete or not there.
+ * The floats are written as they are, so the host must be little endian
+ * (x86, and the Atom of the robot).
+ **/
+bool WritePly(const std::string &path, const std::vector<float> &coordinates)
+{
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen( temporary.c_str(), "wb" );
+    if ( file == NULL ) {
+        return false;
+    }
+    size_t count = coordinates.size() / 3;
+    fprintf( file, "ply\n"
+                   "format binary_little_endian 1.0\n"
+                   "element vertex %lu\n"
+                   "property float x\n"
+                   "property float y\n"
+                   "property float z\n"
+                   "end_header\n", (unsigned long) count );
+    bool written = count == 0 ||
+                   fwrite( &coordinates[0], sizeof(float), 3 * count, file ) == 3 * count;
+    written = fclose( file ) == 0 && written;
+    if ( !written || rename( temporary.c_str(), path.c_str() ) != 0 ) {
+        remove( temporary.c_str() );
+        return false;
+    }
+    return true;
+}
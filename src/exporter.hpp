@@ -0,0 +1,79 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <opencv2/core/core.hpp>
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "cloud.hpp"
+
+/**
+ * File formats for the trajectory, one line per pose of the camera in the
+ * world (camera to world).
+ **/
+enum TrajectoryFormat {
+    TRAJECTORY_TUM,         // timestamp tx ty tz qx qy qz qw
+    TRAJECTORY_KITTI        // the 3x4 matrix [R|t], row by row
+};
+
+/**
+ * Writes what a run produces to files from a thread of its own, so that
+ * the main loop never waits for the disk: the trajectory as it grows, and
+ * snapshots of the map as binary PLY files.
+ *
+ * addPose and addMap only copy their data into a queue under a lock held
+ * for a push_back; the writer thread takes the whole queue at once and
+ * formats and writes it. The trajectory file is flushed after every batch,
+ * so it can be followed while the run goes on. Map snapshots hold the
+ * coordinates as floats and go to prefix_<frame>.ply, written to a
+ * temporary file first and renamed, so a reader never sees half a map.
+ *
+ * The destructor (or close) writes everything queued before returning.
+ **/
+class RunExporter
+{
+    typedef struct {
+        double timestamp;
+        cv::Matx44d pose;               // world to camera
+    } PoseRecord;
+
+    typedef struct {
+        int frame_nr;
+        std::vector<float> coordinates; // x, y, z per point
+    } MapRecord;
+
+    FILE *trajectory;
+    int format;
+    std::string map_prefix;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stopping;
+    std::vector<PoseRecord> poses;
+    std::vector<MapRecord *> maps;
+
+    static void *run(void *argument);
+    void writePoses(const std::vector<PoseRecord> &records);
+
+public:
+    RunExporter();
+    ~RunExporter();
+
+    bool openTrajectory(const std::string &path, int format);
+    void setMapPrefix(const std::string &prefix);
+    bool start();
+    void close();
+
+    void addPose(double timestamp, const cv::Matx44d &pose);
+    void addMap(const Cloud<cv::Point3d> &cloud, int frame_nr);
+};
+
+bool WritePly(const std::string &path, const std::vector<float> &coordinates);
+
+#endif // EXPORTER_H
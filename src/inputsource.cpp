@@ -43,6 +43,41 @@ void undistortImage(cv::Mat &image, cv::Matx33d &cameraMatrix, cv::Mat &distorti
     }
 }
 
+/**
+ * Compute the lookup tables for images of the given size. Returns false,
+ * leaving the tables empty, without a calibration.
+ **/
+bool Undistortion::init(const cv::Matx33d &cameraMatrix, const cv::Mat &distortionCoeffs, cv::Size size)
+{
+    map1.release();
+    map2.release();
+    this->size = size;
+    if ( distortionCoeffs.empty() || cameraMatrix(2,2) == 0 ) {
+        return false;
+    }
+    cv::initUndistortRectifyMap( cameraMatrix, distortionCoeffs, cv::Mat(), cameraMatrix,
+                                 size, CV_16SC2, map1, map2 );
+    return true;
+}
+
+bool Undistortion::empty() const
+{
+    return map1.empty();
+}
+
+/**
+ * Undistort image in place. Images of another size than the tables were
+ * made for are left alone.
+ **/
+void Undistortion::apply(cv::Mat &image) const
+{
+    if ( !empty() && image.size() == size ) {
+        cv::Mat temp;
+        cv::remap( image, temp, map1, map2, cv::INTER_LINEAR );
+        image = temp;
+    }
+}
+
 //InputSource::InputSource();
 
 FileInput::FileInput(const std::string foldername)
@@ -77,12 +112,11 @@ bool FileInput::getFrame(Frame &frame)
     }
     **/
     try{
-        char filename[30];
-        sprintf(filename,
-                "%s/image_%.4d.png",
-                foldername.c_str(),
-                ++index);
-        std::cout << index << std::endl;
+        char filename[512];
+        snprintf(filename, sizeof(filename),
+                 "%s/image_%.4d.png",
+                 foldername.c_str(),
+                 ++index);
 
         frame.img = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
         return true;
@@ -101,6 +135,18 @@ NaoInput::NaoInput(const std::string &robotIp)
     init(robotIp, "NaoInput", AL::kTopCamera, camMat, distCoeff);
 }
 
+/**
+ * Undistort the frames with the given tables, which must outlive the
+ * input; several inputs can share them.
+ **/
+NaoInput::NaoInput(const std::string &robotIp, const Undistortion *undistortion)
+{
+    cv::Matx33d camMat;
+    cv::Mat distCoeff;
+    init(robotIp, "NaoInput", AL::kTopCamera, camMat, distCoeff);
+    this->undistortion = undistortion;
+}
+
 NaoInput::NaoInput(const std::string &robotIp,
                    std::string name,
                    int cameraId,
@@ -121,6 +167,7 @@ void NaoInput::init(const std::string &robotIp,
 
     this->cameraMatrix = cameraMatrix;
     this->distortionCoeffs = distortionCoeffs;
+    this->undistortion = NULL;
 
     //// Use the initial camera position to calculate relative positions
     // space = 1;
@@ -168,8 +215,13 @@ bool NaoInput::getFrame(Frame &frame)
     imgHeader.data = (uchar*) img[6].GetBinary();
     camProxy->releaseImage(clientName);
 
-    undistortImage(imgHeader, cameraMatrix, distortionCoeffs);
-    frame.img = imgHeader.clone();
+    if ( undistortion != NULL ) {
+        frame.img = imgHeader.clone();
+        undistortion->apply( frame.img );
+    } else {
+        undistortImage(imgHeader, cameraMatrix, distortionCoeffs);
+        frame.img = imgHeader.clone();
+    }
 
     return true;
 }
@@ -24,6 +24,22 @@ typedef struct
     cv::Mat img;
 } Frame;
 
+/**
+ * Undistortion of camera images by lookup tables, computed once for a
+ * calibration and image size instead of on every frame as undistortImage
+ * does. Read-only once set up, so inputs on several threads can share one.
+ **/
+class Undistortion
+{
+    cv::Mat map1;
+    cv::Mat map2;
+    cv::Size size;
+public:
+    bool init(const cv::Matx33d &cameraMatrix, const cv::Mat &distortionCoeffs, cv::Size size);
+    bool empty() const;
+    void apply(cv::Mat &image) const;
+};
+
 class InputSource
 {
 public:
@@ -36,6 +52,7 @@ class NaoInput : public InputSource
     cv::Matx33d cameraMatrix;
     cv::Mat distortionCoeffs;
     std::vector<float> initialCameraPosition;
+    const Undistortion *undistortion;
 
     AL::ALVideoDeviceProxy *camProxy;
 
@@ -49,6 +66,7 @@ class NaoInput : public InputSource
 
 public:
     NaoInput(const std::string &robotIp);
+    NaoInput(const std::string &robotIp, const Undistortion *undistortion);
     NaoInput(const std::string &robotIp,
              std::string name,
              int cameraId,
@@ -0,0 +1,193 @@
+#include "keyframemanager.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+static bool lowerId(const std::pair<int, cv::Point2d> &a, const std::pair<int, cv::Point2d> &b)
+{
+    return a.first < b.first;
+}
+
+static double median(std::vector<double> &values)
+{
+    if ( values.empty() ) {
+        return 0.0;
+    }
+    std::nth_element( values.begin(), values.begin() + values.size() / 2, values.end() );
+    return values[values.size() / 2];
+}
+
+KeyframeManager::KeyframeManager()
+{
+    this->min_tracked_ratio = 0.6;
+    this->min_parallax = 20.0;
+    this->min_frames = 2;
+    this->max_frames = 20;
+    this->max_rotation = 10.0 * CV_PI / 180.0;
+    this->max_baseline_ratio = 0.1;
+    reset();
+}
+
+void KeyframeManager::setMinTrackedRatio(double ratio)
+{
+    this->min_tracked_ratio = ratio;
+}
+
+void KeyframeManager::setMinParallax(double pixels)
+{
+    this->min_parallax = pixels;
+}
+
+void KeyframeManager::setFrameRange(int min_frames, int max_frames)
+{
+    this->min_frames = min_frames;
+    this->max_frames = max_frames;
+}
+
+void KeyframeManager::setMaxRotation(double degrees)
+{
+    this->max_rotation = degrees * CV_PI / 180.0;
+}
+
+void KeyframeManager::setMaxBaselineRatio(double ratio)
+{
+    this->max_baseline_ratio = ratio;
+}
+
+/**
+ * Forget the last keyframe, the next tracked frame will be a keyframe.
+ **/
+void KeyframeManager::reset()
+{
+    has_keyframe = false;
+    keyframe_nr = -1;
+    keyframe_depth = 0.0;
+    keyframe_observations.clear();
+    frames_since = 0;
+    reason = "first keyframe";
+}
+
+/**
+ * Should the tracked frame with this pose and these map point observations
+ * become a keyframe? Counts the frame as seen since the last keyframe.
+ **/
+bool KeyframeManager::isKeyframe(const cv::Matx44d &pose,
+                                 const std::vector<int> &point_ids,
+                                 const std::vector<cv::Point2d> &pixels)
+{
+    frames_since++;
+    if ( !has_keyframe ) {
+        reason = "first keyframe";
+        return true;
+    }
+    if ( frames_since < min_frames ) {
+        reason = "too soon";
+        return false;
+    }
+    if ( frames_since >= max_frames ) {
+        reason = "time";
+        return true;
+    }
+
+    // Rotation angle and baseline w.r.t. the keyframe, D = T * T_kf^-1
+    cv::Matx44d D = pose * keyframe_pose.inv();
+    double trace = D(0,0) + D(1,1) + D(2,2);
+    double angle = acos( std::max( -1.0, std::min( 1.0, (trace - 1.0) / 2.0 ) ) );
+    if ( angle > max_rotation ) {
+        reason = "rotation";
+        return true;
+    }
+    double baseline = sqrt( D(0,3) * D(0,3) + D(1,3) * D(1,3) + D(2,3) * D(2,3) );
+    if ( keyframe_depth > 0.0 && baseline > max_baseline_ratio * keyframe_depth ) {
+        reason = "baseline";
+        return true;
+    }
+
+    // Tracked ratio and parallax over the points shared with the keyframe
+    scratch.clear();
+    for ( size_t i = 0; i < point_ids.size(); i++ ) {
+        scratch.push_back( std::make_pair( point_ids[i], pixels[i] ) );
+    }
+    std::sort( scratch.begin(), scratch.end(), lowerId );
+
+    distances.clear();
+    size_t a = 0, b = 0;
+    while ( a < scratch.size() && b < keyframe_observations.size() ) {
+        if ( scratch[a].first < keyframe_observations[b].first ) {
+            a++;
+        } else if ( scratch[a].first > keyframe_observations[b].first ) {
+            b++;
+        } else {
+            cv::Point2d d = scratch[a].second - keyframe_observations[b].second;
+            distances.push_back( sqrt( d.dot(d) ) );
+            a++;
+            b++;
+        }
+    }
+
+    if ( distances.size() < min_tracked_ratio * keyframe_observations.size() ) {
+        reason = "tracking";
+        return true;
+    }
+    if ( median( distances ) > min_parallax ) {
+        reason = "parallax";
+        return true;
+    }
+    reason = "";
+    return false;
+}
+
+/**
+ * Make the frame the reference for the next decisions. points are the world
+ * positions of the observed map points, used for the scene depth.
+ **/
+void KeyframeManager::addKeyframe(int frame_nr, const cv::Matx44d &pose,
+                                  const std::vector<int> &point_ids,
+                                  const std::vector<cv::Point2d> &pixels,
+                                  const std::vector<cv::Point3d> &points)
+{
+    has_keyframe = true;
+    keyframe_nr = frame_nr;
+    keyframe_pose = pose;
+    frames_since = 0;
+
+    keyframe_observations.clear();
+    for ( size_t i = 0; i < point_ids.size(); i++ ) {
+        keyframe_observations.push_back( std::make_pair( point_ids[i], pixels[i] ) );
+    }
+    std::sort( keyframe_observations.begin(), keyframe_observations.end(), lowerId );
+
+    distances.clear();
+    for ( size_t i = 0; i < points.size(); i++ ) {
+        double z = pose(2,0) * points[i].x + pose(2,1) * points[i].y + pose(2,2) * points[i].z + pose(2,3);
+        if ( z > 0.0 ) {
+            distances.push_back( z );
+        }
+    }
+    keyframe_depth = median( distances );
+}
+
+/**
+ * For frames without a map to track against: is the median displacement of
+ * the matched pixels large enough to triangulate from?
+ **/
+bool KeyframeManager::enoughParallax(const std::vector<cv::Point2d> &previous,
+                                     const std::vector<cv::Point2d> &current)
+{
+    distances.clear();
+    for ( size_t i = 0; i < previous.size() && i < current.size(); i++ ) {
+        cv::Point2d d = current[i] - previous[i];
+        distances.push_back( sqrt( d.dot(d) ) );
+    }
+    return median( distances ) > min_parallax;
+}
+
+int KeyframeManager::lastKeyframe() const
+{
+    return keyframe_nr;
+}
+
+const char *KeyframeManager::lastReason() const
+{
+    return reason;
+}
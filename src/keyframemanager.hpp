@@ -0,0 +1,67 @@
+#ifndef KEYFRAMEMANAGER_H
+#define KEYFRAMEMANAGER_H
+
+#include <opencv2/core/core.hpp>
+
+#include <utility>
+#include <vector>
+
+/**
+ * Decides which tracked frames become keyframes.
+ *
+ * Only keyframes go through the expensive steps (triangulation, map
+ * insertion, bundle adjustment, pose graph, loop closure); the frames in
+ * between are only tracked. The decision uses signals that are available
+ * right after tracking:
+ *  - the fraction of the map points of the last keyframe still tracked,
+ *  - the median parallax of those points in pixels,
+ *  - the number of frames since the last keyframe,
+ *  - the rotation and the baseline (relative to the median scene depth)
+ *    between the current pose and the pose of the last keyframe.
+ **/
+class KeyframeManager
+{
+    double min_tracked_ratio;
+    double min_parallax;
+    int min_frames;
+    int max_frames;
+    double max_rotation;
+    double max_baseline_ratio;
+
+    // Last keyframe, observations sorted by point id
+    bool has_keyframe;
+    int keyframe_nr;
+    cv::Matx44d keyframe_pose;
+    double keyframe_depth;
+    std::vector<std::pair<int, cv::Point2d> > keyframe_observations;
+    int frames_since;
+
+    const char *reason;
+    std::vector<std::pair<int, cv::Point2d> > scratch;
+    std::vector<double> distances;
+
+public:
+    KeyframeManager();
+
+    void setMinTrackedRatio(double ratio);
+    void setMinParallax(double pixels);
+    void setFrameRange(int min_frames, int max_frames);
+    void setMaxRotation(double degrees);
+    void setMaxBaselineRatio(double ratio);
+
+    void reset();
+    bool isKeyframe(const cv::Matx44d &pose,
+                    const std::vector<int> &point_ids,
+                    const std::vector<cv::Point2d> &pixels);
+    void addKeyframe(int frame_nr, const cv::Matx44d &pose,
+                     const std::vector<int> &point_ids,
+                     const std::vector<cv::Point2d> &pixels,
+                     const std::vector<cv::Point3d> &points);
+    bool enoughParallax(const std::vector<cv::Point2d> &previous,
+                        const std::vector<cv::Point2d> &current);
+
+    int lastKeyframe() const;
+    const char *lastReason() const;
+};
+
+#endif // KEYFRAMEMANAGER_H
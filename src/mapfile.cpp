@@ -0,0 +1,345 @@
+#include "mapfile.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAP_FILE_ALIGNMENT 64
+
+static const char MAP_FILE_MAGIC[4] = { 'N', 'M', 'A', 'P' };
+
+static uint64_t aligned(uint64_t offset)
+{
+    return (offset + MAP_FILE_ALIGNMENT - 1) / MAP_FILE_ALIGNMENT * MAP_FILE_ALIGNMENT;
+}
+
+MapWriter::MapWriter()
+{
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, MAP_FILE_MAGIC, 4 );
+    header.version = MAP_FILE_VERSION;
+    header.header_size = sizeof(MapFileHeader);
+    for ( int s = 0; s < MAP_SECTION_COUNT; s++ ) {
+        sections[s] = NULL;
+    }
+}
+
+/**
+ * Point columns, count entries each, with ids in [0, id_count). statistics
+ * holds 4 values per point and may be NULL.
+ **/
+void MapWriter::setPoints(int count, int id_count, const double *x, const double *y, const double *z,
+                          const int32_t *ids, const int32_t *frames, const int32_t *statistics)
+{
+    header.point_count = count;
+    header.id_count = id_count;
+    sections[MAP_X] = x;
+    sections[MAP_Y] = y;
+    sections[MAP_Z] = z;
+    sections[MAP_IDS] = ids;
+    sections[MAP_FRAMES] = frames;
+    sections[MAP_STATISTICS] = statistics;
+    for ( int s = MAP_X; s <= MAP_Z; s++ ) {
+        header.sizes[s] = count * sizeof(double);
+    }
+    header.sizes[MAP_IDS] = count * sizeof(int32_t);
+    header.sizes[MAP_FRAMES] = count * sizeof(int32_t);
+    header.sizes[MAP_STATISTICS] = statistics != NULL ? 4 * count * sizeof(int32_t) : 0;
+}
+
+/**
+ * Descriptor matrix, row i for point i. Made continuous if it is not.
+ **/
+void MapWriter::setDescriptors(const cv::Mat &descriptors)
+{
+    this->descriptors = descriptors.isContinuous() ? descriptors : descriptors.clone();
+    header.descriptor_cols = descriptors.cols;
+    header.descriptor_type = descriptors.type();
+    sections[MAP_DESCRIPTORS] = this->descriptors.empty() ? NULL : this->descriptors.ptr(0);
+    header.sizes[MAP_DESCRIPTORS] = descriptors.rows * descriptors.cols * descriptors.elemSize();
+}
+
+void MapWriter::setObservations(int count, const Observation *observations)
+{
+    header.observation_count = count;
+    sections[MAP_OBSERVATIONS] = observations;
+    header.sizes[MAP_OBSERVATIONS] = count * sizeof(Observation);
+}
+
+void MapWriter::setKeyframes(int count, const MapFileKeyframe *keyframes,
+                             int point_count, const int32_t *points)
+{
+    header.keyframe_count = count;
+    header.keyframe_point_count = point_count;
+    sections[MAP_KEYFRAMES] = keyframes;
+    sections[MAP_KEYFRAME_POINTS] = points;
+    header.sizes[MAP_KEYFRAMES] = count * sizeof(MapFileKeyframe);
+    header.sizes[MAP_KEYFRAME_POINTS] = point_count * sizeof(int32_t);
+}
+
+void MapWriter::setThumbnails(int width, int height, int stride, int count,
+                              const int32_t *ids, const short *thumbnails)
+{
+    header.thumbnail_width = width;
+    header.thumbnail_height = height;
+    header.thumbnail_stride = stride;
+    header.thumbnail_count = count;
+    sections[MAP_THUMBNAIL_IDS] = ids;
+    sections[MAP_THUMBNAILS] = thumbnails;
+    header.sizes[MAP_THUMBNAIL_IDS] = count * sizeof(int32_t);
+    header.sizes[MAP_THUMBNAILS] = (uint64_t) count * stride * sizeof(short);
+}
+
+bool MapWriter::write(const std::string &path) const
+{
+    MapFileHeader out = header;
+    uint64_t offset = aligned( sizeof(MapFileHeader) );
+    for ( int s = 0; s < MAP_SECTION_COUNT; s++ ) {
+        if ( sections[s] == NULL ) {
+            out.sizes[s] = 0;
+        }
+        out.offsets[s] = offset;
+        offset = aligned( offset + out.sizes[s] );
+    }
+
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen( temporary.c_str(), "wb" );
+    if ( file == NULL ) {
+        return false;
+    }
+    static const char padding[MAP_FILE_ALIGNMENT] = { 0 };
+    bool ok = fwrite( &out, sizeof(out), 1, file ) == 1;
+    uint64_t position = sizeof(out);
+    for ( int s = 0; s < MAP_SECTION_COUNT && ok; s++ ) {
+        ok = fwrite( padding, 1, out.offsets[s] - position, file ) == out.offsets[s] - position;
+        if ( ok && out.sizes[s] > 0 ) {
+            ok = fwrite( sections[s], 1, out.sizes[s], file ) == out.sizes[s];
+        }
+        position = out.offsets[s] + out.sizes[s];
+    }
+    ok = fflush( file ) == 0 && ok;
+    ok = fsync( fileno(file) ) == 0 && ok;
+    ok = fclose( file ) == 0 && ok;
+    if ( !ok || rename( temporary.c_str(), path.c_str() ) != 0 ) {
+        unlink( temporary.c_str() );
+        return false;
+    }
+    return true;
+}
+
+MapFile::MapFile()
+{
+    this->fd = -1;
+    this->data = NULL;
+    this->length = 0;
+    this->header = NULL;
+}
+
+MapFile::~MapFile()
+{
+    close();
+}
+
+bool MapFile::open(const std::string &path)
+{
+    close();
+    fd = ::open( path.c_str(), O_RDONLY );
+    if ( fd < 0 ) {
+        return false;
+    }
+    struct stat status;
+    if ( fstat( fd, &status ) != 0 || (size_t) status.st_size < sizeof(MapFileHeader) ) {
+        close();
+        return false;
+    }
+    length = status.st_size;
+    void *mapping = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( mapping == MAP_FAILED ) {
+        close();
+        return false;
+    }
+    data = (const unsigned char *) mapping;
+    header = (const MapFileHeader *) data;
+
+    bool ok = memcmp( header->magic, MAP_FILE_MAGIC, 4 ) == 0 &&
+              header->version == MAP_FILE_VERSION &&
+              header->header_size == (int32_t) sizeof(MapFileHeader);
+    for ( int s = 0; s < MAP_SECTION_COUNT && ok; s++ ) {
+        ok = header->offsets[s] % MAP_FILE_ALIGNMENT == 0 &&
+             header->offsets[s] <= length && header->sizes[s] <= length - header->offsets[s];
+    }
+    // Sections must be as large as the counts in the header claim
+    ok = ok && header->point_count >= 0 &&
+         header->sizes[MAP_X] == header->point_count * sizeof(double) &&
+         header->sizes[MAP_Y] == header->sizes[MAP_X] &&
+         header->sizes[MAP_Z] == header->sizes[MAP_X] &&
+         header->sizes[MAP_IDS] == header->point_count * sizeof(int32_t) &&
+         header->sizes[MAP_FRAMES] == header->sizes[MAP_IDS] &&
+         ( header->sizes[MAP_STATISTICS] == 0 || header->sizes[MAP_STATISTICS] == 4 * header->sizes[MAP_IDS] ) &&
+         header->sizes[MAP_OBSERVATIONS] == header->observation_count * sizeof(Observation) &&
+         header->sizes[MAP_KEYFRAMES] == header->keyframe_count * sizeof(MapFileKeyframe) &&
+         header->sizes[MAP_KEYFRAME_POINTS] == header->keyframe_point_count * sizeof(int32_t) &&
+         header->thumbnail_count >= 0 && header->thumbnail_stride >= 0 &&
+         header->sizes[MAP_THUMBNAIL_IDS] == header->thumbnail_count * sizeof(int32_t) &&
+         header->sizes[MAP_THUMBNAILS] == (uint64_t) header->thumbnail_count * header->thumbnail_stride * sizeof(short);
+    if ( ok && header->sizes[MAP_DESCRIPTORS] > 0 ) {
+        ok = header->descriptor_cols > 0 &&
+             ( header->descriptor_type == CV_8U || header->descriptor_type == CV_32F ) &&
+             header->sizes[MAP_DESCRIPTORS] == (uint64_t) header->point_count * header->descriptor_cols *
+                                               CV_ELEM_SIZE(header->descriptor_type);
+    }
+    int first_frame = INT_MAX, last_frame = INT_MIN;
+    for ( int k = 0; k < header->keyframe_count && ok; k++ ) {
+        const MapFileKeyframe &keyframe = keyframes()[k];
+        ok = keyframe.first_point >= 0 && keyframe.point_count >= 0 &&
+             keyframe.first_point + keyframe.point_count <= header->keyframe_point_count &&
+             keyframe.frame_nr >= 0;
+        first_frame = std::min( first_frame, keyframe.frame_nr );
+        last_frame = std::max( last_frame, keyframe.frame_nr );
+    }
+
+    // Restoring a map indexes arrays by point id and by frame: every point
+    // id below id_count and used once, points made and observed in frames
+    // of the keyframes
+    ok = ok && header->id_count >= header->point_count;
+    std::vector<bool> used( ok ? header->id_count : 0, false );
+    for ( int n = 0; n < header->point_count && ok; n++ ) {
+        int32_t id = ids()[n];
+        ok = id >= 0 && id < header->id_count && !used[id] &&
+             frames()[n] >= first_frame && frames()[n] <= last_frame;
+        if ( ok ) {
+            used[id] = true;
+        }
+    }
+    for ( int o = 0; o < header->observation_count && ok; o++ ) {
+        const Observation &observation = observations()[o];
+        ok = observation.point_id >= 0 && observation.point_id < header->id_count && used[observation.point_id] &&
+             observation.frame_nr >= first_frame && observation.frame_nr <= last_frame;
+    }
+    // Thumbnail ids are indices in the keyframes
+    for ( int t = 0; t < header->thumbnail_count && ok; t++ ) {
+        ok = thumbnailIds()[t] >= 0 && thumbnailIds()[t] < header->keyframe_count;
+    }
+    if ( !ok ) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MapFile::close()
+{
+    if ( data != NULL ) {
+        munmap( (void *) data, length );
+    }
+    if ( fd >= 0 ) {
+        ::close( fd );
+    }
+    fd = -1;
+    data = NULL;
+    length = 0;
+    header = NULL;
+}
+
+bool MapFile::isOpen() const
+{
+    return header != NULL;
+}
+
+const MapFileHeader &MapFile::info() const
+{
+    return *header;
+}
+
+const void *MapFile::section(int s) const
+{
+    return header->sizes[s] > 0 ? data + header->offsets[s] : NULL;
+}
+
+int MapFile::pointCount() const
+{
+    return header->point_count;
+}
+
+/**
+ * Coordinate column (0: x, 1: y, 2: z).
+ **/
+const double *MapFile::column(int axis) const
+{
+    return (const double *) section( MAP_X + axis );
+}
+
+const int32_t *MapFile::ids() const
+{
+    return (const int32_t *) section( MAP_IDS );
+}
+
+const int32_t *MapFile::frames() const
+{
+    return (const int32_t *) section( MAP_FRAMES );
+}
+
+/**
+ * Weight, visible, found and last seen frame per point, NULL if not saved.
+ **/
+const int32_t *MapFile::statistics() const
+{
+    return (const int32_t *) section( MAP_STATISTICS );
+}
+
+/**
+ * Descriptor matrix, a header on the mapping (read-only, no copy).
+ **/
+cv::Mat MapFile::descriptors() const
+{
+    if ( header->sizes[MAP_DESCRIPTORS] == 0 ) {
+        return cv::Mat();
+    }
+    return cv::Mat( header->point_count, header->descriptor_cols, header->descriptor_type,
+                    (void *) section( MAP_DESCRIPTORS ) );
+}
+
+int MapFile::observationCount() const
+{
+    return header->observation_count;
+}
+
+const Observation *MapFile::observations() const
+{
+    return (const Observation *) section( MAP_OBSERVATIONS );
+}
+
+int MapFile::keyframeCount() const
+{
+    return header->keyframe_count;
+}
+
+const MapFileKeyframe *MapFile::keyframes() const
+{
+    return (const MapFileKeyframe *) section( MAP_KEYFRAMES );
+}
+
+const int32_t *MapFile::keyframePoints() const
+{
+    return (const int32_t *) section( MAP_KEYFRAME_POINTS );
+}
+
+int MapFile::thumbnailCount() const
+{
+    return header->thumbnail_count;
+}
+
+const int32_t *MapFile::thumbnailIds() const
+{
+    return (const int32_t *) section( MAP_THUMBNAIL_IDS );
+}
+
+const short *MapFile::thumbnails() const
+{
+    return (const short *) section( MAP_THUMBNAILS );
+}
@@ -0,0 +1,140 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <opencv2/core/core.hpp>
+
+#include "observationtable.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define MAP_FILE_VERSION 2
+
+/**
+ * Sections of a map file, in file order.
+ **/
+enum MapSection {
+    MAP_X,                  // double per point
+    MAP_Y,
+    MAP_Z,
+    MAP_IDS,                // int32 per point
+    MAP_FRAMES,             // int32 per point, frame the point was made in
+    MAP_STATISTICS,         // 4 int32 per point: weight, visible, found, last seen
+    MAP_DESCRIPTORS,        // one row per point
+    MAP_OBSERVATIONS,       // Observation records
+    MAP_KEYFRAMES,          // MapFileKeyframe records
+    MAP_KEYFRAME_POINTS,    // int32 point ids, ranges per keyframe
+    MAP_THUMBNAIL_IDS,      // int32 per thumbnail
+    MAP_THUMBNAILS,         // thumbnail_stride shorts per thumbnail
+    MAP_SECTION_COUNT
+};
+
+typedef struct {
+    char magic[4];              // "NMAP"
+    int32_t version;
+    int32_t header_size;
+    int32_t point_count;
+    int32_t descriptor_cols;
+    int32_t descriptor_type;
+    int32_t observation_count;
+    int32_t keyframe_count;
+    int32_t keyframe_point_count;
+    int32_t thumbnail_width;
+    int32_t thumbnail_height;
+    int32_t thumbnail_stride;
+    int32_t thumbnail_count;
+    int32_t id_count;           // point ids are below this
+    uint64_t offsets[MAP_SECTION_COUNT];    // from the start of the file
+    uint64_t sizes[MAP_SECTION_COUNT];      // in bytes
+} MapFileHeader;
+
+/**
+ * A keyframe: world to camera pose (row major) and the map points it saw,
+ * keyframe_points[first_point, first_point + point_count).
+ **/
+typedef struct {
+    double pose[16];
+    int32_t frame_nr;
+    int32_t first_point;
+    int32_t point_count;
+    int32_t reserved;
+} MapFileKeyframe;
+
+/**
+ * Writes a map file from arrays owned by the caller.
+ *
+ * The file is a header followed by the sections, each aligned to 64 bytes,
+ * in the native byte order. Every section is stored exactly as it is used
+ * in memory (coordinate columns, descriptor matrix, fixed size records),
+ * so a reader only has to map the file. The file is written next to the
+ * target and renamed over it when complete, so a crash while saving leaves
+ * the previous map intact.
+ **/
+class MapWriter
+{
+    MapFileHeader header;
+    const void *sections[MAP_SECTION_COUNT];
+    cv::Mat descriptors;
+
+public:
+    MapWriter();
+
+    void setPoints(int count, int id_count, const double *x, const double *y, const double *z,
+                   const int32_t *ids, const int32_t *frames, const int32_t *statistics);
+    void setDescriptors(const cv::Mat &descriptors);
+    void setObservations(int count, const Observation *observations);
+    void setKeyframes(int count, const MapFileKeyframe *keyframes,
+                      int point_count, const int32_t *points);
+    void setThumbnails(int width, int height, int stride, int count,
+                       const int32_t *ids, const short *thumbnails);
+
+    bool write(const std::string &path) const;
+};
+
+/**
+ * Read-only memory mapping of a map file. open() checks the header, the
+ * section bounds, and the point ids and frame numbers that index arrays when
+ * the map is restored; the accessors point straight into the mapping, which
+ * stays valid until close(). The other sections are read from disk as they
+ * are first touched.
+ **/
+class MapFile
+{
+    int fd;
+    const unsigned char *data;
+    size_t length;
+    const MapFileHeader *header;
+
+    const void *section(int s) const;
+
+public:
+    MapFile();
+    ~MapFile();
+
+    bool open(const std::string &path);
+    void close();
+    bool isOpen() const;
+    const MapFileHeader &info() const;
+
+    int pointCount() const;
+    const double *column(int axis) const;
+    const int32_t *ids() const;
+    const int32_t *frames() const;
+    const int32_t *statistics() const;
+    cv::Mat descriptors() const;
+
+    int observationCount() const;
+    const Observation *observations() const;
+
+    int keyframeCount() const;
+    const MapFileKeyframe *keyframes() const;
+    const int32_t *keyframePoints() const;
+
+    int thumbnailCount() const;
+    const int32_t *thumbnailIds() const;
+    const short *thumbnails() const;
+};
+
+#endif // MAPFILE_H
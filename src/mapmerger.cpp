@@ -0,0 +1,574 @@
+#include "mapmerger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <string.h>
+
+Sim3 Sim3Identity()
+{
+    Sim3 sim3;
+    sim3.scale = 1.0;
+    sim3.R = cv::Matx33d::eye();
+    sim3.t = cv::Matx31d( 0, 0, 0 );
+    return sim3;
+}
+
+cv::Point3d Sim3Apply(const Sim3 &sim3, const cv::Point3d &X)
+{
+    cv::Matx31d Y = sim3.scale * ( sim3.R * cv::Matx31d( X.x, X.y, X.z ) ) + sim3.t;
+    return cv::Point3d( Y(0), Y(1), Y(2) );
+}
+
+/**
+ * World to camera pose in the transformed world. Camera coordinates scale
+ * along, so the pose stays a rotation and a translation in the new units.
+ **/
+cv::Matx44d Sim3Pose(const Sim3 &sim3, const cv::Matx44d &pose)
+{
+    cv::Matx33d R = pose.get_minor<3, 3>(0, 0) * sim3.R.t();
+    cv::Matx31d t = sim3.scale * pose.get_minor<3, 1>(0, 3) - R * sim3.t;
+    return cv::Matx44d( R(0,0), R(0,1), R(0,2), t(0),
+                        R(1,0), R(1,1), R(1,2), t(1),
+                        R(2,0), R(2,1), R(2,2), t(2),
+                        0, 0, 0, 1 );
+}
+
+/**
+ * Least squares similarity with to[i] = scale * R * from[i] + t (Umeyama),
+ * at least three point pairs. Fails for degenerate (coincident) points.
+ **/
+bool EstimateSim3(const std::vector<cv::Point3d> &from, const std::vector<cv::Point3d> &to, Sim3 &sim3)
+{
+    int n = std::min( from.size(), to.size() );
+    if ( n < 3 ) {
+        return false;
+    }
+    cv::Matx31d pc( 0, 0, 0 ), qc( 0, 0, 0 );
+    for ( int i = 0; i < n; i++ ) {
+        pc += cv::Matx31d( from[i].x, from[i].y, from[i].z );
+        qc += cv::Matx31d( to[i].x, to[i].y, to[i].z );
+    }
+    pc = pc * (1.0 / n);
+    qc = qc * (1.0 / n);
+
+    cv::Matx33d H = cv::Matx33d::zeros();
+    double variance = 0;
+    for ( int i = 0; i < n; i++ ) {
+        cv::Matx31d p = cv::Matx31d( from[i].x, from[i].y, from[i].z ) - pc;
+        cv::Matx31d q = cv::Matx31d( to[i].x, to[i].y, to[i].z ) - qc;
+        H += p * q.t();
+        variance += p.dot( p );
+    }
+    if ( variance < 1e-12 ) {
+        return false;
+    }
+
+    cv::Matx31d w;
+    cv::Matx33d u, vt;
+    cv::SVD::compute(H, w, u, vt);
+    cv::Matx33d R = vt.t() * u.t();
+    if ( cv::determinant(R) < 0 ) {
+        for ( int j = 0; j < 3; j++ ) {
+            vt(2,j) = -vt(2,j);
+        }
+        R = vt.t() * u.t();
+    }
+    // With R fixed, the scale that fits best is trace(R H) / variance
+    cv::Matx33d RH = R * H;
+    double scale = ( RH(0,0) + RH(1,1) + RH(2,2) ) / variance;
+    if ( !(scale > 1e-9) ) {
+        return false;
+    }
+    sim3.scale = scale;
+    sim3.R = R;
+    sim3.t = qc - scale * ( R * pc );
+    return true;
+}
+
+MapMerger::MapMerger(const Vocabulary &vocabulary, double fusion_radius, double fusion_distance)
+    : vocabulary(vocabulary), database(vocabulary.wordCount())
+{
+    this->frame_count = 0;
+    this->inlier_threshold = 0.05;
+    this->min_matches = 30;
+    this->min_inliers = 20;
+    this->candidates = 3;
+    this->iterations = 200;
+    this->seed = 0x9e3779b9u;
+
+    team.enable_index( fusion_radius > 0 ? 3 * fusion_radius : 0.1 );
+    team.set_fusion( fusion_radius, fusion_distance );
+}
+
+/**
+ * Largest distance, in team map units, between a transformed point and the
+ * point it was matched to for the pair to support an alignment.
+ **/
+void MapMerger::setInlierThreshold(double threshold)
+{
+    this->inlier_threshold = threshold;
+}
+
+/**
+ * Descriptor matches needed to try a keyframe pair, and RANSAC inliers
+ * needed to accept the alignment it gives.
+ **/
+void MapMerger::setMinInliers(int min_matches, int min_inliers)
+{
+    this->min_matches = std::max( min_matches, 3 );
+    this->min_inliers = std::max( min_inliers, 3 );
+}
+
+unsigned int MapMerger::random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+int MapMerger::teamFrame(Agent &agent, int frame_nr)
+{
+    std::map<int, int>::iterator it = agent.frames.find( frame_nr );
+    if ( it != agent.frames.end() ) {
+        return it->second;
+    }
+    agent.frames[frame_nr] = frame_count;
+    return frame_count++;
+}
+
+/**
+ * Points and descriptors of the source points a source keyframe observed.
+ **/
+static void sourcePoints(const std::vector<int> &slots, const double *const columns[3],
+                         const cv::Mat &source_descriptors, const MergeKeyframe &keyframe,
+                         std::vector<cv::Point3d> &points, cv::Mat &descriptors)
+{
+    points.clear();
+    std::vector<int> rows;
+    for ( size_t p = 0; p < keyframe.point_ids.size(); p++ ) {
+        int id = keyframe.point_ids[p];
+        if ( id >= 0 && id < (int) slots.size() && slots[id] >= 0 ) {
+            int slot = slots[id];
+            points.push_back( cv::Point3d( columns[0][slot], columns[1][slot], columns[2][slot] ) );
+            rows.push_back( slot );
+        }
+    }
+    descriptors.create( rows.size(), source_descriptors.cols, source_descriptors.type() );
+    size_t row_size = source_descriptors.cols * source_descriptors.elemSize();
+    for ( size_t r = 0; r < rows.size(); r++ ) {
+        memcpy( descriptors.ptr(r), source_descriptors.ptr( rows[r] ), row_size );
+    }
+}
+
+/**
+ * Points (team ids) and descriptors of the team points a team keyframe observed.
+ **/
+void MapMerger::teamDescriptors(const MergeKeyframe &keyframe, std::vector<int> &ids, cv::Mat &descriptors) const
+{
+    ids.clear();
+    for ( size_t p = 0; p < keyframe.point_ids.size(); p++ ) {
+        if ( team.contains( keyframe.point_ids[p] ) ) {
+            ids.push_back( keyframe.point_ids[p] );
+        }
+    }
+    if ( ids.empty() ) {
+        descriptors = cv::Mat();
+        return;
+    }
+    cv::Mat first = team.get_descriptor( ids[0] );
+    descriptors.create( ids.size(), first.cols, first.type() );
+    size_t row_size = first.cols * first.elemSize();
+    for ( size_t n = 0; n < ids.size(); n++ ) {
+        memcpy( descriptors.ptr(n), team.get_descriptor( ids[n] ).ptr(0), row_size );
+    }
+}
+
+/**
+ * Sim(3) explaining most pairs within the inlier threshold, from minimal
+ * samples of three pairs. Returns the number of inliers, marked in inliers.
+ **/
+int MapMerger::ransacSim3(const std::vector<cv::Point3d> &from, const std::vector<cv::Point3d> &to,
+                          Sim3 &sim3, std::vector<unsigned char> &inliers)
+{
+    int n = from.size();
+    int best = 0;
+    inliers.assign( n, 0 );
+    if ( n < 3 ) {
+        return 0;
+    }
+    std::vector<cv::Point3d> sample_from( 3 ), sample_to( 3 );
+    std::vector<unsigned char> mask( n );
+    double threshold2 = inlier_threshold * inlier_threshold;
+    for ( int it = 0; it < iterations; it++ ) {
+        int a = random() % n, b = random() % n, c = random() % n;
+        if ( a == b || a == c || b == c ) {
+            continue;
+        }
+        sample_from[0] = from[a]; sample_from[1] = from[b]; sample_from[2] = from[c];
+        sample_to[0] = to[a]; sample_to[1] = to[b]; sample_to[2] = to[c];
+        Sim3 candidate;
+        if ( !EstimateSim3( sample_from, sample_to, candidate ) ) {
+            continue;
+        }
+        int count = 0;
+        for ( int i = 0; i < n; i++ ) {
+            cv::Point3d d = Sim3Apply( candidate, from[i] ) - to[i];
+            mask[i] = d.dot( d ) < threshold2;
+            count += mask[i];
+        }
+        if ( count > best ) {
+            best = count;
+            sim3 = candidate;
+            inliers = mask;
+        }
+    }
+    return best;
+}
+
+/**
+ * Find where the source overlaps the team map: every source keyframe is
+ * looked up in the place database, each candidate pair is matched by
+ * descriptor and aligned with RANSAC. The pair with the most inliers wins;
+ * the Sim(3) is refit on its inliers.
+ **/
+bool MapMerger::align(const Source &source, const std::vector<int> &slots, Sim3 &sim3)
+{
+    if ( keyframes.empty() || vocabulary.empty() || source.descriptors.empty() ) {
+        return false;
+    }
+    int best = 0;
+    std::vector<cv::Point3d> best_from, best_to;
+
+    BowVector bow;
+    std::vector<PlaceCandidate> results;
+    std::vector<cv::Point3d> points;
+    cv::Mat descriptors, team_descriptors;
+    std::vector<int> team_ids;
+    std::vector<cv::DMatch> matches;
+    std::vector<cv::Point3d> from, to;
+    std::vector<unsigned char> inliers;
+    for ( size_t k = 0; k < source.keyframes.size(); k++ ) {
+        sourcePoints( slots, source.columns, source.descriptors, source.keyframes[k],
+                      points, descriptors );
+        if ( (int) points.size() < min_matches ) {
+            continue;
+        }
+        vocabulary.transform( descriptors, bow );
+        database.query( bow, database.size(), candidates, results );
+        for ( size_t c = 0; c < results.size(); c++ ) {
+            teamDescriptors( keyframes[results[c].entry], team_ids, team_descriptors );
+            if ( MatchBinaryDescriptors( descriptors, team_descriptors, 80, 0.8f, matches ) < min_matches ) {
+                continue;
+            }
+            from.clear();
+            to.clear();
+            for ( size_t m = 0; m < matches.size(); m++ ) {
+                from.push_back( points[matches[m].queryIdx] );
+                to.push_back( team.get_point( team_ids[matches[m].trainIdx] ) );
+            }
+            Sim3 candidate;
+            int count = ransacSim3( from, to, candidate, inliers );
+            if ( count > best ) {
+                best = count;
+                best_from.clear();
+                best_to.clear();
+                for ( size_t i = 0; i < inliers.size(); i++ ) {
+                    if ( inliers[i] ) {
+                        best_from.push_back( from[i] );
+                        best_to.push_back( to[i] );
+                    }
+                }
+            }
+        }
+    }
+    return best >= min_inliers && EstimateSim3( best_from, best_to, sim3 );
+}
+
+/**
+ * Merge (or update) the map of an agent. Returns false if the agent could
+ * not be aligned with the team map (yet); nothing is merged then.
+ **/
+bool MapMerger::merge(int agent_id, const Source &source)
+{
+    std::map<int, Agent>::iterator found = agents.find( agent_id );
+    if ( found == agents.end() ) {
+        Agent agent;
+        agent.aligned = false;
+        agent.to_team = Sim3Identity();
+        found = agents.insert( std::make_pair( agent_id, agent ) ).first;
+    }
+    Agent &agent = found->second;
+
+    int max_id = -1;
+    for ( int slot = 0; slot < source.count; slot++ ) {
+        max_id = std::max( max_id, source.ids[slot] );
+    }
+    std::vector<int> slots( max_id + 1, -1 );
+    for ( int slot = 0; slot < source.count; slot++ ) {
+        slots[source.ids[slot]] = slot;
+    }
+
+    if ( !agent.aligned ) {
+        if ( keyframes.empty() && team.size() == 0 ) {
+            agent.to_team = Sim3Identity();
+        } else if ( !align( source, slots, agent.to_team ) ) {
+            return false;
+        }
+        agent.aligned = true;
+    }
+
+    // New points go in per frame, so fusion can match them against each
+    // other as well; points the agent created before follow its map
+    std::vector<std::pair<int, int> > fresh;
+    for ( int slot = 0; slot < source.count; slot++ ) {
+        int id = source.ids[slot];
+        if ( agent.points.count( id ) ) {
+            std::map<int, int>::iterator own = agent.owned.find( id );
+            if ( own != agent.owned.end() && team.contains( own->second ) ) {
+                team.set_point( own->second, Sim3Apply( agent.to_team,
+                    cv::Point3d( source.columns[0][slot], source.columns[1][slot], source.columns[2][slot] ) ) );
+            }
+        } else {
+            fresh.push_back( std::make_pair( teamFrame( agent, source.frames[slot] ), slot ) );
+        }
+    }
+    std::sort( fresh.begin(), fresh.end() );
+    std::set<int> fresh_ids;
+    std::vector<cv::Point3d> points;
+    std::vector<int> ids;
+    cv::Mat descriptors;
+    size_t row_size = source.descriptors.cols * source.descriptors.elemSize();
+    for ( size_t begin = 0; begin < fresh.size(); ) {
+        size_t end = begin;
+        while ( end < fresh.size() && fresh[end].first == fresh[begin].first ) {
+            end++;
+        }
+        points.clear();
+        descriptors.create( end - begin, source.descriptors.cols, source.descriptors.type() );
+        for ( size_t f = begin; f < end; f++ ) {
+            int slot = fresh[f].second;
+            points.push_back( Sim3Apply( agent.to_team,
+                cv::Point3d( source.columns[0][slot], source.columns[1][slot], source.columns[2][slot] ) ) );
+            if ( row_size > 0 ) {
+                memcpy( descriptors.ptr(f - begin), source.descriptors.ptr(slot), row_size );
+            }
+        }
+        int first_new = team.id_count();
+        team.add( points, descriptors, fresh[begin].first, ids );
+        for ( size_t f = begin; f < end; f++ ) {
+            int id = source.ids[fresh[f].second];
+            agent.points[id] = ids[f - begin];
+            if ( ids[f - begin] >= first_new ) {
+                agent.owned[id] = ids[f - begin];
+            }
+            fresh_ids.insert( id );
+        }
+        begin = end;
+    }
+
+    // New keyframes, with the thumbnails they had
+    std::map<int, int> thumbnail_rows;
+    if ( source.thumbnail_width == thumbnails.thumbnailWidth() &&
+         source.thumbnail_height == thumbnails.thumbnailHeight() &&
+         source.thumbnail_stride == thumbnails.thumbnailStride() ) {
+        for ( int t = 0; t < source.thumbnail_count; t++ ) {
+            thumbnail_rows[source.thumbnail_ids[t]] = t;
+        }
+    }
+    std::set<int> fresh_frames;
+    BowVector bow;
+    for ( size_t k = 0; k < source.keyframes.size(); k++ ) {
+        const MergeKeyframe &keyframe = source.keyframes[k];
+        if ( agent.keyframes.count( keyframe.frame_nr ) ) {
+            continue;
+        }
+        agent.keyframes.insert( keyframe.frame_nr );
+        fresh_frames.insert( keyframe.frame_nr );
+
+        MergeKeyframe merged;
+        merged.frame_nr = teamFrame( agent, keyframe.frame_nr );
+        merged.pose = Sim3Pose( agent.to_team, keyframe.pose );
+        for ( size_t p = 0; p < keyframe.point_ids.size(); p++ ) {
+            std::map<int, int>::iterator it = agent.points.find( keyframe.point_ids[p] );
+            if ( it != agent.points.end() ) {
+                merged.point_ids.push_back( it->second );
+            }
+        }
+        std::vector<int> team_ids;
+        teamDescriptors( merged, team_ids, descriptors );
+        vocabulary.transform( descriptors, bow );
+        database.add( bow );
+        keyframes.push_back( merged );
+
+        std::map<int, int>::iterator row = thumbnail_rows.find( k );
+        if ( row != thumbnail_rows.end() ) {
+            thumbnails.addThumbnail( source.thumbnails + (size_t) row->second * thumbnails.thumbnailStride(),
+                                     keyframes.size() - 1 );
+        }
+    }
+
+    // Observations of new points or in new keyframes
+    ObservationTable &observations = team.observations();
+    for ( size_t o = 0; o < source.observations.size(); o++ ) {
+        const Observation &observation = source.observations[o];
+        if ( !fresh_ids.count( observation.point_id ) && !fresh_frames.count( observation.frame_nr ) ) {
+            continue;
+        }
+        std::map<int, int>::iterator it = agent.points.find( observation.point_id );
+        if ( it != agent.points.end() ) {
+            observations.add( it->second, teamFrame( agent, observation.frame_nr ), observation.keypoint );
+        }
+    }
+    return true;
+}
+
+/**
+ * Merge a saved map. Points, keyframes and observations are read straight
+ * from the mapping.
+ **/
+bool MapMerger::merge(int agent_id, const MapFile &file)
+{
+    Source source;
+    source.count = file.pointCount();
+    for ( int axis = 0; axis < 3; axis++ ) {
+        source.columns[axis] = file.column(axis);
+    }
+    source.ids = file.ids();
+    source.frames = file.frames();
+    source.descriptors = file.descriptors();
+    for ( int k = 0; k < file.keyframeCount(); k++ ) {
+        const MapFileKeyframe &record = file.keyframes()[k];
+        MergeKeyframe keyframe;
+        keyframe.frame_nr = record.frame_nr;
+        for ( int i = 0; i < 16; i++ ) {
+            keyframe.pose(i / 4, i % 4) = record.pose[i];
+        }
+        const int32_t *points = file.keyframePoints() + record.first_point;
+        keyframe.point_ids.assign( points, points + record.point_count );
+        source.keyframes.push_back( keyframe );
+    }
+    source.observations.assign( file.observations(), file.observations() + file.observationCount() );
+    source.thumbnail_width = file.info().thumbnail_width;
+    source.thumbnail_height = file.info().thumbnail_height;
+    source.thumbnail_stride = file.info().thumbnail_stride;
+    source.thumbnail_count = file.thumbnailCount();
+    source.thumbnails = file.thumbnails();
+    source.thumbnail_ids = file.thumbnailIds();
+    return merge( agent_id, source );
+}
+
+/**
+ * Merge the live map of an agent: its cloud, keyframes and (optionally) the
+ * thumbnails of those keyframes, with keyframe indices as ids.
+ **/
+bool MapMerger::merge(int agent_id, const Cloud<cv::Point3d> &cloud, const std::vector<MergeKeyframe> &keyframes,
+                      const ThumbnailIndex *thumbnails)
+{
+    CloudView<cv::Point3d> view = cloud.view();
+    Source source;
+    source.count = view.size();
+    for ( int axis = 0; axis < 3; axis++ ) {
+        source.columns[axis] = view.column(axis);
+    }
+    source.ids = view.ids();
+    source.frames = view.frames();
+    cloud.get_descriptors( source.descriptors );
+    source.keyframes = keyframes;
+    for ( int slot = 0; slot < view.size(); slot++ ) {
+        const ObservationTable &observations = cloud.observations();
+        for ( int r = observations.firstOfPoint( view.id(slot) ); r >= 0; r = observations.nextOfPoint(r) ) {
+            source.observations.push_back( observations.get(r) );
+        }
+    }
+    source.thumbnail_width = thumbnails != NULL ? thumbnails->thumbnailWidth() : 0;
+    source.thumbnail_height = thumbnails != NULL ? thumbnails->thumbnailHeight() : 0;
+    source.thumbnail_stride = thumbnails != NULL ? thumbnails->thumbnailStride() : 0;
+    source.thumbnail_count = thumbnails != NULL ? thumbnails->size() : 0;
+    source.thumbnails = thumbnails != NULL ? thumbnails->thumbnailData() : NULL;
+    source.thumbnail_ids = thumbnails != NULL ? thumbnails->thumbnailIds() : NULL;
+    return merge( agent_id, source );
+}
+
+bool MapMerger::aligned(int agent_id) const
+{
+    std::map<int, Agent>::const_iterator it = agents.find( agent_id );
+    return it != agents.end() && it->second.aligned;
+}
+
+/**
+ * Transform from the world of an agent to the team world.
+ **/
+const Sim3 &MapMerger::alignment(int agent_id) const
+{
+    return agents.find( agent_id )->second.to_team;
+}
+
+int MapMerger::agentCount() const
+{
+    return agents.size();
+}
+
+const Cloud<cv::Point3d> &MapMerger::map() const
+{
+    return team;
+}
+
+const std::vector<MergeKeyframe> &MapMerger::teamKeyframes() const
+{
+    return keyframes;
+}
+
+/**
+ * Write the team map as a map file, to localize against or merge into
+ * another team map.
+ **/
+bool MapMerger::save(const std::string &path) const
+{
+    CloudView<cv::Point3d> view = team.view();
+    int n = view.size();
+    std::vector<int32_t> statistics( 4 * n );
+    std::vector<Observation> observations;
+    for ( int slot = 0; slot < n; slot++ ) {
+        int id = view.id(slot);
+        statistics[4 * slot] = team.get_weight(id);
+        statistics[4 * slot + 1] = team.get_visible(id);
+        statistics[4 * slot + 2] = team.get_found(id);
+        statistics[4 * slot + 3] = team.get_last_seen(id);
+        for ( int r = team.observations().firstOfPoint(id); r >= 0; r = team.observations().nextOfPoint(r) ) {
+            observations.push_back( team.observations().get(r) );
+        }
+    }
+    cv::Mat descriptors;
+    team.get_descriptors( descriptors );
+
+    std::vector<MapFileKeyframe> records( keyframes.size() );
+    std::vector<int32_t> points;
+    for ( size_t k = 0; k < keyframes.size(); k++ ) {
+        for ( int i = 0; i < 16; i++ ) {
+            records[k].pose[i] = keyframes[k].pose(i / 4, i % 4);
+        }
+        records[k].frame_nr = keyframes[k].frame_nr;
+        records[k].first_point = points.size();
+        for ( size_t p = 0; p < keyframes[k].point_ids.size(); p++ ) {
+            if ( team.contains( keyframes[k].point_ids[p] ) ) {
+                points.push_back( keyframes[k].point_ids[p] );
+            }
+        }
+        records[k].point_count = points.size() - records[k].first_point;
+        records[k].reserved = 0;
+    }
+
+    MapWriter writer;
+    writer.setPoints( n, team.id_count(), view.column(0), view.column(1), view.column(2),
+                      view.ids(), view.frames(), n > 0 ? &statistics[0] : NULL );
+    writer.setDescriptors( descriptors );
+    writer.setObservations( observations.size(), observations.empty() ? NULL : &observations[0] );
+    writer.setKeyframes( records.size(), records.empty() ? NULL : &records[0],
+                         points.size(), points.empty() ? NULL : &points[0] );
+    writer.setThumbnails( thumbnails.thumbnailWidth(), thumbnails.thumbnailHeight(),
+                          thumbnails.thumbnailStride(), thumbnails.size(),
+                          thumbnails.thumbnailIds(), thumbnails.thumbnailData() );
+    return writer.write( path );
+}
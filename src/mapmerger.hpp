@@ -0,0 +1,132 @@
+#ifndef MAPMERGER_H
+#define MAPMERGER_H
+
+#include <opencv2/core/core.hpp>
+
+#include "cloud.hpp"
+#include "mapfile.hpp"
+#include "placedatabase.hpp"
+#include "thumbnailindex.hpp"
+#include "vocabulary.hpp"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * Similarity transform X' = scale * R * X + t, from the world of one map to
+ * that of another.
+ **/
+typedef struct {
+    double scale;
+    cv::Matx33d R;
+    cv::Matx31d t;
+} Sim3;
+
+Sim3 Sim3Identity();
+cv::Point3d Sim3Apply(const Sim3 &sim3, const cv::Point3d &X);
+cv::Matx44d Sim3Pose(const Sim3 &sim3, const cv::Matx44d &pose);
+bool EstimateSim3(const std::vector<cv::Point3d> &from, const std::vector<cv::Point3d> &to, Sim3 &sim3);
+
+/**
+ * A keyframe of a map to merge: world to camera pose and the ids of the map
+ * points it observed.
+ **/
+typedef struct {
+    int frame_nr;
+    cv::Matx44d pose;
+    std::vector<int> point_ids;
+} MergeKeyframe;
+
+/**
+ * Merges the maps of several agents (robots) into one team map.
+ *
+ * The first map merged fixes the team world. Every other agent is aligned
+ * on its first merge: its keyframes are looked up in a place database of
+ * the team keyframes (bag of words), the map points of each candidate pair
+ * are matched by descriptor, and a Sim(3) is fitted to the matched 3d
+ * points with RANSAC, so maps with a different scale (monocular) line up.
+ * An agent that overlaps nothing yet stays unaligned and is tried again on
+ * its next merge.
+ *
+ * Points go into the team cloud with fusion on, so a point both agents
+ * mapped becomes one. Merging is incremental: per agent the merger
+ * remembers its alignment, which of its points and keyframes are in the
+ * team map and under which ids and frame numbers. Merging an updated map of
+ * the same agent only adds what is new and moves the points the agent
+ * created to their new position; the rest of the team map is left alone.
+ *
+ * Keyframes keep the thumbnails they had, so the team map can be saved and
+ * localized against like the map of a single robot.
+ **/
+class MapMerger
+{
+    typedef struct {
+        bool aligned;
+        Sim3 to_team;
+        std::map<int, int> points;      // agent point id -> team point id
+        std::map<int, int> owned;       // agent point id -> team point id, created by this agent
+        std::map<int, int> frames;      // agent frame number -> team frame number
+        std::set<int> keyframes;        // agent frame numbers of the keyframes merged
+    } Agent;
+
+    typedef struct {
+        int count;
+        const double *columns[3];
+        const int *ids;
+        const int *frames;
+        cv::Mat descriptors;
+        std::vector<MergeKeyframe> keyframes;
+        std::vector<Observation> observations;
+        int thumbnail_width;
+        int thumbnail_height;
+        int thumbnail_stride;
+        int thumbnail_count;
+        const short *thumbnails;
+        const int *thumbnail_ids;       // index in keyframes
+    } Source;
+
+    const Vocabulary &vocabulary;
+    Cloud<cv::Point3d> team;
+    std::vector<MergeKeyframe> keyframes;
+    PlaceDatabase database;             // entry n is keyframes[n]
+    ThumbnailIndex thumbnails;          // ids are indices in keyframes
+    std::map<int, Agent> agents;
+    int frame_count;
+
+    double inlier_threshold;
+    int min_matches;
+    int min_inliers;
+    int candidates;
+    int iterations;
+    unsigned int seed;
+
+    unsigned int random();
+    int teamFrame(Agent &agent, int frame_nr);
+    void teamDescriptors(const MergeKeyframe &keyframe, std::vector<int> &ids, cv::Mat &descriptors) const;
+    int ransacSim3(const std::vector<cv::Point3d> &from, const std::vector<cv::Point3d> &to,
+                   Sim3 &sim3, std::vector<unsigned char> &inliers);
+    bool align(const Source &source, const std::vector<int> &slots, Sim3 &sim3);
+    bool merge(int agent_id, const Source &source);
+
+public:
+    MapMerger(const Vocabulary &vocabulary, double fusion_radius, double fusion_distance);
+
+    void setInlierThreshold(double threshold);
+    void setMinInliers(int min_matches, int min_inliers);
+
+    bool merge(int agent_id, const MapFile &file);
+    bool merge(int agent_id, const Cloud<cv::Point3d> &cloud, const std::vector<MergeKeyframe> &keyframes,
+               const ThumbnailIndex *thumbnails);
+
+    bool aligned(int agent_id) const;
+    const Sim3 &alignment(int agent_id) const;
+    int agentCount() const;
+
+    const Cloud<cv::Point3d> &map() const;
+    const std::vector<MergeKeyframe> &teamKeyframes() const;
+    bool save(const std::string &path) const;
+};
+
+#endif // MAPMERGER_H
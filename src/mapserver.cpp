@@ -0,0 +1,141 @@
+/**
+ * Map server for multi-robot runs: navigate (-m address) streams the map
+ * changes of each robot here, and this keeps a copy of every robot's map.
+ * Runs until interrupted; then reports the traffic and apply times per
+ * robot and, with -o, merges the copies into one team map like mergemaps.
+ *
+ * The address is a Unix socket path (containing a '/') or host:port.
+ *
+ * Usage: mapserver [-o output] [-v vocabulary] [-r fusion radius]
+ *                  [-t inlier threshold] address
+ */
+
+#include <opencv2/core/core.hpp>
+
+#include <iostream>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include "mapmerger.hpp"
+#include "mapsync.hpp"
+#include "vocabulary.hpp"
+
+static volatile sig_atomic_t running = 1;
+
+static void interrupt(int)
+{
+    running = 0;
+}
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [-o output] [-v vocabulary] [-r fusion radius]"
+              << " [-t inlier threshold] address" << std::endl;
+}
+
+/**
+ * Merge the maps of all agents, retrying those that overlap nothing yet
+ * while some map still gets merged.
+ **/
+static bool mergeAgents(const MapServer &server, MapMerger &merger, const std::string &output)
+{
+    std::vector<int> agents = server.agents();
+    std::vector<bool> merged( agents.size(), false );
+    for ( bool progress = true; progress; ) {
+        progress = false;
+        for ( size_t a = 0; a < agents.size(); a++ ) {
+            if ( !merged[a] && merger.merge( agents[a], server.map( agents[a] ), server.keyframes( agents[a] ), NULL ) ) {
+                merged[a] = true;
+                progress = true;
+            }
+        }
+    }
+    for ( size_t a = 0; a < agents.size(); a++ ) {
+        std::cout << "Agent " << agents[a] << ": " << server.map( agents[a] ).size() << " points, "
+                  << server.keyframes( agents[a] ).size() << " keyframes"
+                  << ( merged[a] ? "." : ", does not overlap the team map, left out." ) << std::endl;
+    }
+    return merger.save( output );
+}
+
+int main( int argc, char* argv[] ) {
+    std::string vocabulary_file = "vocabulary";
+    std::string output;
+    std::string address;
+    double radius = 0.03;
+    double threshold = 0.05;
+
+    for ( int i = 1; i < argc; i++ ) {
+        std::string arg( argv[i] );
+        if ( arg[0] == '-' && i + 1 < argc ) {
+            std::string value( argv[++i] );
+            if ( arg == "-v" ) {
+                vocabulary_file = value;
+            } else if ( arg == "-o" ) {
+                output = value;
+            } else if ( arg == "-r" ) {
+                radius = atof( value.c_str() );
+            } else if ( arg == "-t" ) {
+                threshold = atof( value.c_str() );
+            } else {
+                usage( argv[0] );
+                return 1;
+            }
+        } else if ( address.empty() ) {
+            address = arg;
+        } else {
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( address.empty() || threshold <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    // Load the vocabulary up front, not after a long run
+    Vocabulary vocabulary;
+    if ( !output.empty() && !vocabulary.load( vocabulary_file ) ) {
+        std::cerr << "Can not load vocabulary " << vocabulary_file << "." << std::endl;
+        return 1;
+    }
+
+    MapServer server;
+    if ( !server.listen( address ) ) {
+        std::cerr << "Can not listen on " << address << "." << std::endl;
+        return 1;
+    }
+    signal( SIGINT, interrupt );
+    signal( SIGTERM, interrupt );
+    std::cout << "Listening on " << address << "." << std::endl;
+
+    int connections = 0;
+    while ( running ) {
+        server.poll( 200 );
+        if ( server.connectionCount() != connections ) {
+            connections = server.connectionCount();
+            std::cout << connections << " agents connected." << std::endl;
+        }
+    }
+    server.close();
+
+    std::vector<int> agents = server.agents();
+    for ( size_t a = 0; a < agents.size(); a++ ) {
+        std::ostringstream name;
+        name << "Agent " << agents[a];
+        PrintSyncStatistics( name.str(), server.stats( agents[a] ) );
+    }
+
+    if ( !output.empty() && !agents.empty() ) {
+        MapMerger merger( vocabulary, radius, 80 );
+        merger.setInlierThreshold( threshold );
+        if ( !mergeAgents( server, merger, output ) ) {
+            std::cerr << "Could not write " << output << "." << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1089 @@
+#include "mapsync.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Largest payload accepted, anything bigger is taken for a corrupt stream
+#define SYNC_MAX_PAYLOAD (256u << 20)
+// How long a publisher waits for the answer to its hello, milliseconds
+#define SYNC_HELLO_TIMEOUT 2000
+// How long a publisher waits for a connection, and for room to send, milliseconds
+#define SYNC_CONNECT_TIMEOUT 1000
+#define SYNC_SEND_TIMEOUT 2000
+// Delay before reconnecting, doubled after every failed attempt, milliseconds
+#define SYNC_RETRY_MIN 100
+#define SYNC_RETRY_MAX 5000
+// How often an idle sender reads the answers of the server, milliseconds
+#define SYNC_POLL_INTERVAL 50
+// Deltas waiting to be sent at most
+#define SYNC_QUEUE 8
+// Largest point id and frame number accepted from an agent, anything
+// bigger is taken for a corrupt delta (the replica would grow to it)
+#define SYNC_MAX_ID (1 << 22)
+#define SYNC_MAX_FRAME (1 << 22)
+// How long closing waits for the server to acknowledge the last delta, milliseconds
+#define SYNC_CLOSE_TIMEOUT 2000
+
+static double now()
+{
+    return (double) cv::getTickCount() / cv::getTickFrequency();
+}
+
+/**
+ * Connect fd to name, giving up after SYNC_CONNECT_TIMEOUT. Sends on the
+ * connected socket fail after SYNC_SEND_TIMEOUT without progress.
+ **/
+static bool connectWithin(int fd, const struct sockaddr *name, socklen_t length)
+{
+    int flags = fcntl( fd, F_GETFL, 0 );
+    if ( flags < 0 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) < 0 ) {
+        return false;
+    }
+    if ( connect( fd, name, length ) != 0 ) {
+        if ( errno != EINPROGRESS && errno != EAGAIN ) {
+            return false;
+        }
+        struct pollfd writable;
+        writable.fd = fd;
+        writable.events = POLLOUT;
+        int error = 0;
+        socklen_t size = sizeof(error);
+        if ( ::poll( &writable, 1, SYNC_CONNECT_TIMEOUT ) <= 0 ||
+             getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &size ) != 0 || error != 0 ) {
+            return false;
+        }
+    }
+    struct timeval timeout;
+    timeout.tv_sec = SYNC_SEND_TIMEOUT / 1000;
+    timeout.tv_usec = ( SYNC_SEND_TIMEOUT % 1000 ) * 1000;
+    return fcntl( fd, F_SETFL, flags ) == 0 &&
+           setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) ) == 0;
+}
+
+/**
+ * Connected (or, with server, listening) stream socket for address: a Unix
+ * socket path when it contains a '/', host:port otherwise. -1 on failure.
+ * Connecting takes at most SYNC_CONNECT_TIMEOUT per address tried.
+ **/
+static int openSocket(const std::string &address, bool server)
+{
+    if ( address.find( '/' ) != std::string::npos ) {
+        struct sockaddr_un name;
+        if ( address.size() >= sizeof(name.sun_path) ) {
+            return -1;
+        }
+        memset( &name, 0, sizeof(name) );
+        name.sun_family = AF_UNIX;
+        strcpy( name.sun_path, address.c_str() );
+        int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if ( fd < 0 ) {
+            return -1;
+        }
+        if ( server ) {
+            unlink( address.c_str() );
+        }
+        bool ok = server ? bind( fd, (struct sockaddr *) &name, sizeof(name) ) == 0 && ::listen( fd, 16 ) == 0
+                         : connectWithin( fd, (struct sockaddr *) &name, sizeof(name) );
+        if ( !ok ) {
+            ::close( fd );
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind( ':' );
+    if ( colon == std::string::npos ) {
+        return -1;
+    }
+    std::string host = address.substr( 0, colon );
+    std::string port = address.substr( colon + 1 );
+    struct addrinfo hints, *found;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server ? AI_PASSIVE : 0;
+    if ( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &found ) != 0 ) {
+        return -1;
+    }
+    int fd = -1;
+    for ( struct addrinfo *a = found; a != NULL && fd < 0; a = a->ai_next ) {
+        fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+        if ( fd < 0 ) {
+            continue;
+        }
+        int on = 1;
+        bool ok;
+        if ( server ) {
+            setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+            ok = bind( fd, a->ai_addr, a->ai_addrlen ) == 0 && ::listen( fd, 16 ) == 0;
+        } else {
+            // Deltas are small and latency matters more than packet count
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+            ok = connectWithin( fd, a->ai_addr, a->ai_addrlen );
+        }
+        if ( !ok ) {
+            ::close( fd );
+            fd = -1;
+        }
+    }
+    freeaddrinfo( found );
+    return fd;
+}
+
+static bool sendAll(int fd, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    while ( length > 0 ) {
+        ssize_t sent = send( fd, p, length, MSG_NOSIGNAL );
+        if ( sent < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( sent <= 0 ) {
+            return false;
+        }
+        p += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/**
+ * Append what can be read from fd without blocking to buffer. False once
+ * the other side closed the connection or it failed.
+ **/
+static bool receiveAvailable(int fd, std::vector<unsigned char> &buffer)
+{
+    unsigned char chunk[65536];
+    for ( ;; ) {
+        ssize_t received = recv( fd, chunk, sizeof(chunk), MSG_DONTWAIT );
+        if ( received > 0 ) {
+            buffer.insert( buffer.end(), chunk, chunk + received );
+            continue;
+        }
+        if ( received < 0 && errno == EINTR ) {
+            continue;
+        }
+        return received < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK );
+    }
+}
+
+/**
+ * Length of the first complete message in buffer, 0 if it is not complete
+ * yet, -1 if the buffer does not start with a message.
+ **/
+static long completeMessage(const std::vector<unsigned char> &buffer, SyncHeader &header)
+{
+    if ( buffer.size() < sizeof(SyncHeader) ) {
+        return 0;
+    }
+    memcpy( &header, &buffer[0], sizeof(SyncHeader) );
+    if ( header.magic != MAP_SYNC_MAGIC || header.length > SYNC_MAX_PAYLOAD ) {
+        return -1;
+    }
+    size_t length = sizeof(SyncHeader) + header.length;
+    return buffer.size() >= length ? (long) length : 0;
+}
+
+static bool sendMessage(int fd, int type, int agent, uint64_t sequence, const void *payload, uint32_t length)
+{
+    SyncHeader header;
+    header.magic = MAP_SYNC_MAGIC;
+    header.type = type;
+    header.agent = agent;
+    header.length = length;
+    header.sequence = sequence;
+    return sendAll( fd, &header, sizeof(header) ) && ( length == 0 || sendAll( fd, payload, length ) );
+}
+
+static void put(std::vector<unsigned char> &out, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    out.insert( out.end(), p, p + length );
+}
+
+static void putInt(std::vector<unsigned char> &out, int32_t value)
+{
+    put( out, &value, sizeof(value) );
+}
+
+static void putPoint(std::vector<unsigned char> &out, const cv::Point3d &p)
+{
+    float xyz[3] = { (float) p.x, (float) p.y, (float) p.z };
+    put( out, xyz, sizeof(xyz) );
+}
+
+/**
+ * Reads the fields of a delta, failing (instead of reading past the end)
+ * on a truncated one.
+ **/
+class DeltaReader
+{
+    const unsigned char *p;
+    const unsigned char *end;
+public:
+    DeltaReader(const unsigned char *data, size_t length) : p(data), end(data + length) {}
+    bool get(void *data, size_t length)
+    {
+        if ( (size_t) (end - p) < length ) {
+            return false;
+        }
+        memcpy( data, p, length );
+        p += length;
+        return true;
+    }
+    const unsigned char *take(size_t length)
+    {
+        if ( (size_t) (end - p) < length ) {
+            return NULL;
+        }
+        p += length;
+        return p - length;
+    }
+    bool done() const
+    {
+        return p == end;
+    }
+};
+
+static void clearStatistics(SyncStatistics &statistics)
+{
+    memset( &statistics, 0, sizeof(statistics) );
+}
+
+static void countDelta(SyncStatistics &statistics, bool snapshot, int records, size_t bytes)
+{
+    double t = now();
+    if ( statistics.deltas == 0 ) {
+        statistics.first_time = t;
+    }
+    statistics.last_time = t;
+    statistics.deltas++;
+    statistics.snapshots += snapshot ? 1 : 0;
+    statistics.records += records;
+    statistics.bytes += bytes;
+}
+
+static void countApply(SyncStatistics &statistics, double seconds)
+{
+    statistics.applied++;
+    statistics.apply_total += seconds;
+    statistics.apply_max = std::max( statistics.apply_max, seconds );
+}
+
+void PrintSyncStatistics(const std::string &name, const SyncStatistics &statistics)
+{
+    if ( statistics.deltas == 0 ) {
+        std::cout << name << ": no deltas." << std::endl;
+        return;
+    }
+    double seconds = statistics.last_time - statistics.first_time;
+    std::cout << name << ": " << statistics.deltas << " deltas (" << statistics.snapshots << " snapshots, "
+              << statistics.resyncs << " resyncs), " << statistics.records << " records, "
+              << statistics.bytes / 1024.0 << " kB, " << statistics.bytes / 1024.0 / statistics.deltas
+              << " kB per delta";
+    if ( seconds > 0 ) {
+        std::cout << ", " << statistics.bytes / 1024.0 / seconds << " kB/s";
+    }
+    if ( statistics.applied > 0 ) {
+        std::cout << "; apply " << 1000 * statistics.apply_total / statistics.applied << " ms mean, "
+                  << 1000 * statistics.apply_max << " ms max";
+    }
+    std::cout << "." << std::endl;
+}
+
+MapPublisher::MapPublisher(int agent)
+{
+    this->agent = agent;
+    this->cloud = NULL;
+    this->snapshot = true;
+    this->sequence = 0;
+    this->running = false;
+    this->stopping = false;
+    this->linked = false;
+    this->resync = false;
+    this->fd = -1;
+    this->sent = 0;
+    this->acknowledged = 0;
+    clearStatistics( statistics );
+    pthread_mutex_init( &lock, NULL );
+    pthread_cond_init( &wake, NULL );
+}
+
+MapPublisher::~MapPublisher()
+{
+    close();
+    if ( cloud != NULL ) {
+        cloud->remove_listener( changed, this );
+    }
+    pthread_cond_destroy( &wake );
+    pthread_mutex_destroy( &lock );
+}
+
+/**
+ * Publish the changes to cloud from now on; the first delta is a snapshot.
+ **/
+void MapPublisher::attach(Cloud<cv::Point3d> &cloud)
+{
+    if ( this->cloud != NULL ) {
+        this->cloud->remove_listener( changed, this );
+    }
+    this->cloud = &cloud;
+    cloud.add_listener( changed, this );
+    pending.clear();
+    snapshot = true;
+}
+
+void MapPublisher::changed(void *context, int change, int id)
+{
+    MapPublisher *publisher = (MapPublisher *) context;
+    std::map<int, int> &pending = publisher->pending;
+    if ( change == CLOUD_RESET ) {
+        pending.clear();
+        publisher->snapshot = true;
+    }
+    if ( publisher->snapshot ) {
+        // The whole map goes out with the next delta anyway
+        return;
+    }
+    std::map<int, int>::iterator it = pending.find( id );
+    if ( change == CLOUD_ADDED ) {
+        pending[id] = CLOUD_ADDED;
+    } else if ( change == CLOUD_MOVED ) {
+        if ( it == pending.end() ) {
+            pending[id] = CLOUD_MOVED;
+        }
+    } else if ( change == CLOUD_REMOVED ) {
+        if ( it != pending.end() && it->second == CLOUD_ADDED ) {
+            // The server never heard of it
+            pending.erase( it );
+        } else {
+            pending[id] = CLOUD_REMOVED;
+        }
+    }
+}
+
+/**
+ * Start the sender thread, which connects to the server at address and
+ * reconnects when the connection is lost. Returns at once; false if the
+ * thread can not be started.
+ **/
+bool MapPublisher::connect(const std::string &address)
+{
+    close();
+    this->address = address;
+    stopping = false;
+    running = pthread_create( &thread, NULL, run, this ) == 0;
+    return running;
+}
+
+/**
+ * Whether deltas go out at the moment.
+ **/
+bool MapPublisher::connected() const
+{
+    pthread_mutex_lock( &lock );
+    bool result = linked;
+    pthread_mutex_unlock( &lock );
+    return result;
+}
+
+/**
+ * Send what is queued if connected and wait (up to SYNC_CLOSE_TIMEOUT) for
+ * the server to acknowledge it, then stop the sender thread and close the
+ * connection.
+ **/
+void MapPublisher::close()
+{
+    if ( running ) {
+        pthread_mutex_lock( &lock );
+        stopping = true;
+        pthread_cond_signal( &wake );
+        pthread_mutex_unlock( &lock );
+        pthread_join( thread, NULL );
+        running = false;
+    }
+}
+
+/**
+ * Queued deltas are kept, the handshake of the next connection decides
+ * whether they can still be sent. Called with lock held.
+ **/
+void MapPublisher::disconnect()
+{
+    if ( fd >= 0 ) {
+        ::close( fd );
+    }
+    fd = -1;
+    input.clear();
+    linked = false;
+}
+
+/**
+ * Hello with the last delta sent; the server answers with the last one it
+ * applied. Blocks up to SYNC_HELLO_TIMEOUT.
+ **/
+bool MapPublisher::handshake(uint64_t &applied)
+{
+    if ( !sendMessage( fd, SYNC_HELLO, agent, sent, NULL, 0 ) ) {
+        return false;
+    }
+    double deadline = now() + SYNC_HELLO_TIMEOUT / 1000.0;
+    SyncHeader header;
+    long length;
+    while ( ( length = completeMessage( input, header ) ) == 0 ) {
+        struct pollfd readable;
+        readable.fd = fd;
+        readable.events = POLLIN;
+        int wait = (int) ( 1000 * ( deadline - now() ) );
+        if ( wait <= 0 || ::poll( &readable, 1, wait ) <= 0 || !receiveAvailable( fd, input ) ) {
+            return false;
+        }
+    }
+    if ( length < 0 || header.type != SYNC_ACK ) {
+        return false;
+    }
+    input.erase( input.begin(), input.begin() + length );
+    applied = header.sequence;
+    acknowledged = applied;
+    return true;
+}
+
+/**
+ * Handle the acknowledgements and resync requests that arrived so far.
+ * Called with lock held.
+ **/
+void MapPublisher::receive()
+{
+    if ( !receiveAvailable( fd, input ) ) {
+        disconnect();
+        return;
+    }
+    SyncHeader header;
+    long length;
+    while ( ( length = completeMessage( input, header ) ) != 0 ) {
+        if ( length < 0 ) {
+            disconnect();
+            return;
+        }
+        if ( header.type == SYNC_ACK ) {
+            uint64_t apply_ns = 0;
+            if ( header.length >= sizeof(apply_ns) ) {
+                memcpy( &apply_ns, &input[sizeof(SyncHeader)], sizeof(apply_ns) );
+            }
+            countApply( statistics, apply_ns * 1e-9 );
+            acknowledged = header.sequence;
+        } else if ( header.type == SYNC_RESYNC ) {
+            // The server skips deltas until the snapshot
+            statistics.resyncs++;
+            queue.clear();
+            resync = true;
+        }
+        input.erase( input.begin(), input.begin() + length );
+    }
+}
+
+/**
+ * Wait on condition for at most seconds.
+ **/
+static void waitFor(pthread_cond_t &condition, pthread_mutex_t &mutex, double seconds)
+{
+    struct timeval time;
+    gettimeofday( &time, NULL );
+    double until = time.tv_sec + time.tv_usec * 1e-6 + seconds;
+    struct timespec deadline;
+    deadline.tv_sec = (time_t) until;
+    deadline.tv_nsec = (long) ( ( until - deadline.tv_sec ) * 1e9 );
+    pthread_cond_timedwait( &condition, &mutex, &deadline );
+}
+
+void *MapPublisher::run(void *argument)
+{
+    ( (MapPublisher *) argument )->serve();
+    return NULL;
+}
+
+/**
+ * The sender thread: (re)connect, send the queued deltas in order and read
+ * the answers, until stopped. Once stopped it sends what is left and waits
+ * for the acknowledgement of the last delta before disconnecting, so the
+ * server does not lose it. The lock is released for the network calls that
+ * may block, the publishing thread only ever adds to the back of the queue
+ * meanwhile.
+ **/
+void MapPublisher::serve()
+{
+    int delay = SYNC_RETRY_MIN;
+    double retry = 0;
+    double closing = 0;
+    std::vector<unsigned char> bytes;
+    pthread_mutex_lock( &lock );
+    while ( !stopping || ( fd >= 0 && ( !queue.empty() || acknowledged != sent ) ) ) {
+        if ( fd < 0 ) {
+            if ( retry > now() ) {
+                waitFor( wake, lock, retry - now() );
+                continue;
+            }
+            pthread_mutex_unlock( &lock );
+            uint64_t applied = 0;
+            fd = openSocket( address, false );
+            bool ok = fd >= 0 && handshake( applied );
+            pthread_mutex_lock( &lock );
+            if ( !ok ) {
+                disconnect();
+                retry = now() + delay / 1000.0;
+                delay = std::min( 2 * delay, SYNC_RETRY_MAX );
+                continue;
+            }
+            delay = SYNC_RETRY_MIN;
+            if ( applied != sent ) {
+                // Anything but exactly our last delta needs a fresh start
+                queue.clear();
+                resync = true;
+            }
+            linked = true;
+            continue;
+        }
+        receive();
+        if ( fd < 0 ) {
+            continue;
+        }
+        if ( queue.empty() ) {
+            if ( stopping ) {
+                if ( closing == 0 ) {
+                    closing = now() + SYNC_CLOSE_TIMEOUT / 1000.0;
+                } else if ( now() > closing ) {
+                    break;
+                }
+            }
+            waitFor( wake, lock, SYNC_POLL_INTERVAL / 1000.0 );
+            continue;
+        }
+        bytes.swap( queue.front().bytes );
+        pthread_mutex_unlock( &lock );
+        bool ok = sendAll( fd, &bytes[0], bytes.size() );
+        pthread_mutex_lock( &lock );
+        if ( !ok ) {
+            // Again after reconnecting, unless the server wants a snapshot
+            queue.front().bytes.swap( bytes );
+            disconnect();
+            continue;
+        }
+        const QueuedDelta &delta = queue.front();
+        sent = delta.sequence;
+        countDelta( statistics, delta.snapshot, delta.records, bytes.size() );
+        queue.pop_front();
+    }
+    disconnect();
+    pthread_mutex_unlock( &lock );
+}
+
+/**
+ * Add a keyframe, or replace the one with the same frame number (after its
+ * pose was optimized or it saw more points). point_ids are the map points
+ * it observed. Set only the keyframes that are new or changed, each one
+ * set goes out with the next delta.
+ **/
+void MapPublisher::setKeyframe(int frame_nr, const cv::Matx44d &pose, const std::vector<int> &point_ids)
+{
+    std::map<int, int>::iterator it = keyframe_index.find( frame_nr );
+    if ( it == keyframe_index.end() ) {
+        it = keyframe_index.insert( std::make_pair( frame_nr, (int) keyframes.size() ) ).first;
+        keyframes.push_back( MergeKeyframe() );
+    }
+    MergeKeyframe &keyframe = keyframes[it->second];
+    keyframe.frame_nr = frame_nr;
+    keyframe.pose = pose;
+    keyframe.point_ids = point_ids;
+    pending_keyframes.insert( it->second );
+}
+
+/**
+ * Delta message in output, from the pending changes or the whole map.
+ * Returns the number of records.
+ **/
+int MapPublisher::encode()
+{
+    output.resize( sizeof(SyncHeader) + sizeof(SyncDeltaHeader) );
+    SyncDeltaHeader delta;
+    delta.flags = snapshot ? SYNC_SNAPSHOT : 0;
+    delta.descriptor_type = CV_8U;
+    delta.descriptor_cols = 0;
+    delta.record_count = 0;
+
+    cv::Mat descriptor;
+    if ( cloud->size() > 0 ) {
+        descriptor = cloud->get_descriptor( cloud->id(0) );
+    }
+    size_t row_size = descriptor.cols * descriptor.elemSize();
+    if ( !descriptor.empty() ) {
+        delta.descriptor_type = descriptor.type();
+        delta.descriptor_cols = descriptor.cols;
+    }
+
+    std::vector<int> added, moved, removed;
+    if ( snapshot ) {
+        // In id order, as the cloud handed them out
+        cloud->get_ids( added );
+        std::sort( added.begin(), added.end() );
+    } else {
+        for ( std::map<int, int>::const_iterator it = pending.begin(); it != pending.end(); it++ ) {
+            std::vector<int> &list = it->second == CLOUD_ADDED ? added : it->second == CLOUD_MOVED ? moved : removed;
+            list.push_back( it->first );
+        }
+    }
+
+    for ( size_t i = 0; i < removed.size(); i++ ) {
+        output.push_back( SYNC_POINT_REMOVED );
+        putInt( output, removed[i] );
+    }
+    for ( size_t i = 0; i < added.size(); i++ ) {
+        if ( !cloud->contains( added[i] ) ) {
+            continue;
+        }
+        output.push_back( SYNC_POINT_ADDED );
+        putInt( output, added[i] );
+        putInt( output, cloud->get_frame( added[i] ) );
+        putPoint( output, cloud->get_point( added[i] ) );
+        if ( row_size > 0 ) {
+            put( output, cloud->get_descriptor( added[i] ).ptr(0), row_size );
+        }
+        delta.record_count++;
+    }
+    for ( size_t i = 0; i < moved.size(); i++ ) {
+        if ( !cloud->contains( moved[i] ) ) {
+            continue;
+        }
+        output.push_back( SYNC_POINT_MOVED );
+        putInt( output, moved[i] );
+        putPoint( output, cloud->get_point( moved[i] ) );
+        delta.record_count++;
+    }
+    delta.record_count += removed.size();
+
+    // Keyframes after the points, so their point ids are known on arrival
+    std::set<int> all;
+    const std::set<int> *changed = &pending_keyframes;
+    if ( snapshot ) {
+        for ( size_t k = 0; k < keyframes.size(); k++ ) {
+            all.insert( k );
+        }
+        changed = &all;
+    }
+    for ( std::set<int>::const_iterator it = changed->begin(); it != changed->end(); it++ ) {
+        const MergeKeyframe &keyframe = keyframes[*it];
+        output.push_back( SYNC_KEYFRAME );
+        putInt( output, keyframe.frame_nr );
+        put( output, keyframe.pose.val, 12 * sizeof(double) );
+        putInt( output, keyframe.point_ids.size() );
+        if ( !keyframe.point_ids.empty() ) {
+            put( output, &keyframe.point_ids[0], keyframe.point_ids.size() * sizeof(int32_t) );
+        }
+        delta.record_count++;
+    }
+
+    memcpy( &output[sizeof(SyncHeader)], &delta, sizeof(delta) );
+    return delta.record_count;
+}
+
+/**
+ * Queue the changes since the last publish (the whole map when a snapshot
+ * is due) as one delta for the sender thread. Returns the bytes queued, 0
+ * if nothing changed or the queue is full, -1 if the server can not be
+ * reached at the moment; the changes are kept for a later publish then.
+ **/
+int MapPublisher::publish()
+{
+    if ( cloud == NULL || !running ) {
+        return -1;
+    }
+    pthread_mutex_lock( &lock );
+    if ( resync ) {
+        resync = false;
+        pending.clear();
+        snapshot = true;
+    }
+    bool up = linked;
+    bool room = queue.size() < SYNC_QUEUE;
+    pthread_mutex_unlock( &lock );
+    if ( !up ) {
+        return -1;
+    }
+    if ( !room ) {
+        return 0;
+    }
+    int records = encode();
+    if ( records == 0 && !snapshot ) {
+        return 0;
+    }
+
+    SyncHeader header;
+    header.magic = MAP_SYNC_MAGIC;
+    header.type = SYNC_DELTA;
+    header.agent = agent;
+    header.length = output.size() - sizeof(SyncHeader);
+    header.sequence = sequence + 1;
+    memcpy( &output[0], &header, sizeof(header) );
+    int bytes = output.size();
+
+    pthread_mutex_lock( &lock );
+    // A resync asked for meanwhile makes this delta useless, the snapshot
+    // of the next publish replaces it
+    if ( !resync ) {
+        queue.push_back( QueuedDelta() );
+        QueuedDelta &delta = queue.back();
+        delta.bytes.swap( output );
+        delta.sequence = header.sequence;
+        delta.records = records;
+        delta.snapshot = snapshot;
+        pthread_cond_signal( &wake );
+    }
+    pthread_mutex_unlock( &lock );
+    sequence++;
+    pending.clear();
+    pending_keyframes.clear();
+    snapshot = false;
+    return bytes;
+}
+
+/**
+ * Bytes and records sent, and the apply times the server reported for the
+ * deltas it acknowledged so far.
+ **/
+SyncStatistics MapPublisher::stats() const
+{
+    pthread_mutex_lock( &lock );
+    SyncStatistics result = statistics;
+    pthread_mutex_unlock( &lock );
+    return result;
+}
+
+MapServer::MapServer()
+{
+    this->listen_fd = -1;
+}
+
+MapServer::~MapServer()
+{
+    close();
+    for ( std::map<int, Replica *>::iterator it = replicas.begin(); it != replicas.end(); it++ ) {
+        delete it->second;
+    }
+}
+
+/**
+ * Accept publishers on address (see MapPublisher), replacing a stale Unix
+ * socket.
+ **/
+bool MapServer::listen(const std::string &address)
+{
+    close();
+    listen_fd = openSocket( address, true );
+    if ( listen_fd >= 0 && address.find( '/' ) != std::string::npos ) {
+        socket_path = address;
+    }
+    return listen_fd >= 0;
+}
+
+/**
+ * Stop listening and drop all connections. The replicas stay.
+ **/
+void MapServer::close()
+{
+    for ( size_t c = 0; c < connections.size(); c++ ) {
+        ::close( connections[c].fd );
+    }
+    connections.clear();
+    if ( listen_fd >= 0 ) {
+        ::close( listen_fd );
+    }
+    listen_fd = -1;
+    if ( !socket_path.empty() ) {
+        unlink( socket_path.c_str() );
+        socket_path.clear();
+    }
+}
+
+MapServer::Replica &MapServer::replica(int agent)
+{
+    std::map<int, Replica *>::iterator it = replicas.find( agent );
+    if ( it == replicas.end() ) {
+        Replica *replica = new Replica();
+        replica->sequence = 0;
+        replica->waiting = false;
+        clearStatistics( replica->statistics );
+        it = replicas.insert( std::make_pair( agent, replica ) ).first;
+    }
+    return *it->second;
+}
+
+/**
+ * Wait up to timeout_ms for connections and messages and handle them.
+ * Returns the number of messages handled, -1 when not listening.
+ **/
+int MapServer::poll(int timeout_ms)
+{
+    if ( listen_fd < 0 ) {
+        return -1;
+    }
+    std::vector<struct pollfd> fds( connections.size() + 1 );
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for ( size_t c = 0; c < connections.size(); c++ ) {
+        fds[c + 1].fd = connections[c].fd;
+        fds[c + 1].events = POLLIN;
+    }
+    if ( ::poll( &fds[0], fds.size(), timeout_ms ) <= 0 ) {
+        return 0;
+    }
+
+    int handled = 0;
+    std::vector<Connection> open;
+    for ( size_t c = 0; c < connections.size(); c++ ) {
+        Connection &connection = connections[c];
+        bool alive = true;
+        if ( fds[c + 1].revents != 0 ) {
+            // Handle what came in before the other side closed, then close
+            bool open_side = receiveAvailable( connection.fd, connection.input );
+            SyncHeader header;
+            long length;
+            while ( alive && ( length = completeMessage( connection.input, header ) ) != 0 ) {
+                alive = length > 0 && handle( connection, header, &connection.input[sizeof(SyncHeader)] );
+                if ( alive ) {
+                    connection.input.erase( connection.input.begin(), connection.input.begin() + length );
+                    handled++;
+                }
+            }
+            alive = alive && open_side;
+        }
+        if ( alive ) {
+            open.push_back( connection );
+        } else {
+            ::close( connection.fd );
+        }
+    }
+    connections.swap( open );
+
+    if ( fds[0].revents & POLLIN ) {
+        int fd = accept( listen_fd, NULL, NULL );
+        if ( fd >= 0 ) {
+            int on = 1;
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+            Connection connection;
+            connection.fd = fd;
+            connection.agent = -1;
+            connection.asked = false;
+            connections.push_back( connection );
+        }
+    }
+    return handled;
+}
+
+/**
+ * One message from a connection. False if the connection should be closed.
+ **/
+bool MapServer::handle(Connection &connection, const SyncHeader &header, const unsigned char *payload)
+{
+    if ( header.type == SYNC_HELLO ) {
+        connection.agent = header.agent;
+        uint64_t apply_ns = 0;
+        return sendMessage( connection.fd, SYNC_ACK, header.agent, replica( header.agent ).sequence,
+                            &apply_ns, sizeof(apply_ns) );
+    }
+    if ( header.type != SYNC_DELTA || connection.agent < 0 || header.agent != connection.agent ||
+         header.length < sizeof(SyncDeltaHeader) ) {
+        return false;
+    }
+
+    Replica &target = replica( connection.agent );
+    SyncDeltaHeader delta;
+    memcpy( &delta, payload, sizeof(delta) );
+    bool reset = ( delta.flags & SYNC_SNAPSHOT ) != 0;
+    if ( !reset && ( target.waiting || header.sequence != target.sequence + 1 ) ) {
+        // Missed a delta: ask for a snapshot (once per connection) and skip
+        // deltas until it comes
+        if ( !target.waiting ) {
+            target.waiting = true;
+            target.statistics.resyncs++;
+        }
+        if ( !connection.asked ) {
+            connection.asked = true;
+            return sendMessage( connection.fd, SYNC_RESYNC, connection.agent, target.sequence, NULL, 0 );
+        }
+        return true;
+    }
+
+    double start = now();
+    if ( !apply( target, payload, header.length ) ) {
+        return false;
+    }
+    double seconds = now() - start;
+    target.sequence = header.sequence;
+    target.waiting = false;
+    connection.asked = false;
+    countDelta( target.statistics, reset, delta.record_count, sizeof(SyncHeader) + header.length );
+    countApply( target.statistics, seconds );
+
+    uint64_t apply_ns = (uint64_t) ( seconds * 1e9 );
+    return sendMessage( connection.fd, SYNC_ACK, connection.agent, header.sequence, &apply_ns, sizeof(apply_ns) );
+}
+
+/**
+ * Apply a delta to a replica. False if it is malformed, the replica is left
+ * as it was then and the agent resends a snapshot after reconnecting. The
+ * delta is read twice: once to check it, once to apply it.
+ **/
+bool MapServer::apply(Replica &replica, const unsigned char *payload, size_t length)
+{
+    SyncDeltaHeader delta;
+    for ( int pass = 0; pass < 2; pass++ ) {
+        bool check = pass == 0;
+        DeltaReader reader( payload, length );
+        if ( !reader.get( &delta, sizeof(delta) ) || delta.record_count < 0 || delta.descriptor_cols < 0 ||
+             delta.descriptor_cols > 4096 || ( delta.descriptor_type != CV_8U && delta.descriptor_type != CV_32F ) ) {
+            return false;
+        }
+        if ( !check && ( delta.flags & SYNC_SNAPSHOT ) ) {
+            replica.cloud.clear();
+            replica.keyframes.clear();
+            replica.keyframe_index.clear();
+        }
+        cv::Mat descriptor;
+        if ( delta.descriptor_cols > 0 ) {
+            descriptor.create( 1, delta.descriptor_cols, delta.descriptor_type );
+        }
+        size_t row_size = descriptor.cols * descriptor.elemSize();
+
+        for ( int r = 0; r < delta.record_count; r++ ) {
+            unsigned char tag;
+            int32_t id, frame_nr;
+            float xyz[3];
+            if ( !reader.get( &tag, 1 ) ) {
+                return false;
+            }
+            if ( tag == SYNC_POINT_ADDED ) {
+                const unsigned char *row;
+                if ( !reader.get( &id, sizeof(id) ) || !reader.get( &frame_nr, sizeof(frame_nr) ) ||
+                     !reader.get( xyz, sizeof(xyz) ) || ( row = reader.take( row_size ) ) == NULL ||
+                     id < 0 || id >= SYNC_MAX_ID || frame_nr < 0 || frame_nr >= SYNC_MAX_FRAME ) {
+                    return false;
+                }
+                if ( check ) {
+                    continue;
+                }
+                if ( row_size > 0 ) {
+                    memcpy( descriptor.ptr(0), row, row_size );
+                }
+                cv::Point3d p( xyz[0], xyz[1], xyz[2] );
+                if ( !replica.cloud.insert( id, p, descriptor, frame_nr ) && replica.cloud.contains( id ) ) {
+                    replica.cloud.set_point( id, p );
+                }
+            } else if ( tag == SYNC_POINT_MOVED ) {
+                if ( !reader.get( &id, sizeof(id) ) || !reader.get( xyz, sizeof(xyz) ) ) {
+                    return false;
+                }
+                if ( !check && replica.cloud.contains( id ) ) {
+                    replica.cloud.set_point( id, cv::Point3d( xyz[0], xyz[1], xyz[2] ) );
+                }
+            } else if ( tag == SYNC_POINT_REMOVED ) {
+                if ( !reader.get( &id, sizeof(id) ) ) {
+                    return false;
+                }
+                if ( !check ) {
+                    replica.cloud.remove( id );
+                }
+            } else if ( tag == SYNC_KEYFRAME ) {
+                double pose[12];
+                int32_t count;
+                if ( !reader.get( &frame_nr, sizeof(frame_nr) ) || !reader.get( pose, sizeof(pose) ) ||
+                     !reader.get( &count, sizeof(count) ) || frame_nr < 0 || frame_nr >= SYNC_MAX_FRAME ||
+                     count < 0 || (size_t) count > length / sizeof(int32_t) ) {
+                    return false;
+                }
+                const unsigned char *ids = reader.take( count * sizeof(int32_t) );
+                if ( ids == NULL ) {
+                    return false;
+                }
+                if ( check ) {
+                    continue;
+                }
+                MergeKeyframe keyframe;
+                keyframe.frame_nr = frame_nr;
+                keyframe.pose = cv::Matx44d::eye();
+                for ( int i = 0; i < 12; i++ ) {
+                    keyframe.pose(i / 4, i % 4) = pose[i];
+                }
+                keyframe.point_ids.resize( count );
+                if ( count > 0 ) {
+                    memcpy( &keyframe.point_ids[0], ids, count * sizeof(int32_t) );
+                }
+
+                std::map<int, int>::iterator it = replica.keyframe_index.find( frame_nr );
+                if ( it == replica.keyframe_index.end() ) {
+                    replica.keyframe_index[frame_nr] = replica.keyframes.size();
+                    replica.keyframes.push_back( keyframe );
+                } else {
+                    replica.keyframes[it->second] = keyframe;
+                    replica.cloud.observations().removeFrame( frame_nr );
+                }
+                for ( int i = 0; i < count; i++ ) {
+                    if ( replica.cloud.contains( keyframe.point_ids[i] ) ) {
+                        replica.cloud.observations().add( keyframe.point_ids[i], frame_nr, -1 );
+                    }
+                }
+            } else {
+                return false;
+            }
+        }
+        if ( !reader.done() ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int MapServer::connectionCount() const
+{
+    return connections.size();
+}
+
+/**
+ * Agents that sent a hello so far, connected or not.
+ **/
+std::vector<int> MapServer::agents() const
+{
+    std::vector<int> ids;
+    for ( std::map<int, Replica *>::const_iterator it = replicas.begin(); it != replicas.end(); it++ ) {
+        ids.push_back( it->first );
+    }
+    return ids;
+}
+
+const Cloud<cv::Point3d> &MapServer::map(int agent) const
+{
+    return replicas.find( agent )->second->cloud;
+}
+
+const std::vector<MergeKeyframe> &MapServer::keyframes(int agent) const
+{
+    return replicas.find( agent )->second->keyframes;
+}
+
+/**
+ * Bytes and records received from an agent and the time spent applying them.
+ **/
+const SyncStatistics &MapServer::stats(int agent) const
+{
+    return replicas.find( agent )->second->statistics;
+}
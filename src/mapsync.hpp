@@ -0,0 +1,224 @@
+#ifndef MAPSYNC_H
+#define MAPSYNC_H
+
+#include <opencv2/core/core.hpp>
+
+#include "cloud.hpp"
+#include "mapmerger.hpp"
+
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define MAP_SYNC_MAGIC 0x4e59534e      // "NSYN" in the byte order of the machine
+
+/**
+ * Messages between a MapPublisher (agent) and a MapServer.
+ **/
+enum SyncMessage {
+    SYNC_HELLO,     // agent -> server: sequence is the last delta the agent sent
+    SYNC_DELTA,     // agent -> server: changes to the map, sequence counts up from 1
+    SYNC_ACK,       // server -> agent: sequence was applied, payload is the apply time (uint64 ns)
+    SYNC_RESYNC     // server -> agent: a delta was missed, send a snapshot
+};
+
+/**
+ * Records in a delta, each a tag byte followed by its fields (native byte
+ * order, packed):
+ * added:    int32 id, int32 frame, float x, y, z, descriptor row
+ * moved:    int32 id, float x, y, z
+ * removed:  int32 id
+ * keyframe: int32 frame, double pose[12] (world to camera, row major 3x4),
+ *           int32 count, int32 point ids[count]
+ **/
+enum SyncRecord {
+    SYNC_POINT_ADDED,
+    SYNC_POINT_MOVED,
+    SYNC_POINT_REMOVED,
+    SYNC_KEYFRAME
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    int32_t agent;
+    uint32_t length;        // payload bytes after the header
+    uint64_t sequence;
+} SyncHeader;
+
+// Delta flag: the receiver drops its copy of the map first, the delta holds all of it
+#define SYNC_SNAPSHOT 1
+
+/**
+ * Start of the payload of a delta, followed by record_count records.
+ **/
+typedef struct {
+    uint32_t flags;
+    int32_t descriptor_type;
+    int32_t descriptor_cols;
+    int32_t record_count;
+} SyncDeltaHeader;
+
+/**
+ * Traffic and latency of one side of a map stream. Times in seconds.
+ **/
+typedef struct {
+    int deltas;
+    int snapshots;
+    int resyncs;
+    int records;
+    uint64_t bytes;
+    int applied;            // deltas with a known apply time
+    double apply_total;
+    double apply_max;
+    double first_time;      // of the first delta, for the bandwidth
+    double last_time;
+} SyncStatistics;
+
+void PrintSyncStatistics(const std::string &name, const SyncStatistics &statistics);
+
+/**
+ * Agent side of map synchronization: streams the changes to a Cloud, and
+ * the keyframes made on it, to a MapServer as compact binary deltas.
+ *
+ * The publisher listens to the cloud (Cloud::add_listener) and only notes
+ * which points were added, moved or removed. publish() then reads their
+ * current state from the cloud, so a point that was added and moved several
+ * times before a publish costs one record, and a point added and culled in
+ * between costs nothing. Coordinates travel as floats.
+ *
+ * Every delta has the next sequence number. The server acknowledges each
+ * one with the time it took to apply it; a gap in the sequence makes it ask
+ * for a snapshot, a delta holding the whole map. After a reconnect the
+ * server tells the last delta it applied, and a snapshot is sent unless that
+ * is the last one sent. Changes made while not connected are collected as
+ * usual (at most one entry per point) and go out with the next delta.
+ *
+ * Deltas are encoded by the thread that changes the cloud (publish() reads
+ * it) and sent by a thread of the publisher, which also connects, reconnects
+ * with a growing delay and reads the answers of the server. At most
+ * SYNC_QUEUE deltas wait to be sent; while the queue is full, or there is
+ * no connection, changes keep collecting instead, so publish() never waits
+ * for the network.
+ *
+ * An address is a Unix socket path when it contains a '/', and host:port
+ * for TCP otherwise.
+ **/
+class MapPublisher
+{
+    typedef struct {
+        std::vector<unsigned char> bytes;
+        uint64_t sequence;
+        int records;
+        bool snapshot;
+    } QueuedDelta;
+
+    int agent;
+    std::string address;
+    Cloud<cv::Point3d> *cloud;
+
+    // Used by the thread that publishes
+    std::map<int, int> pending;             // point id -> CLOUD_ADDED, CLOUD_MOVED or CLOUD_REMOVED
+    std::vector<MergeKeyframe> keyframes;
+    std::map<int, int> keyframe_index;      // frame number -> index in keyframes
+    std::set<int> pending_keyframes;        // indices in keyframes
+    bool snapshot;                          // next delta must be a snapshot
+    uint64_t sequence;                      // of the last delta queued
+    std::vector<unsigned char> output;
+
+    // Shared with the sender thread, under lock
+    pthread_t thread;
+    mutable pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stopping;
+    bool linked;                            // connected, and the server is where the queue continues
+    bool resync;                            // the server needs a snapshot
+    std::deque<QueuedDelta> queue;
+    SyncStatistics statistics;
+
+    // Used by the sender thread only
+    int fd;
+    uint64_t sent;                          // sequence of the last delta sent
+    uint64_t acknowledged;                  // sequence of the last delta the server applied
+    std::vector<unsigned char> input;
+
+    static void changed(void *context, int change, int id);
+    static void *run(void *argument);
+    void serve();
+    void disconnect();
+    bool handshake(uint64_t &applied);
+    void receive();
+    int encode();
+
+public:
+    MapPublisher(int agent);
+    ~MapPublisher();
+
+    void attach(Cloud<cv::Point3d> &cloud);
+    bool connect(const std::string &address);
+    bool connected() const;
+    void close();
+
+    void setKeyframe(int frame_nr, const cv::Matx44d &pose, const std::vector<int> &point_ids);
+    int publish();
+
+    SyncStatistics stats() const;
+};
+
+/**
+ * Server side of map synchronization: accepts MapPublisher connections and
+ * keeps a copy of the map of every agent, point ids and frame numbers as
+ * the agent has them.
+ *
+ * poll() serves all connections from the calling thread; messages are
+ * buffered until complete, so a slow agent does not hold up the others.
+ * The copies can be merged into a team map with a MapMerger.
+ **/
+class MapServer
+{
+    typedef struct {
+        Cloud<cv::Point3d> cloud;
+        std::vector<MergeKeyframe> keyframes;
+        std::map<int, int> keyframe_index;  // frame number -> index in keyframes
+        uint64_t sequence;                  // of the last delta applied
+        bool waiting;                       // for a snapshot after a gap
+        SyncStatistics statistics;
+    } Replica;
+
+    typedef struct {
+        int fd;
+        int agent;                          // -1 until its hello
+        bool asked;                         // for a snapshot, none applied since
+        std::vector<unsigned char> input;
+    } Connection;
+
+    int listen_fd;
+    std::string socket_path;
+    std::vector<Connection> connections;
+    std::map<int, Replica *> replicas;
+
+    Replica &replica(int agent);
+    bool handle(Connection &connection, const SyncHeader &header, const unsigned char *payload);
+    bool apply(Replica &replica, const unsigned char *payload, size_t length);
+
+public:
+    MapServer();
+    ~MapServer();
+
+    bool listen(const std::string &address);
+    void close();
+    int poll(int timeout_ms);
+
+    int connectionCount() const;
+    std::vector<int> agents() const;
+    const Cloud<cv::Point3d> &map(int agent) const;
+    const std::vector<MergeKeyframe> &keyframes(int agent) const;
+    const SyncStatistics &stats(int agent) const;
+};
+
+#endif // MAPSYNC_H
@@ -0,0 +1,241 @@
+#include "mapviewer.hpp"
+
+#include "pcl-1.6/pcl/visualization/cloud_viewer.h"
+
+#include <unistd.h>
+
+MapViewer::MapViewer(const std::string &title, double voxel_size, int max_points, int refresh)
+    : shown( voxel_size )
+{
+    this->title = title;
+    this->voxel_size = voxel_size;
+    this->max_points = max_points;
+    this->refresh = refresh;
+    this->cloud = NULL;
+    this->snapshot = true;
+    this->mailbox = NULL;
+    this->stopping = 0;
+    this->closed = 0;
+    this->running = false;
+}
+
+MapViewer::~MapViewer()
+{
+    if ( cloud != NULL ) {
+        cloud->remove_listener( changed, this );
+    }
+    if ( running ) {
+        __sync_lock_test_and_set( &stopping, 1 );
+        pthread_join( thread, NULL );
+    }
+    delete exchange( NULL );
+}
+
+/**
+ * Open the window and start drawing, from a thread of its own.
+ **/
+bool MapViewer::start()
+{
+    if ( running ) {
+        return true;
+    }
+    running = pthread_create( &thread, NULL, run, this ) == 0;
+    return running;
+}
+
+/**
+ * Show cloud and its changes from now on; the first update holds it whole.
+ **/
+void MapViewer::attach(Cloud<cv::Point3d> &cloud)
+{
+    if ( this->cloud != NULL ) {
+        this->cloud->remove_listener( changed, this );
+    }
+    this->cloud = &cloud;
+    cloud.add_listener( changed, this );
+    pending.clear();
+    snapshot = true;
+}
+
+void MapViewer::changed(void *context, int change, int id)
+{
+    MapViewer *viewer = (MapViewer *) context;
+    std::map<int, int> &pending = viewer->pending;
+    if ( change == CLOUD_RESET ) {
+        pending.clear();
+        viewer->snapshot = true;
+    }
+    if ( viewer->snapshot ) {
+        return;
+    }
+    std::map<int, int>::iterator it = pending.find( id );
+    if ( change == CLOUD_ADDED ) {
+        pending[id] = CLOUD_ADDED;
+    } else if ( change == CLOUD_MOVED ) {
+        if ( it == pending.end() ) {
+            pending[id] = CLOUD_MOVED;
+        }
+    } else if ( change == CLOUD_REMOVED ) {
+        if ( it != pending.end() && it->second == CLOUD_ADDED ) {
+            // The viewer never got it
+            pending.erase( it );
+        } else {
+            pending[id] = CLOUD_REMOVED;
+        }
+    }
+}
+
+/**
+ * Swap update into the mailbox, returns what was in it.
+ **/
+ViewerUpdate *MapViewer::exchange(ViewerUpdate *update)
+{
+    // A full barrier: everything written to update before is seen by
+    // whoever swaps it out
+    ViewerUpdate *previous = NULL;
+    for ( ;; ) {
+        ViewerUpdate *seen = __sync_val_compare_and_swap( &mailbox, previous, update );
+        if ( seen == previous ) {
+            return previous;
+        }
+        previous = seen;
+    }
+}
+
+/**
+ * Hand the changes to the cloud since the last publish to the viewer
+ * thread. Never waits for it. Returns the number of points changed.
+ **/
+int MapViewer::publish()
+{
+    if ( cloud == NULL || !isOpen() || ( pending.empty() && !snapshot ) ) {
+        return 0;
+    }
+    ViewerUpdate *update = new ViewerUpdate;
+    update->reset = snapshot;
+    if ( snapshot ) {
+        std::vector<int> ids;
+        std::vector<cv::Point3d> points;
+        cloud->get_ids( ids );
+        cloud->get_points( points );
+        update->ids = ids;
+        update->positions.assign( points.begin(), points.end() );
+        update->removed.assign( ids.size(), 0 );
+    } else {
+        for ( std::map<int, int>::const_iterator it = pending.begin(); it != pending.end(); ++it ) {
+            bool removed = it->second == CLOUD_REMOVED || !cloud->contains( it->first );
+            update->ids.push_back( it->first );
+            update->positions.push_back( removed ? cv::Point3f() : cv::Point3f( cloud->get_point( it->first ) ) );
+            update->removed.push_back( removed );
+        }
+    }
+    pending.clear();
+    snapshot = false;
+    int changes = update->ids.size();
+
+    // Only this thread fills the mailbox, the viewer thread only empties it
+    ViewerUpdate *previous = exchange( NULL );
+    if ( previous != NULL && !update->reset ) {
+        previous->ids.insert( previous->ids.end(), update->ids.begin(), update->ids.end() );
+        previous->positions.insert( previous->positions.end(),
+                                    update->positions.begin(), update->positions.end() );
+        previous->removed.insert( previous->removed.end(), update->removed.begin(), update->removed.end() );
+        delete update;
+        update = previous;
+    } else {
+        delete previous;
+    }
+    exchange( update );
+    return changes;
+}
+
+/**
+ * Whether the viewer thread runs and its window was not closed.
+ **/
+bool MapViewer::isOpen() const
+{
+    return running && !__sync_fetch_and_add( const_cast<volatile int *>( &closed ), 0 );
+}
+
+void *MapViewer::run(void *argument)
+{
+    MapViewer *viewer = (MapViewer *) argument;
+    pcl::visualization::CloudViewer window( viewer->title );
+
+    while ( !__sync_fetch_and_add( &viewer->stopping, 0 ) && !window.wasStopped() ) {
+        ViewerUpdate *update = viewer->exchange( NULL );
+        if ( update != NULL ) {
+            viewer->apply( *update );
+            delete update;
+            viewer->levelOfDetail();
+
+            pcl::PointCloud<pcl::PointXYZ>::Ptr cloud( new pcl::PointCloud<pcl::PointXYZ> );
+            const std::vector<cv::Point3d> &drawn = viewer->drawn;
+            cloud->width = 1;
+            cloud->height = drawn.size();
+            cloud->points.resize( drawn.size() );
+            for ( size_t n = 0; n < drawn.size(); n++ ) {
+                cloud->points[n].x = drawn[n].x;
+                cloud->points[n].y = drawn[n].y;
+                cloud->points[n].z = drawn[n].z;
+            }
+            window.showCloud( cloud );
+        }
+        usleep( viewer->refresh * 1000 );
+    }
+    __sync_lock_test_and_set( &viewer->closed, 1 );
+    return NULL;
+}
+
+void MapViewer::apply(const ViewerUpdate &update)
+{
+    if ( update.reset ) {
+        shown.setVoxelSize( voxel_size );
+        positions.clear();
+        present.clear();
+    }
+    for ( size_t n = 0; n < update.ids.size(); n++ ) {
+        int id = update.ids[n];
+        if ( update.removed[n] ) {
+            if ( id < (int) present.size() ) {
+                present[id] = 0;
+            }
+            shown.remove( id );
+            continue;
+        }
+        if ( id >= (int) present.size() ) {
+            positions.resize( id + 1 );
+            present.resize( id + 1, 0 );
+        }
+        positions[id] = cv::Point3d( update.positions[n] );
+        present[id] = 1;
+        shown.insert( id, positions[id] );
+    }
+}
+
+/**
+ * The points to draw: all of them up to max_points, the voxel means above
+ * that, with voxels doubled in size until few enough are left.
+ **/
+void MapViewer::levelOfDetail()
+{
+    drawn.clear();
+    if ( shown.size() <= max_points ) {
+        for ( size_t id = 0; id < present.size(); id++ ) {
+            if ( present[id] ) {
+                drawn.push_back( positions[id] );
+            }
+        }
+        return;
+    }
+    shown.voxelCentroids( drawn );
+    while ( (int) drawn.size() > max_points ) {
+        shown.setVoxelSize( shown.voxelSize() * 2 );
+        for ( size_t id = 0; id < present.size(); id++ ) {
+            if ( present[id] ) {
+                shown.insert( id, positions[id] );
+            }
+        }
+        shown.voxelCentroids( drawn );
+    }
+}
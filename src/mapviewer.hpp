@@ -0,0 +1,86 @@
+#ifndef MAPVIEWER_H
+#define MAPVIEWER_H
+
+#include <opencv2/core/core.hpp>
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cloud.hpp"
+#include "voxelindex.hpp"
+
+/**
+ * A batch of changes to the map for the viewer, in the order they were
+ * made: point ids[n] moved to positions[n], or was removed when removed[n]
+ * is set. With reset the viewer drops all points it has first.
+ **/
+typedef struct {
+    bool reset;
+    std::vector<int> ids;
+    std::vector<cv::Point3f> positions;
+    std::vector<unsigned char> removed;
+} ViewerUpdate;
+
+/**
+ * Shows a Cloud in a PCL viewer window from a thread of its own, so that
+ * drawing never holds up tracking.
+ *
+ * Like MapPublisher, the viewer listens to the cloud and only notes which
+ * points changed; publish() reads their positions and posts them as one
+ * update. The mailbox between the tracker and the viewer thread is a single
+ * pointer that both swap atomically, so neither ever waits for the other.
+ * When the viewer thread has not taken the last update yet, publish() takes
+ * it back and appends the new changes: the viewer always gets to the latest
+ * state, however far behind it falls.
+ *
+ * The viewer thread keeps its own copy of the points in a VoxelIndex. Up to
+ * max_points are drawn as they are; above that one point per voxel (the mean
+ * of its points), and the voxels grow until at most max_points remain.
+ *
+ * Closing the window stops the thread; publish() then does nothing.
+ **/
+class MapViewer
+{
+    std::string title;
+    double voxel_size;
+    int max_points;
+    int refresh;                            // milliseconds between looks at the mailbox
+
+    // Tracker side
+    Cloud<cv::Point3d> *cloud;
+    std::map<int, int> pending;             // point id -> CLOUD_ADDED, CLOUD_MOVED or CLOUD_REMOVED
+    bool snapshot;                          // next update must hold the whole map
+
+    ViewerUpdate * volatile mailbox;
+    volatile int stopping;
+    volatile int closed;
+    pthread_t thread;
+    bool running;
+
+    // Viewer thread side
+    VoxelIndex shown;
+    std::vector<cv::Point3d> positions;     // by point id
+    std::vector<unsigned char> present;
+    std::vector<cv::Point3d> drawn;
+
+    static void changed(void *context, int change, int id);
+    static void *run(void *argument);
+    ViewerUpdate *exchange(ViewerUpdate *update);
+    void apply(const ViewerUpdate &update);
+    void levelOfDetail();
+
+public:
+    MapViewer(const std::string &title, double voxel_size = 0.05, int max_points = 100000,
+              int refresh = 100);
+    ~MapViewer();
+
+    bool start();
+    void attach(Cloud<cv::Point3d> &cloud);
+    int publish();
+    bool isOpen() const;
+};
+
+#endif // MAPVIEWER_H
@@ -0,0 +1,107 @@
+/**
+ * Merge the maps saved by several robots (navigate -s) into one team map,
+ * which navigate can localize against (-l) or which can be merged again.
+ * The first map fixes the world of the team map; the others are aligned to
+ * it where they overlap. Maps that overlap none of the merged ones are
+ * retried after the rest, a later map may connect them.
+ *
+ * Usage: mergemaps [-v vocabulary] [-o output] [-r fusion radius]
+ *                  [-t inlier threshold] map map [map ...]
+ */
+
+#include <opencv2/core/core.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include "mapfile.hpp"
+#include "mapmerger.hpp"
+#include "vocabulary.hpp"
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [-v vocabulary] [-o output] [-r fusion radius]"
+              << " [-t inlier threshold] map map [map ...]" << std::endl;
+}
+
+int main( int argc, char* argv[] ) {
+    std::string vocabulary_file = "vocabulary";
+    std::string output = "team.map";
+    double radius = 0.03;
+    double threshold = 0.05;
+    std::vector<std::string> maps;
+
+    for ( int i = 1; i < argc; i++ ) {
+        std::string arg( argv[i] );
+        if ( arg[0] == '-' && i + 1 < argc ) {
+            std::string value( argv[++i] );
+            if ( arg == "-v" ) {
+                vocabulary_file = value;
+            } else if ( arg == "-o" ) {
+                output = value;
+            } else if ( arg == "-r" ) {
+                radius = atof( value.c_str() );
+            } else if ( arg == "-t" ) {
+                threshold = atof( value.c_str() );
+            } else {
+                usage( argv[0] );
+                return 1;
+            }
+        } else {
+            maps.push_back( arg );
+        }
+    }
+    if ( maps.size() < 2 || threshold <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    // Same vocabulary as navigate, it finds the places the maps share
+    Vocabulary vocabulary;
+    if ( !vocabulary.load( vocabulary_file ) ) {
+        std::cerr << "Can not load vocabulary " << vocabulary_file << "." << std::endl;
+        return 1;
+    }
+    MapMerger merger( vocabulary, radius, 80 );
+    merger.setInlierThreshold( threshold );
+
+    // Agent n is maps[n]; keep going while some map still gets merged
+    std::vector<bool> merged( maps.size(), false );
+    int remaining = maps.size();
+    for ( bool progress = true; progress && remaining > 0; ) {
+        progress = false;
+        for ( size_t m = 0; m < maps.size(); m++ ) {
+            if ( merged[m] ) {
+                continue;
+            }
+            MapFile file;
+            if ( !file.open( maps[m] ) ) {
+                std::cerr << "Can not read map " << maps[m] << "." << std::endl;
+                return 1;
+            }
+            if ( !merger.merge( m, file ) ) {
+                continue;
+            }
+            merged[m] = true;
+            remaining--;
+            progress = true;
+            const Sim3 &sim3 = merger.alignment( m );
+            std::cout << maps[m] << ": " << file.pointCount() << " points, " << file.keyframeCount()
+                      << " keyframes, scale " << sim3.scale << ", offset " << sim3.t.t()
+                      << "; team map " << merger.map().size() << " points." << std::endl;
+        }
+    }
+    for ( size_t m = 0; m < maps.size(); m++ ) {
+        if ( !merged[m] ) {
+            std::cout << maps[m] << " does not overlap the team map, left out." << std::endl;
+        }
+    }
+
+    if ( !merger.save( output ) ) {
+        std::cerr << "Could not write " << output << "." << std::endl;
+        return 1;
+    }
+    return 0;
+}
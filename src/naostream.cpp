@@ -21,20 +21,50 @@
 
 #include <iostream>
 #include <string>
+#include <deque>
+#include <sstream>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <time.h>
 
 #include "inputsource.hpp"
 #include "cloud.hpp"
-
+#include "cloudquery.hpp"
+#include "scale.hpp"
+#include "pnptracker.hpp"
+#include "bundleadjuster.hpp"
+#include "posegraph.hpp"
+#include "vocabulary.hpp"
+#include "placedatabase.hpp"
+#include "keyframemanager.hpp"
+#include "thumbnailindex.hpp"
+#include "covisibilitygraph.hpp"
+#include "mapfile.hpp"
+#include "compactcloud.hpp"
+#include "mapsync.hpp"
+#include "sessionhost.hpp"
+#include "trackstore.hpp"
+#include "triangulation.hpp"
+#include "exporter.hpp"
+#include "sharedstate.hpp"
+
+// Show the map in a viewer window, drawn from a thread of its own. Headless
+// builds define VISUALIZE 0 and need no PCL
+#ifndef VISUALIZE
 #define VISUALIZE 1
+#endif
 #if VISUALIZE
-
+#include "mapviewer.hpp"
+#define VIEWER_VOXEL_SIZE 0.05      // map units, to thin out maps over VIEWER_MAX_POINTS
+#define VIEWER_MAX_POINTS 100000
 #endif
 
 #define RED cv::Scalar( 0, 0, 255 )
 #define EPSILON 0.0001
-#define THRESHOLD 0.05
 #define VERBOSE 1
+// Write the matches shown of every frame to some.png as well
+#define SAVE_MATCHES 0
 
 #define _BRISK 0
 #define _FREAK 1
@@ -42,6 +72,80 @@
 
 #define _FEATURE _BRISK
 #define HARTLEY_TRIANGULATION 1
+// Track frames against the map (PnP) once it has points, instead of frame-to-frame only
+#define PNP_TRACKING 1
+// Refine the last BA_WINDOW keyframes and their points after every frame
+#define LOCAL_BA 1
+#define BA_WINDOW 10
+// Keep a pose graph of all frames, re-optimized when loop closures come in
+#define POSE_GRAPH 1
+// Weight of the robot odometry edges relative to the visual ones. The robot
+// measures in metres, the map has a scale of its own: robot translations are
+// scaled by the ratio of the visual to the robot path length, and only count
+// once the robot moved ODOMETRY_SCALE_MIN_PATH metres (its rotations always do)
+#define ODOMETRY_WEIGHT 0.1
+#define ODOMETRY_SCALE_MIN_PATH 0.5
+// Detect revisited places with the bag of words vocabulary (file "vocabulary",
+// see trainvocabulary) and add them to the pose graph as loop closures
+#define LOOP_CLOSURE 1
+#define LOOP_MIN_AGE 30         // nodes between a keyframe and its loop candidates
+#define LOOP_MIN_SCORE 0.7      // candidate score relative to the previous keyframe
+#define LOOP_MIN_MATCHES 30
+// After tracking loss, find the pose again from the keyframes that look alike
+#define RELOCALIZATION 1
+#define RELOC_CANDIDATES 3
+#define RELOC_MAX_FRAMES 15     // lost frames before starting over frame-to-frame
+// Merge new map points into existing ones that lie close and look alike
+#define MAP_FUSION 1
+#define VOXEL_SIZE 0.1          // spatial index cell, map units
+#define FUSION_RADIUS 0.03
+#define FUSION_MAX_DISTANCE 80  // descriptor distance (bits for binary descriptors)
+// Track against the points of the keyframes covisible with the last one that
+// project into the predicted view, instead of against the whole map
+#define LOCAL_MAP 1
+#define LOCAL_MAP_KEYFRAMES 10
+#define LOCAL_MAP_MIN_WEIGHT 15     // shared points for a covisibility link to count
+#define LOCAL_MAP_MIN_POINTS 100    // below this, match against the whole map
+#define LOCAL_MAP_MARGIN 20         // pixels outside the image a point may project to
+// Drop map points that are rarely found where they should be, and keep the
+// map under a size ceiling
+#define MAP_CULLING 1
+#define MAP_MIN_FOUND_RATIO 0.25
+#define MAP_MIN_VISIBLE 5           // predictions before the found ratio counts
+#define MAP_MAX_POINTS 50000
+// Keypoints of keyframes that are not map points are followed as candidate
+// tracks, matched on descriptor and checked against the epipolar line. A
+// track not seen for TRACK_MAX_AGE keyframes is dropped; once the rays of its
+// first and last sighting meet at TRACK_MIN_PARALLAX it becomes a map point
+#define TRACK_LENGTH 8              // sightings kept per track
+#define TRACK_MAX_AGE 30            // keyframes
+#define TRACK_MAX_COUNT 20000
+#define TRACK_MAX_DISTANCE 80       // descriptor distance
+#define TRACK_MAX_EPIPOLAR 2.0      // pixels
+#define TRACK_MIN_PARALLAX 2.0      // degrees
+
+// Map points are triangulated from all their sightings, and again from the
+// new keyframes that see them when the baseline got wider by RETRIANGULATE_GAIN
+#define TRIANGULATION_MAX_ERROR 2.0 // pixels, RMS over the views
+#define RETRIANGULATE 1
+#define RETRIANGULATE_GAIN 1.0      // degrees
+// With a map file to save to (-s), save every MAP_SAVE_INTERVAL keyframes and at the end
+#define MAP_SAVE_INTERVAL 50
+// Saved maps keep one representative (medoid) descriptor per point, chosen
+// from the keyframes that observed it; a map loaded to localize against (-l)
+// is held block quantized and its keyframes carry no descriptor copies
+#define COMPACT_MAP 1
+#define COMPACT_BLOCK_SIZE 1.0      // map units, coordinates are exact to 1/2^17 of it
+// With a map server to stream to (-m address, agent id -a), send the changes
+// to the map and the keyframes after every keyframe
+#define MAP_SYNC 1
+// Write the pose of every frame (-t file in TUM format, -k file in KITTI
+// format) and the map as PLY (-p prefix) every EXPORT_MAP_INTERVAL keyframes
+// (-i keyframes) and at the end, from a writer thread
+#define EXPORT_MAP_INTERVAL 25
+// Publish the poses and, every keyframe, the map in shared memory object -e
+// name for other processes on the machine (see SharedReader)
+#define SHARED_POSES 1024           // poses kept in the ring
 
 enum DMMethod { 
     TS_MS, // Total Shift - Mean Shift
@@ -50,14 +154,83 @@ enum DMMethod {
 };
 typedef std::vector<cv::KeyPoint> KeyPointVector;
 
+/**
+ * A frame in the local bundle adjustment window: its world to camera pose and
+ * the map points (ids in cloud_3D) it observed, with their pixel positions.
+ **/
+typedef struct {
+    int frame_nr;
+    cv::Matx44d pose;
+    std::vector<int> point_ids;
+    std::vector<cv::Point2d> measurements;
+} BAKeyframe;
+
+/**
+ * What loop closure and relocalization remember of a keyframe: its pose, the
+ * descriptors of the map points it observed and the ids of those points
+ * in cloud_3D. With POSE_GRAPH, keyframe n is pose graph node n. pixels
+ * holds the position of every keypoint of the keyframe, by keypoint index,
+ * so observations can be triangulated again (empty for loaded keyframes).
+ **/
+typedef struct {
+    int frame_nr;
+    cv::Matx44d pose;
+    cv::Mat descriptors;
+    std::vector<int> point_ids;
+    std::vector<cv::Point2f> pixels;
+} MapKeyframe;
+
 void KeypointsToPoints(KeyPointVector keypoints, std::vector<cv::Point2d> &points) {
     for( int i = 0; i < keypoints.size(); i++ ) {
         points.push_back( keypoints[i].pt );
     }
 }
 
+void KeypointPixels(const KeyPointVector &keypoints, std::vector<cv::Point2f> &pixels) {
+    pixels.resize( keypoints.size() );
+    for( size_t i = 0; i < keypoints.size(); i++ ) {
+        pixels[i] = keypoints[i].pt;
+    }
+}
+
+/**
+ * The keyframe of frame_nr in keyframes (ordered by frame_nr), or 0.
+ **/
+const MapKeyframe *FindKeyframe(const std::vector<MapKeyframe> &keyframes, int frame_nr) {
+    int low = 0, high = keyframes.size() - 1;
+    while( low <= high ) {
+        int middle = (low + high) / 2;
+        if( keyframes[middle].frame_nr == frame_nr ) {
+            return &keyframes[middle];
+        }
+        if( keyframes[middle].frame_nr < frame_nr ) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Position of the camera in the world, given the pose [R|t] that maps world
+ * points into the camera frame: C = -R^T * t.
+ **/
+cv::Matx41d CameraPosition(const cv::Matx44d &pose) {
+    cv::Matx41d position( 0.0, 0.0, 0.0, 1.0 );
+    for( int i = 0; i < 3; i++ ) {
+        position(i) = -( pose(0,i) * pose(0,3) + pose(1,i) * pose(1,3) + pose(2,i) * pose(2,3) );
+    }
+    return position;
+}
+
 
-class VisualOdometry
+/**
+ * One tracking session: an input, the map built from it and the state
+ * carried from frame to frame. Runs on its own with MainLoop, or a frame
+ * at a time in a SessionHost next to other sessions.
+ **/
+class VisualOdometry : public TrackingSession
 {
     InputSource *inputSource;
     cv::Matx33d K;
@@ -84,32 +257,193 @@ class VisualOdometry
                         std::vector<cv::Point3d> &best_X,
                         cv::Matx34d &best_transform );
 
-    void SolvePnPUsingRansac( std::vector<cv::DMatch> matches,
-                              KeyPointVector current_keypoints,
-                              std::vector<cv::Point3d> total_3D_pointcloud,
-                              std::vector<cv::Point2d> &imagepoints,
-                              std::vector<cv::Point3d> &objectpoints,
-                              cv::Matx34d& transformationmatrix);
-
     void determineRollPitchYaw(double &roll, double &pitch, double &yaw, cv::Matx34d RTMatrix);
     double distanceMeasure( KeyPointVector kpv1, KeyPointVector kpv2, DMMethod method );
-    double findScaleLinear(cv::Matx34d &Pcam, cv::Mat &points3d, cv::Mat &points2d);
     void TriangulatePoints(std::vector<cv::Point2d> &previous_points,
                            std::vector<cv::Point2d> &current_points,
                            cv::Matx34d &P1, cv::Matx34d &P2, std::vector<cv::Point3d> &X);
 
-    void DetermineNewOutliers(std::vector<cv::DMatch> &matches,
-                              std::vector<cv::Point2d> &current_points,
-                              cv::Mat &current_descriptors,
-                              std::vector<cv::Point2d> &current_outlier_points_2d,
-                              cv::Mat &current_outlier_descriptors_2d);
+    void ExtendTracks(TrackStore &tracks, int frame_nr, const cv::Matx34d &pose,
+                      const KeyPointVector &keypoints, const cv::Mat &descriptors,
+                      const std::vector<bool> &used);
+    int PromoteTracks(TrackStore &tracks, int frame_nr, Cloud<cv::Point3d> &cloud,
+                      std::vector<int> &point_ids, std::vector<cv::Point2d> &pixels,
+                      cv::Mat &point_descriptors);
+    void UpdateTracks(const cv::Matx34d &pose, const std::vector<bool> &used);
+    int RetriangulatePoints(const std::vector<int> &point_ids);
+    void SetPointAngle(int id, double angle);
+
+    void LocalBundleAdjustment(BundleAdjuster &ba,
+                               std::deque<BAKeyframe> &window,
+                               Cloud<cv::Point3d> &cloud);
+    void UpdatePoseGraph(PoseGraph &graph, cv::Matx44d &pose, const Frame &frame,
+                         int frame_nr, std::vector<float> &last_camPosition);
+    bool OptimizePoseGraph(PoseGraph &graph, std::vector<MapKeyframe> &keyframes,
+                           Cloud<cv::Point3d> &cloud);
+    bool DetectLoop(const Vocabulary &vocabulary, PlaceDatabase &database,
+                    std::vector<MapKeyframe> &keyframes, PoseGraph &graph,
+                    PnPTracker &tracker, const cv::Mat &descriptors,
+                    const KeyPointVector &keypoints, Cloud<cv::Point3d> &cloud,
+                    cv::Matx44d &pose);
+    template <class Map>
+    bool Relocalize(ThumbnailIndex &index, const std::vector<MapKeyframe> &keyframes,
+                    PnPTracker &tracker, const cv::Mat &image, const cv::Mat &descriptors,
+                    const KeyPointVector &keypoints, const Map &map,
+                    cv::Matx44d &pose, int &keyframe_nr);
+    int ReferenceKeyframe(const ObservationTable &observations, const std::vector<int> &point_ids,
+                          int fallback);
+    template <class Map>
+    void BuildLocalMap(const CovisibilityGraph &graph, const Map &map,
+                       int reference, const cv::Matx34d &pose, cv::Size image_size,
+                       std::vector<int> &ids, cv::Mat &descriptors);
+    template <class Map>
+    void MapDescriptors(const Map &map, const std::vector<int> &ids, cv::Mat &descriptors);
+
+    std::string mapLoadPath;
+    std::string mapSavePath;
+    std::string trajectoryPath;
+    int trajectoryFormat;
+    std::string mapExportPrefix;
+    int mapExportInterval;
+    std::string mapServerAddress;
+    int mapAgent;
+    void RepresentativeDescriptors(const std::vector<MapKeyframe> &keyframes, Cloud<cv::Point3d> &cloud);
+    bool SaveMap(const std::string &path, Cloud<cv::Point3d> &cloud,
+                 const std::vector<MapKeyframe> &keyframes, const ThumbnailIndex &thumbnails);
+    template <class Map>
+    bool LoadMap(const std::string &path, Map &map,
+                 std::vector<MapKeyframe> &keyframes, ThumbnailIndex &thumbnails,
+                 CovisibilityGraph &covisibility);
+
+    // Shared with the other sessions of the process, read only
+    const Vocabulary &vocabulary;
+    // Show windows; sessions in a host run without
+    bool interactive;
+    // Run as fast as frames come in and keep quiet, for replaying recordings
+    bool headless;
+    int frames_read;
+    std::ostream silent;
+    std::ostream &log();
+
+    // Carried from one step to the next
+    cv::Mat current_descriptors, previous_descriptors;
+    KeyPointVector current_keypoints, previous_keypoints;
+    std::vector<cv::DMatch> matches;
+    cv::Matx41d robotPosition;
+#if _FEATURE == _BRISK
+    cv::BRISK features;
+#elif _FEATURE == _FREAK
+    cv::FREAK features;
+#elif _FEATURE == _ORB
+    cv::ORB features;
+#endif
+    Frame current_frame;
+    Frame previous_frame;
+    cv::FlannBasedMatcher matcher;
+    std::vector<cv::DMatch>::iterator match_it;
+
+    // Use frame-to-frame initially, switch to frame-to-map once the map has points.
+    bool epnp;
+    PnPTracker pnpTracker;
+
+    // Only keyframes extend and refine the map, other frames are just tracked
+    KeyframeManager keyframeManager;
+
+    // World to camera pose of the previous frame, and the last motion between
+    // two frames (used to predict the next pose)
+    cv::Matx44d previous_pose;
+    cv::Matx44d velocity;
+    // Keyframe number of the frame previous_keypoints came from, -1 when
+    // that frame is not a keyframe
+    int previous_frame_nr;
+
+    // Keyframes linked by shared map points, and the part of the map around
+    // the last keyframe that is tracked against
+    CovisibilityGraph covisibility;
+    std::vector<int> local_ids;
+    cv::Mat local_descriptors;
+    Selection local_selection;          // of the cloud, when the points in view are the local map
+
+    // Keyframes for local bundle adjustment, oldest first
+    std::deque<BAKeyframe> window;
+    BundleAdjuster bundleAdjuster;
+
+    // One node per keyframe; path lengths between them seen by the camera
+    // (map units) and by the robot (metres), for the scale of robot odometry
+    PoseGraph poseGraph;
+    std::vector<float> node_camPosition;
+    double visual_path, robot_path;
+
+    // Keyframes for relocalization and loop closure
+    std::vector<MapKeyframe> mapKeyframes;
+    ThumbnailIndex thumbnailIndex;
+    PnPTracker keyframeTracker;
+    bool lost;
+    int lost_frames;
+
+    // Place recognition, one database entry per keyframe
+    bool loop_closure;
+    PlaceDatabase placeDatabase;
+
+    // Storage for 3d points and corresponding descriptors, and the keypoints
+    // that may become map points
+    Cloud<cv::Point3d> cloud_3D;
+    TrackStore candidateTracks;
+    Triangulator triangulator;
+    std::vector<float> point_angles;    // map point id -> widest view angle of its position
+
+    bool localize_only;
+    int reference_frame;
+    int keyframes_since_save;
+    CompactCloud compact_map;
+    bool compact;
+    bool relocalization;
+
+    MapPublisher *mapPublisher;
+    bool publish_map;
+    // Indices in mapKeyframes of the keyframes whose pose or points changed
+    // since the last keyframe, and how many of them were handed to the publisher
+    std::set<int> changedKeyframes;
+    size_t published_keyframes;
+
+    RunExporter exporter;
+    int keyframes_since_export;
+    std::string sharedStateName;
+    SharedPublisher sharedState;
+    void ReportPose(const cv::Matx44d &pose);
+
+    // Number the next keyframe gets, the first one is 0
+    int frame_nr;
+    cv::Mat total_3D_descriptors;
+
+    // Scale of initial and current image
+    double current_scale, init_scale, ratio_scale;
+    bool scale_initialized;
+    ScaleEstimator scaleEstimator;
+
+    // Matrix [I|0], and [R|t] of the current frame
+    cv::Matx34d P1;
+    cv::Matx34d P2;
+
+#if VISUALIZE
+    MapViewer *viewer;
+#endif
 
 public:
-    VisualOdometry(InputSource *source);
+    VisualOdometry(InputSource *source, const SharedResources &resources);
     ~VisualOdometry();
+    void setMapFiles(const std::string &load_path, const std::string &save_path);
+    void setMapServer(const std::string &address, int agent);
+    void setExport(const std::string &trajectory_path, int trajectory_format,
+                   const std::string &map_prefix, int map_interval);
+    void setSharedState(const std::string &name);
+    void setInteractive(bool interactive);
+    void setHeadless(bool headless);
     bool MainLoop();
 
-    bool validConfig;
+    bool start();
+    int step();
+    void finish();
 };
 
 /**
@@ -181,7 +515,7 @@ bool VisualOdometry::GetCameraMatrixHorn( cv::Matx33d &E, cv::Mat &R1, cv::Mat &
         t = (cv::Mat)TTsquared.col(2) / sqrt(TTsquared(2,2));
     }
 
-    std::cout << t << std::endl;
+    log() << t << std::endl;
 
     // Determine rotationmatrix in multiple steps
     // 1. Calculate cofactor of E
@@ -220,8 +554,8 @@ bool VisualOdometry::DecomposeEtoRandT( cv::Matx33d &E, cv::Mat &R1, cv::Mat &R2
         singular_values_ratio = 1.0/singular_values_ratio; // flip ratio to keep it [0,1]
     }
     if ( singular_values_ratio < 0.7 ) {
-        std::cout << "singular values are too far apart\n" << std::endl;
-        std::cout << svd.w << std::endl;
+        log() << "singular values are too far apart\n" << std::endl;
+        log() << svd.w << std::endl;
 
         return false;
     }
@@ -323,300 +657,1070 @@ cv::Matx31d VisualOdometry::IterativeLinearLSTriangulation(cv::Point3d u1, cv::M
     return cv::Matx31d( X(0), X(1), X(2) );
 }
 
-bool VisualOdometry::MainLoop() {
-    // Declare neccessary storage variables
-    cv::Mat current_descriptors, previous_descriptors;
-    KeyPointVector current_keypoints, previous_keypoints;
-    std::vector<cv::DMatch> matches;
-    cv::Matx41d robotPosition (0.0, 0.0, 0.0, 1.0);
-
-    // Create brisk detector
-#if _FEATURE == _BRISK
-    cv::BRISK features(60, 4, 1.0f);
-    features.create("BRISK");
-#elif _FEATURE == _FREAK
-    cv::FREAK features(60, 4, 1.0f);
-    features.create("FREAK");
-#elif _FEATURE == _ORB
-    cv::ORB features(60, 4, 1.0f);
-    features.create("ORB");
-#endif
-    ///
-    /// ORB(int nfeatures = 500, float scaleFactor = 1.2f, int nlevels = 8, int edgeThreshold = 31,
-    /// int firstLevel = 0, int WTA_K=2, int scoreType=ORB::HARRIS_SCORE, int patchSize=31 );
-    ///
-
-    // Get the previous frame
-    Frame current_frame;
-    Frame previous_frame;
-    inputSource->getFrame( previous_frame );
-
-    cv::Mat colorMat = previous_frame.img.clone();
-    cv::cvtColor(colorMat, previous_frame.img, CV_BGR2GRAY);
-
-    // Detect features for the firstm time
-    features.detect( previous_frame.img, previous_keypoints );    
-    features.compute( previous_frame.img, previous_keypoints, previous_descriptors );
-
-    // Ready matcher and corresponding iterator object
-    cv::FlannBasedMatcher matcher( new cv::flann::LshIndexParams( 20, 10, 2 ) );
-    std::vector<cv::DMatch>::iterator match_it;
-
-    // Use frame-to-frame initially.
-    bool epnp = false;
-
-    // Storage for 3d points and corresponding descriptors
-    Cloud<cv::Point3d> cloud_3D;
-    Cloud<cv::Point2d> cloud_2D;
-
-    int frame_nr = 0;
-    cv::Mat total_3D_descriptors;
-    cv::Mat total_2D_descriptors;
+/**
+ * Jointly refine the poses of the keyframes in the window and the map points
+ * seen at least twice within it. The two oldest keyframes are kept fixed, they
+ * anchor both the position and the (monocular) scale of the window.
+ * Refined poses are written back into the window and the map keyframes of
+ * the same frames, points into the cloud.
+ **/
+void VisualOdometry::LocalBundleAdjustment(BundleAdjuster &ba,
+                                           std::deque<BAKeyframe> &window,
+                                           Cloud<cv::Point3d> &cloud)
+{
+    if ( window.size() < 3 ) {
+        return;
+    }
 
-    // Scale of initial and current image
-    double current_scale, init_scale, ratio_scale;
+    // Count observations per point, only multiply seen points constrain anything
+    std::vector<int> seen( cloud.id_count(), 0 );
+    for ( size_t k = 0; k < window.size(); k++ ) {
+        for ( size_t n = 0; n < window[k].point_ids.size(); n++ ) {
+            int id = window[k].point_ids[n];
+            if ( cloud.contains(id) ) {
+                seen[id]++;
+            }
+        }
+    }
 
-    // Construct matrix [I|0]
-    cv::Matx34d P1( 1, 0, 0, 0,
-                    0, 1, 0, 0,
-                    0, 0, 1, 0 );
-    // Ready for construction of matrix [R|t]
-    cv::Matx34d P2;
+    ba.clear();
+    std::vector<int> ba_point( cloud.id_count(), -1 );
+    for ( size_t k = 0; k < window.size(); k++ ) {
+        ba.addCamera( window[k].pose.get_minor<3, 4>(0, 0), k < 2 );
+    }
+    for ( size_t k = 0; k < window.size(); k++ ) {
+        for ( size_t n = 0; n < window[k].point_ids.size(); n++ ) {
+            int id = window[k].point_ids[n];
+            if ( !cloud.contains(id) || seen[id] < 2 ) {
+                continue;
+            }
+            if ( ba_point[id] < 0 ) {
+                ba_point[id] = ba.addPoint( cloud.get_point(id) );
+            }
+            ba.addObservation( k, ba_point[id], window[k].measurements[n] );
+        }
+    }
 
-#if VISUALIZE
-    pcl::visualization::CloudViewer viewer("Cloudviewer");
+    if ( ba.pointCount() == 0 || !ba.optimize() ) {
+        return;
+    }
+#if VERBOSE
+    log() << "Local BA: " << ba.cameraCount() << " keyframes, " << ba.pointCount()
+              << " points, cost " << ba.initialCost() << " -> " << ba.finalCost()
+              << " in " << ba.iterationCount() << " iterations" << std::endl;
 #endif
-    while ( (char) cv::waitKey( 30 ) == -1 ) {
-        // Retrieve an image
-        if ( !inputSource->getFrame( current_frame ) ) {
-            std::cout << "Can not read the next frame." << std::endl;
-            break;
+
+    for ( size_t k = 2; k < window.size(); k++ ) {
+        cv::vconcat( ba.getCamera(k), cv::Matx14d(0, 0, 0, 1), window[k].pose );
+        // Map keyframes are in frame order, the window is at the end of them
+        for ( size_t m = mapKeyframes.size(); m-- > 0 && mapKeyframes[m].frame_nr >= window[k].frame_nr; ) {
+            if ( mapKeyframes[m].frame_nr == window[k].frame_nr ) {
+                mapKeyframes[m].pose = window[k].pose;
+                changedKeyframes.insert( m );
+            }
         }
-        if ( !current_frame.img.data ) {
-            std::cerr << "No image found." << std::endl;
-            return false;
+    }
+    for ( size_t id = 0; id < ba_point.size(); id++ ) {
+        if ( ba_point[id] >= 0 ) {
+            cloud.set_point( id, ba.getPoint( ba_point[id] ) );
         }
+    }
+}
 
-        // Convert to grayscale
-        cv::Mat colorMat = current_frame.img.clone();
-        cv::cvtColor(colorMat, current_frame.img, CV_BGR2GRAY);
-
-        // Detect features
-        features.detect( current_frame.img, current_keypoints );
+/**
+ * Collect the map points that may be visible from pose: the points seen by
+ * the keyframes around reference in the covisibility graph that project in
+ * front of the camera and into the image (give or take LOCAL_MAP_MARGIN
+ * pixels). ids receives their ids in cloud, row n of descriptors belongs to
+ * ids[n]. Costs in the order of the number of points seen by those
+ * keyframes, whatever the size of the map.
+ **/
+template <class Map>
+void VisualOdometry::BuildLocalMap(const CovisibilityGraph &graph, const Map &map,
+                                   int reference, const cv::Matx34d &pose, cv::Size image_size,
+                                   std::vector<int> &ids, cv::Mat &descriptors)
+{
+    ids.clear();
+    std::vector<int> keyframes;
+    graph.localKeyframes( reference, LOCAL_MAP_KEYFRAMES, LOCAL_MAP_MIN_WEIGHT, keyframes );
+
+    const ObservationTable &observations = map.observations();
+    std::vector<int> candidates;
+    for ( size_t k = 0; k < keyframes.size(); k++ ) {
+        for ( int r = observations.firstOfFrame(keyframes[k]); r >= 0; r = observations.nextOfFrame(r) ) {
+            candidates.push_back( observations.get(r).point_id );
+        }
+    }
+    std::sort( candidates.begin(), candidates.end() );
+    candidates.erase( std::unique( candidates.begin(), candidates.end() ), candidates.end() );
 
-        // TODO : What if zero features found?
-        if ( previous_keypoints.size() == 0 ) {
+    // Frustum culling against the predicted pose
+    for ( size_t c = 0; c < candidates.size(); c++ ) {
+        if ( !map.contains( candidates[c] ) ) {
             continue;
         }
+        cv::Point3d X = map.get_point( candidates[c] );
+        cv::Matx31d x = K * ( pose * cv::Matx41d( X.x, X.y, X.z, 1.0 ) );
+        if ( x(2) <= EPSILON ) {
+            continue;
+        }
+        double u = x(0) / x(2), v = x(1) / x(2);
+        if ( u < -LOCAL_MAP_MARGIN || u > image_size.width + LOCAL_MAP_MARGIN ||
+             v < -LOCAL_MAP_MARGIN || v > image_size.height + LOCAL_MAP_MARGIN ) {
+            continue;
+        }
+        ids.push_back( candidates[c] );
+    }
+    MapDescriptors( map, ids, descriptors );
+}
 
-        // Find descriptors for these features
-        features.compute( current_frame.img, current_keypoints, current_descriptors );
-
-        if (epnp)
-        {
-            // CASE 1: SolvePnP
-            cloud_3D.get_descriptors(total_3D_descriptors);
-            matches.clear();
-            matcher.match( current_descriptors, total_3D_descriptors, matches );
+/**
+ * Descriptors of map points, row n for ids[n]. All ids must be in the map.
+ **/
+template <class Map>
+void VisualOdometry::MapDescriptors(const Map &map, const std::vector<int> &ids, cv::Mat &descriptors)
+{
+    if ( ids.empty() ) {
+        descriptors = cv::Mat();
+        return;
+    }
+    cv::Mat first = map.get_descriptor( ids[0] );
+    descriptors.create( ids.size(), first.cols, first.type() );
+    for ( size_t n = 0; n < ids.size(); n++ ) {
+        map.get_descriptor( ids[n] ).copyTo( descriptors.row(n) );
+    }
+}
 
-            // Determine minimum distance and derive good matches from it
-            double minDist = matches[0].distance;
-            for(match_it = matches.begin(); match_it != matches.end(); match_it++) {
-                if(match_it->distance < minDist) minDist = match_it->distance;
-            }
-            std::vector<cv::DMatch> good_matches;
-            for(match_it = matches.begin(); match_it != matches.end(); match_it++) {
-                if(match_it->distance < 2*minDist) {
-                    good_matches.push_back( *match_it );
+/**
+ * Add a frame to the pose graph, linked to the previous node by visual odometry
+ * and, if the robot reports its camera position, by robot odometry as well.
+ * Once the graph holds loop closures the affected part is re-optimized, and
+ * pose is replaced by the corrected one.
+ **/
+void VisualOdometry::UpdatePoseGraph(PoseGraph &graph, cv::Matx44d &pose, const Frame &frame,
+                                     int frame_nr, std::vector<float> &last_camPosition)
+{
+    int node = graph.addNode( pose, frame_nr );
+    if ( node > 0 ) {
+        cv::Matx44d visual = pose * graph.getPose(node - 1).inv();
+        graph.addOdometryEdge( node - 1, node, visual, PoseInformation(1.0, 1.0) );
+        if ( frame.camPosition.size() == 6 && last_camPosition.size() == 6 ) {
+            cv::Matx44d odometry = PoseFromCamPosition( frame.camPosition ) *
+                                   PoseFromCamPosition( last_camPosition ).inv();
+            visual_path += sqrt( visual(0,3) * visual(0,3) + visual(1,3) * visual(1,3) + visual(2,3) * visual(2,3) );
+            robot_path += sqrt( odometry(0,3) * odometry(0,3) + odometry(1,3) * odometry(1,3) +
+                                odometry(2,3) * odometry(2,3) );
+            double translation_weight = 0.0;
+            if ( robot_path >= ODOMETRY_SCALE_MIN_PATH && visual_path > 0.0 ) {
+                // Metres to map units
+                double scale = visual_path / robot_path;
+                for ( int i = 0; i < 3; i++ ) {
+                    odometry(i,3) *= scale;
                 }
+                translation_weight = ODOMETRY_WEIGHT;
             }
-# if VERBOSE
-            std::cout << "Before pruning " << matches.size()
-                      << " matches, after " << good_matches.size() << "." << std::endl;
-#endif
+            graph.addOdometryEdge( node - 1, node, odometry,
+                                   PoseInformation(ODOMETRY_WEIGHT, translation_weight) );
+        }
+    }
+    last_camPosition = frame.camPosition;
 
-            // determine correct keypoints and corresponding 3d positions
-            std::vector<cv::Point3d> points_3d;
-            cloud_3D.get_points(points_3d);
-            std::vector<cv::Point2d> imagepoints;
-            std::vector<cv::Point3d> objectpoints;
-            SolvePnPUsingRansac(good_matches, current_keypoints, points_3d, imagepoints, objectpoints, P2);
-
-            // Print out [R|T]
-            std::cout << P2 << std::endl;
-
-            //////////////////////////////////
-            // Triangulate any (yet) unknown points
-            cloud_2D.get_descriptors(total_2D_descriptors);
-            if(!total_2D_descriptors.empty()) {
-                matches.clear();
-                matcher.match(current_descriptors, total_2D_descriptors, matches);
-                std::vector<cv::Point2d> matching_2D_points, current_points, total_2D_points;
-                cloud_2D.get_points(total_2D_points);
-
-                for ( match_it = matches.begin(); match_it != matches.begin() + current_descriptors.rows; match_it++ ) {
-                    current_points.push_back( current_keypoints[match_it->queryIdx].pt );
-                    matching_2D_points.push_back( total_2D_points[match_it->trainIdx] );
-                }
+    if ( graph.loopCount() > 0 && graph.isDirty() ) {
+        OptimizePoseGraph( graph, mapKeyframes, cloud_3D );
+        pose = graph.getPose( node );
+    }
+}
+
+/**
+ * Optimize the dirty part of the pose graph and move everything that hangs
+ * off the nodes that moved: the map points made at a node (stored in world
+ * coordinates), the keyframe of the node and its entry in the bundle
+ * adjustment window.
+ **/
+bool VisualOdometry::OptimizePoseGraph(PoseGraph &graph, std::vector<MapKeyframe> &keyframes,
+                                       Cloud<cv::Point3d> &cloud)
+{
+    std::vector<cv::Matx44d> old_poses( graph.size() );
+    for ( int n = 0; n < graph.size(); n++ ) {
+        old_poses[n] = graph.getPose( n );
+    }
+    if ( !graph.optimize() ) {
+        return false;
+    }
+#if VERBOSE
+    log() << "Pose graph: " << graph.size() << " nodes, cost " << graph.initialCost()
+              << " -> " << graph.finalCost() << std::endl;
+#endif
 
-                cv::Matx33d fundamental;
-                std::vector<cv::Point2d> previous_points_inliers, current_points_inliers;
-                double mean_distance = determineFundamentalMatrix(matching_2D_points,
-                                                                  current_points,
-                                                                  previous_points_inliers,
-                                                                  current_points_inliers,
-                                                                  matches,
-                                                                  fundamental);
-
-                std::vector<cv::Point2d> current_outlier_points_2d;
-                cv::Mat current_outlier_descriptors_2d;
-
-                DetermineNewOutliers(matches,
-                                     current_points,
-                                     current_descriptors,
-                                     current_outlier_points_2d,
-                                     current_outlier_descriptors_2d);
-
-                cloud_2D.add(current_outlier_points_2d, current_outlier_descriptors_2d, frame_nr);
-
-                // If displacement is not sufficiently large, skip this image.
-                if (mean_distance < THRESHOLD)
-                {
-                    if (mean_distance < 1)
-                    {
-                        // what the fuck just happened
-                        std::cout << "wut 0 mean_distance wut" << std::endl;
-                    }
-        #if VERBOSE
-                    std::cout << "Displacement not sufficiently large, skipping frame." << std::endl;
-        #endif
+    std::vector<bool> moved( graph.size(), false );
+    for ( int n = 0; n < graph.size(); n++ ) {
+        cv::Matx44d pose = graph.getPose( n );
+        moved[n] = cv::norm( pose - old_poses[n] ) > 0.0;
+        if ( !moved[n] ) {
+            continue;
+        }
+        cv::Matx44d correction = pose.inv() * old_poses[n];
+        std::pair<const CloudRange *, const CloudRange *> ranges = cloud.frame_ranges( graph.getFrame(n) );
+        for ( const CloudRange *range = ranges.first; range != ranges.second; range++ ) {
+            for ( int id = range->first; id < range->end; id++ ) {
+                if ( !cloud.contains(id) ) {
                     continue;
                 }
-
-                std::vector<cv::Point3d> X;
-                TriangulatePoints(matching_2D_points,
-                                  current_points,
-                                  P1,
-                                  P2,
-                                  X);
-
-                //cloud_3D.add(X, , frame_nr);
-
-           // Add to all_descriptors and 3d point cloud
-            } else {
-                // If no 2d points available, add all current points to the cloud.
-                std::vector<cv::Point2d> current_points;
-                KeypointsToPoints(current_keypoints, current_points);
-                cloud_2D.add(current_points, current_descriptors, frame_nr);
+                cv::Point3d p = cloud.get_point( id );
+                cv::Matx41d X = correction * cv::Matx41d( p.x, p.y, p.z, 1.0 );
+                cloud.set_point( id, cv::Point3d( X(0), X(1), X(2) ) );
             }
+        }
+    }
+    for ( size_t k = 0; k < keyframes.size(); k++ ) {
+        int n = graph.findFrame( keyframes[k].frame_nr );
+        if ( n >= 0 && moved[n] && graph.getFrame(n) == keyframes[k].frame_nr ) {
+            keyframes[k].pose = graph.getPose( n );
+            changedKeyframes.insert( k );
+        }
+    }
+#if LOCAL_BA
+    for ( size_t k = 0; k < window.size(); k++ ) {
+        int n = graph.findFrame( window[k].frame_nr );
+        if ( n >= 0 && moved[n] && graph.getFrame(n) == window[k].frame_nr ) {
+            window[k].pose = graph.getPose( n );
+        }
+    }
+#endif
+    return true;
+}
 
+/**
+ * Look up the newest pose graph node (whose MapKeyframe is keyframes.back())
+ * in the place database. Candidates are verified by matching their map point
+ * descriptors and tracking the current frame against those points with PnP.
+ * A verified candidate becomes a loop edge; the graph is optimized, map points
+ * and keyframes move along with their node, and pose is corrected.
+ **/
+bool VisualOdometry::DetectLoop(const Vocabulary &vocabulary, PlaceDatabase &database,
+                                std::vector<MapKeyframe> &keyframes, PoseGraph &graph,
+                                PnPTracker &tracker, const cv::Mat &descriptors,
+                                const KeyPointVector &keypoints, Cloud<cv::Point3d> &cloud,
+                                cv::Matx44d &pose)
+{
+    BowVector bow;
+    vocabulary.transform( descriptors, bow );
+    int node = database.add( bow );
+    if ( node < LOOP_MIN_AGE ) {
+        return false;
+    }
 
-        } else {
-
-            // CASE 0: frame-to-frame
+    // Score relative to the previous keyframe, which looks most alike
+    float reference = BowScore( bow, database.get(node - 1) );
+    std::vector<PlaceCandidate> candidates;
+    database.query( bow, node - LOOP_MIN_AGE, 3, candidates );
 
-            // Match descriptor vectors using FLANN matcher
-            matcher.match( current_descriptors, previous_descriptors, matches );
+    std::vector<cv::DMatch> matches;
+    for ( size_t c = 0; c < candidates.size(); c++ ) {
+        if ( candidates[c].score < LOOP_MIN_SCORE * reference ) {
+            break;
+        }
+        const MapKeyframe &candidate = keyframes[candidates[c].entry];
+        if ( MatchBinaryDescriptors( descriptors, candidate.descriptors, 80, 0.8f, matches ) < LOOP_MIN_MATCHES ) {
+            continue;
+        }
 
-            // Calculation of centroid by looping over matches
-            cv::Point2d current_centroid(0,0);
-            cv::Point2d previous_centroid(0,0);
-            std::vector<cv::Point2d> current_points_normalized, previous_points_normalized;
-            cv::Point2d cp;
-            cv::Point2d pp;
+        tracker.clear();
+        for ( size_t m = 0; m < matches.size(); m++ ) {
+            int id = candidate.point_ids[matches[m].trainIdx];
+            if ( cloud.contains(id) ) {
+                tracker.add( cloud.get_point(id), keypoints[matches[m].queryIdx].pt );
+            }
+        }
+        cv::Matx44d candidate_pose = graph.getPose( candidates[c].entry );
+        cv::Matx34d P = candidate_pose.get_minor<3, 4>(0, 0);
+        if ( !tracker.track(P) ) {
+            continue;
+        }
 
-            for ( match_it = matches.begin(); match_it != matches.begin() + current_descriptors.rows; match_it++ ) {
-                cp = current_keypoints[match_it->queryIdx].pt;
-                pp = previous_keypoints[match_it->trainIdx].pt;
+#if VERBOSE
+        log() << "Loop closure: node " << node << " revisits node " << candidates[c].entry
+                  << " (score " << candidates[c].score << ", " << tracker.inlierCount()
+                  << " inliers)." << std::endl;
+#endif
+        cv::Matx44d loop_pose;
+        cv::vconcat( P, cv::Matx14d(0, 0, 0, 1), loop_pose );
+        graph.addLoopEdge( candidates[c].entry, node, loop_pose * candidate_pose.inv(),
+                           PoseInformation(10.0, 10.0) );
+
+        OptimizePoseGraph( graph, keyframes, cloud );
+        pose = graph.getPose( node );
+        return true;
+    }
+    return false;
+}
 
-                current_centroid.x += cp.x;
-                current_centroid.y += cp.y;
-                current_points_normalized.push_back( cp );
+/**
+ * Recover the pose after tracking loss: take the keyframes whose thumbnails
+ * are closest to the image, match against the map points they observed and
+ * solve PnP, starting from the pose of the keyframe. keyframe_nr receives the
+ * frame number of the keyframe that worked. Keyframes without descriptors of
+ * their own (from a map file) are matched against those of the map points.
+ **/
+template <class Map>
+bool VisualOdometry::Relocalize(ThumbnailIndex &index, const std::vector<MapKeyframe> &keyframes,
+                                PnPTracker &tracker, const cv::Mat &image, const cv::Mat &descriptors,
+                                const KeyPointVector &keypoints, const Map &map,
+                                cv::Matx44d &pose, int &keyframe_nr)
+{
+    std::vector<std::pair<int, int> > candidates;
+    index.query( image, RELOC_CANDIDATES, candidates );
 
-                previous_centroid.x += pp.x;
-                previous_centroid.y += pp.y;
-                previous_points_normalized.push_back( pp );
+    std::vector<cv::DMatch> matches;
+    cv::Mat point_descriptors;
+    for ( size_t c = 0; c < candidates.size(); c++ ) {
+        const MapKeyframe &keyframe = keyframes[candidates[c].first];
+        if ( keyframe.descriptors.empty() ) {
+            MapDescriptors( map, keyframe.point_ids, point_descriptors );
+        } else {
+            point_descriptors = keyframe.descriptors;
+        }
+        if ( MatchBinaryDescriptors( descriptors, point_descriptors, 80, 0.8f, matches ) < 10 ) {
+            continue;
+        }
+        tracker.clear();
+        for ( size_t m = 0; m < matches.size(); m++ ) {
+            int id = keyframe.point_ids[matches[m].trainIdx];
+            if ( map.contains(id) ) {
+                tracker.add( map.get_point(id), keypoints[matches[m].queryIdx].pt );
             }
+        }
+        cv::Matx34d P = keyframe.pose.get_minor<3, 4>(0, 0);
+        if ( tracker.track(P) ) {
+#if VERBOSE
+            log() << "Relocalized at keyframe " << candidates[c].first << " (frame "
+                      << keyframe.frame_nr << ", " << tracker.inlierCount() << " inliers)." << std::endl;
+#endif
+            cv::vconcat( P, cv::Matx14d(0, 0, 0, 1), pose );
+            keyframe_nr = keyframe.frame_nr;
+            return true;
+        }
+    }
+    return false;
+}
 
-            // Normalize the centroids
-            int matchesSize = matches.size();
-            current_centroid.x /= matchesSize;
-            current_centroid.y /= matchesSize;
-            previous_centroid.x /= matchesSize;
-            previous_centroid.y /= matchesSize;
-
-            double current_scaling = 0;
-            double previous_scaling = 0;
-
-            // Translate points to have (0,0) as centroid
-            for ( size_t i = 0; i < matches.size(); i++ ) {
-                current_points_normalized[i] -= current_centroid;
-                previous_points_normalized[i] -= previous_centroid;
+/**
+ * The keyframe that sees the most of the given map points, fallback if none
+ * sees any of them.
+ **/
+int VisualOdometry::ReferenceKeyframe(const ObservationTable &observations,
+                                      const std::vector<int> &point_ids, int fallback)
+{
+    std::map<int, int> counts;
+    for ( size_t n = 0; n < point_ids.size(); n++ ) {
+        for ( int r = observations.firstOfPoint(point_ids[n]); r >= 0; r = observations.nextOfPoint(r) ) {
+            counts[observations.get(r).frame_nr]++;
+        }
+    }
+    int best = fallback, best_count = 0;
+    for ( std::map<int, int>::iterator it = counts.begin(); it != counts.end(); it++ ) {
+        if ( it->second > best_count ) {
+            best = it->first;
+            best_count = it->second;
+        }
+    }
+    return best;
+}
 
-                current_scaling += cv::norm( current_points_normalized[i] );
-                previous_scaling += cv::norm( previous_points_normalized[i] );
+/**
+ * Give every map point that more than one keyframe observed the medoid of
+ * the descriptors those keyframes saw it with, so the one descriptor kept
+ * per point matches all of its views best.
+ **/
+void VisualOdometry::RepresentativeDescriptors(const std::vector<MapKeyframe> &keyframes,
+                                               Cloud<cv::Point3d> &cloud)
+{
+    // (keyframe, row) per point id
+    std::vector<std::vector<std::pair<int, int> > > views( cloud.id_count() );
+    for ( size_t k = 0; k < keyframes.size(); k++ ) {
+        for ( size_t p = 0; p < keyframes[k].point_ids.size() && (int) p < keyframes[k].descriptors.rows; p++ ) {
+            int id = keyframes[k].point_ids[p];
+            if ( cloud.contains(id) ) {
+                views[id].push_back( std::make_pair( k, p ) );
             }
+        }
+    }
+    cv::Mat samples;
+    for ( size_t id = 0; id < views.size(); id++ ) {
+        if ( views[id].size() < 2 ) {
+            continue;
+        }
+        const cv::Mat &first = keyframes[views[id][0].first].descriptors;
+        samples.create( views[id].size(), first.cols, first.type() );
+        for ( size_t v = 0; v < views[id].size(); v++ ) {
+            const cv::Mat &rows = keyframes[views[id][v].first].descriptors;
+            memcpy( samples.ptr(v), rows.ptr( views[id][v].second ), rows.cols * rows.elemSize() );
+        }
+        cloud.choose_descriptor( id, samples );
+    }
+}
 
-            // Enforce mean distance sqrt( 2 ) from origin (0,0)
-            current_scaling  = sqrt( 2.0 ) * (double) matches.size() / current_scaling;
-            previous_scaling = sqrt( 2.0 ) * (double) matches.size() / previous_scaling;
-
-            // Compute transformation matrices
-            cv::Matx33d current_T( current_scaling, 0,               -current_scaling * current_centroid.x,
-                                   0,               current_scaling, -current_scaling * current_centroid.y,
-                                   0,               0,               1
-                                 );
-
-            cv::Matx33d previous_T ( previous_scaling, 0,                -previous_scaling * previous_centroid.x,
-                                     0,                previous_scaling, -previous_scaling * previous_centroid.y,
-                                     0,                0,                1
-                                   );
-
-            // Scale points
-            for ( size_t i = 0; i < matches.size(); i++ ) {
-                previous_points_normalized[i] *= previous_scaling;
-                current_points_normalized[i]  *= current_scaling;
+/**
+ * Write the map (points, descriptors, statistics, observations, keyframes
+ * and their thumbnails) to a map file.
+ **/
+bool VisualOdometry::SaveMap(const std::string &path, Cloud<cv::Point3d> &cloud,
+                             const std::vector<MapKeyframe> &keyframes, const ThumbnailIndex &thumbnails)
+{
+#if COMPACT_MAP
+    RepresentativeDescriptors( keyframes, cloud );
+#endif
+    CloudView<cv::Point3d> view = cloud.view();
+    int n = view.size();
+
+    std::vector<int32_t> statistics( 4 * n );
+    std::vector<Observation> observations;
+    for ( int slot = 0; slot < n; slot++ ) {
+        int id = view.id(slot);
+        statistics[4 * slot] = cloud.get_weight(id);
+        statistics[4 * slot + 1] = cloud.get_visible(id);
+        statistics[4 * slot + 2] = cloud.get_found(id);
+        statistics[4 * slot + 3] = cloud.get_last_seen(id);
+        for ( int r = cloud.observations().firstOfPoint(id); r >= 0; r = cloud.observations().nextOfPoint(r) ) {
+            observations.push_back( cloud.observations().get(r) );
+        }
+    }
+    cv::Mat descriptors;
+    cloud.get_descriptors( descriptors );
+
+    // Keyframes keep only the points still in the map
+    std::vector<MapFileKeyframe> records( keyframes.size() );
+    std::vector<int32_t> points;
+    for ( size_t k = 0; k < keyframes.size(); k++ ) {
+        for ( int i = 0; i < 16; i++ ) {
+            records[k].pose[i] = keyframes[k].pose(i / 4, i % 4);
+        }
+        records[k].frame_nr = keyframes[k].frame_nr;
+        records[k].first_point = points.size();
+        for ( size_t p = 0; p < keyframes[k].point_ids.size(); p++ ) {
+            if ( cloud.contains( keyframes[k].point_ids[p] ) ) {
+                points.push_back( keyframes[k].point_ids[p] );
             }
+        }
+        records[k].point_count = points.size() - records[k].first_point;
+        records[k].reserved = 0;
+    }
 
-            // Find the fundamental matrix and reject outliers and calc distance between matches
-            cv::Matx33d F;
-            std::vector<cv::Point2d> current_points_normalized_inliers, previous_points_normalized_inliers;
-
-            double mean_distance = determineFundamentalMatrix(previous_points_normalized,
-                                                              current_points_normalized,
-                                                              previous_points_normalized_inliers,
-                                                              current_points_normalized_inliers,
-                                                              matches,
-                                                              F);
+    MapWriter writer;
+    writer.setPoints( n, cloud.id_count(), view.column(0), view.column(1), view.column(2),
+                      view.ids(), view.frames(), n > 0 ? &statistics[0] : NULL );
+    writer.setDescriptors( descriptors );
+    writer.setObservations( observations.size(), observations.empty() ? NULL : &observations[0] );
+    writer.setKeyframes( records.size(), records.empty() ? NULL : &records[0],
+                         points.size(), points.empty() ? NULL : &points[0] );
+    writer.setThumbnails( thumbnails.thumbnailWidth(), thumbnails.thumbnailHeight(),
+                          thumbnails.thumbnailStride(), thumbnails.size(),
+                          thumbnails.thumbnailIds(), thumbnails.thumbnailData() );
+    return writer.write( path );
+}
 
+/**
+ * Replace the map by the one in a map file, into a Cloud or a CompactCloud.
+ * The file is mapped into memory and its sections are copied into the map
+ * and keyframe records as blocks; only the spatial index, the observation
+ * lists and the covisibility graph are rebuilt. Keyframes get no descriptor
+ * copies, Relocalize takes those of the map points.
+ **/
+template <class Map>
+bool VisualOdometry::LoadMap(const std::string &path, Map &map,
+                             std::vector<MapKeyframe> &keyframes, ThumbnailIndex &thumbnails,
+                             CovisibilityGraph &covisibility)
+{
+    MapFile file;
+    if ( !file.open( path ) ) {
+        return false;
+    }
+    const double *coordinates[3] = { file.column(0), file.column(1), file.column(2) };
+    map.restore( file.pointCount(), coordinates, file.ids(), file.frames(),
+                 file.statistics(), file.descriptors() );
+
+    ObservationTable &observations = map.observations();
+    for ( int o = 0; o < file.observationCount(); o++ ) {
+        const Observation &observation = file.observations()[o];
+        observations.add( observation.point_id, observation.frame_nr, observation.keypoint );
+    }
 
+    keyframes.clear();
+    covisibility.clear();
+    for ( int k = 0; k < file.keyframeCount(); k++ ) {
+        const MapFileKeyframe &record = file.keyframes()[k];
+        MapKeyframe keyframe;
+        keyframe.frame_nr = record.frame_nr;
+        for ( int i = 0; i < 16; i++ ) {
+            keyframe.pose(i / 4, i % 4) = record.pose[i];
+        }
+        const int32_t *points = file.keyframePoints() + record.first_point;
+        for ( int p = 0; p < record.point_count; p++ ) {
+            if ( map.contains( points[p] ) ) {
+                keyframe.point_ids.push_back( points[p] );
+            }
+        }
+        keyframes.push_back( keyframe );
+        covisibility.update( keyframe.frame_nr, observations );
+    }
 
-            // Add outliers to the 2d cloud of unused features
-            std::vector<cv::Point2d> all_points_current, all_points_previous;
-            KeypointsToPoints( current_keypoints, all_points_current );
-            KeypointsToPoints( previous_keypoints, all_points_previous );
+    thumbnails.clear();
+    if ( file.thumbnailCount() > 0 &&
+         !thumbnails.restore( file.info().thumbnail_width, file.info().thumbnail_height,
+                              file.info().thumbnail_stride, file.thumbnailCount(), file.thumbnails(),
+                              file.thumbnailIds() ) ) {
+        log() << "Map thumbnails have another size, relocalization will not work." << std::endl;
+    }
+#if VERBOSE
+    log() << "Loaded map " << path << ": " << map.size() << " points, "
+              << keyframes.size() << " keyframes." << std::endl;
+#endif
+    return true;
+}
 
-            std::vector<cv::Point2d> current_outlier_points_2d;
-            cv::Mat current_outlier_descriptors_2d;
+/**
+ * Run the session on the calling thread until the input runs out or a key
+ * is pressed in one of its windows. Headless, it tells how fast it went.
+ **/
+bool VisualOdometry::MainLoop() {
+    if ( !start() ) {
+        return false;
+    }
+    int status = SESSION_RUNNING;
+    double started = (double) cv::getTickCount() / cv::getTickFrequency();
+    while ( status == SESSION_RUNNING ) {
+        // Windows only get drawn while waiting for a key
+        if ( interactive && (char) cv::waitKey( headless ? 1 : 30 ) != -1 ) {
+            break;
+        }
+        status = step();
+    }
+    finish();
+    if ( headless ) {
+        double seconds = (double) cv::getTickCount() / cv::getTickFrequency() - started;
+        std::cout << frames_read << " frames in " << seconds << " s (" << frames_read / seconds << " frames/s), "
+                  << mapKeyframes.size() << " keyframes, " << cloud_3D.size() << " map points." << std::endl;
+    }
+    return status != SESSION_FAILED;
+}
 
-            DetermineNewOutliers(matches,
-                                 all_points_current,
-                                 current_descriptors,
-                                 current_outlier_points_2d,
-                                 current_outlier_descriptors_2d);
+/**
+ * Read the first frame and set up the map: empty, or the map file to
+ * localize against.
+ **/
+bool VisualOdometry::start() {
+#if _FEATURE == _BRISK
+    features.create("BRISK");
+#elif _FEATURE == _FREAK
+    features.create("FREAK");
+#elif _FEATURE == _ORB
+    features.create("ORB");
+#endif
+    ///
+    /// ORB(int nfeatures = 500, float scaleFactor = 1.2f, int nlevels = 8, int edgeThreshold = 31,
+    /// int firstLevel = 0, int WTA_K=2, int scoreType=ORB::HARRIS_SCORE, int patchSize=31 );
+    ///
+
+    // Get the previous frame
+    if ( !inputSource->getFrame( previous_frame ) || !previous_frame.img.data ) {
+        std::cerr << "No image found." << std::endl;
+        return false;
+    }
+
+    cv::Mat colorMat = previous_frame.img.clone();
+    cv::cvtColor(colorMat, previous_frame.img, CV_BGR2GRAY);
 
-            cloud_2D.add(current_outlier_points_2d, current_outlier_descriptors_2d, frame_nr);
+    // Detect features for the firstm time
+    features.detect( previous_frame.img, previous_keypoints );    
+    features.compute( previous_frame.img, previous_keypoints, previous_descriptors );
 
-            // Scale up again
-            F = current_T.t() * F * previous_T;
+    // Use frame-to-frame initially, switch to frame-to-map once the map has points.
+    epnp = false;
+    previous_pose = cv::Matx44d::eye();
+    velocity = cv::Matx44d::eye();
 
-    #if VERBOSE
-            std::cout << "Matches before pruning: " << matchesSize << ". " <<
-                         "Matches after: " << matches.size() << "\n" <<
-                         "Mean displacement: " << mean_distance << std::endl;
-    #endif
+    keyframeTracker.setMinInliers( LOOP_MIN_MATCHES / 2 );
+    lost = false;
+    lost_frames = 0;
+    if ( LOOP_CLOSURE && !loop_closure ) {
+        log() << "No vocabulary file present, loop closure disabled." << std::endl;
+    }
+
+    cloud_3D.enable_index( VOXEL_SIZE );
+#if MAP_FUSION
+    cloud_3D.set_fusion( FUSION_RADIUS, FUSION_MAX_DISTANCE );
+#endif
+#if MAP_CULLING
+    cloud_3D.set_culling( MAP_MIN_FOUND_RATIO, MAP_MIN_VISIBLE, 0, MAP_MAX_POINTS );
+#endif
+
+    // Localize against a prebuilt map: start lost, so the first frames are
+    // relocalized against its keyframes, and never change the map
+    localize_only = !mapLoadPath.empty();
+    reference_frame = -1;
+    keyframes_since_save = 0;
+    keyframes_since_export = 0;
+    compact = localize_only && COMPACT_MAP;
+    if ( localize_only ) {
+        bool loaded = compact ? LoadMap( mapLoadPath, compact_map, mapKeyframes, thumbnailIndex, covisibility )
+                              : LoadMap( mapLoadPath, cloud_3D, mapKeyframes, thumbnailIndex, covisibility );
+        if ( !loaded ) {
+            std::cerr << "Can not load map " << mapLoadPath << "." << std::endl;
+            return false;
+        }
+#if VERBOSE
+        if ( compact ) {
+            log() << "Compact map: " << compact_map.block_count() << " blocks, "
+                      << compact_map.memory() / 1024 << " kB." << std::endl;
+        }
+#endif
+        epnp = true;
+        lost = true;
+    }
+    relocalization = RELOCALIZATION || localize_only;
+
+#if MAP_SYNC
+    // A map loaded to localize against does not change, nothing to stream
+    publish_map = !mapServerAddress.empty() && !localize_only;
+    if ( publish_map ) {
+        mapPublisher = new MapPublisher( mapAgent );
+        mapPublisher->attach( cloud_3D );
+        if ( !mapPublisher->connect( mapServerAddress ) ) {
+            std::cerr << "Can not start streaming the map to " << mapServerAddress << "." << std::endl;
+        }
+        published_keyframes = 0;
+    }
+#endif
+    if ( !trajectoryPath.empty() && !exporter.openTrajectory( trajectoryPath, trajectoryFormat ) ) {
+        std::cerr << "Can not write trajectory " << trajectoryPath << "." << std::endl;
+    }
+    exporter.setMapPrefix( mapExportPrefix );
+    if ( !trajectoryPath.empty() || !mapExportPrefix.empty() ) {
+        exporter.start();
+    }
+    if ( !sharedStateName.empty() && !sharedState.open( sharedStateName, SHARED_POSES, MAP_MAX_POINTS ) ) {
+        std::cerr << "Can not share state as " << sharedStateName << "." << std::endl;
+    }
+
+    frame_nr = 0;
+    previous_frame_nr = -1;
+    scale_initialized = false;
+    visual_path = robot_path = 0.0;
+
+#if VISUALIZE
+    if ( interactive ) {
+        viewer = new MapViewer( "Cloudviewer", VIEWER_VOXEL_SIZE, VIEWER_MAX_POINTS );
+        viewer->attach( cloud_3D );
+        viewer->start();
+    }
+#endif
+    return true;
+}
 
-            // Draw only inliers
+/**
+ * Track the next frame, and extend the map when it is a keyframe. Returns
+ * SESSION_RUNNING while there are frames left.
+ **/
+int VisualOdometry::step() {
+    // Retrieve an image
+    if ( !inputSource->getFrame( current_frame ) ) {
+        log() << "Can not read the next frame." << std::endl;
+        return SESSION_FINISHED;
+    }
+    if ( !current_frame.img.data ) {
+        // How a FileInput tells the end of its folder
+        std::cerr << "No image found." << std::endl;
+        return SESSION_FINISHED;
+    }
+    log() << "Frame " << ++frames_read << std::endl;
+
+    // Convert to grayscale
+    cv::Mat colorMat = current_frame.img.clone();
+    cv::cvtColor(colorMat, current_frame.img, CV_BGR2GRAY);
+
+    // Detect features
+    features.detect( current_frame.img, current_keypoints );
+
+    // Find descriptors for these features
+    features.compute( current_frame.img, current_keypoints, current_descriptors );
+
+    if ( current_keypoints.empty() ) {
+        // Nothing to track (blur, a white wall), the next frames will tell
+#if VERBOSE
+        log() << "No features found, skipping frame." << std::endl;
+#endif
+        lost = lost || epnp;
+        epnp = false;
+        return SESSION_RUNNING;
+    }
+    if ( previous_keypoints.empty() ) {
+        // Started without features, begin from this frame instead
+        previous_keypoints = current_keypoints;
+        previous_frame = current_frame;
+        previous_descriptors = current_descriptors;
+        previous_frame_nr = -1;
+        return SESSION_RUNNING;
+    }
+
+    if ( lost ) {
+        cv::Matx44d recovered_pose;
+        bool relocalized = false;
+        if ( relocalization && compact ) {
+            relocalized = Relocalize( thumbnailIndex, mapKeyframes, keyframeTracker,
+                                      current_frame.img, current_descriptors,
+                                      current_keypoints, compact_map, recovered_pose,
+                                      reference_frame );
+        } else if ( relocalization ) {
+            relocalized = Relocalize( thumbnailIndex, mapKeyframes, keyframeTracker,
+                                      current_frame.img, current_descriptors,
+                                      current_keypoints, cloud_3D, recovered_pose,
+                                      reference_frame );
+        }
+        if ( relocalized ) {
+            lost = false;
+            epnp = true;
+            previous_pose = recovered_pose;
+            velocity = cv::Matx44d::eye();
+
+            ReportPose( recovered_pose );
+        } else if ( !localize_only && ++lost_frames > RELOC_MAX_FRAMES ) {
+            // Give up, continue frame-to-frame from here
+            lost = false;
+        }
+        previous_keypoints = current_keypoints;
+        previous_frame = current_frame;
+        previous_descriptors = current_descriptors;
+        previous_frame_nr = -1;
+        return SESSION_RUNNING;
+    }
+
+    if (epnp)
+    {
+        // CASE 1: SolvePnP
+
+        // Constant velocity prediction of the current pose
+        cv::Matx44d predicted_pose = velocity * previous_pose;
+        P2 = predicted_pose.get_minor<3, 4>(0, 0);
+
+        bool local_map = false;
+#if LOCAL_MAP
+        if ( compact ) {
+            BuildLocalMap( covisibility, compact_map, reference_frame, P2,
+                           current_frame.img.size(), local_ids, local_descriptors );
+        } else {
+            BuildLocalMap( covisibility, cloud_3D,
+                           localize_only ? reference_frame : keyframeManager.lastKeyframe(), P2,
+                           current_frame.img.size(), local_ids, local_descriptors );
+        }
+        local_map = (int) local_ids.size() >= LOCAL_MAP_MIN_POINTS;
+#endif
+        if ( compact && !local_map ) {
+            // Instead of the whole map, the blocks in the predicted view
+            compact_map.frustum_search( K, P2, current_frame.img.size(), LOCAL_MAP_MARGIN, local_ids );
+            MapDescriptors( compact_map, local_ids, local_descriptors );
+            local_map = true;
+        } else if ( !local_map ) {
+            // Instead of the whole map, the points in the predicted view: one
+            // pass down the coordinate columns, descriptors copied by runs
+            CloudView<cv::Point3d> view = cloud_3D.view();
+            QueryFrustum in_view( K, P2, current_frame.img.size(), LOCAL_MAP_MARGIN );
+            if ( query_select( view, in_view, local_selection, defaultThreadCount() ) > 0 ) {
+                query_gather( view, local_selection, (std::vector<cv::Point3d> *) NULL, &local_ids,
+                              &local_descriptors );
+                local_map = true;
+            }
+        }
+        matches.clear();
+        if ( local_map ) {
+            for ( size_t n = 0; n < local_ids.size() && !compact; n++ ) {
+                cloud_3D.mark_visible( local_ids[n] );
+            }
+            matcher.match( current_descriptors, local_descriptors, matches );
+            // From local map rows to cloud slots; the compact map is read by id
+            for ( size_t m = 0; m < matches.size() && !compact; m++ ) {
+                matches[m].trainIdx = cloud_3D.slot( local_ids[matches[m].trainIdx] );
+            }
+        } else {
+            // Cached in the cloud, only copied when the map changed
+            cloud_3D.get_descriptors(total_3D_descriptors);
+            matcher.match( current_descriptors, total_3D_descriptors, matches );
+        }
+#if VERBOSE
+        log() << "Matched against " << (local_map ? local_ids.size() : cloud_3D.size())
+                  << " map points." << std::endl;
+#endif
+        if ( matches.empty() ) {
+            epnp = false;
+            lost = relocalization && !mapKeyframes.empty();
+            lost_frames = 0;
+            return SESSION_RUNNING;
+        }
+
+        // Determine minimum distance and derive good matches from it
+        double minDist = matches[0].distance;
+        for(match_it = matches.begin(); match_it != matches.end(); match_it++) {
+            if(match_it->distance < minDist) minDist = match_it->distance;
+        }
+        std::vector<cv::DMatch> good_matches;
+        for(match_it = matches.begin(); match_it != matches.end(); match_it++) {
+            if(match_it->distance < 2*minDist) {
+                good_matches.push_back( *match_it );
+            }
+        }
+# if VERBOSE
+        log() << "Before pruning " << matches.size()
+                  << " matches, after " << good_matches.size() << "." << std::endl;
+#endif
+
+        // determine correct keypoints and corresponding 3d positions,
+        // read in place: the map does not change until the next keyframe
+        CloudView<cv::Point3d> map_view = cloud_3D.view();
+        if ( compact ) {
+            pnpTracker.clear();
+            for ( size_t m = 0; m < good_matches.size(); m++ ) {
+                pnpTracker.add( compact_map.get_point( local_ids[good_matches[m].trainIdx] ),
+                                current_keypoints[good_matches[m].queryIdx].pt );
+            }
+        } else {
+            pnpTracker.gather(good_matches, current_keypoints,
+                              map_view.column(0), map_view.column(1), map_view.column(2));
+        }
+
+        if ( !pnpTracker.track(P2) ) {
+            // Lost the map, fall back to frame-to-frame from the last tracked frame
+#if VERBOSE
+            log() << "PnP tracking failed (" << pnpTracker.size()
+                      << " correspondences), relocalizing." << std::endl;
+#endif
+            epnp = false;
+            lost = relocalization && !mapKeyframes.empty();
+            lost_frames = 0;
+            return SESSION_RUNNING;
+        }
+
+#if VERBOSE
+        log() << "PnP inliers: " << pnpTracker.inlierCount() << "/"
+                  << pnpTracker.size() << "\n" << P2 << std::endl;
+#endif
+
+        cv::Matx44d current_pose;
+        cv::vconcat( P2, cv::Matx14d(0, 0, 0, 1), current_pose );
+
+        // Map points tracked in this frame
+        std::vector<int> tracked_ids;
+        std::vector<int> tracked_keypoints;
+        std::vector<cv::Point2d> tracked_pixels;
+        std::vector<cv::Point3d> tracked_points;
+        const std::vector<unsigned char> &inliers = pnpTracker.inlierMask();
+        for ( size_t n = 0; n < good_matches.size() && n < inliers.size(); n++ ) {
+            if ( inliers[n] ) {
+                int train = good_matches[n].trainIdx;
+                tracked_ids.push_back( compact ? local_ids[train] : map_view.id(train) );
+                tracked_keypoints.push_back( good_matches[n].queryIdx );
+                cloud_3D.mark_found( tracked_ids.back(), frame_nr );
+                tracked_pixels.push_back( current_keypoints[good_matches[n].queryIdx].pt );
+                tracked_points.push_back( compact ? compact_map.get_point( tracked_ids.back() )
+                                                  : map_view.get_point(train) );
+            }
+        }
+
+        if ( localize_only ) {
+            reference_frame = ReferenceKeyframe( compact ? compact_map.observations() : cloud_3D.observations(),
+                                                 tracked_ids, reference_frame );
+        }
+        if ( localize_only || !keyframeManager.isKeyframe( current_pose, tracked_ids, tracked_pixels ) ) {
+            // Not a keyframe: keep the pose, leave the map alone
+            velocity = current_pose * previous_pose.inv();
+            previous_pose = current_pose;
+
+            ReportPose( current_pose );
+
+            previous_keypoints = current_keypoints;
+            previous_frame = current_frame;
+            previous_descriptors = current_descriptors;
+            previous_frame_nr = -1;
+            return SESSION_RUNNING;
+        }
+#if VERBOSE
+        log() << "Keyframe (" << keyframeManager.lastReason() << ")." << std::endl;
+#endif
+        keyframeManager.addKeyframe( frame_nr, current_pose, tracked_ids, tracked_pixels, tracked_points );
+        for ( size_t n = 0; n < tracked_ids.size(); n++ ) {
+            cloud_3D.observations().add( tracked_ids[n], frame_nr, tracked_keypoints[n] );
+        }
+        covisibility.update( frame_nr, cloud_3D.observations() );
+
+#if LOCAL_BA
+        BAKeyframe keyframe;
+        keyframe.frame_nr = frame_nr;
+        keyframe.pose = current_pose;
+        keyframe.point_ids = tracked_ids;
+        keyframe.measurements = tracked_pixels;
+        window.push_back( keyframe );
+        if ( window.size() > BA_WINDOW ) {
+            window.pop_front();
+        }
+        LocalBundleAdjustment( bundleAdjuster, window, cloud_3D );
+        current_pose = window.back().pose;
+        P2 = current_pose.get_minor<3, 4>(0, 0);
+#endif
+#if POSE_GRAPH
+        UpdatePoseGraph( poseGraph, current_pose, current_frame, frame_nr, node_camPosition );
+#endif
+        MapKeyframe mapKeyframe;
+        mapKeyframe.frame_nr = frame_nr;
+        mapKeyframe.pose = current_pose;
+        mapKeyframe.point_ids = tracked_ids;
+        KeypointPixels( current_keypoints, mapKeyframe.pixels );
+        for ( size_t n = 0; n < good_matches.size() && n < inliers.size(); n++ ) {
+            if ( inliers[n] ) {
+                mapKeyframe.descriptors.push_back( current_descriptors.row(good_matches[n].queryIdx) );
+            }
+        }
+        mapKeyframes.push_back( mapKeyframe );
+        thumbnailIndex.add( current_frame.img, mapKeyframes.size() - 1 );
+#if POSE_GRAPH
+#if LOOP_CLOSURE
+        if ( loop_closure ) {
+            DetectLoop( vocabulary, placeDatabase, mapKeyframes, poseGraph, keyframeTracker,
+                        current_descriptors, current_keypoints, cloud_3D, current_pose );
+        }
+#endif
+        P2 = current_pose.get_minor<3, 4>(0, 0);
+#endif
+
+        velocity = current_pose * previous_pose.inv();
+        previous_pose = current_pose;
+
+        ReportPose( current_pose );
+
+        previous_keypoints = current_keypoints;
+        previous_frame = current_frame;
+        previous_descriptors = current_descriptors;
+        previous_frame_nr = frame_nr;
+
+        //////////////////////////////////
+        // Follow the keypoints that are not map points yet, and turn the
+        // ones seen from far enough apart into map points
+        std::vector<bool> used( current_keypoints.size(), false );
+        for ( size_t n = 0; n < tracked_keypoints.size(); n++ ) {
+            used[tracked_keypoints[n]] = true;
+        }
+#if RETRIANGULATE
+        int retriangulated = RetriangulatePoints( tracked_ids );
+#if VERBOSE
+        log() << "Retriangulated " << retriangulated << " map points." << std::endl;
+#endif
+#endif
+        UpdateTracks( P2, used );
+
+
+    } else {
+
+        // CASE 0: frame-to-frame
+
+        // Match descriptor vectors using FLANN matcher
+        matcher.match( current_descriptors, previous_descriptors, matches );
+
+        // Calculation of centroid by looping over matches
+        cv::Point2d current_centroid(0,0);
+        cv::Point2d previous_centroid(0,0);
+        std::vector<cv::Point2d> current_points_normalized, previous_points_normalized;
+        cv::Point2d cp;
+        cv::Point2d pp;
+
+        for ( match_it = matches.begin(); match_it != matches.begin() + current_descriptors.rows; match_it++ ) {
+            cp = current_keypoints[match_it->queryIdx].pt;
+            pp = previous_keypoints[match_it->trainIdx].pt;
+
+            current_centroid.x += cp.x;
+            current_centroid.y += cp.y;
+            current_points_normalized.push_back( cp );
+
+            previous_centroid.x += pp.x;
+            previous_centroid.y += pp.y;
+            previous_points_normalized.push_back( pp );
+        }
+
+        // Normalize the centroids
+        int matchesSize = matches.size();
+        current_centroid.x /= matchesSize;
+        current_centroid.y /= matchesSize;
+        previous_centroid.x /= matchesSize;
+        previous_centroid.y /= matchesSize;
+
+        double current_scaling = 0;
+        double previous_scaling = 0;
+
+        // Translate points to have (0,0) as centroid
+        for ( size_t i = 0; i < matches.size(); i++ ) {
+            current_points_normalized[i] -= current_centroid;
+            previous_points_normalized[i] -= previous_centroid;
+
+            current_scaling += cv::norm( current_points_normalized[i] );
+            previous_scaling += cv::norm( previous_points_normalized[i] );
+        }
+
+        // Enforce mean distance sqrt( 2 ) from origin (0,0)
+        current_scaling  = sqrt( 2.0 ) * (double) matches.size() / current_scaling;
+        previous_scaling = sqrt( 2.0 ) * (double) matches.size() / previous_scaling;
+
+        // Compute transformation matrices
+        cv::Matx33d current_T( current_scaling, 0,               -current_scaling * current_centroid.x,
+                               0,               current_scaling, -current_scaling * current_centroid.y,
+                               0,               0,               1
+                             );
+
+        cv::Matx33d previous_T ( previous_scaling, 0,                -previous_scaling * previous_centroid.x,
+                                 0,                previous_scaling, -previous_scaling * previous_centroid.y,
+                                 0,                0,                1
+                               );
+
+        // Scale points
+        for ( size_t i = 0; i < matches.size(); i++ ) {
+            previous_points_normalized[i] *= previous_scaling;
+            current_points_normalized[i]  *= current_scaling;
+        }
+
+        // Find the fundamental matrix and reject outliers and calc distance between matches
+        cv::Matx33d F;
+        std::vector<cv::Point2d> current_points_normalized_inliers, previous_points_normalized_inliers;
+
+        double mean_distance = determineFundamentalMatrix(previous_points_normalized,
+                                                          current_points_normalized,
+                                                          previous_points_normalized_inliers,
+                                                          current_points_normalized_inliers,
+                                                          matches,
+                                                          F);
+
+
+
+        // Scale up again
+        F = current_T.t() * F * previous_T;
+
+#if VERBOSE
+        log() << "Matches before pruning: " << matchesSize << ". " <<
+                     "Matches after: " << matches.size() << "\n" <<
+                     "Mean displacement: " << mean_distance << std::endl;
+#endif
+
+        // Without enough parallax nothing can be triangulated: skip the frame
+        // and compare the next one to the same previous frame. Measured on the
+        // inliers of F only, mismatches would make any frame look far enough.
+        std::vector<cv::Point2d> cpoints, ppoints;
+        for ( size_t m = 0; m < matches.size(); m++ ) {
+            cpoints.push_back( current_keypoints[matches[m].queryIdx].pt );
+            ppoints.push_back( previous_keypoints[matches[m].trainIdx].pt );
+        }
+        if ( !keyframeManager.enoughParallax( ppoints, cpoints ) ) {
+#if VERBOSE
+            log() << "Displacement not sufficiently large, skipping frame." << std::endl;
+#endif
+            return SESSION_RUNNING;
+        }
+
+        // Draw only inliers
+        if ( interactive ) {
             cv::Mat img_matches;
             cv::drawMatches(
                 current_frame.img, current_keypoints, previous_frame.img, previous_keypoints,
@@ -625,174 +1729,327 @@ bool VisualOdometry::MainLoop() {
                 );
 
             imshow( "Good Matches", img_matches );
+#if SAVE_MATCHES
             imwrite("some.png", img_matches);
+#endif
+        }
 
-            // If displacement is not sufficiently large, skip this image.
-            std::cout << mean_distance << std::endl;
-            if (mean_distance < THRESHOLD)
-            {
-                if (mean_distance < 0.00001)
-                {
-                    // what the fuck just happened
-                    std::cout << "wut 0 mean_distance wut" << std::endl;
-                }
-    #if VERBOSE
-                std::cout << "Displacement not sufficiently large, skipping frame." << std::endl;
-    #endif
-                continue;
-            }
+        // Compute essential matrix
+        cv::Matx33d E (cv::Mat(K.t() * F * K));
+
+        // Estimation of projection matrix
+        cv::Mat R1, R2, t;
+        if( !GetCameraMatrixHorn( E, R1, R2, t ) ) {
+            return SESSION_FAILED;
+        }
 
-            // Compute essential matrix
-            cv::Matx33d E (cv::Mat(K.t() * F * K));
+        // Check correctness(!(cv::Mat(visualOdometry->K).empty()))
+        if ( cv::determinant(R1) < 0 ) R1 = -R1;
+        if ( cv::determinant(R2) < 0 ) R2 = -R2;
 
-            // Estimation of projection matrix
-            cv::Mat R1, R2, t;
-            if( !GetCameraMatrixHorn( E, R1, R2, t ) ) {
-                return false;
-            }
+        std::vector<cv::Point3d> best_X;
+        cv::Matx34d best_transform;
+        FindBestRandT(ppoints, cpoints, R1, R2, t, best_X, best_transform);
 
-            // Check correctness(!(cv::Mat(visualOdometry->K).empty()))
-            if ( cv::determinant(R1) < 0 ) R1 = -R1;
-            if ( cv::determinant(R2) < 0 ) R2 = -R2;
+#if VERBOSE
+        log() << "Best found transformation\n" << best_transform << "\n" << std::endl;
+        for ( size_t x  = 0; x < best_X.size(); x++ ) {
+            log() << ppoints[x] << "\t" << cpoints[x] << "\t" << best_X[x] << std::endl;
+        }
+#endif
+        // SOLVE THEM SCALE ISSUES for m = 1;
+        // best_X[n] was triangulated from ppoints[n] and cpoints[n], so both
+        // arrays can be handed to the estimator as they are.
+#if VERBOSE
+        log() << "Finding scale..." << std::endl;
+#endif
 
-            std::vector<cv::Point3d> best_X;
-            cv::Matx34d best_transform;
+        double norm_t = cv::norm(best_transform.col(3));
+        best_transform(0,3) /= norm_t;
+        best_transform(1,3) /= norm_t;
+        best_transform(2,3) /= norm_t;
+
+        ScaleEstimate scale_estimate;
+        bool scale_found = !best_X.empty() &&
+                           scaleEstimator.estimate(best_transform,
+                                                   &best_X[0],
+                                                   &cpoints[0],
+                                                   best_X.size(),
+                                                   scale_estimate);
+#if VERBOSE
+        log() << "Scale: " << scale_estimate.scale
+                  << " +- " << scale_estimate.sigma << " ("
+                  << scale_estimate.inliers << "/" << scale_estimate.total
+                  << " inliers)" << std::endl;
+#endif
 
-            std::vector<cv::Point2d> cpoints, ppoints;
-            for ( size_t m = 0; m < matches.size(); m++ ) {
-                cpoints.push_back( current_keypoints[matches[m].queryIdx].pt );
-                ppoints.push_back( previous_keypoints[matches[m].trainIdx].pt );
+        if(!scale_initialized) {
+            if(scale_found) {
+                init_scale = scale_estimate.scale;
+                scale_initialized = true;
             }
+        } else if(scale_found) {
+            current_scale = scale_estimate.scale;
 
-            FindBestRandT(ppoints, cpoints, R1, R2, t, best_X, best_transform);
+            // You want to scale the points towards your init scale.
+            ratio_scale = init_scale / current_scale;
+            best_transform(0,3) *= ratio_scale;
+            best_transform(1,3) *= ratio_scale;
+            best_transform(2,3) *= ratio_scale;
 
+            // Clear current best_X and obtain it with new scaling
+            best_X.clear();
+
+            cv::Matx34d P1( 1, 0, 0, 0,
+                            0, 1, 0, 0,
+                            0, 0, 1, 0 );
+
+            TriangulatePoints(ppoints, cpoints, P1, best_transform, best_X);
 #if VERBOSE
-            std::cout << "Best found transformation\n" << best_transform << "\n" << std::endl;
-            for ( size_t x  = 0; x < best_X.size(); x++ ) {
-                std::cout << ppoints[x] << "\t" << cpoints[x] << "\t" << best_X[x] << std::endl;
-            }
-#endif
-#if VISUALIZE
-            // Display found points
-            cloud_3D.show_cloud(viewer, 3);
+            log() << "Scaled found transformation\n" << best_transform << "\n" << std::endl;
 #endif
+        }
 
-            /**
-             *  Input  - Pcam  -> (3x4) Camera position
-             *         - X3D   -> (3xn) 3D points
-             *         - Q     -> (2xn) Image points
-             *         - K     -> (3x3) Camera calibration
-             *
-             *  Output - scale -> (1x1) Scaling factor
-             *         - Pcam  -> (3x4) Scaled camera matrix
-             **/
-            // SOLVE THEM SCALE ISSUES for m = 1;
-            cv::Mat imagepoints (2, best_X.size(), CV_64F);
-            cv::Mat objectpoints(3, best_X.size(), CV_64F);
-
-            for ( size_t n = 0; n < best_X.size(); n++) {
-                imagepoints.at<double>(0, n) = current_keypoints[matches[n].queryIdx].pt.x;
-                imagepoints.at<double>(1, n) = current_keypoints[matches[n].queryIdx].pt.y;
-
-                cv::Point3d pt = best_X[n];
-                objectpoints.at<double>(0,n) = pt.x;
-                objectpoints.at<double>(1,n) = pt.y;
-                objectpoints.at<double>(2,n) = pt.z;
-            }
-            
-            std::cout << "Finding scale..." << std::endl;
-
-            double norm_t = cv::norm(best_transform.col(3));
-            best_transform(0,3) /= norm_t;
-            best_transform(1,3) /= norm_t;
-            best_transform(2,3) /= norm_t;
-
-            std::cout << best_transform << std::endl;
-
-            if(frame_nr == 0) {
-                init_scale = findScaleLinear(best_transform,
-                                            objectpoints,
-                                            imagepoints);
-                std::cout << "Scale First Frame: " << init_scale << std::endl;
-            } else {
-                current_scale = findScaleLinear(best_transform,
-                                                objectpoints,
-                                                imagepoints);
-
-                std::cout << "Scale First Frame: "   << init_scale << std::endl;
-                std::cout << "Scale Current Frame: " << current_scale << std::endl;
-
-                std::cout << "Rescale points..." << std::endl;
-                // You want to scale the points towards your init scale.
-                ratio_scale = init_scale / current_scale;
-                best_transform(0,3) *= ratio_scale;
-                best_transform(1,3) *= ratio_scale;
-                best_transform(2,3) *= ratio_scale;
-
-                // Clear current best_X and obtain it with new scaling
-                best_X.clear();
-
-                cv::Matx34d P1( 1, 0, 0, 0,
-                                0, 1, 0, 0,
-                                0, 0, 1, 0 );
-
-                TriangulatePoints(ppoints, cpoints, P1, best_transform, best_X);
 #if VERBOSE
-                std::cout << "Scaled found transformation\n" << best_transform << "\n" << std::endl;
+        log() << "Found points: " << std::endl;
+        for ( size_t x = 0; x < best_X.size(); x++ ) {
+            log() << best_X[x] << std::endl;
+        }
 #endif
-            }
 
+        cv::Matx44d transformationMatrix;
+        cv::vconcat( best_transform, cv::Matx14d(0, 0, 0, 1), transformationMatrix );
+
+        // best_X lives in the frame of the previous camera, bring it to the world
+        // frame so that later frames can be tracked against it.
+        cv::Matx44d previous_pose_inv = previous_pose.inv();
+        for ( size_t x = 0; x < best_X.size(); x++ ) {
+            cv::Matx41d X_w = previous_pose_inv * cv::Matx41d( best_X[x].x, best_X[x].y, best_X[x].z, 1.0 );
+            best_X[x] = cv::Point3d( X_w(0), X_w(1), X_w(2) );
+        }
+
+        // Update total points/cloud, descriptor n belongs to best_X[n]
 #if VERBOSE
-            std::cout << "Found points: " << std::endl;
-            for ( size_t x = 0; x < best_X.size(); x++ ) {
-                std::cout << best_X[x] << std::endl;
-            }
+        log() << "Storing points" << std::endl;
 #endif
+        total_3D_descriptors = cv::Mat( matches.size(), current_descriptors.size().width, current_descriptors.type());
+        for ( size_t matchnr = 0; matchnr < matches.size(); matchnr++) {
+             current_descriptors.row(matches[matchnr].queryIdx).copyTo( total_3D_descriptors.row(matchnr) );
+        }
 
-            // Update total points/cloud
-            std::cout << "Storing points" << std::endl;
-            total_3D_descriptors = cv::Mat( matches.size(), current_descriptors.size().width, current_descriptors.type());
-            for ( size_t matchnr = 0; matchnr < matches.size(); matchnr++) {
-                 total_3D_descriptors.row(matchnr) = current_descriptors.row(matchnr);
-            }
-            cloud_3D.add(best_X, total_3D_descriptors, frame_nr);
-            
-            // TODO BE SMART
+        // The previous frame is a keyframe too. When it is not one yet (the
+        // first frame, or a tracked frame after PnP failed) it is numbered
+        // here, before the current one, and gets its records below.
+        // previous_pose is its pose; after giving up relocalization, the
+        // last one known.
+        bool new_previous = previous_frame_nr < 0;
+        if ( new_previous ) {
+            previous_frame_nr = frame_nr++;
+        }
+        cv::Matx44d previous_keyframe_pose = previous_pose_inv.inv();
+
+        // Map point of each of best_X, new or fused into an existing one
+        std::vector<int> point_ids;
+        cloud_3D.add(best_X, total_3D_descriptors, frame_nr, point_ids);
+        for ( size_t n = 0; n < point_ids.size(); n++ ) {
+            cloud_3D.observations().add( point_ids[n], previous_frame_nr, matches[n].trainIdx );
+            cloud_3D.observations().add( point_ids[n], frame_nr, matches[n].queryIdx );
+        }
+        covisibility.update( previous_frame_nr, cloud_3D.observations() );
+        covisibility.update( frame_nr, cloud_3D.observations() );
+
+        velocity = transformationMatrix;
+        previous_pose = transformationMatrix * previous_pose;
+        cv::Matx34d first_pose = previous_keyframe_pose.get_minor<3, 4>(0, 0);
+        for ( size_t n = 0; n < point_ids.size(); n++ ) {
+            SetPointAngle( point_ids[n], ViewAngle( best_X[n], first_pose, previous_pose.get_minor<3, 4>(0, 0) ) );
+        }
 
-            //cv::Matx44d transformationMatrix( best_transform(0,0),best_transform(0,1),best_transform(0,2),best_transform(0,3),
-            //                                  best_transform(1,0),best_transform(1,1),best_transform(1,2),best_transform(1,3),
-            //                                  best_transform(2,0),best_transform(2,1),best_transform(2,2),best_transform(2,3),
-            //                                  0, 0, 0, 1 );
+#if LOCAL_BA
+        // Both frames observed the new points, ppoints/cpoints are ordered like best_X
+        if ( window.empty() || window.back().frame_nr != previous_frame_nr ) {
+            BAKeyframe first;
+            first.frame_nr = previous_frame_nr;
+            first.pose = previous_keyframe_pose;
+            window.push_back( first );
+        }
+        BAKeyframe keyframe;
+        keyframe.frame_nr = frame_nr;
+        keyframe.pose = previous_pose;
+        for ( size_t n = 0; n < best_X.size(); n++ ) {
+            window.back().point_ids.push_back( point_ids[n] );
+            window.back().measurements.push_back( ppoints[n] );
+            keyframe.point_ids.push_back( point_ids[n] );
+            keyframe.measurements.push_back( cpoints[n] );
+        }
+        window.push_back( keyframe );
+        while ( window.size() > BA_WINDOW ) {
+            window.pop_front();
+        }
+        LocalBundleAdjustment( bundleAdjuster, window, cloud_3D );
+        velocity = window.back().pose * previous_pose_inv;
+        previous_pose = window.back().pose;
+        if ( window.size() > 1 && window[window.size() - 2].frame_nr == previous_frame_nr ) {
+            previous_keyframe_pose = window[window.size() - 2].pose;
+        }
+#endif
+        // The previous frame's keyframe record sees the new points as well
+        cv::Mat previous_point_descriptors( matches.size(), previous_descriptors.cols, previous_descriptors.type() );
+        for ( size_t n = 0; n < matches.size(); n++ ) {
+            previous_descriptors.row(matches[n].trainIdx).copyTo( previous_point_descriptors.row(n) );
+        }
+        if ( new_previous ) {
+            MapKeyframe first;
+            first.frame_nr = previous_frame_nr;
+            first.pose = previous_keyframe_pose;
+            first.point_ids = point_ids;
+            first.descriptors = previous_point_descriptors;
+            KeypointPixels( previous_keypoints, first.pixels );
+#if POSE_GRAPH
+            UpdatePoseGraph( poseGraph, first.pose, previous_frame,
+                             previous_frame_nr, node_camPosition );
+#if LOOP_CLOSURE
+            if ( loop_closure ) {
+                BowVector bow;
+                vocabulary.transform( previous_descriptors, bow );
+                placeDatabase.add( bow );
+            }
+#endif
+#endif
+            mapKeyframes.push_back( first );
+            thumbnailIndex.add( previous_frame.img, mapKeyframes.size() - 1 );
+        } else if ( !mapKeyframes.empty() && mapKeyframes.back().frame_nr == previous_frame_nr ) {
+            MapKeyframe &last = mapKeyframes.back();
+            last.point_ids.insert( last.point_ids.end(), point_ids.begin(), point_ids.end() );
+            last.descriptors.push_back( previous_point_descriptors );
+            changedKeyframes.insert( mapKeyframes.size() - 1 );
+        }
+#if POSE_GRAPH
+        UpdatePoseGraph( poseGraph, previous_pose, current_frame, frame_nr, node_camPosition );
+#endif
+        MapKeyframe mapKeyframe;
+        mapKeyframe.frame_nr = frame_nr;
+        mapKeyframe.pose = previous_pose;
+        mapKeyframe.descriptors = total_3D_descriptors.clone();
+        KeypointPixels( current_keypoints, mapKeyframe.pixels );
+        for ( size_t n = 0; n < best_X.size(); n++ ) {
+            mapKeyframe.point_ids.push_back( point_ids[n] );
+        }
+        mapKeyframes.push_back( mapKeyframe );
+        thumbnailIndex.add( current_frame.img, mapKeyframes.size() - 1 );
+#if POSE_GRAPH
+#if LOOP_CLOSURE
+        if ( loop_closure ) {
+            DetectLoop( vocabulary, placeDatabase, mapKeyframes, poseGraph, keyframeTracker,
+                        current_descriptors, current_keypoints, cloud_3D, previous_pose );
+        }
+#endif
+        velocity = previous_pose * previous_pose_inv;
+#endif
 
-            cv::Matx44d transformationMatrix;
-            cv::vconcat( best_transform, cv::Matx14d(0, 0, 0, 1), transformationMatrix );
+        ReportPose( previous_pose );
 
-            robotPosition = transformationMatrix * robotPosition;
-            robotPosition(0,0) /= robotPosition(3,0);
-            robotPosition(1,0) /= robotPosition(3,0);
-            robotPosition(2,0) /= robotPosition(3,0);
-            robotPosition(3,0) /= robotPosition(3,0);
+        double roll, pitch, yaw;
+        determineRollPitchYaw(roll, pitch, yaw, best_transform);
+        //log() << "roll" << roll << "\n"
+        //          << "pitch" << pitch << "\n"
+        //          << "yaw" << yaw << std::endl;
 
-            std::cout << "Position: " << robotPosition.t() << std::endl;
+        // Assign current values to the previous ones, for the next iteration
+        previous_keypoints = current_keypoints;
+        previous_frame = current_frame;
+        previous_descriptors = current_descriptors;
+        previous_frame_nr = frame_nr;
 
-            double roll, pitch, yaw;
-            determineRollPitchYaw(roll, pitch, yaw, best_transform);
-            //std::cout << "roll" << roll << "\n"
-            //          << "pitch" << pitch << "\n"
-            //          << "yaw" << yaw << std::endl;
-
-            // Assign current values to the previous ones, for the next iteration
-            previous_keypoints = current_keypoints;
-            previous_frame = current_frame;
-            previous_descriptors = current_descriptors;
+        // Both frames of a frame-to-frame step are keyframes
+        keyframeManager.addKeyframe( frame_nr, previous_pose, point_ids, cpoints, best_X );
 
+        // The keypoints that did not become map points start candidate tracks
+        std::vector<bool> used( current_keypoints.size(), false );
+        for ( size_t m = 0; m < matches.size(); m++ ) {
+            used[matches[m].queryIdx] = true;
+        }
+        cv::Matx34d current_pose = previous_pose.get_minor<3, 4>(0, 0);
+        UpdateTracks( current_pose, used );
 
-            //epnp = true;
+        // The map now has points to track against
+        epnp = PNP_TRACKING;
+    }
+    // Only keyframes get here, once per keyframe is often enough
+    int expired = candidateTracks.expire( frame_nr );
+#if MAP_CULLING
+    // The keyframes that saw the culled points share fewer points now
+    std::vector<Observation> culled_observations;
+    int culled_3D = cloud_3D.cull( frame_nr, NULL, &culled_observations );
+    covisibility.removeObservations( culled_observations );
+#if VERBOSE
+    log() << "Culled " << culled_3D << " map points (" << cloud_3D.size() << " left)." << std::endl;
+#endif
+#endif
+#if VERBOSE
+    log() << "Expired " << expired << " candidate tracks (" << candidateTracks.size()
+              << " left)." << std::endl;
+#endif
+#if VISUALIZE
+    if ( viewer != NULL ) {
+        viewer->publish();
+    }
+#endif
+#if MAP_SYNC
+    if ( publish_map ) {
+        // The keyframes added since the last publish, and the older ones
+        // that moved or saw more points
+        for ( size_t k = published_keyframes; k < mapKeyframes.size(); k++ ) {
+            changedKeyframes.insert( k );
         }
-        frame_nr++;
+        published_keyframes = mapKeyframes.size();
+        for ( std::set<int>::const_iterator k = changedKeyframes.begin(); k != changedKeyframes.end(); k++ ) {
+            mapPublisher->setKeyframe( mapKeyframes[*k].frame_nr, mapKeyframes[*k].pose,
+                                      mapKeyframes[*k].point_ids );
+        }
+        int queued = mapPublisher->publish();
+#if VERBOSE
+        if ( queued > 0 ) {
+            log() << "Queued " << queued << " bytes of map changes." << std::endl;
+        }
+#endif
     }
-    // Main loop successful.
-    return true;
+#endif
+    changedKeyframes.clear();
+    if ( !mapSavePath.empty() && ++keyframes_since_save >= MAP_SAVE_INTERVAL ) {
+        if ( !SaveMap( mapSavePath, cloud_3D, mapKeyframes, thumbnailIndex ) ) {
+            std::cerr << "Can not save map " << mapSavePath << "." << std::endl;
+        }
+        keyframes_since_save = 0;
+    }
+    sharedState.publishMap( cloud_3D, frame_nr );
+    if ( !mapExportPrefix.empty() && !localize_only && ++keyframes_since_export >= mapExportInterval ) {
+        exporter.addMap( cloud_3D, frame_nr );
+        keyframes_since_export = 0;
+    }
+    frame_nr++;
+    return SESSION_RUNNING;
+}
+
+/**
+ * Save and send what is left of the map after the last step.
+ **/
+void VisualOdometry::finish() {
+    if ( !mapSavePath.empty() && !localize_only &&
+         !SaveMap( mapSavePath, cloud_3D, mapKeyframes, thumbnailIndex ) ) {
+        std::cerr << "Can not save map " << mapSavePath << "." << std::endl;
+    }
+#if MAP_SYNC
+    if ( publish_map ) {
+        mapPublisher->publish();
+        mapPublisher->close();
+        PrintSyncStatistics( "Map sync", mapPublisher->stats() );
+    }
+#endif
+    if ( !localize_only ) {
+        exporter.addMap( cloud_3D, frame_nr );
+    }
+    exporter.close();
 }
 
 double VisualOdometry::TestTriangulation(std::vector<cv::Point3d> &pcloud_pt3d, cv::Matx34d &P) {
@@ -815,127 +2072,12 @@ double VisualOdometry::TestTriangulation(std::vector<cv::Point3d> &pcloud_pt3d,
 
     double percentage = ((double)count / (double)pcloud_pt3d.size());
 //#if VERBOSE
-    std::cout << count << "/" << pcloud_pt3d.size() << " = " << percentage*100.0 << "% are in front of camera" << std::endl;
+    log() << count << "/" << pcloud_pt3d.size() << " = " << percentage*100.0 << "% are in front of camera" << std::endl;
 //#endif
     return percentage;
 
 }
 
-/**
- *  Input  - Pcam  -> (3x4) Camera position
- *         - X3D   -> (3xn) 3D points
- *         - Q     -> (2xn) Image points
- *         - K     -> (3x3) Camera calibration
- *
- *  Output - scale -> (1x1) Scaling factor
- *         - Pcam  -> (3x4) Scaled camera matrix
- **/
-double VisualOdometry::findScaleLinear(cv::Matx34d &Pcam,
-                                       cv::Mat &points3d,
-                                       cv::Mat &points2d) {
-
-    // Make 2d points homogeneous
-    cv::Mat points2d_homogeneous;
-    cv::vconcat(points2d,
-                cv::Mat::ones(1, points2d.size().width, points2d.type()),
-                points2d_homogeneous);
-
-    // Make 3d points homogeneous
-    cv::Mat points3d_homogeneous;
-    cv::vconcat(points3d,
-                cv::Mat::ones(1, points3d.size().width, points3d.type()),
-                points3d_homogeneous);
-    //std::cout << "Homogeneous points" << std::endl;
-    //std::cout << points2d_homogeneous << std::endl;
-
-    // Put 2d points in space K-1 x Q, form 3 x n matrix Qw
-    cv::Mat Qw = ((cv::Mat)K.inv()) * points2d_homogeneous;
-
-    // Project 3D points in image:
-    // 3xn = 3x4 * 4xn
-    //cv::Mat Pw = ((cv::Mat)Pcam) * points3d_homogeneous;
-    //Pw = ((cv::Mat)K) * Pw;
-
-    // Divide by homogeneous thingemajizz
-    //for ( int i = 0; i < Pw.size().width; i++) {
-    //    Pw.at<double>(0,i) = Pw.at<double>(0,i) / Pw.at<double>(2,i);
-    //    Pw.at<double>(1,i) = Pw.at<double>(1,i) / Pw.at<double>(2,i);
-    //    Pw.at<double>(2,i) = 1.0;
-    //}
-
-    double scale;
-    // Build matrix A and vector b
-    cv::Mat_<double> A ( 2 * points2d.size().width, 1 );
-    cv::Mat_<double> b ( 2 * points2d.size().width, 1 );
-
-    cv::Matx13d r1( Pcam(0,0), Pcam(0,1), Pcam(0,2) );
-    cv::Matx13d r2( Pcam(1,0), Pcam(1,1), Pcam(1,2) );
-    cv::Matx13d r3( Pcam(2,0), Pcam(2,1), Pcam(2,2) );
-
-    cv::Matx23d r12;
-    cv::vconcat(r1,r2,r12);
-
-    cv::Matx21d tu (Pcam(0,3), Pcam(1,3));
-
-    cv::Matx21d temp1, temp2;
-    for ( int i = 0; i < points3d.size().width; i++ ) {
-        //temp1 = ( Pcam(1:2,1:3) * X3D(1:3,i)  -
-        //         (Pcam(3,1:3) * X3D(1:3,i)) * Qw(1:2,i));
-        cv::Matx31d pointX ( points3d.at<double>(0,i),
-                             points3d.at<double>(1,i),
-                             points3d.at<double>(2,i) );
-        cv::Matx21d pointx ( Qw.at<double>(0,i),
-                             Qw.at<double>(1,i) );
-
-        cv::subtract( ((cv::Mat)r12) * (cv::Mat)pointX,
-                      (cv::Mat)pointx * ((cv::Mat)((cv::Mat)r3 * (cv::Mat)pointX)),
-                      temp1);
-
-        //temp2 = Pcam(3,4) * Qw(1:2,i) - Pcam(1:2,4);
-        cv::subtract( Pcam(2,3) * (cv::Mat)pointx, (cv::Mat)tu, temp2);
-
-        A.at<double>(i*2,   0) = temp2(0);
-        A.at<double>(i*2+1, 0) = temp2(1);
-        b.at<double>(i*2,   0) = temp1(0);
-        b.at<double>(i*2+1, 0) = temp1(1);
-    }
-
-    cv::Mat scalemat = ((A.t() * b) / (A.t() * A));
-    scale = scalemat.at<double>(0, 0);
-
-
-    // METHOD 4
-    double scale2;
-    cv::Mat_<double> A2 ( points2d.size().width, 1 );
-    cv::Mat_<double> b2 ( points2d.size().width, 1 );
-
-    for ( int i = 0; i < points3d.size().width; i++ ) {
-        cv::Matx31d pointX ( points3d.at<double>(0,i),
-                             points3d.at<double>(1,i),
-                             points3d.at<double>(2,i) );
-        cv::Point2d pointx ( Qw.at<double>(0,i),
-                             Qw.at<double>(1,i) );
-
-        //                  Pcam(2,4) * ( Qw(1,i)            / Qw(2,i))            - Pcam(1,4);
-        A2.at<double>(i, 0) = Pcam(1,3) * (pointx.x / pointx.y) - Pcam(0,3);
-
-        //                  (Pcam(1,1:3)-Pcam(2,1:3) *
-        //                  (Qw(1,i) / Qw(2,i))) * X3D(1:3,i)
-        cv::Mat temp = ((cv::Mat) r1 - ((cv::Mat) r2 * (pointx.x / pointx.y))) * (cv::Mat) pointX;
-        b2.at<double>(i, 0) = temp.at<double>(0,0);
-    }
-    scale2 = (double)((cv::Mat)((cv::Mat(A.t() * A)) * A.t() *b)).at<double>(0,0);
-
-    scalemat = ((A2.t() * b2) / (A2.t() * A2));
-    scale2 = scalemat.at<double>(0, 0);
-
-    std::cout << Pcam << std::endl;
-    std::cout << "Scale method 3: " << scale << std::endl;
-    std::cout << "Scale method 4: " << scale2 << std::endl;
-
-    return scale;
-}
-
 void VisualOdometry::determineRollPitchYaw(double &roll, double &pitch, double &yaw, cv::Matx34d RTMatrix)
 {
     // Order of rotation must be roll pitch yaw for this to work
@@ -944,18 +2086,138 @@ void VisualOdometry::determineRollPitchYaw(double &roll, double &pitch, double &
     yaw = atan2(RTMatrix(2,1), RTMatrix(2,2));
 }
 
-VisualOdometry::VisualOdometry(InputSource *source){
-
+/**
+ * Calibration and vocabulary come from resources, which must outlive the
+ * session. Takes ownership of source.
+ **/
+VisualOdometry::VisualOdometry(InputSource *source, const SharedResources &resources)
+    : K( resources.K ),
+      distortionCoeffs( resources.distortionCoeffs ),
+      vocabulary( resources.vocabulary ),
+      silent( NULL ),
+      robotPosition( 0.0, 0.0, 0.0, 1.0 ),
+      features( 60, 4, 1.0f ),
+      matcher( new cv::flann::LshIndexParams( 20, 10, 2 ) ),
+      pnpTracker( K ),
+      bundleAdjuster( K ),
+      keyframeTracker( K ),
+      placeDatabase( resources.vocabulary.wordCount() ),
+      candidateTracks( K, TRACK_LENGTH, TRACK_MAX_AGE, TRACK_MAX_COUNT ),
+      triangulator( K ),
+      compact_map( COMPACT_BLOCK_SIZE ),
+      scaleEstimator( K, SCALE_MEDIAN ),
+      P1( 1, 0, 0, 0,
+          0, 1, 0, 0,
+          0, 0, 1, 0 )
+{
     this->inputSource = source;
-
-    // Load calibrationmatrix K (and distortioncoefficients while we're at it).
-    this->validConfig = loadSettings( K, distortionCoeffs);
+    this->mapAgent = 0;
+    this->interactive = true;
+    this->headless = false;
+    this->trajectoryFormat = TRAJECTORY_TUM;
+    this->mapExportInterval = EXPORT_MAP_INTERVAL;
+    this->frames_read = 0;
+    this->loop_closure = LOOP_CLOSURE && POSE_GRAPH && resources.has_vocabulary;
+    this->mapPublisher = NULL;
+    this->publish_map = false;
+    this->published_keyframes = 0;
+    this->localize_only = false;
+#if VISUALIZE
+    this->viewer = NULL;
+#endif
 }
 
 VisualOdometry::~VisualOdometry(){
+    delete this->mapPublisher;
+#if VISUALIZE
+    delete this->viewer;
+#endif
     delete this->inputSource;
 }
 
+/**
+ * Localize against the map in load_path instead of building one (when not
+ * empty), and save the map to save_path (when not empty).
+ **/
+void VisualOdometry::setMapFiles(const std::string &load_path, const std::string &save_path)
+{
+    this->mapLoadPath = load_path;
+    this->mapSavePath = save_path;
+}
+
+/**
+ * Stream the map to the map server at address (see MapPublisher) as agent
+ * agent, when address is not empty.
+ **/
+void VisualOdometry::setMapServer(const std::string &address, int agent)
+{
+    this->mapServerAddress = address;
+    this->mapAgent = agent;
+}
+
+/**
+ * Write the trajectory to trajectory_path in trajectory_format (a
+ * TrajectoryFormat) and the map to map_prefix_<keyframe>.ply every
+ * map_interval keyframes, each when its path is not empty.
+ **/
+void VisualOdometry::setExport(const std::string &trajectory_path, int trajectory_format,
+                               const std::string &map_prefix, int map_interval)
+{
+    this->trajectoryPath = trajectory_path;
+    this->trajectoryFormat = trajectory_format;
+    this->mapExportPrefix = map_prefix;
+    this->mapExportInterval = map_interval > 0 ? map_interval : EXPORT_MAP_INTERVAL;
+}
+
+/**
+ * Publish the poses and the map in the shared memory object name (starting
+ * with a '/'), when it is not empty.
+ **/
+void VisualOdometry::setSharedState(const std::string &name)
+{
+    this->sharedStateName = name;
+}
+
+/**
+ * The pose (world to camera) of the current frame is known: tell, and add
+ * it to the trajectory.
+ **/
+void VisualOdometry::ReportPose(const cv::Matx44d &pose)
+{
+    robotPosition = CameraPosition( pose );
+    log() << "Position: " << robotPosition.t() << std::endl;
+    exporter.addPose( frames_read, pose );
+    sharedState.publishPose( frames_read, frame_nr, pose );
+}
+
+/**
+ * Whether to show the matches and the map in windows (on by default).
+ **/
+void VisualOdometry::setInteractive(bool interactive)
+{
+    this->interactive = interactive;
+}
+
+/**
+ * Headless: no windows, no waiting for keys and no console output but a
+ * summary at the end. setInteractive(true) afterwards brings the windows
+ * back, without slowing the loop down to key presses.
+ **/
+void VisualOdometry::setHeadless(bool headless)
+{
+    this->headless = headless;
+    this->interactive = !headless;
+}
+
+/**
+ * Where progress goes: the console, or nowhere when headless. Nothing is
+ * even formatted then, the stream has no buffer.
+ **/
+std::ostream &VisualOdometry::log()
+{
+    return headless ? silent : std::cout;
+}
+
 double VisualOdometry::distanceMeasure( KeyPointVector kpv1, KeyPointVector kpv2, DMMethod method = MEAN_SHIFT ) {
     assert( kpv1.size() == kpv2.size() );
         cv::Point2d mean_shift( 0, 0 );
@@ -979,68 +2241,128 @@ double VisualOdometry::distanceMeasure( KeyPointVector kpv1, KeyPointVector kpv2
     }
 }
 
+/**
+ * With one input the session runs here, with windows. With several (-n and
+ * -f repeated) they run side by side over a pool of -j threads (default one
+ * per processor), each saving to saveMap.<n> and streaming as agent + n.
+ **/
 int main( int argc, char* argv[] ) {
     if ( argc < 3 ) {
-        std::cerr << "Usage" << argv[0] << " '(-n robotIp|-f folderName)'" << std::endl;
+        std::cerr << "Usage" << argv[0] << " '(-n robotIp|-f folderName)... [-l loadMap] [-s saveMap] [-m mapServer] [-a agent] [-j threads] [-t tumPoses|-k kittiPoses] [-p plyPrefix] [-i keyframes] [-e sharedName] [--headless]'" << std::endl;
         return 1;
     }
 
-    VisualOdometry *visualOdometry;
-    InputSource *inputSource;
-
-    if ( std::string(argv[1]) == "-n" ) {
-        const std::string robotIp( argv[2] );
-        inputSource = new NaoInput( robotIp );
-    } else if ( std::string(argv[1]) == "-f" ) {
-        const std::string folderName(argv[2]);
-        inputSource = new FileInput( folderName );
-    } else {
+    std::vector<std::pair<std::string, std::string> > inputs;
+    std::string loadMap, saveMap, mapServer, trajectory, plyPrefix, sharedName;
+    int trajectoryFormat = TRAJECTORY_TUM;
+    int plyInterval = EXPORT_MAP_INTERVAL;
+    int agent = 0;
+    int threads = 0;
+    bool headless = false;
+    for ( int i = 1; i < argc; i += 2 ) {
+        const std::string option( argv[i] );
+        if ( option == "--headless" ) {
+            // The only option without a value
+            headless = true;
+            i--;
+        } else if ( i + 1 == argc ) {
+            std::cout << "Wrong use of command line arguments." << std::endl;
+            return 1;
+        } else if ( option == "-n" || option == "-f" ) {
+            inputs.push_back( std::make_pair( option, std::string(argv[i + 1]) ) );
+        } else if ( option == "-l" ) {
+            loadMap = argv[i + 1];
+        } else if ( option == "-s" ) {
+            saveMap = argv[i + 1];
+        } else if ( option == "-m" ) {
+            mapServer = argv[i + 1];
+        } else if ( option == "-a" ) {
+            agent = atoi( argv[i + 1] );
+        } else if ( option == "-j" ) {
+            threads = atoi( argv[i + 1] );
+        } else if ( option == "-t" || option == "-k" ) {
+            trajectory = argv[i + 1];
+            trajectoryFormat = option == "-t" ? TRAJECTORY_TUM : TRAJECTORY_KITTI;
+        } else if ( option == "-p" ) {
+            plyPrefix = argv[i + 1];
+        } else if ( option == "-i" ) {
+            plyInterval = atoi( argv[i + 1] );
+        } else if ( option == "-e" ) {
+            sharedName = argv[i + 1];
+        } else {
+            std::cout << "Wrong use of command line arguments." << std::endl;
+            return 1;
+        }
+    }
+    if ( inputs.empty() ) {
         std::cout << "Wrong use of command line arguments." << std::endl;
         return 1;
     }
 
-    visualOdometry = new VisualOdometry( inputSource );
-    if (visualOdometry->validConfig)
-    {
-        visualOdometry->MainLoop();
+    // Calibration (undistortion for the VGA frames of the robot) and
+    // vocabulary, loaded once for all sessions
+    SharedResources resources;
+    if ( !LoadSharedResources( resources, "vocabulary", cv::Size(640, 480) ) ) {
+        return 1;
+    }
+
+    std::vector<VisualOdometry *> sessions;
+    for ( size_t n = 0; n < inputs.size(); n++ ) {
+        InputSource *inputSource;
+        if ( inputs[n].first == "-n" ) {
+            inputSource = new NaoInput( inputs[n].second, &resources.undistortion );
+        } else {
+            inputSource = new FileInput( inputs[n].second );
+        }
+        VisualOdometry *visualOdometry = new VisualOdometry( inputSource, resources );
+        if ( inputs.size() == 1 ) {
+            visualOdometry->setMapFiles( loadMap, saveMap );
+            visualOdometry->setMapServer( mapServer, agent );
+            visualOdometry->setExport( trajectory, trajectoryFormat, plyPrefix, plyInterval );
+            visualOdometry->setSharedState( sharedName );
+        } else {
+            std::ostringstream path;
+            path << saveMap << "." << n;
+            visualOdometry->setMapFiles( loadMap, saveMap.empty() ? saveMap : path.str() );
+            visualOdometry->setMapServer( mapServer, agent + n );
+            std::ostringstream trajectoryPath, prefix;
+            trajectoryPath << trajectory << "." << n;
+            prefix << plyPrefix << "." << n;
+            visualOdometry->setExport( trajectory.empty() ? trajectory : trajectoryPath.str(), trajectoryFormat,
+                                       plyPrefix.empty() ? plyPrefix : prefix.str(), plyInterval );
+            std::ostringstream shared;
+            shared << sharedName << "." << n;
+            visualOdometry->setSharedState( sharedName.empty() ? sharedName : shared.str() );
+            visualOdometry->setInteractive( false );
+        }
+        if ( headless ) {
+            visualOdometry->setHeadless( true );
+        }
+        sessions.push_back( visualOdometry );
+    }
+
+    if ( sessions.size() == 1 ) {
+        bool success = sessions[0]->MainLoop();
+        delete sessions[0];
+        return success ? 0 : 1;
     }
-}
 
-void VisualOdometry::SolvePnPUsingRansac( std::vector<cv::DMatch> matches,
-                                          KeyPointVector current_keypoints,
-                                          std::vector<cv::Point3d> total_3D_pointcloud,
-                                          std::vector<cv::Point2d> &imagepoints,
-                                          std::vector<cv::Point3d> &objectpoints,
-                                          cv::Matx34d& transformationmatrix) {
-    cv::Point2d ip;
-    cv::Point3d op;
-    cv::Point3f op_float;
-    cv::Point2f ip_float;
-    std::vector<cv::Point3f> objectpoints_float;
-    std::vector<cv::Point2f> imagepoints_float;
-
-    for (int i = 0; i < matches.size(); i++) {
-        ip = current_keypoints[matches[i].queryIdx].pt;
-        ip_float = cv::Point2f( ip.x, ip.y );
-        op = total_3D_pointcloud[matches[i].trainIdx];
-        op_float = cv::Point3f( op.x, op.y, op.z );
-
-        imagepoints.push_back(ip);
-        imagepoints_float.push_back(ip_float);
-        objectpoints.push_back(op);
-        objectpoints_float.push_back(op_float);
-    }
-
-    cv::Mat rvec, tvec, inliers;
-    cv::solvePnPRansac(objectpoints_float, imagepoints_float, K, distortionCoeffs, rvec, tvec,
-                       false, 100, 8.0, 100, inliers);
-
-
-    // Construct matrix [R|t]
-    cv::Matx33d R;
-    cv::Rodrigues(rvec, R);
-    std::cout << R << std::endl;
-    cv::hconcat(R, tvec, transformationmatrix);
+    SessionHost host( threads );
+    for ( size_t n = 0; n < sessions.size(); n++ ) {
+        host.add( sessions[n] );
+    }
+    std::cout << "Running " << host.size() << " sessions on "
+              << host.threadCount() << " threads." << std::endl;
+    host.run();
+
+    bool success = true;
+    for ( int n = 0; n < host.size(); n++ ) {
+        std::cout << "Session " << n << " (" << inputs[n].second << "): " << host.steps(n) << " frames, "
+                  << ( host.status(n) == SESSION_FAILED ? "failed" : "done" ) << ", "
+                  << host.busyTime(n) << " s busy." << std::endl;
+        success = success && host.status(n) != SESSION_FAILED;
+    }
+    return success ? 0 : 1;
 }
 
 /**
@@ -1135,30 +2457,223 @@ void VisualOdometry::TriangulatePoints(std::vector<cv::Point2d> &previous_points
 #endif
 }
 
-void VisualOdometry::DetermineNewOutliers(std::vector<cv::DMatch> &matches,
-                                          std::vector<cv::Point2d> &current_points,
-                                          cv::Mat &current_descriptors,
-                                          std::vector<cv::Point2d> &current_outlier_points_2d,
-                                          cv::Mat &current_outlier_descriptors_2d)
+/**
+ * Continue the candidate tracks with the keypoints of keyframe frame_nr
+ * that are not used as map points (used[n] false), best descriptor matches
+ * first, and start new tracks with the keypoints that continue none.
+ **/
+void VisualOdometry::ExtendTracks(TrackStore &tracks, int frame_nr, const cv::Matx34d &pose,
+                                  const KeyPointVector &keypoints, const cv::Mat &descriptors,
+                                  const std::vector<bool> &used)
+{
+    tracks.addFrame( frame_nr, pose );
+
+    std::vector<int> free_keypoints;
+    cv::Mat free_descriptors;
+    for ( size_t n = 0; n < keypoints.size(); n++ ) {
+        if ( !used[n] ) {
+            free_keypoints.push_back( n );
+            free_descriptors.push_back( descriptors.row(n) );
+        }
+    }
+
+    std::vector<bool> extended( free_keypoints.size(), false );
+    if ( tracks.size() > 0 && !free_keypoints.empty() ) {
+        std::vector<cv::DMatch> track_matches;
+        matcher.match( free_descriptors, tracks.descriptors(), track_matches );
+        // A track takes one keypoint per keyframe, the closest match
+        std::sort( track_matches.begin(), track_matches.end() );
+        for ( size_t m = 0; m < track_matches.size(); m++ ) {
+            int n = track_matches[m].queryIdx;
+            if ( track_matches[m].distance <= TRACK_MAX_DISTANCE &&
+                 tracks.extend( track_matches[m].trainIdx, frame_nr, free_keypoints[n],
+                                keypoints[free_keypoints[n]].pt, free_descriptors.row(n),
+                                TRACK_MAX_EPIPOLAR ) ) {
+                extended[n] = true;
+            }
+        }
+    }
+    for ( size_t n = 0; n < free_keypoints.size(); n++ ) {
+        if ( !extended[n] ) {
+            tracks.add( frame_nr, free_keypoints[n], keypoints[free_keypoints[n]].pt,
+                        free_descriptors.row(n) );
+        }
+    }
+}
+
+/**
+ * Triangulate the tracks seen in keyframe frame_nr that have enough
+ * parallax from all their sightings kept, and move those in front of all
+ * cameras that reproject well into the map with an observation per
+ * sighting. The others are dropped, they do not add up. point_ids, pixels
+ * and point_descriptors get the new map points as seen in frame_nr.
+ * Returns the number of map points made.
+ **/
+int VisualOdometry::PromoteTracks(TrackStore &tracks, int frame_nr, Cloud<cv::Point3d> &cloud,
+                                  std::vector<int> &point_ids, std::vector<cv::Point2d> &pixels,
+                                  cv::Mat &point_descriptors)
 {
-    bool outlier;
-
-    // Loop over all points in previous to find ones that matches does not refer to.
-    for (int i = 0 ; i < current_points.size(); i++) {
-        outlier = true;
-        for(int j = 0; j < matches.size(); j++) {
-            if (matches[j].queryIdx == i)  {
-                outlier = false;
-                break;
+    std::vector<int> ready;
+    tracks.promotable( frame_nr, TRACK_MIN_PARALLAX * CV_PI / 180.0, ready );
+    if ( ready.empty() ) {
+        return 0;
+    }
+
+    triangulator.clear();
+    for ( size_t r = 0; r < ready.size(); r++ ) {
+        triangulator.addPoint();
+        for ( int i = 0; i < tracks.observationCount( ready[r] ); i++ ) {
+            const TrackObservation &sighting = tracks.observation( ready[r], i );
+            cv::Matx34d pose;
+            if ( tracks.framePose( sighting.frame_nr, pose ) ) {
+                triangulator.addView( pose, sighting.pixel );
             }
         }
-        if (outlier) {
-            current_outlier_points_2d.push_back( current_points[i] );
-            if(current_outlier_descriptors_2d.empty()) {
-                current_outlier_descriptors_2d = current_descriptors.row(i);
-            } else {
-                cv::vconcat(current_outlier_descriptors_2d, current_descriptors.row(i), current_outlier_descriptors_2d );
+    }
+    triangulator.solve();
+
+    cv::Mat track_descriptors = tracks.descriptors();
+    std::vector<int> promoted;      // index in ready
+    std::vector<cv::Point3d> X;
+    cv::Mat X_descriptors;
+    for ( size_t r = 0; r < ready.size(); r++ ) {
+        if ( triangulator.valid(r) && triangulator.error(r) <= TRIANGULATION_MAX_ERROR ) {
+            promoted.push_back( r );
+            X.push_back( triangulator.point(r) );
+            X_descriptors.push_back( track_descriptors.row( ready[r] ) );
+        }
+    }
+
+    std::vector<int> ids;
+    if ( !X.empty() ) {
+        cloud.add( X, X_descriptors, frame_nr, ids );
+    }
+    for ( size_t n = 0; n < ids.size(); n++ ) {
+        int slot = ready[promoted[n]];
+        SetPointAngle( ids[n], triangulator.angle( promoted[n] ) );
+        for ( int i = 0; i < tracks.observationCount( slot ); i++ ) {
+            const TrackObservation &sighting = tracks.observation( slot, i );
+            cloud.observations().add( ids[n], sighting.frame_nr, sighting.keypoint );
+        }
+        point_ids.push_back( ids[n] );
+        pixels.push_back( tracks.latest( slot ).pixel );
+        point_descriptors.push_back( X_descriptors.row(n) );
+    }
+    tracks.removeTracks( ready );
+    return ids.size();
+}
+
+/**
+ * Widest angle between two views the position of map point id was
+ * triangulated from, in radians.
+ **/
+void VisualOdometry::SetPointAngle(int id, double angle)
+{
+    if ( id >= (int) point_angles.size() ) {
+        point_angles.resize( cloud_3D.id_count() > id ? cloud_3D.id_count() : id + 1, 0.0f );
+    }
+    point_angles[id] = angle;
+}
+
+/**
+ * Triangulate the map points in point_ids, just observed by the current
+ * keyframe, again from all the keyframes that saw them, when the current
+ * keyframe widens the widest angle they were triangulated from by
+ * RETRIANGULATE_GAIN or more. Positions that do not reproject within
+ * TRIANGULATION_MAX_ERROR are left alone. Returns the number of points moved.
+ **/
+int VisualOdometry::RetriangulatePoints(const std::vector<int> &point_ids)
+{
+    const MapKeyframe *current = FindKeyframe( mapKeyframes, frame_nr );
+    if ( current == 0 || current->pixels.empty() ) {
+        return 0;
+    }
+    cv::Matx34d current_pose = current->pose.get_minor<3, 4>(0, 0);
+    const ObservationTable &observations = cloud_3D.observations();
+    double gain = RETRIANGULATE_GAIN * CV_PI / 180.0;
+
+    triangulator.clear();
+    std::vector<int> ids;
+    std::vector<cv::Matx34d> poses;
+    std::vector<cv::Point2d> views;
+    for ( size_t n = 0; n < point_ids.size(); n++ ) {
+        int id = point_ids[n];
+        if ( !cloud_3D.contains(id) ) {
+            continue;
+        }
+        cv::Point3d X = cloud_3D.get_point(id);
+        double recorded = id < (int) point_angles.size() ? point_angles[id] : 0.0;
+        double widest = 0.0;
+        poses.clear();
+        views.clear();
+        for ( int r = observations.firstOfPoint(id); r >= 0; r = observations.nextOfPoint(r) ) {
+            const Observation &observation = observations.get(r);
+            const MapKeyframe *keyframe = FindKeyframe( mapKeyframes, observation.frame_nr );
+            if ( keyframe == 0 || observation.keypoint < 0 ||
+                 observation.keypoint >= (int) keyframe->pixels.size() ) {
+                continue;
             }
+            cv::Matx34d pose = keyframe->pose.get_minor<3, 4>(0, 0);
+            poses.push_back( pose );
+            views.push_back( keyframe->pixels[observation.keypoint] );
+            widest = std::max( widest, ViewAngle( X, current_pose, pose ) );
+        }
+        if ( poses.size() < 2 || widest < recorded + gain ) {
+            continue;
         }
+        triangulator.addPoint();
+        for ( size_t v = 0; v < poses.size(); v++ ) {
+            triangulator.addView( poses[v], views[v] );
+        }
+        ids.push_back( id );
+    }
+    if ( ids.empty() ) {
+        return 0;
     }
+    triangulator.solve();
+
+    int moved = 0;
+    for ( size_t n = 0; n < ids.size(); n++ ) {
+        double recorded = ids[n] < (int) point_angles.size() ? point_angles[ids[n]] : 0.0;
+        if ( triangulator.valid(n) && triangulator.error(n) <= TRIANGULATION_MAX_ERROR &&
+             triangulator.angle(n) > recorded ) {
+            cloud_3D.set_point( ids[n], triangulator.point(n) );
+            SetPointAngle( ids[n], triangulator.angle(n) );
+            moved++;
+        }
+    }
+    return moved;
+}
+
+/**
+ * Candidate tracks for the current keyframe at pose: extend them, and add
+ * the points promoted to the map to what the keyframe observed.
+ **/
+void VisualOdometry::UpdateTracks(const cv::Matx34d &pose, const std::vector<bool> &used)
+{
+    ExtendTracks( candidateTracks, frame_nr, pose, current_keypoints, current_descriptors, used );
+
+    std::vector<int> promoted_ids;
+    std::vector<cv::Point2d> promoted_pixels;
+    cv::Mat promoted_descriptors;
+    int promoted = PromoteTracks( candidateTracks, frame_nr, cloud_3D,
+                                  promoted_ids, promoted_pixels, promoted_descriptors );
+    if ( promoted == 0 ) {
+        return;
+    }
+    MapKeyframe &keyframe = mapKeyframes.back();
+    keyframe.point_ids.insert( keyframe.point_ids.end(), promoted_ids.begin(), promoted_ids.end() );
+    keyframe.descriptors.push_back( promoted_descriptors );
+#if LOCAL_BA
+    if ( !window.empty() && window.back().frame_nr == frame_nr ) {
+        window.back().point_ids.insert( window.back().point_ids.end(),
+                                        promoted_ids.begin(), promoted_ids.end() );
+        window.back().measurements.insert( window.back().measurements.end(),
+                                           promoted_pixels.begin(), promoted_pixels.end() );
+    }
+#endif
+    covisibility.update( frame_nr, cloud_3D.observations() );
+#if VERBOSE
+    log() << "Promoted " << promoted << " candidate tracks to map points." << std::endl;
+#endif
 }
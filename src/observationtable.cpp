@@ -0,0 +1,239 @@
+#include "observationtable.hpp"
+
+ObservationTable::ObservationTable()
+{
+    this->count = 0;
+}
+
+void ObservationTable::clear()
+{
+    records.clear();
+    point_next.clear();
+    point_previous.clear();
+    frame_next.clear();
+    frame_previous.clear();
+    free_records.clear();
+    point_heads.clear();
+    point_counts.clear();
+    frame_heads.clear();
+    frame_counts.clear();
+    count = 0;
+}
+
+void ObservationTable::grow(std::vector<int> &heads, std::vector<int> &counts, int index)
+{
+    if ( index >= (int) heads.size() ) {
+        int n = index + 1 > 2 * (int) heads.size() ? index + 1 : 2 * heads.size();
+        heads.resize( n, -1 );
+        counts.resize( n, 0 );
+    }
+}
+
+/**
+ * Record that frame_nr sees point_id as keypoint. A frame sees a point at
+ * most once, adding it again only updates the keypoint. Returns the record.
+ **/
+int ObservationTable::add(int point_id, int frame_nr, int keypoint)
+{
+    if ( point_id < 0 || frame_nr < 0 ) {
+        return -1;
+    }
+    int existing = find( point_id, frame_nr );
+    if ( existing >= 0 ) {
+        records[existing].keypoint = keypoint;
+        return existing;
+    }
+    grow( point_heads, point_counts, point_id );
+    grow( frame_heads, frame_counts, frame_nr );
+
+    int r;
+    if ( !free_records.empty() ) {
+        r = free_records.back();
+        free_records.pop_back();
+    } else {
+        r = records.size();
+        records.resize( r + 1 );
+        point_next.resize( r + 1 );
+        point_previous.resize( r + 1 );
+        frame_next.resize( r + 1 );
+        frame_previous.resize( r + 1 );
+    }
+    records[r].point_id = point_id;
+    records[r].frame_nr = frame_nr;
+    records[r].keypoint = keypoint;
+
+    point_previous[r] = -1;
+    point_next[r] = point_heads[point_id];
+    if ( point_next[r] >= 0 ) {
+        point_previous[point_next[r]] = r;
+    }
+    point_heads[point_id] = r;
+    point_counts[point_id]++;
+
+    frame_previous[r] = -1;
+    frame_next[r] = frame_heads[frame_nr];
+    if ( frame_next[r] >= 0 ) {
+        frame_previous[frame_next[r]] = r;
+    }
+    frame_heads[frame_nr] = r;
+    frame_counts[frame_nr]++;
+
+    count++;
+    return r;
+}
+
+/**
+ * Take a record off both lists and put it on the free list.
+ **/
+void ObservationTable::unlink(int r)
+{
+    const Observation &o = records[r];
+    if ( point_previous[r] >= 0 ) {
+        point_next[point_previous[r]] = point_next[r];
+    } else {
+        point_heads[o.point_id] = point_next[r];
+    }
+    if ( point_next[r] >= 0 ) {
+        point_previous[point_next[r]] = point_previous[r];
+    }
+    point_counts[o.point_id]--;
+
+    if ( frame_previous[r] >= 0 ) {
+        frame_next[frame_previous[r]] = frame_next[r];
+    } else {
+        frame_heads[o.frame_nr] = frame_next[r];
+    }
+    if ( frame_next[r] >= 0 ) {
+        frame_previous[frame_next[r]] = frame_previous[r];
+    }
+    frame_counts[o.frame_nr]--;
+
+    records[r].point_id = -1;
+    free_records.push_back( r );
+    count--;
+}
+
+bool ObservationTable::remove(int point_id, int frame_nr)
+{
+    int r = find( point_id, frame_nr );
+    if ( r < 0 ) {
+        return false;
+    }
+    unlink( r );
+    return true;
+}
+
+void ObservationTable::removePoint(int point_id)
+{
+    int r = firstOfPoint( point_id );
+    while ( r >= 0 ) {
+        int next = point_next[r];
+        unlink( r );
+        r = next;
+    }
+}
+
+void ObservationTable::removeFrame(int frame_nr)
+{
+    int r = firstOfFrame( frame_nr );
+    while ( r >= 0 ) {
+        int next = frame_next[r];
+        unlink( r );
+        r = next;
+    }
+}
+
+int ObservationTable::size() const
+{
+    return count;
+}
+
+/**
+ * Number of frames that see a point.
+ **/
+int ObservationTable::observationCount(int point_id) const
+{
+    return point_id >= 0 && point_id < (int) point_counts.size() ? point_counts[point_id] : 0;
+}
+
+/**
+ * Number of points a frame sees.
+ **/
+int ObservationTable::frameCount(int frame_nr) const
+{
+    return frame_nr >= 0 && frame_nr < (int) frame_counts.size() ? frame_counts[frame_nr] : 0;
+}
+
+/**
+ * Record of point_id in frame_nr, -1 if the frame does not see it. Walks
+ * the shorter of the two lists.
+ **/
+int ObservationTable::find(int point_id, int frame_nr) const
+{
+    if ( observationCount(point_id) <= frameCount(frame_nr) ) {
+        for ( int r = firstOfPoint(point_id); r >= 0; r = point_next[r] ) {
+            if ( records[r].frame_nr == frame_nr ) {
+                return r;
+            }
+        }
+    } else {
+        for ( int r = firstOfFrame(frame_nr); r >= 0; r = frame_next[r] ) {
+            if ( records[r].point_id == point_id ) {
+                return r;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Keypoint index of point_id in frame_nr, -1 if the frame does not see it.
+ **/
+int ObservationTable::keypoint(int point_id, int frame_nr) const
+{
+    int r = find( point_id, frame_nr );
+    return r >= 0 ? records[r].keypoint : -1;
+}
+
+int ObservationTable::firstOfPoint(int point_id) const
+{
+    return point_id >= 0 && point_id < (int) point_heads.size() ? point_heads[point_id] : -1;
+}
+
+int ObservationTable::nextOfPoint(int record) const
+{
+    return point_next[record];
+}
+
+int ObservationTable::firstOfFrame(int frame_nr) const
+{
+    return frame_nr >= 0 && frame_nr < (int) frame_heads.size() ? frame_heads[frame_nr] : -1;
+}
+
+int ObservationTable::nextOfFrame(int record) const
+{
+    return frame_next[record];
+}
+
+const Observation &ObservationTable::get(int record) const
+{
+    return records[record];
+}
+
+void ObservationTable::pointObservations(int point_id, std::vector<Observation> &observations) const
+{
+    observations.clear();
+    observations.reserve( observationCount(point_id) );
+    for ( int r = firstOfPoint(point_id); r >= 0; r = point_next[r] ) {
+        observations.push_back( records[r] );
+    }
+}
+
+void ObservationTable::framePoints(int frame_nr, std::vector<int> &point_ids) const
+{
+    point_ids.clear();
+    point_ids.reserve( frameCount(frame_nr) );
+    for ( int r = firstOfFrame(frame_nr); r >= 0; r = frame_next[r] ) {
+        point_ids.push_back( records[r].point_id );
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef OBSERVATIONTABLE_H
+#define OBSERVATIONTABLE_H
+
+#include <vector>
+
+/**
+ * Map point point_id was seen in frame frame_nr as keypoint keypoint.
+ **/
+typedef struct
+{
+    int point_id;
+    int frame_nr;
+    int keypoint;
+} Observation;
+
+/**
+ * Which frames see which map points, in both directions.
+ *
+ * All observations live in one pool of records. Every record is on two
+ * doubly linked lists, one through the observations of its point and one
+ * through those of its frame, with the list heads and lengths in tables
+ * indexed by point id and by frame number. Reaching either list is a table
+ * lookup, adding or unlinking a record is constant time, and freed records
+ * are reused. Iterate without copying:
+ *
+ *     for ( int r = table.firstOfPoint(id); r >= 0; r = table.nextOfPoint(r) ) {
+ *         const Observation &o = table.get(r);
+ *     }
+ **/
+class ObservationTable
+{
+    std::vector<Observation> records;
+    std::vector<int> point_next, point_previous;
+    std::vector<int> frame_next, frame_previous;
+    std::vector<int> free_records;
+
+    std::vector<int> point_heads, point_counts;
+    std::vector<int> frame_heads, frame_counts;
+
+    int count;
+
+    static void grow(std::vector<int> &heads, std::vector<int> &counts, int index);
+    void unlink(int record);
+
+public:
+    ObservationTable();
+
+    void clear();
+    int add(int point_id, int frame_nr, int keypoint);
+    bool remove(int point_id, int frame_nr);
+    void removePoint(int point_id);
+    void removeFrame(int frame_nr);
+
+    int size() const;
+    int observationCount(int point_id) const;
+    int frameCount(int frame_nr) const;
+    int find(int point_id, int frame_nr) const;
+    int keypoint(int point_id, int frame_nr) const;
+
+    int firstOfPoint(int point_id) const;
+    int nextOfPoint(int record) const;
+    int firstOfFrame(int frame_nr) const;
+    int nextOfFrame(int record) const;
+    const Observation &get(int record) const;
+
+    void pointObservations(int point_id, std::vector<Observation> &observations) const;
+    void framePoints(int frame_nr, std::vector<int> &point_ids) const;
+};
+
+#endif // OBSERVATIONTABLE_H
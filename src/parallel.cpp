@@ -0,0 +1,117 @@
+#include "parallel.hpp"
+#include "threadpool.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define MAX_THREADS 32
+// Below this many items per thread, spawning threads costs more than it saves
+#define MIN_CHUNK 64
+
+typedef struct
+{
+    RangeFunction function;
+    void *context;
+    int begin;
+    int end;
+} Chunk;
+
+static void *runChunk(void *argument)
+{
+    Chunk *chunk = (Chunk *) argument;
+    chunk->function(chunk->context, chunk->begin, chunk->end);
+    return NULL;
+}
+
+typedef struct
+{
+    Chunk chunk;
+    volatile int *remaining;
+} PoolChunk;
+
+static void runPoolChunk(void *argument)
+{
+    PoolChunk *chunk = (PoolChunk *) argument;
+    runChunk(&chunk->chunk);
+    __sync_fetch_and_sub(chunk->remaining, 1);
+}
+
+/**
+ * parallelFor inside a pool task: queue the chunks on the pool instead of
+ * starting threads. The caller runs what is not stolen itself, and waits
+ * for the rest without picking up unrelated tasks.
+ **/
+static void poolFor(ThreadPool *pool, Chunk *chunks, int threads)
+{
+    PoolChunk pool_chunks[MAX_THREADS];
+    volatile int remaining = threads - 1;
+
+    for ( int i = 1; i < threads; i++ ) {
+        pool_chunks[i].chunk = chunks[i];
+        pool_chunks[i].remaining = &remaining;
+        pool->submit(runPoolChunk, &pool_chunks[i]);
+    }
+    runChunk(&chunks[0]);
+    while ( __sync_fetch_and_add( &remaining, 0 ) > 0 ) {
+        if ( !pool->runLocal(runPoolChunk) ) {
+            sched_yield();
+        }
+    }
+}
+
+void parallelFor(int n, RangeFunction function, void *context, int threads)
+{
+    if ( n <= 0 ) {
+        return;
+    }
+    if ( threads > MAX_THREADS ) {
+        threads = MAX_THREADS;
+    }
+    if ( threads > n / MIN_CHUNK ) {
+        threads = n / MIN_CHUNK;
+    }
+    ThreadPool *pool = ThreadPool::current();
+    if ( pool != NULL && threads > pool->size() ) {
+        threads = pool->size();
+    }
+    if ( threads <= 1 ) {
+        function(context, 0, n);
+        return;
+    }
+
+    Chunk chunks[MAX_THREADS];
+    pthread_t workers[MAX_THREADS];
+    bool started[MAX_THREADS];
+
+    for ( int i = 0; i < threads; i++ ) {
+        chunks[i].function = function;
+        chunks[i].context = context;
+        chunks[i].begin = (int) ((long long) n * i / threads);
+        chunks[i].end = (int) ((long long) n * (i + 1) / threads);
+    }
+    if ( pool != NULL ) {
+        poolFor(pool, chunks, threads);
+        return;
+    }
+
+    for ( int i = 1; i < threads; i++ ) {
+        started[i] = pthread_create(&workers[i], NULL, runChunk, &chunks[i]) == 0;
+        if ( !started[i] ) {
+            // Could not get a thread, do it here instead
+            runChunk(&chunks[i]);
+        }
+    }
+    runChunk(&chunks[0]);
+    for ( int i = 1; i < threads; i++ ) {
+        if ( started[i] ) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+}
+
+int defaultThreadCount()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
@@ -0,0 +1,21 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/**
+ * Work function for parallelFor: handle items [begin, end) of a job.
+ * context is passed through untouched.
+ **/
+typedef void (*RangeFunction)(void *context, int begin, int end);
+
+/**
+ * Split the range [0, n) into about equal chunks and process them on up to
+ * threads threads (the calling thread takes the first chunk). Returns when
+ * all chunks are done. With threads <= 1 or tiny ranges everything runs on
+ * the calling thread. Called from a ThreadPool task, the chunks run on that
+ * pool (at most one per worker) instead of on threads of their own.
+ **/
+void parallelFor(int n, RangeFunction function, void *context, int threads);
+
+int defaultThreadCount();
+
+#endif // PARALLEL_H
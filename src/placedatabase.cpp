@@ -0,0 +1,142 @@
+#include "placedatabase.hpp"
+
+#include <algorithm>
+
+static bool higherScore(const PlaceCandidate &a, const PlaceCandidate &b)
+{
+    return a.score > b.score;
+}
+
+PlaceDatabase::PlaceDatabase(int words)
+{
+    inverted.resize( words );
+}
+
+void PlaceDatabase::clear()
+{
+    for ( size_t w = 0; w < inverted.size(); w++ ) {
+        inverted[w].clear();
+    }
+    entries.clear();
+}
+
+/**
+ * Add a keyframe, returns its entry number (entries are numbered in order).
+ **/
+int PlaceDatabase::add(const BowVector &bow)
+{
+    int entry = entries.size();
+    entries.push_back( bow );
+    scores.push_back( 0.0f );
+    for ( size_t i = 0; i < bow.size(); i++ ) {
+        if ( bow[i].first >= (int) inverted.size() ) {
+            inverted.resize( bow[i].first + 1 );
+        }
+        inverted[bow[i].first].push_back( std::make_pair( entry, bow[i].second ) );
+    }
+    return entry;
+}
+
+/**
+ * Best scoring entries older than max_entry, best first. Use max_entry to
+ * leave out the recent keyframes, which always look alike.
+ **/
+int PlaceDatabase::query(const BowVector &bow, int max_entry, int max_results,
+                         std::vector<PlaceCandidate> &results)
+{
+    results.clear();
+    touched.clear();
+
+    for ( size_t i = 0; i < bow.size(); i++ ) {
+        int w = bow[i].first;
+        if ( w >= (int) inverted.size() ) {
+            continue;
+        }
+        float v = bow[i].second;
+        const std::vector<std::pair<int, float> > &postings = inverted[w];
+        // Postings are in entry order, so the old ones come first
+        for ( size_t p = 0; p < postings.size() && postings[p].first < max_entry; p++ ) {
+            int entry = postings[p].first;
+            if ( scores[entry] == 0.0f ) {
+                touched.push_back( entry );
+            }
+            scores[entry] += std::min( v, postings[p].second );
+        }
+    }
+
+    for ( size_t i = 0; i < touched.size(); i++ ) {
+        PlaceCandidate candidate;
+        candidate.entry = touched[i];
+        candidate.score = scores[touched[i]];
+        results.push_back( candidate );
+        scores[touched[i]] = 0.0f;
+    }
+
+    if ( (int) results.size() > max_results ) {
+        std::partial_sort( results.begin(), results.begin() + max_results, results.end(), higherScore );
+        results.resize( max_results );
+    } else {
+        std::sort( results.begin(), results.end(), higherScore );
+    }
+    return results.size();
+}
+
+const BowVector &PlaceDatabase::get(int entry) const
+{
+    return entries[entry];
+}
+
+int PlaceDatabase::size() const
+{
+    return entries.size();
+}
+
+float BowScore(const BowVector &a, const BowVector &b)
+{
+    float score = 0.0f;
+    size_t i = 0, j = 0;
+    while ( i < a.size() && j < b.size() ) {
+        if ( a[i].first < b[j].first ) {
+            i++;
+        } else if ( a[i].first > b[j].first ) {
+            j++;
+        } else {
+            score += std::min( a[i].second, b[j].second );
+            i++;
+            j++;
+        }
+    }
+    return score;
+}
+
+int MatchBinaryDescriptors(const cv::Mat &query, const cv::Mat &train,
+                           int max_distance, float ratio,
+                           std::vector<cv::DMatch> &matches)
+{
+    matches.clear();
+    if ( query.empty() || train.empty() || query.cols != train.cols ) {
+        return 0;
+    }
+    int bytes = query.cols;
+    for ( int q = 0; q < query.rows; q++ ) {
+        const unsigned char *d = query.ptr<unsigned char>(q);
+        int best = -1;
+        int best_distance = bytes * 8 + 1;
+        int second_distance = bytes * 8 + 1;
+        for ( int t = 0; t < train.rows; t++ ) {
+            int distance = HammingDistance( d, train.ptr<unsigned char>(t), bytes );
+            if ( distance < best_distance ) {
+                second_distance = best_distance;
+                best_distance = distance;
+                best = t;
+            } else if ( distance < second_distance ) {
+                second_distance = distance;
+            }
+        }
+        if ( best >= 0 && best_distance <= max_distance &&
+             best_distance < ratio * second_distance ) {
+            matches.push_back( cv::DMatch( q, best, (float) best_distance ) );
+        }
+    }
+    return matches.size();
+}
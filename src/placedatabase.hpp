@@ -0,0 +1,59 @@
+#ifndef PLACEDATABASE_H
+#define PLACEDATABASE_H
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include <vector>
+
+#include "vocabulary.hpp"
+
+typedef struct
+{
+    int entry;
+    float score;
+} PlaceCandidate;
+
+/**
+ * Inverted index from words to the keyframes (entries) that contain them.
+ *
+ * A query only visits the entries that share a word with the query vector, and
+ * scores them with the L1 similarity sum(min(v_i, w_i)) of the normalized bag
+ * of words vectors (1 for identical vectors, 0 for disjoint ones). Score
+ * buffers are kept between queries.
+ **/
+class PlaceDatabase
+{
+    std::vector<std::vector<std::pair<int, float> > > inverted;
+    std::vector<BowVector> entries;
+
+    std::vector<float> scores;
+    std::vector<int> touched;
+
+public:
+    PlaceDatabase(int words = 0);
+
+    void clear();
+    int add(const BowVector &bow);
+    int query(const BowVector &bow, int max_entry, int max_results,
+              std::vector<PlaceCandidate> &results);
+
+    const BowVector &get(int entry) const;
+    int size() const;
+};
+
+/**
+ * Similarity of two normalized bag of words vectors, in [0, 1].
+ **/
+float BowScore(const BowVector &a, const BowVector &b);
+
+/**
+ * Brute force Hamming matching of binary descriptors with a ratio test:
+ * for every query row the nearest train row, if it is closer than
+ * max_distance and clearly closer than the second nearest.
+ **/
+int MatchBinaryDescriptors(const cv::Mat &query, const cv::Mat &train,
+                           int max_distance, float ratio,
+                           std::vector<cv::DMatch> &matches);
+
+#endif // PLACEDATABASE_H
@@ -0,0 +1,532 @@
+#include "pnptracker.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+#define PNP_EPSILON 1e-12
+
+/**
+ * Real roots of a*x^3 + b*x^2 + c*x + d, returns their number.
+ **/
+static int solveCubic(double a, double b, double c, double d, double roots[3])
+{
+    if ( fabs(a) < PNP_EPSILON ) {
+        // Quadratic
+        if ( fabs(b) < PNP_EPSILON ) {
+            if ( fabs(c) < PNP_EPSILON ) {
+                return 0;
+            }
+            roots[0] = -d / c;
+            return 1;
+        }
+        double D = c * c - 4 * b * d;
+        if ( D < 0 ) {
+            return 0;
+        }
+        D = sqrt(D);
+        roots[0] = (-c - D) / (2 * b);
+        roots[1] = (-c + D) / (2 * b);
+        return 2;
+    }
+
+    // Depressed cubic t^3 + p*t + q with x = t - b / 3a
+    double A = b / a, B = c / a, C = d / a;
+    double p = B - A * A / 3.0;
+    double q = 2.0 * A * A * A / 27.0 - A * B / 3.0 + C;
+    double shift = -A / 3.0;
+    double D = q * q / 4.0 + p * p * p / 27.0;
+
+    if ( D > PNP_EPSILON ) {
+        double s = sqrt(D);
+        roots[0] = cbrt(-q / 2.0 + s) + cbrt(-q / 2.0 - s) + shift;
+        return 1;
+    }
+    if ( D > -PNP_EPSILON ) {
+        double u = cbrt(-q / 2.0);
+        roots[0] = 2 * u + shift;
+        roots[1] = -u + shift;
+        return 2;
+    }
+    double r = sqrt(-p / 3.0);
+    double phi = acos( std::max(-1.0, std::min(1.0, -q / (2.0 * r * r * r))) );
+    roots[0] = 2 * r * cos(phi / 3.0) + shift;
+    roots[1] = 2 * r * cos((phi + 2 * M_PI) / 3.0) + shift;
+    roots[2] = 2 * r * cos((phi + 4 * M_PI) / 3.0) + shift;
+    return 3;
+}
+
+static double evalQuartic(const double c[5], double x)
+{
+    return (((c[4] * x + c[3]) * x + c[2]) * x + c[1]) * x + c[0];
+}
+
+/**
+ * Real roots of c[4]*x^4 + ... + c[0]. The stationary points (roots of the
+ * derivative) split the real line into monotonic pieces, each of which holds
+ * at most one root that is found by bisection.
+ **/
+static int solveQuartic(const double c[5], double roots[4])
+{
+    if ( fabs(c[4]) < PNP_EPSILON ) {
+        return solveCubic(c[3], c[2], c[1], c[0], roots);
+    }
+
+    double bound = 0.0;
+    for ( int i = 0; i < 4; i++ ) {
+        bound = std::max( bound, fabs(c[i] / c[4]) );
+    }
+    bound += 1.0;
+
+    double stationary[3];
+    int n = solveCubic(4 * c[4], 3 * c[3], 2 * c[2], c[1], stationary);
+    std::sort(stationary, stationary + n);
+
+    double edges[5];
+    int m = 0;
+    edges[m++] = -bound;
+    for ( int i = 0; i < n; i++ ) {
+        if ( stationary[i] > -bound && stationary[i] < bound ) {
+            edges[m++] = stationary[i];
+        }
+    }
+    edges[m++] = bound;
+
+    int count = 0;
+    for ( int i = 0; i + 1 < m && count < 4; i++ ) {
+        double lo = edges[i], hi = edges[i+1];
+        double flo = evalQuartic(c, lo), fhi = evalQuartic(c, hi);
+
+        if ( fabs(flo) < PNP_EPSILON ) {
+            // Touching root at a stationary point
+            if ( i > 0 ) {
+                roots[count++] = lo;
+            }
+            continue;
+        }
+        if ( (flo < 0) == (fhi < 0) ) {
+            continue;
+        }
+        for ( int it = 0; it < 60; it++ ) {
+            double mid = 0.5 * (lo + hi);
+            double fmid = evalQuartic(c, mid);
+            if ( (fmid < 0) == (flo < 0) ) {
+                lo = mid;
+                flo = fmid;
+            } else {
+                hi = mid;
+            }
+        }
+        roots[count++] = 0.5 * (lo + hi);
+    }
+    return count;
+}
+
+/**
+ * Rigid transform [R|t] with q_i = R * p_i + t for three point pairs (Kabsch).
+ **/
+static bool alignPoints(const cv::Matx31d p[3], const cv::Matx31d q[3], cv::Matx34d &pose)
+{
+    cv::Matx31d pc = (p[0] + p[1] + p[2]) * (1.0 / 3.0);
+    cv::Matx31d qc = (q[0] + q[1] + q[2]) * (1.0 / 3.0);
+
+    cv::Matx33d H = cv::Matx33d::zeros();
+    for ( int i = 0; i < 3; i++ ) {
+        H += (p[i] - pc) * (q[i] - qc).t();
+    }
+
+    cv::Matx31d w;
+    cv::Matx33d u, vt;
+    cv::SVD::compute(H, w, u, vt);
+
+    cv::Matx33d R = vt.t() * u.t();
+    if ( cv::determinant(R) < 0 ) {
+        for ( int j = 0; j < 3; j++ ) {
+            vt(2,j) = -vt(2,j);
+        }
+        R = vt.t() * u.t();
+    }
+    cv::Matx31d t = qc - R * pc;
+
+    pose = cv::Matx34d( R(0,0), R(0,1), R(0,2), t(0),
+                        R(1,0), R(1,1), R(1,2), t(1),
+                        R(2,0), R(2,1), R(2,2), t(2) );
+    return true;
+}
+
+PnPTracker::PnPTracker(const cv::Matx33d &K, int capacity)
+{
+    this->K = K;
+    this->fx = K(0,0);
+    this->fy = K(1,1);
+    this->cx = K(0,2);
+    this->cy = K(1,2);
+
+    this->count = 0;
+    this->inlier_count = 0;
+    this->confidence = 0.99;
+    this->acceptRatio = 0.6;
+    this->maxIterations = 100;
+    this->minInliers = 15;
+    this->refineIterations = 5;
+    this->seed = 0x2545f491u;
+
+    setReprojectionError(8.0);
+    reserve(capacity);
+}
+
+void PnPTracker::setReprojectionError(double pixels)
+{
+    this->threshold = pixels / (0.5 * (fx + fy));
+}
+
+void PnPTracker::setMaxIterations(int n)
+{
+    this->maxIterations = n;
+}
+
+void PnPTracker::setMinInliers(int n)
+{
+    this->minInliers = n;
+}
+
+void PnPTracker::reserve(int capacity)
+{
+    if ( (int) X.size() >= capacity ) {
+        return;
+    }
+    X.resize(capacity);
+    Y.resize(capacity);
+    Z.resize(capacity);
+    x.resize(capacity);
+    y.resize(capacity);
+    inliers.resize(capacity);
+}
+
+unsigned int PnPTracker::nextRandom()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+void PnPTracker::clear()
+{
+    count = 0;
+    inlier_count = 0;
+}
+
+void PnPTracker::add(const cv::Point3d &world_point, const cv::Point2f &image_point)
+{
+    if ( count == (int) X.size() ) {
+        reserve( 2 * count );
+    }
+    X[count] = world_point.x;
+    Y[count] = world_point.y;
+    Z[count] = world_point.z;
+    x[count] = (image_point.x - cx) / fx;
+    y[count] = (image_point.y - cy) / fy;
+    count++;
+}
+
+/**
+ * Collect the correspondences of matches between keypoints of the current
+ * frame (queryIdx) and points of the map (trainIdx).
+ **/
+void PnPTracker::gather(const std::vector<cv::DMatch> &matches,
+                        const std::vector<cv::KeyPoint> &keypoints,
+                        const std::vector<cv::Point3d> &points)
+{
+    clear();
+    reserve( matches.size() );
+    for ( size_t i = 0; i < matches.size(); i++ ) {
+        add( points[matches[i].trainIdx], keypoints[matches[i].queryIdx].pt );
+    }
+}
+
+/**
+ * Same, with the map points given as coordinate columns (e.g. a CloudView),
+ * so they need not be copied into a vector first.
+ **/
+void PnPTracker::gather(const std::vector<cv::DMatch> &matches,
+                        const std::vector<cv::KeyPoint> &keypoints,
+                        const double *points_x, const double *points_y, const double *points_z)
+{
+    clear();
+    reserve( matches.size() );
+    for ( size_t i = 0; i < matches.size(); i++ ) {
+        int n = matches[i].trainIdx;
+        add( cv::Point3d( points_x[n], points_y[n], points_z[n] ), keypoints[matches[i].queryIdx].pt );
+    }
+}
+
+/**
+ * Number of correspondences that pose reprojects within the threshold.
+ **/
+int PnPTracker::score(const cv::Matx34d &pose, std::vector<unsigned char> *mask) const
+{
+    const float r00 = pose(0,0), r01 = pose(0,1), r02 = pose(0,2), t0 = pose(0,3);
+    const float r10 = pose(1,0), r11 = pose(1,1), r12 = pose(1,2), t1 = pose(1,3);
+    const float r20 = pose(2,0), r21 = pose(2,1), r22 = pose(2,2), t2 = pose(2,3);
+    const float thr2 = threshold * threshold;
+
+    const float *pX = &X[0], *pY = &Y[0], *pZ = &Z[0];
+    const float *px = &x[0], *py = &y[0];
+
+    // Branch free so the compiler can vectorize it
+    int n = 0;
+    for ( int i = 0; i < count; i++ ) {
+        float xc = r00 * pX[i] + r01 * pY[i] + r02 * pZ[i] + t0;
+        float yc = r10 * pX[i] + r11 * pY[i] + r12 * pZ[i] + t1;
+        float zc = r20 * pX[i] + r21 * pY[i] + r22 * pZ[i] + t2;
+        float ex = xc - px[i] * zc;
+        float ey = yc - py[i] * zc;
+        // Compare (ex^2 + ey^2) / zc^2 < thr2 without dividing; requires zc > 0
+        int ok = (zc > 0.0f) & (ex * ex + ey * ey < thr2 * zc * zc);
+        if ( mask ) {
+            (*mask)[i] = ok;
+        }
+        n += ok;
+    }
+    return n;
+}
+
+/**
+ * Grunert's P3P solution (as in Haralick et al., "Review and analysis of
+ * solutions of the three point perspective pose estimation problem", 1994).
+ * Returns the number of poses (at most 4).
+ **/
+int PnPTracker::solveP3P(const int sample[3], cv::Matx34d poses[4]) const
+{
+    cv::Matx31d P[3], f[3];
+    for ( int i = 0; i < 3; i++ ) {
+        int k = sample[i];
+        P[i] = cv::Matx31d( X[k], Y[k], Z[k] );
+        f[i] = cv::Matx31d( x[k], y[k], 1.0 );
+        f[i] *= 1.0 / cv::norm(f[i]);
+    }
+
+    double a2 = (P[1] - P[2]).ddot(P[1] - P[2]);
+    double b2 = (P[0] - P[2]).ddot(P[0] - P[2]);
+    double c2 = (P[0] - P[1]).ddot(P[0] - P[1]);
+    if ( a2 < PNP_EPSILON || b2 < PNP_EPSILON || c2 < PNP_EPSILON ) {
+        return 0;
+    }
+
+    double cos_a = f[1].ddot(f[2]);
+    double cos_b = f[0].ddot(f[2]);
+    double cos_g = f[0].ddot(f[1]);
+
+    double amc = (a2 - c2) / b2;
+    double apc = (a2 + c2) / b2;
+    double ca2 = cos_a * cos_a, cb2 = cos_b * cos_b, cg2 = cos_g * cos_g;
+
+    double coeffs[5];
+    coeffs[4] = (amc - 1) * (amc - 1) - 4 * c2 / b2 * ca2;
+    coeffs[3] = 4 * ( amc * (1 - amc) * cos_b
+                    - (1 - apc) * cos_a * cos_g
+                    + 2 * c2 / b2 * ca2 * cos_b );
+    coeffs[2] = 2 * ( amc * amc - 1
+                    + 2 * amc * amc * cb2
+                    + 2 * (b2 - c2) / b2 * ca2
+                    - 4 * apc * cos_a * cos_b * cos_g
+                    + 2 * (b2 - a2) / b2 * cg2 );
+    coeffs[1] = 4 * ( -amc * (1 + amc) * cos_b
+                    + 2 * a2 / b2 * cg2 * cos_b
+                    - (1 - apc) * cos_a * cos_g );
+    coeffs[0] = (1 + amc) * (1 + amc) - 4 * a2 / b2 * cg2;
+
+    double roots[4];
+    int n = solveQuartic(coeffs, roots);
+
+    int m = 0;
+    for ( int i = 0; i < n; i++ ) {
+        double v = roots[i];
+        if ( v <= 0 ) {
+            continue;
+        }
+        double denominator = 2 * (cos_g - v * cos_a);
+        if ( fabs(denominator) < PNP_EPSILON ) {
+            continue;
+        }
+        double u = ( (amc - 1) * v * v - 2 * amc * cos_b * v + 1 + amc ) / denominator;
+        if ( u <= 0 ) {
+            continue;
+        }
+        double s1_squared = b2 / (1 + v * v - 2 * v * cos_b);
+        if ( s1_squared <= 0 ) {
+            continue;
+        }
+
+        // Distances along the rays
+        double s1 = sqrt(s1_squared);
+        cv::Matx31d Q[3];
+        Q[0] = f[0] * s1;
+        Q[1] = f[1] * (u * s1);
+        Q[2] = f[2] * (v * s1);
+
+        if ( alignPoints(P, Q, poses[m]) ) {
+            m++;
+        }
+    }
+    return m;
+}
+
+/**
+ * Gauss-Newton on the reprojection error of the inliers, with the update
+ * applied on the left: R <- exp(w) * R, t <- exp(w) * t + v.
+ **/
+bool PnPTracker::refine(cv::Matx34d &pose) const
+{
+    for ( int it = 0; it < refineIterations; it++ ) {
+        cv::Matx66d H = cv::Matx66d::zeros();
+        cv::Matx61d g = cv::Matx61d::zeros();
+        int n = 0;
+
+        for ( int i = 0; i < count; i++ ) {
+            if ( !inliers[i] ) {
+                continue;
+            }
+            double xc = pose(0,0) * X[i] + pose(0,1) * Y[i] + pose(0,2) * Z[i] + pose(0,3);
+            double yc = pose(1,0) * X[i] + pose(1,1) * Y[i] + pose(1,2) * Z[i] + pose(1,3);
+            double zc = pose(2,0) * X[i] + pose(2,1) * Y[i] + pose(2,2) * Z[i] + pose(2,3);
+            if ( zc < PNP_EPSILON ) {
+                continue;
+            }
+            double iz = 1.0 / zc;
+            double u = xc * iz, v = yc * iz;
+            double ru = u - x[i], rv = v - y[i];
+
+            // d(u,v)/d(w,v) = d(u,v)/dXc * [-[Xc]x | I]
+            double Ju[6] = { -u * v, 1 + u * u, -v, iz, 0, -u * iz };
+            double Jv[6] = { -(1 + v * v), u * v, u, 0, iz, -v * iz };
+
+            for ( int r = 0; r < 6; r++ ) {
+                g(r) += Ju[r] * ru + Jv[r] * rv;
+                for ( int c = r; c < 6; c++ ) {
+                    H(r,c) += Ju[r] * Ju[c] + Jv[r] * Jv[c];
+                }
+            }
+            n++;
+        }
+        if ( n < 3 ) {
+            return false;
+        }
+        for ( int r = 0; r < 6; r++ ) {
+            for ( int c = 0; c < r; c++ ) {
+                H(r,c) = H(c,r);
+            }
+        }
+
+        cv::Matx61d delta;
+        if ( !cv::solve(H, -g, delta, cv::DECOMP_CHOLESKY) ) {
+            return false;
+        }
+
+        cv::Matx33d dR;
+        cv::Rodrigues( cv::Matx31d(delta(0), delta(1), delta(2)), dR );
+        cv::Matx33d R( pose(0,0), pose(0,1), pose(0,2),
+                       pose(1,0), pose(1,1), pose(1,2),
+                       pose(2,0), pose(2,1), pose(2,2) );
+        cv::Matx31d t( pose(0,3), pose(1,3), pose(2,3) );
+        R = dR * R;
+        t = dR * t + cv::Matx31d(delta(3), delta(4), delta(5));
+
+        pose = cv::Matx34d( R(0,0), R(0,1), R(0,2), t(0),
+                            R(1,0), R(1,1), R(1,2), t(1),
+                            R(2,0), R(2,1), R(2,2), t(2) );
+
+        if ( cv::norm(delta) < 1e-6 ) {
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * Estimate the camera pose from the gathered correspondences. On input pose
+ * holds the prediction (e.g. from a constant velocity model), on success it is
+ * replaced by the estimate. Returns false if too few inliers were found.
+ **/
+bool PnPTracker::track(cv::Matx34d &pose)
+{
+    inlier_count = 0;
+    if ( count < std::max(minInliers, 4) ) {
+        return false;
+    }
+
+    cv::Matx34d best = pose;
+    int best_count = score( pose, NULL );
+
+    // Steady state: the prediction is good enough, skip sampling
+    double w = (double) best_count / count;
+    if ( w < acceptRatio ) {
+        cv::Matx34d hypotheses[4];
+        int iterations = maxIterations;
+        for ( int it = 0; it < iterations; it++ ) {
+            int sample[3];
+            sample[0] = nextRandom() % count;
+            do {
+                sample[1] = nextRandom() % count;
+            } while ( sample[1] == sample[0] );
+            do {
+                sample[2] = nextRandom() % count;
+            } while ( sample[2] == sample[0] || sample[2] == sample[1] );
+
+            int n = solveP3P( sample, hypotheses );
+            for ( int h = 0; h < n; h++ ) {
+                int c = score( hypotheses[h], NULL );
+                if ( c > best_count ) {
+                    best_count = c;
+                    best = hypotheses[h];
+
+                    w = (double) c / count;
+                    double outlier_free = w * w * w;
+                    if ( outlier_free > 1.0 - PNP_EPSILON ) {
+                        iterations = 0;
+                    } else {
+                        double needed = log(1.0 - confidence) / log(1.0 - outlier_free);
+                        iterations = std::min( maxIterations, (int) ceil(needed) );
+                    }
+                }
+            }
+        }
+    }
+
+    if ( best_count < minInliers ) {
+        return false;
+    }
+
+    // Refine, then refine again on the inliers of the refined pose
+    for ( int round = 0; round < 2; round++ ) {
+        score( best, &inliers );
+        if ( !refine( best ) ) {
+            return false;
+        }
+    }
+    inlier_count = score( best, &inliers );
+    if ( inlier_count < minInliers ) {
+        return false;
+    }
+
+    pose = best;
+    return true;
+}
+
+int PnPTracker::size() const
+{
+    return count;
+}
+
+int PnPTracker::inlierCount() const
+{
+    return inlier_count;
+}
+
+/**
+ * Inlier flags of the last call to track, indexed like the correspondences.
+ **/
+const std::vector<unsigned char> &PnPTracker::inlierMask() const
+{
+    return inliers;
+}
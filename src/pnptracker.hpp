@@ -0,0 +1,70 @@
+#ifndef PNPTRACKER_H
+#define PNPTRACKER_H
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include <vector>
+
+/**
+ * Frame-to-map camera tracking from 2d-3d correspondences.
+ *
+ * Correspondences are gathered into preallocated float structure-of-arrays
+ * buffers (world point, normalized image point). The pose is found with
+ * RANSAC over a P3P minimal solver, where the predicted pose is tried first:
+ * when it already explains most of the correspondences no samples are drawn
+ * at all. The best hypothesis is refined by a few Gauss-Newton steps on its
+ * inliers.
+ *
+ * Poses are [R|t] matrices mapping world points into the camera frame.
+ **/
+class PnPTracker
+{
+    cv::Matx33d K;
+    double fx, fy, cx, cy;
+
+    // Correspondences, world coordinates and normalized image coordinates
+    std::vector<float> X, Y, Z;
+    std::vector<float> x, y;
+    std::vector<unsigned char> inliers;
+    int count;
+    int inlier_count;
+
+    double threshold;           // inlier threshold, normalized image units
+    double confidence;
+    double acceptRatio;         // inlier ratio at which the prediction is kept
+    int maxIterations;
+    int minInliers;
+    int refineIterations;
+    unsigned int seed;
+
+    void reserve(int capacity);
+    int score(const cv::Matx34d &pose, std::vector<unsigned char> *mask) const;
+    int solveP3P(const int sample[3], cv::Matx34d poses[4]) const;
+    bool refine(cv::Matx34d &pose) const;
+    unsigned int nextRandom();
+
+public:
+    PnPTracker(const cv::Matx33d &K, int capacity = 1024);
+
+    void setReprojectionError(double pixels);
+    void setMaxIterations(int n);
+    void setMinInliers(int n);
+
+    void clear();
+    void add(const cv::Point3d &world_point, const cv::Point2f &image_point);
+    void gather(const std::vector<cv::DMatch> &matches,
+                const std::vector<cv::KeyPoint> &keypoints,
+                const std::vector<cv::Point3d> &points);
+    void gather(const std::vector<cv::DMatch> &matches,
+                const std::vector<cv::KeyPoint> &keypoints,
+                const double *points_x, const double *points_y, const double *points_z);
+
+    bool track(cv::Matx34d &pose);
+
+    int size() const;
+    int inlierCount() const;
+    const std::vector<unsigned char> &inlierMask() const;
+};
+
+#endif // PNPTRACKER_H
@@ -0,0 +1,470 @@
+#include "posegraph.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+/**
+ * Adjoint of a pose for twists ordered (rotation, translation):
+ * T * exp(d) * T^-1 = exp(Ad(T) * d).
+ **/
+static cv::Matx66d adjoint(const cv::Matx44d &T)
+{
+    cv::Matx66d A = cv::Matx66d::zeros();
+    for ( int r = 0; r < 3; r++ ) {
+        for ( int c = 0; c < 3; c++ ) {
+            A(r,c) = T(r,c);
+            A(r+3,c+3) = T(r,c);
+        }
+    }
+    // [t]x * R
+    double tx = T(0,3), ty = T(1,3), tz = T(2,3);
+    for ( int c = 0; c < 3; c++ ) {
+        A(3,c) = -tz * T(1,c) + ty * T(2,c);
+        A(4,c) =  tz * T(0,c) - tx * T(2,c);
+        A(5,c) = -ty * T(0,c) + tx * T(1,c);
+    }
+    return A;
+}
+
+/**
+ * Inverse of the left Jacobian of SO(3) at w: log(exp(d) * exp(w)) is
+ * w + J^-1 * d for small d.
+ **/
+static cv::Matx33d leftJacobianInverse(const cv::Matx31d &w)
+{
+    cv::Matx33d W(     0, -w(2),  w(1),
+                    w(2),     0, -w(0),
+                   -w(1),  w(0),     0 );
+    double theta = sqrt( w(0) * w(0) + w(1) * w(1) + w(2) * w(2) );
+    // 1/theta^2 - (1 + cos(theta)) / (2 * theta * sin(theta)), 1/12 near 0
+    double c = theta < 1e-4 ? 1.0 / 12.0 + theta * theta / 720.0
+                            : 1.0 / (theta * theta) - (1.0 + cos(theta)) / (2.0 * theta * sin(theta));
+    return cv::Matx33d::eye() - 0.5 * W + c * (W * W);
+}
+
+/**
+ * Inverse of a rigid transformation, without a general 4x4 inversion.
+ **/
+static cv::Matx44d rigidInverse(const cv::Matx44d &T)
+{
+    cv::Matx44d I = cv::Matx44d::eye();
+    for ( int r = 0; r < 3; r++ ) {
+        for ( int c = 0; c < 3; c++ ) {
+            I(r,c) = T(c,r);
+        }
+        I(r,3) = -( T(0,r) * T(0,3) + T(1,r) * T(1,3) + T(2,r) * T(2,3) );
+    }
+    return I;
+}
+
+PoseGraph::PoseGraph()
+{
+    this->dirty_from = 0;
+    this->loop_count = 0;
+    this->max_iterations = 20;
+    this->iterations = 0;
+    this->initial_cost = 0.0;
+    this->final_cost = 0.0;
+}
+
+void PoseGraph::setMaxIterations(int n)
+{
+    this->max_iterations = n;
+}
+
+void PoseGraph::clear()
+{
+    poses.clear();
+    frames.clear();
+    edges.clear();
+    dirty_from = 0;
+    loop_count = 0;
+}
+
+int PoseGraph::addNode(const cv::Matx44d &pose, int frame_nr)
+{
+    poses.push_back( pose );
+    frames.push_back( frame_nr );
+    return poses.size() - 1;
+}
+
+void PoseGraph::addEdge(int from, int to, const cv::Matx44d &measurement,
+                        const cv::Matx66d &information, bool loop)
+{
+    if ( from == to || from < 0 || to < 0 ||
+         from >= (int) poses.size() || to >= (int) poses.size() ) {
+        return;
+    }
+    Edge edge;
+    edge.from = from;
+    edge.to = to;
+    edge.measurement = measurement;
+    edge.information = information;
+    edge.loop = loop;
+    edges.push_back( edge );
+
+    // The older node stays where it is, everything after it may move. Node 0
+    // is never freed, it fixes the gauge.
+    dirty_from = std::min( dirty_from, std::min(from, to) + 1 );
+}
+
+/**
+ * Relative pose between two consecutive keyframes, from visual or robot
+ * odometry. measurement maps camera from into camera to.
+ **/
+void PoseGraph::addOdometryEdge(int from, int to, const cv::Matx44d &measurement,
+                                const cv::Matx66d &information)
+{
+    addEdge( from, to, measurement, information, false );
+}
+
+/**
+ * Relative pose between a keyframe and an earlier, revisited one.
+ **/
+void PoseGraph::addLoopEdge(int from, int to, const cv::Matx44d &measurement,
+                            const cv::Matx66d &information)
+{
+    int before = edges.size();
+    addEdge( from, to, measurement, information, true );
+    loop_count += (int) edges.size() - before;
+}
+
+/**
+ * Error E = Z^-1 * T_to * T_from^-1 of an edge as r = (log(R_E), t_E), and
+ * the Jacobians of r w.r.t. left updates of both poses. Returns r^T * info * r.
+ **/
+double PoseGraph::edgeError(const Edge &edge, cv::Matx61d &r, cv::Matx66d *Ji, cv::Matx66d *Jj) const
+{
+    cv::Matx44d Z_inv = rigidInverse( edge.measurement );
+    cv::Matx44d E = Z_inv * poses[edge.to] * rigidInverse( poses[edge.from] );
+
+    cv::Matx33d R_E( E(0,0), E(0,1), E(0,2),
+                     E(1,0), E(1,1), E(1,2),
+                     E(2,0), E(2,1), E(2,2) );
+    cv::Matx31d w;
+    cv::Rodrigues( R_E, w );
+    r = cv::Matx61d( w(0), w(1), w(2), E(0,3), E(1,3), E(2,3) );
+
+    if ( Ji != NULL && Jj != NULL ) {
+        // A left update exp(d) of E changes r by L * d: the rotation part
+        // through the SO(3) Jacobian, the translation part by d_w x t + d_v
+        cv::Matx66d L = cv::Matx66d::eye();
+        cv::Matx33d J_w = leftJacobianInverse( w );
+        for ( int i = 0; i < 3; i++ ) {
+            for ( int k = 0; k < 3; k++ ) {
+                L(i,k) = J_w(i,k);
+            }
+        }
+        L(3,1) =  E(2,3); L(3,2) = -E(1,3);
+        L(4,0) = -E(2,3); L(4,2) =  E(0,3);
+        L(5,0) =  E(1,3); L(5,1) = -E(0,3);
+
+        *Jj = L * adjoint( Z_inv );
+        *Ji = L * adjoint( E ) * -1.0;
+    }
+    return ( r.t() * edge.information * r )(0);
+}
+
+/**
+ * Residual of edge number edge at the current poses, and if asked its
+ * Jacobians w.r.t. left updates of the from and the to node. Returns the
+ * weighted squared error.
+ **/
+double PoseGraph::edgeResidual(int edge, cv::Matx61d &r, cv::Matx66d *J_from, cv::Matx66d *J_to) const
+{
+    cv::Matx66d Ji, Jj;
+    double error = edgeError( edges[edge], r, &Ji, &Jj );
+    if ( J_from != NULL ) {
+        *J_from = Ji;
+    }
+    if ( J_to != NULL ) {
+        *J_to = Jj;
+    }
+    return error;
+}
+
+/**
+ * Cost of all edges that touch a node from start onward.
+ **/
+double PoseGraph::cost(int start) const
+{
+    double sum = 0.0;
+    cv::Matx61d r;
+    for ( size_t e = 0; e < edges.size(); e++ ) {
+        if ( std::max(edges[e].from, edges[e].to) >= start ) {
+            sum += edgeError( edges[e], r, NULL, NULL );
+        }
+    }
+    return sum;
+}
+
+/**
+ * One damped Gauss-Newton step for the nodes from start onward.
+ **/
+bool PoseGraph::solveStep(int start, double lambda)
+{
+    int n_free = poses.size() - start;
+    int dim = 6 * n_free;
+
+    // Envelope: each block row starts at the oldest free node it shares an edge with
+    std::vector<int> first_block( n_free );
+    for ( int k = 0; k < n_free; k++ ) {
+        first_block[k] = k;
+    }
+    for ( size_t e = 0; e < edges.size(); e++ ) {
+        int lo = std::min( edges[e].from, edges[e].to ) - start;
+        int hi = std::max( edges[e].from, edges[e].to ) - start;
+        if ( lo >= 0 ) {
+            first_block[hi] = std::min( first_block[hi], lo );
+        }
+    }
+    first.resize( dim );
+    row_start.resize( dim + 1 );
+    row_start[0] = 0;
+    for ( int row = 0; row < dim; row++ ) {
+        first[row] = 6 * first_block[row / 6];
+        row_start[row + 1] = row_start[row] + row - first[row] + 1;
+    }
+    H.assign( row_start[dim], 0.0 );
+    b.assign( dim, 0.0 );
+
+    // Accumulate J^T * info * J into the lower triangle
+    cv::Matx61d r;
+    cv::Matx66d J[2];
+    for ( size_t e = 0; e < edges.size(); e++ ) {
+        const Edge &edge = edges[e];
+        if ( std::max(edge.from, edge.to) < start ) {
+            continue;
+        }
+        edgeError( edge, r, &J[0], &J[1] );
+        int node[2] = { edge.from - start, edge.to - start };
+
+        cv::Matx<double, 6, 6> JtW[2];
+        for ( int a = 0; a < 2; a++ ) {
+            if ( node[a] < 0 ) {
+                continue;
+            }
+            JtW[a] = J[a].t() * edge.information;
+            cv::Matx61d g = JtW[a] * r;
+            for ( int k = 0; k < 6; k++ ) {
+                b[6*node[a] + k] -= g(k);
+            }
+        }
+        for ( int a = 0; a < 2; a++ ) {
+            for ( int c = 0; c < 2; c++ ) {
+                if ( node[a] < 0 || node[c] < 0 || node[c] > node[a] ) {
+                    continue;
+                }
+                cv::Matx66d block = JtW[a] * J[c];
+                for ( int i = 0; i < 6; i++ ) {
+                    int row = 6*node[a] + i;
+                    for ( int k = 0; k < 6; k++ ) {
+                        int col = 6*node[c] + k;
+                        if ( col <= row ) {
+                            H[row_start[row] + col - first[row]] += block(i,k);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Marquardt damping
+    for ( int row = 0; row < dim; row++ ) {
+        double &d = H[row_start[row] + row - first[row]];
+        d += lambda * std::max( d, 1e-9 );
+    }
+
+    // Skyline Cholesky H = L * L^T, in place
+    for ( int row = 0; row < dim; row++ ) {
+        double *Lr = &H[row_start[row]] - first[row];
+        for ( int col = first[row]; col <= row; col++ ) {
+            double *Lc = &H[row_start[col]] - first[col];
+            double sum = Lr[col];
+            for ( int k = std::max(first[row], first[col]); k < col; k++ ) {
+                sum -= Lr[k] * Lc[k];
+            }
+            if ( col < row ) {
+                Lr[col] = sum / Lc[col];
+            } else if ( sum <= 0.0 ) {
+                return false;
+            } else {
+                Lr[row] = sqrt( sum );
+            }
+        }
+    }
+
+    // Forward and back substitution
+    dx = b;
+    for ( int row = 0; row < dim; row++ ) {
+        const double *Lr = &H[row_start[row]] - first[row];
+        double sum = dx[row];
+        for ( int k = first[row]; k < row; k++ ) {
+            sum -= Lr[k] * dx[k];
+        }
+        dx[row] = sum / Lr[row];
+    }
+    for ( int row = dim - 1; row >= 0; row-- ) {
+        const double *Lr = &H[row_start[row]] - first[row];
+        dx[row] /= Lr[row];
+        for ( int k = first[row]; k < row; k++ ) {
+            dx[k] -= Lr[k] * dx[row];
+        }
+    }
+
+    // Left update: R <- exp(w) * R, t <- exp(w) * t + v
+    for ( int k = 0; k < n_free; k++ ) {
+        const double *d = &dx[6*k];
+        cv::Matx33d dR;
+        cv::Rodrigues( cv::Matx31d(d[0], d[1], d[2]), dR );
+        cv::Matx44d update = cv::Matx44d::eye();
+        for ( int i = 0; i < 3; i++ ) {
+            for ( int j = 0; j < 3; j++ ) {
+                update(i,j) = dR(i,j);
+            }
+            update(i,3) = d[3 + i];
+        }
+        poses[start + k] = update * poses[start + k];
+    }
+    return true;
+}
+
+/**
+ * Levenberg-Marquardt over the dirty part of the graph. Returns true if the
+ * poses changed.
+ **/
+bool PoseGraph::optimize()
+{
+    iterations = 0;
+    int start = std::max( dirty_from, 1 );
+    dirty_from = poses.size();
+    if ( start >= (int) poses.size() ) {
+        return false;
+    }
+
+    double current = cost( start );
+    initial_cost = final_cost = current;
+
+    std::vector<cv::Matx44d> saved;
+    double lambda = 1e-4;
+    while ( iterations < max_iterations ) {
+        iterations++;
+        saved.assign( poses.begin() + start, poses.end() );
+
+        if ( !solveStep( start, lambda ) ) {
+            std::copy( saved.begin(), saved.end(), poses.begin() + start );
+            lambda *= 10.0;
+            continue;
+        }
+
+        double next = cost( start );
+        if ( next < current ) {
+            bool converged = (current - next) < 1e-9 + 1e-6 * current;
+            current = next;
+            lambda = std::max( lambda / 10.0, 1e-9 );
+            if ( converged ) {
+                break;
+            }
+        } else {
+            std::copy( saved.begin(), saved.end(), poses.begin() + start );
+            lambda *= 10.0;
+            if ( lambda > 1e8 ) {
+                break;
+            }
+        }
+    }
+
+    final_cost = current;
+    return final_cost < initial_cost;
+}
+
+cv::Matx44d PoseGraph::getPose(int node) const
+{
+    return poses[node];
+}
+
+int PoseGraph::getFrame(int node) const
+{
+    return frames[node];
+}
+
+/**
+ * Last node added at or before frame frame_nr, -1 if there is none.
+ **/
+int PoseGraph::findFrame(int frame_nr) const
+{
+    std::vector<int>::const_iterator it = std::upper_bound( frames.begin(), frames.end(), frame_nr );
+    return (int) (it - frames.begin()) - 1;
+}
+
+int PoseGraph::size() const
+{
+    return poses.size();
+}
+
+int PoseGraph::edgeCount() const
+{
+    return edges.size();
+}
+
+int PoseGraph::loopCount() const
+{
+    return loop_count;
+}
+
+bool PoseGraph::isDirty() const
+{
+    return std::max( dirty_from, 1 ) < (int) poses.size();
+}
+
+int PoseGraph::iterationCount() const
+{
+    return iterations;
+}
+
+double PoseGraph::initialCost() const
+{
+    return initial_cost;
+}
+
+double PoseGraph::finalCost() const
+{
+    return final_cost;
+}
+
+cv::Matx66d PoseInformation(double rotation_weight, double translation_weight)
+{
+    cv::Matx66d information = cv::Matx66d::zeros();
+    for ( int k = 0; k < 3; k++ ) {
+        information(k,k) = rotation_weight;
+        information(k+3,k+3) = translation_weight;
+    }
+    return information;
+}
+
+cv::Matx44d PoseFromCamPosition(const std::vector<float> &camPosition)
+{
+    double x = camPosition[0], y = camPosition[1], z = camPosition[2];
+    double cr = cos(camPosition[3]), sr = sin(camPosition[3]);
+    double cp = cos(camPosition[4]), sp = sin(camPosition[4]);
+    double cy = cos(camPosition[5]), sy = sin(camPosition[5]);
+
+    // Camera to world rotation of the NAO camera frame (x forward, y left, z up), R = Rz * Ry * Rx
+    cv::Matx33d R_wn( cy*cp, cy*sp*sr - sy*cr, cy*sp*cr + sy*sr,
+                      sy*cp, sy*sp*sr + cy*cr, sy*sp*cr - cy*sr,
+                        -sp,            cp*sr,            cp*cr );
+    // Optical axes (x right, y down, z forward) in the NAO camera frame
+    cv::Matx33d R_no(  0,  0, 1,
+                      -1,  0, 0,
+                       0, -1, 0 );
+    cv::Matx33d R_wc = R_wn * R_no;
+
+    cv::Matx44d pose = cv::Matx44d::eye();
+    for ( int r = 0; r < 3; r++ ) {
+        for ( int c = 0; c < 3; c++ ) {
+            pose(r,c) = R_wc(c,r);
+        }
+        pose(r,3) = -( R_wc(0,r) * x + R_wc(1,r) * y + R_wc(2,r) * z );
+    }
+    return pose;
+}
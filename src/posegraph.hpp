@@ -0,0 +1,100 @@
+#ifndef POSEGRAPH_H
+#define POSEGRAPH_H
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+/**
+ * Keyframe pose graph for global consistency.
+ *
+ * Nodes are world to camera poses of keyframes, edges are relative pose
+ * measurements Z_ij = T_j * T_i^-1 (camera i to camera j, the same convention
+ * as the frame-to-frame transform in MainLoop) with a 6x6 information matrix
+ * over (rotation, translation). Edges come from visual odometry, from the
+ * robot odometry and from loop closures.
+ *
+ * The solver is incremental: adding an edge marks the graph dirty from its
+ * oldest node onward, and optimize() only moves the nodes from there to the
+ * newest one, keeping everything before it fixed. Odometry edges thus cost a
+ * tiny solve at the head of the graph, a loop closure re-optimizes the loop.
+ * Nodes are ordered by time, so the normal equations of a chain with a few
+ * loop edges have a narrow profile; they are factored with a skyline
+ * (envelope) Cholesky that never touches the zeros outside it.
+ **/
+class PoseGraph
+{
+    typedef struct
+    {
+        int from;
+        int to;
+        cv::Matx44d measurement;
+        cv::Matx66d information;
+        bool loop;
+    } Edge;
+
+    std::vector<cv::Matx44d> poses;
+    std::vector<int> frames;
+    std::vector<Edge> edges;
+    int dirty_from;
+    int loop_count;
+
+    int max_iterations;
+    int iterations;
+    double initial_cost;
+    double final_cost;
+
+    // Skyline storage of the normal equations: row r holds columns first[r]..r
+    std::vector<int> first;
+    std::vector<int> row_start;
+    std::vector<double> H;
+    std::vector<double> b;
+    std::vector<double> dx;
+
+    double edgeError(const Edge &edge, cv::Matx61d &r, cv::Matx66d *Ji, cv::Matx66d *Jj) const;
+    double cost(int start) const;
+    bool solveStep(int start, double lambda);
+    void addEdge(int from, int to, const cv::Matx44d &measurement,
+                 const cv::Matx66d &information, bool loop);
+
+public:
+    PoseGraph();
+
+    void setMaxIterations(int n);
+
+    void clear();
+    int addNode(const cv::Matx44d &pose, int frame_nr);
+    void addOdometryEdge(int from, int to, const cv::Matx44d &measurement,
+                         const cv::Matx66d &information);
+    void addLoopEdge(int from, int to, const cv::Matx44d &measurement,
+                     const cv::Matx66d &information);
+
+    bool optimize();
+    double edgeResidual(int edge, cv::Matx61d &r, cv::Matx66d *J_from = NULL, cv::Matx66d *J_to = NULL) const;
+
+    cv::Matx44d getPose(int node) const;
+    int getFrame(int node) const;
+    int findFrame(int frame_nr) const;
+    int size() const;
+    int edgeCount() const;
+    int loopCount() const;
+    bool isDirty() const;
+    int iterationCount() const;
+    double initialCost() const;
+    double finalCost() const;
+};
+
+/**
+ * Information matrix with separate weights for the rotation and the
+ * translation part of an edge.
+ **/
+cv::Matx66d PoseInformation(double rotation_weight, double translation_weight);
+
+/**
+ * World to camera pose from a NAO camera position (x, y, z, wx, wy, wz as
+ * returned by ALMotionProxy::getPosition), in the optical frame convention
+ * used by the rest of the pipeline (x right, y down, z forward).
+ **/
+cv::Matx44d PoseFromCamPosition(const std::vector<float> &camPosition);
+
+#endif // POSEGRAPH_H
@@ -0,0 +1,245 @@
+#include "scale.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+#define SCALE_EPSILON 1e-12
+// Consistency constant turning a median absolute deviation into a sigma
+#define MAD_TO_SIGMA 1.4826
+
+ScaleEstimator::ScaleEstimator(const cv::Matx33d &K, ScaleMethod method)
+{
+    this->Kinv = K.inv();
+    this->method = method;
+    this->inlierThreshold = 0.01;
+    this->minInliers = 5;
+    this->ransacIterations = 64;
+    this->seed = 0x9e3779b9u;
+}
+
+void ScaleEstimator::setMethod(ScaleMethod method)
+{
+    this->method = method;
+}
+
+/**
+ * Maximum residual of a_i * s - b_i (normalized image units times depth) for a
+ * point to count as RANSAC inlier.
+ **/
+void ScaleEstimator::setInlierThreshold(double threshold)
+{
+    this->inlierThreshold = threshold;
+}
+
+void ScaleEstimator::setMinInliers(int n)
+{
+    this->minInliers = n;
+}
+
+unsigned int ScaleEstimator::nextRandom()
+{
+    // xorshift32, cheap and good enough to pick samples
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/**
+ * Fill a, b and ratios with the equations of all points that constrain the
+ * scale, compacted to the front of the buffers. Returns their number.
+ **/
+int ScaleEstimator::buildEquations(const cv::Matx34d &Pcam,
+                                   const cv::Point3d *points3d,
+                                   const cv::Point2d *points2d,
+                                   int n)
+{
+    if ( (int) ratios.size() < n ) {
+        a.resize( 2 * n );
+        b.resize( 2 * n );
+        ratios.resize( n );
+        scratch.resize( n );
+        valid.resize( n );
+    }
+
+    const cv::Matx33d &Ki = Kinv;
+    int m = 0;
+    for ( int i = 0; i < n; i++ ) {
+        const cv::Point2d &u = points2d[i];
+        const cv::Point3d &X = points3d[i];
+
+        // Normalized image point, third coordinate of K^-1 * (u, v, 1) is 1
+        double qx = Ki(0,0) * u.x + Ki(0,1) * u.y + Ki(0,2);
+        double qy = Ki(1,0) * u.x + Ki(1,1) * u.y + Ki(1,2);
+
+        double r1X = Pcam(0,0) * X.x + Pcam(0,1) * X.y + Pcam(0,2) * X.z;
+        double r2X = Pcam(1,0) * X.x + Pcam(1,1) * X.y + Pcam(1,2) * X.z;
+        double r3X = Pcam(2,0) * X.x + Pcam(2,1) * X.y + Pcam(2,2) * X.z;
+
+        double ax = Pcam(2,3) * qx - Pcam(0,3);
+        double ay = Pcam(2,3) * qy - Pcam(1,3);
+        double aa = ax * ax + ay * ay;
+
+        // Point lies on the epipolar line of the translation, no information
+        if ( aa < SCALE_EPSILON ) {
+            continue;
+        }
+
+        double bx = r1X - qx * r3X;
+        double by = r2X - qy * r3X;
+
+        a[2*m]   = ax;
+        a[2*m+1] = ay;
+        b[2*m]   = bx;
+        b[2*m+1] = by;
+        ratios[m] = ( ax * bx + ay * by ) / aa;
+        m++;
+    }
+    return m;
+}
+
+double ScaleEstimator::median(const double *values, int n)
+{
+    std::copy( values, values + n, scratch.begin() );
+    std::nth_element( scratch.begin(), scratch.begin() + n / 2, scratch.begin() + n );
+    return scratch[n / 2];
+}
+
+/**
+ * Mark the equations whose residual at the given scale is below the current
+ * threshold in mask (if given). For the median method the threshold is derived
+ * from the residuals themselves. Returns the number of inliers.
+ **/
+int ScaleEstimator::selectInliers(double scale, int n, std::vector<unsigned char> *mask)
+{
+    double threshold = inlierThreshold;
+
+    if ( method == SCALE_MEDIAN ) {
+        // Robust sigma of the residuals at the median scale
+        for ( int i = 0; i < n; i++ ) {
+            double rx = a[2*i]   * scale - b[2*i];
+            double ry = a[2*i+1] * scale - b[2*i+1];
+            scratch[i] = sqrt( rx * rx + ry * ry );
+        }
+        std::nth_element( scratch.begin(), scratch.begin() + n / 2, scratch.begin() + n );
+        threshold = std::max( 3.0 * MAD_TO_SIGMA * scratch[n / 2], SCALE_EPSILON );
+    }
+
+    int count = 0;
+    for ( int i = 0; i < n; i++ ) {
+        double rx = a[2*i]   * scale - b[2*i];
+        double ry = a[2*i+1] * scale - b[2*i+1];
+        bool inlier = rx * rx + ry * ry <= threshold * threshold;
+        if ( mask ) {
+            (*mask)[i] = inlier;
+        }
+        count += inlier;
+    }
+    return count;
+}
+
+/**
+ * Least squares scale over the equations marked in valid, along with its
+ * standard deviation estimated from the residuals.
+ **/
+bool ScaleEstimator::refit(int n, ScaleEstimate &result)
+{
+    double ab = 0.0, aa = 0.0;
+    int count = 0;
+    for ( int i = 0; i < n; i++ ) {
+        if ( !valid[i] ) {
+            continue;
+        }
+        ab += a[2*i] * b[2*i] + a[2*i+1] * b[2*i+1];
+        aa += a[2*i] * a[2*i] + a[2*i+1] * a[2*i+1];
+        count++;
+    }
+    if ( count < minInliers || aa < SCALE_EPSILON ) {
+        result.inliers = count;
+        return false;
+    }
+
+    double scale = ab / aa;
+    double sse = 0.0;
+    for ( int i = 0; i < n; i++ ) {
+        if ( !valid[i] ) {
+            continue;
+        }
+        double rx = a[2*i]   * scale - b[2*i];
+        double ry = a[2*i+1] * scale - b[2*i+1];
+        sse += rx * rx + ry * ry;
+    }
+
+    // 2 equations per point, 1 unknown
+    double variance = sse / std::max( 2 * count - 1, 1 );
+
+    result.scale = scale;
+    result.sigma = sqrt( variance / aa );
+    result.inliers = count;
+    return true;
+}
+
+/**
+ *  Input  - Pcam     -> (3x4) Camera matrix [R|t], t of unknown length
+ *         - points3d -> n 3D points in the frame of the previous camera
+ *         - points2d -> n corresponding image points in the current camera
+ *
+ *  Output - result   -> scale of t, its standard deviation and the inliers
+ *
+ *  Returns false if too few points agree on a scale.
+ **/
+bool ScaleEstimator::estimate(const cv::Matx34d &Pcam,
+                              const cv::Point3d *points3d,
+                              const cv::Point2d *points2d,
+                              int n,
+                              ScaleEstimate &result)
+{
+    result.scale = 1.0;
+    result.sigma = 0.0;
+    result.inliers = 0;
+    result.total = n;
+
+    int m = buildEquations( Pcam, points3d, points2d, n );
+    if ( m < minInliers ) {
+        return false;
+    }
+
+    switch ( method ) {
+    case SCALE_LEAST_SQUARES:
+        std::fill( valid.begin(), valid.begin() + m, 1 );
+        break;
+    case SCALE_MEDIAN:
+        selectInliers( median( &ratios[0], m ), m, &valid );
+        break;
+    case SCALE_RANSAC: {
+        // A single point fixes the scale, so every ratio is a hypothesis
+        int best_count = 0;
+        double best_scale = 0.0;
+        int iterations = ransacIterations;
+        for ( int it = 0; it < iterations; it++ ) {
+            double hypothesis = ratios[nextRandom() % m];
+            int count = selectInliers( hypothesis, m, NULL );
+            if ( count > best_count ) {
+                best_count = count;
+                best_scale = hypothesis;
+
+                // Adapt number of iterations to 99% confidence
+                double w = (double) count / m;
+                if ( w >= 1.0 ) {
+                    break;
+                }
+                int needed = (int) ceil( log( 0.01 ) / log( 1.0 - w ) );
+                iterations = std::min( ransacIterations, needed );
+            }
+        }
+        if ( best_count < minInliers ) {
+            result.inliers = best_count;
+            return false;
+        }
+        selectInliers( best_scale, m, &valid );
+        break;
+    }
+    }
+
+    return refit( m, result );
+}
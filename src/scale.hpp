@@ -0,0 +1,70 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+enum ScaleMethod {
+    SCALE_LEAST_SQUARES, // Plain linear fit over all points
+    SCALE_MEDIAN,        // Median of per-point ratios, MAD inlier gate, refit
+    SCALE_RANSAC         // 1-point RANSAC over per-point ratios, refit
+};
+
+typedef struct
+{
+    double scale;
+    double sigma;   // standard deviation of the scale estimate
+    int inliers;
+    int total;
+} ScaleEstimate;
+
+/**
+ * Estimates the scale of the translation of a camera matrix Pcam = [R|t] that
+ * best reprojects known 3d points onto their observed image points, i.e. the s
+ * for which  q ~ R * X + s * t,  with q = K^-1 * (u, v, 1).
+ *
+ * Every point gives two linear equations a_i * s = b_i, so all the math is
+ * done on 2-vectors. Scratch storage is kept between calls and only grows, so
+ * after the first keyframe an estimate does not allocate.
+ **/
+class ScaleEstimator
+{
+    cv::Matx33d Kinv;
+    ScaleMethod method;
+    double inlierThreshold;
+    int minInliers;
+    int ransacIterations;
+    unsigned int seed;
+
+    // Per point: a_i (2 values), b_i (2 values), and a candidate ratio
+    std::vector<double> a;
+    std::vector<double> b;
+    std::vector<double> ratios;
+    std::vector<double> scratch;
+    std::vector<unsigned char> valid;
+
+    int buildEquations(const cv::Matx34d &Pcam,
+                       const cv::Point3d *points3d,
+                       const cv::Point2d *points2d,
+                       int n);
+    int selectInliers(double scale, int n, std::vector<unsigned char> *mask);
+    double median(const double *values, int n);
+    bool refit(int n, ScaleEstimate &result);
+    unsigned int nextRandom();
+
+public:
+    ScaleEstimator(const cv::Matx33d &K, ScaleMethod method = SCALE_MEDIAN);
+
+    void setMethod(ScaleMethod method);
+    void setInlierThreshold(double threshold);
+    void setMinInliers(int n);
+
+    bool estimate(const cv::Matx34d &Pcam,
+                  const cv::Point3d *points3d,
+                  const cv::Point2d *points2d,
+                  int n,
+                  ScaleEstimate &result);
+};
+
+#endif // SCALE_H
@@ -0,0 +1,144 @@
+#include "sessionhost.hpp"
+
+static double now()
+{
+    return (double) cv::getTickCount() / cv::getTickFrequency();
+}
+
+/**
+ * Load the calibration (file "config") and undistortion tables for images
+ * of image_size, and the vocabulary when the file is there. Returns false
+ * without a calibration.
+ **/
+bool LoadSharedResources(SharedResources &resources, const std::string &vocabulary_file,
+                         cv::Size image_size)
+{
+    if ( !loadSettings( resources.K, resources.distortionCoeffs ) ) {
+        return false;
+    }
+    resources.undistortion.init( resources.K, resources.distortionCoeffs, image_size );
+    resources.has_vocabulary = resources.vocabulary.load( vocabulary_file );
+    return true;
+}
+
+/**
+ * With threads < 1, one worker per processor.
+ **/
+SessionHost::SessionHost(int threads)
+    : pool( threads )
+{
+    this->running = 0;
+    pthread_mutex_init( &lock, NULL );
+    pthread_cond_init( &done, NULL );
+}
+
+/**
+ * Deletes the sessions.
+ **/
+SessionHost::~SessionHost()
+{
+    for ( size_t i = 0; i < slots.size(); i++ ) {
+        delete slots[i]->session;
+        delete slots[i];
+    }
+    pthread_cond_destroy( &done );
+    pthread_mutex_destroy( &lock );
+}
+
+/**
+ * Add a session to run, the host takes ownership. Returns its index.
+ **/
+int SessionHost::add(TrackingSession *session)
+{
+    Slot *slot = new Slot;
+    slot->host = this;
+    slot->session = session;
+    slot->started = false;
+    slot->status = SESSION_RUNNING;
+    slot->steps = 0;
+    slot->busy = 0.0;
+    slots.push_back( slot );
+    return slots.size() - 1;
+}
+
+void SessionHost::stepTask(void *context)
+{
+    Slot *slot = (Slot *) context;
+    double start = now();
+
+    if ( !slot->started ) {
+        slot->started = true;
+        if ( !slot->session->start() ) {
+            slot->started = false;
+            slot->status = SESSION_FAILED;
+        }
+    }
+    if ( slot->status == SESSION_RUNNING ) {
+        slot->status = slot->session->step();
+        slot->steps++;
+    }
+    if ( slot->status == SESSION_RUNNING ) {
+        slot->busy += now() - start;
+        slot->host->pool.defer( stepTask, slot );
+        return;
+    }
+    if ( slot->started ) {
+        slot->session->finish();
+    }
+    slot->busy += now() - start;
+
+    SessionHost *host = slot->host;
+    pthread_mutex_lock( &host->lock );
+    host->running--;
+    pthread_cond_signal( &host->done );
+    pthread_mutex_unlock( &host->lock );
+}
+
+/**
+ * Run all sessions added so far to the end, blocks until they are.
+ **/
+void SessionHost::run()
+{
+    pthread_mutex_lock( &lock );
+    for ( size_t i = 0; i < slots.size(); i++ ) {
+        if ( !slots[i]->started && slots[i]->status == SESSION_RUNNING ) {
+            running++;
+            pool.submit( stepTask, slots[i] );
+        }
+    }
+    while ( running > 0 ) {
+        pthread_cond_wait( &done, &lock );
+    }
+    pthread_mutex_unlock( &lock );
+}
+
+int SessionHost::size() const
+{
+    return slots.size();
+}
+
+int SessionHost::threadCount() const
+{
+    return pool.size();
+}
+
+/**
+ * SESSION_FINISHED or SESSION_FAILED after run().
+ **/
+int SessionHost::status(int session) const
+{
+    return slots[session]->status;
+}
+
+/**
+ * Frames the session was stepped.
+ **/
+int SessionHost::steps(int session) const
+{
+    return slots[session]->steps;
+}
+
+double SessionHost::busyTime(int session) const
+{
+    return slots[session]->busy;
+}
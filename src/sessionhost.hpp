@@ -0,0 +1,91 @@
+#ifndef SESSIONHOST_H
+#define SESSIONHOST_H
+
+#include <opencv2/core/core.hpp>
+
+#include "inputsource.hpp"
+#include "threadpool.hpp"
+#include "vocabulary.hpp"
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+enum SessionStatus {
+    SESSION_RUNNING,    // more frames to come
+    SESSION_FINISHED,   // the input ran out
+    SESSION_FAILED
+};
+
+/**
+ * A tracking run that can be driven a frame at a time: start() once, then
+ * step() until it stops returning SESSION_RUNNING, then finish(). Only
+ * finished when started successfully.
+ **/
+class TrackingSession
+{
+public:
+    virtual ~TrackingSession() {}
+    virtual bool start() = 0;
+    virtual int step() = 0;
+    virtual void finish() = 0;
+};
+
+/**
+ * Read-only data the sessions of a process share, loaded once: the camera
+ * calibration with its undistortion tables, and the vocabulary.
+ **/
+typedef struct {
+    cv::Matx33d K;
+    cv::Mat distortionCoeffs;
+    Undistortion undistortion;
+    Vocabulary vocabulary;
+    bool has_vocabulary;
+} SharedResources;
+
+bool LoadSharedResources(SharedResources &resources, const std::string &vocabulary_file,
+                         cv::Size image_size);
+
+/**
+ * Runs many independent sessions in one process over one ThreadPool.
+ *
+ * Each step of a session is a pool task that queues the next step behind
+ * the other work of its worker (ThreadPool::defer), so a session never runs
+ * on two threads at once, sessions take turns a frame at a time when there
+ * are more of them than workers, and idle workers steal waiting sessions.
+ * Parallel loops inside a step (bundle adjustment) run on the same pool.
+ **/
+class SessionHost
+{
+    typedef struct {
+        SessionHost *host;
+        TrackingSession *session;
+        bool started;
+        int status;
+        int steps;
+        double busy;        // seconds in start, step and finish
+    } Slot;
+
+    ThreadPool pool;
+    std::vector<Slot *> slots;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int running;
+
+    static void stepTask(void *context);
+
+public:
+    SessionHost(int threads);
+    ~SessionHost();
+
+    int add(TrackingSession *session);
+    void run();
+
+    int size() const;
+    int threadCount() const;
+    int status(int session) const;
+    int steps(int session) const;
+    double busyTime(int session) const;
+};
+
+#endif // SESSIONHOST_H
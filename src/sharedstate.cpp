@@ -0,0 +1,287 @@
+#include "sharedstate.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t align8(size_t size)
+{
+    return (size + 7) & ~(size_t) 7;
+}
+
+static size_t mapBufferSize(uint32_t capacity)
+{
+    return align8( sizeof(SharedMap) + 3 * sizeof(float) * capacity );
+}
+
+SharedPublisher::SharedPublisher()
+{
+    this->region = NULL;
+    this->region_size = 0;
+    this->header = NULL;
+}
+
+SharedPublisher::~SharedPublisher()
+{
+    close();
+}
+
+/**
+ * Make the shared memory object name (starting with a '/') for
+ * pose_capacity poses and maps of map_capacity points, replacing what was
+ * there under that name.
+ **/
+bool SharedPublisher::open(const std::string &name, int pose_capacity, int map_capacity)
+{
+    close();
+    size_t poses_offset = align8( sizeof(SharedHeader) );
+    size_t maps_offset = poses_offset + align8( sizeof(SharedPose) * pose_capacity );
+    size_t size = maps_offset + 2 * mapBufferSize( map_capacity );
+
+    int fd = shm_open( name.c_str(), O_CREAT | O_RDWR, 0644 );
+    if ( fd < 0 ) {
+        return false;
+    }
+    if ( ftruncate( fd, size ) != 0 ) {
+        ::close( fd );
+        return false;
+    }
+    void *memory = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    ::close( fd );
+    if ( memory == MAP_FAILED ) {
+        return false;
+    }
+    this->name = name;
+    region = memory;
+    region_size = size;
+    header = (SharedHeader *) region;
+
+    // Readers check the magic number, it goes in last
+    header->magic = 0;
+    __sync_synchronize();
+    memset( (char *) region + sizeof(uint32_t), 0, size - sizeof(uint32_t) );
+    header->version = SHARED_STATE_VERSION;
+    header->pose_capacity = pose_capacity;
+    header->map_capacity = map_capacity;
+    header->poses_offset = poses_offset;
+    header->maps_offset[0] = maps_offset;
+    header->maps_offset[1] = maps_offset + mapBufferSize( map_capacity );
+    __sync_synchronize();
+    header->magic = SHARED_STATE_MAGIC;
+    return true;
+}
+
+/**
+ * Unmap and remove the object; readers that have it mapped keep their copy.
+ **/
+void SharedPublisher::close()
+{
+    if ( region == NULL ) {
+        return;
+    }
+    munmap( region, region_size );
+    shm_unlink( name.c_str() );
+    region = NULL;
+    header = NULL;
+}
+
+bool SharedPublisher::isOpen() const
+{
+    return region != NULL;
+}
+
+/**
+ * Add the pose (world to camera) of frame, taken at timestamp, to the ring.
+ **/
+void SharedPublisher::publishPose(double timestamp, int frame, const cv::Matx44d &pose)
+{
+    if ( header == NULL ) {
+        return;
+    }
+    uint64_t n = header->pose_count;
+    SharedPose *slot = (SharedPose *) ( (char *) region + header->poses_offset ) + n % header->pose_capacity;
+
+    uint32_t sequence = slot->sequence;
+    slot->sequence = sequence + 1;
+    __sync_synchronize();
+    slot->frame = frame;
+    slot->index = n;
+    slot->timestamp = timestamp;
+    for ( int i = 0; i < 12; i++ ) {
+        slot->pose[i] = pose(i / 4, i % 4);
+    }
+    __sync_synchronize();
+    slot->sequence = sequence + 2;
+    __sync_synchronize();
+    header->pose_count = n + 1;
+}
+
+/**
+ * Copy the points of cloud into the buffer readers are not pointed at, then
+ * point them at it. Points beyond the capacity are left out.
+ **/
+void SharedPublisher::publishMap(const Cloud<cv::Point3d> &cloud, int frame_nr)
+{
+    if ( header == NULL ) {
+        return;
+    }
+    uint32_t target = header->map_count == 0 ? 0 : header->map_current ^ 1;
+    SharedMap *map = (SharedMap *) ( (char *) region + header->maps_offset[target] );
+    float *points = (float *) ( map + 1 );
+
+    uint32_t sequence = map->sequence;
+    map->sequence = sequence + 1;
+    __sync_synchronize();
+    CloudView<cv::Point3d> view = cloud.view();
+    uint32_t count = std::min( (uint32_t) view.size(), header->map_capacity );
+    for ( int axis = 0; axis < 3; axis++ ) {
+        const double *column = view.column( axis );
+        for ( uint32_t n = 0; n < count; n++ ) {
+            points[3 * n + axis] = column[n];
+        }
+    }
+    map->frame_nr = frame_nr;
+    map->count = count;
+    map->total = view.size();
+    __sync_synchronize();
+    map->sequence = sequence + 2;
+    __sync_synchronize();
+    header->map_current = target;
+    header->map_count = header->map_count + 1;
+}
+
+SharedReader::SharedReader()
+{
+    this->region = NULL;
+    this->region_size = 0;
+    this->header = NULL;
+}
+
+SharedReader::~SharedReader()
+{
+    close();
+}
+
+/**
+ * Map the object name read only. Fails when there is none, or it is not
+ * (yet) set up by a publisher of this version.
+ **/
+bool SharedReader::open(const std::string &name)
+{
+    close();
+    int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+    if ( fd < 0 ) {
+        return false;
+    }
+    struct stat status;
+    if ( fstat( fd, &status ) != 0 || (size_t) status.st_size < sizeof(SharedHeader) ) {
+        ::close( fd );
+        return false;
+    }
+    void *memory = mmap( NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    ::close( fd );
+    if ( memory == MAP_FAILED ) {
+        return false;
+    }
+    region = memory;
+    region_size = status.st_size;
+    header = (const SharedHeader *) region;
+
+    bool valid = header->magic == SHARED_STATE_MAGIC;
+    __sync_synchronize();
+    valid = valid && header->version == SHARED_STATE_VERSION &&
+            header->maps_offset[1] + mapBufferSize( header->map_capacity ) <= region_size;
+    if ( !valid ) {
+        close();
+    }
+    return valid;
+}
+
+void SharedReader::close()
+{
+    if ( region != NULL ) {
+        munmap( region, region_size );
+    }
+    region = NULL;
+    header = NULL;
+}
+
+uint64_t SharedReader::poseCount() const
+{
+    return header == NULL ? 0 : header->pose_count;
+}
+
+/**
+ * Copy pose number n (0 is the first one published). Fails when it is not
+ * published yet, or the ring has moved on past it.
+ **/
+bool SharedReader::pose(uint64_t n, SharedPose &pose) const
+{
+    if ( header == NULL || n >= header->pose_count ) {
+        return false;
+    }
+    const SharedPose *slot = (const SharedPose *) ( (const char *) region + header->poses_offset ) +
+                             n % header->pose_capacity;
+    for ( ;; ) {
+        uint32_t sequence = slot->sequence;
+        __sync_synchronize();
+        if ( sequence & 1 ) {
+            continue;
+        }
+        pose.frame = slot->frame;
+        pose.index = slot->index;
+        pose.timestamp = slot->timestamp;
+        for ( int i = 0; i < 12; i++ ) {
+            pose.pose[i] = slot->pose[i];
+        }
+        __sync_synchronize();
+        if ( slot->sequence == sequence ) {
+            pose.sequence = sequence;
+            return pose.index == n;
+        }
+    }
+}
+
+bool SharedReader::latestPose(SharedPose &pose) const
+{
+    uint64_t count = poseCount();
+    return count > 0 && this->pose( count - 1, pose );
+}
+
+/**
+ * The newest complete map, NULL before the first one. Its points can be
+ * read in place; endMap tells whether they held still meanwhile.
+ **/
+const SharedMap *SharedReader::beginMap(uint32_t &sequence) const
+{
+    if ( header == NULL || header->map_count == 0 ) {
+        return NULL;
+    }
+    for ( ;; ) {
+        uint32_t current = header->map_current;
+        __sync_synchronize();
+        const SharedMap *map = (const SharedMap *) ( (const char *) region + header->maps_offset[current & 1] );
+        sequence = map->sequence;
+        __sync_synchronize();
+        if ( !(sequence & 1) ) {
+            return map;
+        }
+    }
+}
+
+/**
+ * x, y, z of the points of map, map->count of them.
+ **/
+const float *SharedReader::mapPoints(const SharedMap *map) const
+{
+    return (const float *) ( map + 1 );
+}
+
+bool SharedReader::endMap(const SharedMap *map, uint32_t sequence) const
+{
+    __sync_synchronize();
+    return map->sequence == sequence;
+}
@@ -0,0 +1,124 @@
+#ifndef SHAREDSTATE_H
+#define SHAREDSTATE_H
+
+#include <opencv2/core/core.hpp>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "cloud.hpp"
+
+#define SHARED_STATE_MAGIC 0x4e415653      // "NAVS" in the byte order of the machine
+#define SHARED_STATE_VERSION 1
+
+/**
+ * One pose in the ring. sequence is odd while the slot is being written.
+ * pose is the 3x4 world to camera matrix, row by row.
+ **/
+typedef struct {
+    volatile uint32_t sequence;
+    int32_t frame;
+    uint64_t index;             // pose number, tells whether the slot was reused
+    double timestamp;
+    double pose[12];
+} SharedPose;
+
+/**
+ * Head of one of the two map buffers, followed by 3 * capacity floats
+ * (x, y, z per point). sequence is odd while the buffer is being written.
+ **/
+typedef struct {
+    volatile uint32_t sequence;
+    int32_t frame_nr;
+    uint32_t count;             // points in the buffer
+    uint32_t total;             // points in the map, more than count when it did not fit
+} SharedMap;
+
+/**
+ * Start of the shared memory region; the pose ring and the two map
+ * buffers follow at the offsets given.
+ **/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pose_capacity;
+    uint32_t map_capacity;
+    uint64_t poses_offset;
+    uint64_t maps_offset[2];
+    volatile uint64_t pose_count;       // poses written so far, the newest is in slot (count - 1) % capacity
+    volatile uint32_t map_current;      // buffer holding the newest complete map
+    volatile uint32_t map_count;        // maps written so far
+} SharedHeader;
+
+/**
+ * Publishes the poses and the map of a run in a POSIX shared memory object,
+ * for other processes on the machine (a controller, a viewer, a logger) to
+ * read while it runs.
+ *
+ * Poses go into a ring of fixed size; every slot is a seqlock, so the
+ * writer never waits for readers and a reader finds out from the sequence
+ * whether the writer came by while it read. The map goes into one of two
+ * buffers, the one readers are not pointed at, and map_current is switched
+ * once it is complete. A reader works on the current buffer in place, no
+ * copy needed, and checks its sequence afterwards: it only changes when the
+ * writer has come round to that buffer again, two maps later.
+ *
+ * The object is made (or resized) by the publisher and removed when it is
+ * destroyed. Layout and values are native to the machine.
+ **/
+class SharedPublisher
+{
+    std::string name;
+    void *region;
+    size_t region_size;
+    SharedHeader *header;
+
+public:
+    SharedPublisher();
+    ~SharedPublisher();
+
+    bool open(const std::string &name, int pose_capacity, int map_capacity);
+    void close();
+    bool isOpen() const;
+
+    void publishPose(double timestamp, int frame, const cv::Matx44d &pose);
+    void publishMap(const Cloud<cv::Point3d> &cloud, int frame_nr);
+};
+
+/**
+ * Reading side of a SharedPublisher, for other processes.
+ *
+ *     SharedReader reader;
+ *     reader.open( "/navigate" );
+ *     SharedPose pose;
+ *     if ( reader.latestPose( pose ) ) { ... }
+ *
+ *     uint32_t sequence;
+ *     const SharedMap *map = reader.beginMap( sequence );
+ *     ... reader.mapPoints( map )[3 * n] ...
+ *     if ( !reader.endMap( map, sequence ) ) { the map changed underneath, start over }
+ **/
+class SharedReader
+{
+    void *region;
+    size_t region_size;
+    const SharedHeader *header;
+
+public:
+    SharedReader();
+    ~SharedReader();
+
+    bool open(const std::string &name);
+    void close();
+
+    uint64_t poseCount() const;
+    bool pose(uint64_t n, SharedPose &pose) const;
+    bool latestPose(SharedPose &pose) const;
+
+    const SharedMap *beginMap(uint32_t &sequence) const;
+    const float *mapPoints(const SharedMap *map) const;
+    bool endMap(const SharedMap *map, uint32_t sequence) const;
+};
+
+#endif // SHAREDSTATE_H
@@ -0,0 +1,213 @@
+#include "../bundleadjuster.hpp"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Checks of the bundle adjuster on a synthetic scene: cameras on an arc
+ * looking at a cloud of points, started from perturbed poses and points.
+ * The first two cameras are fixed, they hold the gauge (position, rotation
+ * and scale). Also checks that points are not moved behind a camera to get
+ * rid of their residuals. Returns non-zero on failure.
+ **/
+
+#define CAMERAS 8
+#define POINTS 600
+
+static double uniform(double low, double high)
+{
+    return low + (high - low) * rand() / (double) RAND_MAX;
+}
+
+static cv::Matx34d makePose(const cv::Matx31d &rotation, const cv::Matx31d &centre)
+{
+    cv::Matx33d R;
+    cv::Rodrigues( rotation, R );
+    cv::Matx31d t = -( R * centre );
+    return cv::Matx34d( R(0,0), R(0,1), R(0,2), t(0),
+                        R(1,0), R(1,1), R(1,2), t(1),
+                        R(2,0), R(2,1), R(2,2), t(2) );
+}
+
+static cv::Point2d project(const cv::Matx33d &K, const cv::Matx34d &pose, const cv::Point3d &X)
+{
+    cv::Matx31d x = K * ( pose * cv::Matx41d( X.x, X.y, X.z, 1.0 ) );
+    return cv::Point2d( x(0) / x(2), x(1) / x(2) );
+}
+
+typedef struct {
+    std::vector<cv::Matx34d> poses;
+    std::vector<cv::Point3d> points;
+    std::vector<int> camera;
+    std::vector<int> point;
+    std::vector<cv::Point2d> measurements;
+} Scene;
+
+/**
+ * Every point is seen by about two thirds of the cameras, measured with
+ * pixel_noise and, for one in outlier_every observations, 30 pixels off.
+ **/
+static Scene makeScene(const cv::Matx33d &K, double pixel_noise, int outlier_every)
+{
+    Scene scene;
+    for ( int c = 0; c < CAMERAS; c++ ) {
+        scene.poses.push_back( makePose( cv::Matx31d(0.02 * c, -0.05 * c, 0.0), cv::Matx31d(0.3 * c, 0.0, 0.0) ) );
+    }
+    for ( int j = 0; j < POINTS; j++ ) {
+        scene.points.push_back( cv::Point3d( uniform(-2, 4), uniform(-2, 2), uniform(5, 8) ) );
+        for ( int c = 0; c < CAMERAS; c++ ) {
+            if ( rand() % 3 == 0 ) {
+                continue;
+            }
+            cv::Point2d z = project( K, scene.poses[c], scene.points[j] );
+            z += cv::Point2d( uniform(-pixel_noise, pixel_noise), uniform(-pixel_noise, pixel_noise) );
+            if ( outlier_every > 0 && rand() % outlier_every == 0 ) {
+                z.x += 30.0;
+            }
+            scene.camera.push_back( c );
+            scene.point.push_back( j );
+            scene.measurements.push_back( z );
+        }
+    }
+    return scene;
+}
+
+/**
+ * Load scene into ba with the free cameras and all points perturbed.
+ **/
+static void addPerturbed(BundleAdjuster &ba, const Scene &scene)
+{
+    ba.clear();
+    for ( int c = 0; c < CAMERAS; c++ ) {
+        cv::Matx34d pose = scene.poses[c];
+        if ( c >= 2 ) {
+            cv::Matx31d centre( 0.3 * c + uniform(-0.05, 0.05), uniform(-0.05, 0.05), uniform(-0.05, 0.05) );
+            cv::Matx31d rotation( 0.02 * c + uniform(-0.01, 0.01), -0.05 * c + uniform(-0.01, 0.01), uniform(-0.01, 0.01) );
+            pose = makePose( rotation, centre );
+        }
+        ba.addCamera( pose, c < 2 );
+    }
+    for ( int j = 0; j < POINTS; j++ ) {
+        ba.addPoint( scene.points[j] + cv::Point3d( uniform(-0.1, 0.1), uniform(-0.1, 0.1), uniform(-0.1, 0.1) ) );
+    }
+    for ( size_t n = 0; n < scene.measurements.size(); n++ ) {
+        ba.addObservation( scene.camera[n], scene.point[n], scene.measurements[n] );
+    }
+}
+
+/**
+ * Root mean square reprojection error in pixels of the current estimate,
+ * leaving out observations further off than max_error.
+ **/
+static double reprojectionError(const cv::Matx33d &K, const BundleAdjuster &ba, const Scene &scene, double max_error)
+{
+    double sum = 0.0;
+    int count = 0;
+    for ( size_t n = 0; n < scene.measurements.size(); n++ ) {
+        cv::Point2d e = project( K, ba.getCamera(scene.camera[n]), ba.getPoint(scene.point[n]) ) - scene.measurements[n];
+        double squared = e.x * e.x + e.y * e.y;
+        if ( squared <= max_error * max_error ) {
+            sum += squared;
+            count++;
+        }
+    }
+    return count > 0 ? sqrt( sum / count ) : 0.0;
+}
+
+/**
+ * Largest difference between an estimated camera and the true one.
+ **/
+static double poseError(const BundleAdjuster &ba, const Scene &scene)
+{
+    double worst = 0.0;
+    for ( int c = 0; c < CAMERAS; c++ ) {
+        cv::Matx34d difference = ba.getCamera(c) - scene.poses[c];
+        worst = std::max( worst, cv::norm( difference ) );
+    }
+    return worst;
+}
+
+/**
+ * Whether the fixed cameras came back exactly as they went in.
+ **/
+static bool gaugeKept(const BundleAdjuster &ba, const Scene &scene)
+{
+    for ( int c = 0; c < 2; c++ ) {
+        cv::Matx34d pose = ba.getCamera(c);
+        for ( int k = 0; k < 12; k++ ) {
+            if ( pose.val[k] != scene.poses[c].val[k] ) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    srand( 1 );
+    int failures = 0;
+    cv::Matx33d K( 500, 0, 320, 0, 500, 240, 0, 0, 1 );
+    BundleAdjuster ba( K );
+    ba.setMaxIterations( 100 );
+    ba.setTimeBudget( 10000 );
+
+    // Exact measurements: the fixed cameras pin the solution to the truth
+    Scene exact = makeScene( K, 0.0, 0 );
+    addPerturbed( ba, exact );
+    double initial = reprojectionError( K, ba, exact, 1e9 );
+    bool ok = ba.optimize();
+    double final = reprojectionError( K, ba, exact, 1e9 );
+    double pose_error = poseError( ba, exact );
+    if ( !ok || final > 1e-6 || pose_error > 1e-6 || !gaugeKept( ba, exact ) ) {
+        printf( "Exact: reprojection %g -> %g px in %d iterations, pose error %g, gauge %s\n", initial, final,
+                ba.iterationCount(), pose_error, gaugeKept( ba, exact ) ? "kept" : "moved" );
+        failures++;
+    }
+
+    // Half a pixel of noise and 2% outliers: the inliers end up at the noise
+    // level (0.41 pixels), the cameras much closer to the truth than they
+    // started; how close is limited by the short baseline of the gauge
+    Scene noisy = makeScene( K, 0.5, 50 );
+    addPerturbed( ba, noisy );
+    initial = reprojectionError( K, ba, noisy, 1e9 );
+    double initial_pose_error = poseError( ba, noisy );
+    ok = ba.optimize();
+    final = reprojectionError( K, ba, noisy, 5.0 );
+    pose_error = poseError( ba, noisy );
+    if ( !ok || ba.finalCost() >= ba.initialCost() || final > 0.6 || pose_error > 0.02 ||
+         pose_error > initial_pose_error / 4 || !gaugeKept( ba, noisy ) ) {
+        printf( "Noisy: reprojection %g -> %g px in %d iterations, cost %g -> %g, pose error %g -> %g, gauge %s\n",
+                initial, final, ba.iterationCount(), ba.initialCost(), ba.finalCost(), initial_pose_error,
+                pose_error, gaugeKept( ba, noisy ) ? "kept" : "moved" );
+        failures++;
+    }
+
+    // Two fixed cameras facing each other, points just in front of the second
+    // one that it sees far off: moving them behind it along the ray of the
+    // first would get rid of those residuals, but must not happen
+    ba.clear();
+    ba.addCamera( cv::Matx34d( 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0 ), true );
+    ba.addCamera( cv::Matx34d( -1, 0, 0, 0, 0, 1, 0, 0, 0, 0, -1, 10 ), true );
+    for ( int j = 0; j < 20; j++ ) {
+        cv::Point3d X( 0.01 * j, 0.0, 9.6 );
+        ba.addPoint( X );
+        ba.addObservation( 0, j, project( K, cv::Matx34d( 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0 ), X ) );
+        ba.addObservation( 1, j, cv::Point2d( 720, 540 ) );
+    }
+    ba.optimize();
+    int behind = 0;
+    for ( int j = 0; j < 20; j++ ) {
+        behind += ba.getPoint(j).z >= 10.0;
+    }
+    if ( behind > 0 ) {
+        printf( "Behind: %d of 20 points moved behind the camera, cost %g -> %g\n", behind, ba.initialCost(),
+                ba.finalCost() );
+        failures++;
+    }
+
+    printf( "%s\n", failures == 0 ? "bundleadjuster_test passed" : "bundleadjuster_test FAILED" );
+    return failures != 0;
+}
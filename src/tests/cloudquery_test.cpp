@@ -0,0 +1,194 @@
+#include "../cloudquery.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Checks of the cloud query engine against a plain loop over the slots:
+ * query_select over views of many sizes (most not a multiple of 64, some
+ * spanning several blocks), with holes left by removed points, on one and
+ * on several threads, and query_gather with float and byte descriptors of
+ * several bytes per row. Returns non-zero on failure.
+ **/
+
+static double uniform(double low, double high)
+{
+    return low + (high - low) * rand() / (double) RAND_MAX;
+}
+
+/**
+ * Cloud of n points in a 20 unit cube, point k added in frame k / 10 and
+ * seen in k % 5 frames, every seventh one removed again. Descriptor rows
+ * are unique per point.
+ **/
+static void fillCloud(Cloud<cv::Point3d> &cloud, int n, int descriptor_type, int descriptor_cols)
+{
+    for ( int k = 0; k < n; k++ ) {
+        cv::Mat descriptor( 1, descriptor_cols, descriptor_type );
+        for ( int c = 0; c < descriptor_cols; c++ ) {
+            if ( descriptor_type == CV_32F ) {
+                descriptor.at<float>(0, c) = k * 100 + c;
+            } else {
+                descriptor.at<unsigned char>(0, c) = ( k * 7 + c * 13 ) & 0xff;
+            }
+        }
+        cv::Point3d p( uniform(-10, 10), uniform(-10, 10), uniform(-10, 10) );
+        int id = cloud.add( p, descriptor, k / 10 );
+        for ( int frame = 0; frame < k % 5; frame++ ) {
+            cloud.observations().add( id, frame, 0 );
+        }
+    }
+    for ( int k = 3; k < n; k += 7 ) {
+        cloud.remove( k );
+    }
+}
+
+/**
+ * Slot by slot: inside the box or added in frames 10 to 30, seen two or
+ * three times, and further than 6 from the camera centre (1, -2, -0.5).
+ **/
+static bool combinedReference(const CloudView<cv::Point3d> &view, const ObservationTable &table, int slot)
+{
+    cv::Point3d p = view.get_point( slot );
+    bool box = p.x >= -5 && p.x <= 3 && p.y >= -5 && p.y <= 4 && p.z >= -5 && p.z <= 5;
+    bool frames = view.frame( slot ) >= 10 && view.frame( slot ) <= 30;
+    int seen = table.observationCount( view.id( slot ) );
+    cv::Point3d d = p - cv::Point3d( 1, -2, -0.5 );
+    return ( box || frames ) && seen >= 2 && seen <= 3 && d.dot( d ) > 36;
+}
+
+static bool frustumReference(const CloudView<cv::Point3d> &view, const cv::Matx33d &K, const cv::Matx34d &pose,
+                             cv::Size image_size, double margin, int slot)
+{
+    cv::Point3d X = view.get_point( slot );
+    cv::Matx31d x = K * ( pose * cv::Matx41d( X.x, X.y, X.z, 1.0 ) );
+    if ( x(2) <= 1e-9 ) {
+        return false;
+    }
+    double u = x(0) / x(2), v = x(1) / x(2);
+    return u >= -margin && u <= image_size.width + margin && v >= -margin && v <= image_size.height + margin;
+}
+
+/**
+ * Compare a selection with the reference slots, and what query_gather
+ * copies for it with the cloud. Returns the number of differences.
+ **/
+static int checkSelection(const char *name, const Cloud<cv::Point3d> &cloud, const CloudView<cv::Point3d> &view,
+                          const Selection &selection, int selected, const std::vector<int> &expected)
+{
+    int differences = 0;
+    std::vector<int> slots;
+    selection.get_slots( slots );
+    if ( slots != expected || selected != (int) expected.size() || selection.count() != selected ) {
+        differences++;
+    }
+
+    int begin = 0, end = 0, in_runs = 0;
+    while ( selection.next_run( begin, end ) ) {
+        in_runs += end - begin;
+    }
+    if ( in_runs != selected ) {
+        differences++;
+    }
+
+    std::vector<cv::Point3d> points;
+    std::vector<int> ids;
+    cv::Mat descriptors;
+    query_gather( view, selection, &points, &ids, &descriptors );
+    if ( points.size() != expected.size() || ids.size() != expected.size() ||
+         descriptors.rows != (int) expected.size() ) {
+        printf( "%s: gathered %d points, %d ids, %d descriptors for %d slots\n", name, (int) points.size(),
+                (int) ids.size(), descriptors.rows, (int) expected.size() );
+        return differences + 1;
+    }
+    for ( size_t n = 0; n < expected.size(); n++ ) {
+        cv::Point3d p = view.get_point( expected[n] );
+        if ( points[n].x != p.x || points[n].y != p.y || points[n].z != p.z || ids[n] != view.id( expected[n] ) ) {
+            differences++;
+            continue;
+        }
+        cv::Mat row = cloud.get_descriptor( ids[n] );
+        if ( row.type() != descriptors.type() || row.cols != descriptors.cols ||
+             memcmp( descriptors.ptr( n ), row.ptr(0), row.cols * row.elemSize() ) != 0 ) {
+            differences++;
+        }
+    }
+    if ( differences > 0 ) {
+        printf( "%s: %d differences, %d slots selected of %d, %d expected\n", name, differences, selected,
+                view.size(), (int) expected.size() );
+    }
+    return differences;
+}
+
+int main()
+{
+    srand( 1 );
+    int failures = 0;
+    cv::Matx44d pose = cv::Matx44d::eye();
+    pose(0,3) = -1;
+    pose(1,3) = 2;
+    pose(2,3) = 0.5;
+    cv::Matx33d K( 300, 0, 160, 0, 300, 120, 0, 0, 1 );
+    cv::Size image_size( 320, 240 );
+
+    // Sizes left after removing every seventh point: 1, 55, 64, 65, 863 and
+    // 3859 slots, the last over several blocks
+    const int sizes[] = { 1, 64, 75, 76, 1007, 4502 };
+    for ( size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ ) {
+        for ( int type = 0; type < 2; type++ ) {
+            Cloud<cv::Point3d> cloud;
+            fillCloud( cloud, sizes[s], type == 0 ? CV_32F : CV_8U, type == 0 ? 8 : 32 );
+            const ObservationTable &table = cloud.observations();
+            QueryAnd<QueryOr<QueryBox, QueryFrames>, QueryAnd<QueryObservations, QueryNot<QueryDistance> > > query =
+                query_and( query_or( QueryBox( cv::Point3d(-5, -5, -5), cv::Point3d(3, 4, 5) ), QueryFrames( 10, 30 ) ),
+                           query_and( QueryObservations( table, 2, 3 ), query_not( QueryDistance( pose, 6.0 ) ) ) );
+            QueryFrustum frustum( K, pose.get_minor<3, 4>(0, 0), image_size, 20 );
+
+            CloudSnapshot<cv::Point3d> snapshot;
+            cloud.snapshot( snapshot );
+            for ( int pass = 0; pass < 2; pass++ ) {
+                CloudView<cv::Point3d> view = pass == 0 ? cloud.view() : snapshot.view();
+                std::vector<int> combined, in_view;
+                for ( int slot = 0; slot < view.size(); slot++ ) {
+                    if ( combinedReference( view, table, slot ) ) {
+                        combined.push_back( slot );
+                    }
+                    if ( frustumReference( view, K, pose.get_minor<3, 4>(0, 0), image_size, 20, slot ) ) {
+                        in_view.push_back( slot );
+                    }
+                }
+                for ( int threads = 1; threads <= 4; threads += 3 ) {
+                    char name[64];
+                    sprintf( name, "%d slots, %s, %s, %d threads", view.size(), type == 0 ? "float" : "byte",
+                             pass == 0 ? "cloud" : "snapshot", threads );
+                    Selection selection;
+                    int selected = query_select( view, query, selection, threads );
+                    failures += checkSelection( name, cloud, view, selection, selected, combined ) > 0;
+                    selected = query_select( view, frustum, selection, threads );
+                    failures += checkSelection( name, cloud, view, selection, selected, in_view ) > 0;
+
+                    // Everything, as the union of a selection and its inverse
+                    Selection inverse = selection;
+                    inverse.invert();
+                    Selection all = selection;
+                    all |= inverse;
+                    inverse &= selection;
+                    if ( all.count() != view.size() || !inverse.empty() ) {
+                        printf( "%s: inverse overlaps or leaves out slots\n", name );
+                        failures++;
+                    }
+                    std::vector<int> every( view.size() );
+                    for ( int slot = 0; slot < view.size(); slot++ ) {
+                        every[slot] = slot;
+                    }
+                    failures += checkSelection( name, cloud, view, all, all.count(), every ) > 0;
+                }
+            }
+        }
+    }
+
+    printf( "%s\n", failures == 0 ? "cloudquery_test passed" : "cloudquery_test FAILED" );
+    return failures != 0;
+}
@@ -0,0 +1,131 @@
+#include "../posegraph.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Checks of the pose graph solver: the analytic edge Jacobians against
+ * central differences, and a perturbed loop settling back on its
+ * measurements. Returns non-zero on failure.
+ **/
+
+static double uniform(double low, double high)
+{
+    return low + (high - low) * rand() / (double) RAND_MAX;
+}
+
+/**
+ * The left update the solver applies: R <- exp(w) * R, t <- exp(w) * t + v.
+ **/
+static cv::Matx44d leftUpdate(const cv::Matx61d &d, const cv::Matx44d &T)
+{
+    cv::Matx33d dR;
+    cv::Rodrigues( cv::Matx31d(d(0), d(1), d(2)), dR );
+    cv::Matx44d update = cv::Matx44d::eye();
+    for ( int i = 0; i < 3; i++ ) {
+        for ( int j = 0; j < 3; j++ ) {
+            update(i,j) = dR(i,j);
+        }
+        update(i,3) = d(3 + i);
+    }
+    return update * T;
+}
+
+static cv::Matx44d randomPose(double angle, double distance)
+{
+    cv::Matx61d d;
+    for ( int k = 0; k < 3; k++ ) {
+        d(k) = uniform( -angle, angle );
+        d(k + 3) = uniform( -distance, distance );
+    }
+    return leftUpdate( d, cv::Matx44d::eye() );
+}
+
+/**
+ * Largest difference between the analytic Jacobians of a two node edge and
+ * central differences, over both nodes.
+ **/
+static double jacobianError(const cv::Matx44d &from, const cv::Matx44d &to, const cv::Matx44d &measurement)
+{
+    PoseGraph graph;
+    graph.addNode( from, 0 );
+    graph.addNode( to, 1 );
+    graph.addOdometryEdge( 0, 1, measurement, PoseInformation(1.0, 1.0) );
+    cv::Matx61d r;
+    cv::Matx66d J[2];
+    graph.edgeResidual( 0, r, &J[0], &J[1] );
+
+    const double h = 1e-6;
+    double worst = 0.0;
+    for ( int node = 0; node < 2; node++ ) {
+        for ( int k = 0; k < 6; k++ ) {
+            cv::Matx61d d = cv::Matx61d::zeros();
+            cv::Matx61d r_plus, r_minus;
+            for ( int sign = -1; sign <= 1; sign += 2 ) {
+                d(k) = sign * h;
+                PoseGraph moved;
+                moved.addNode( node == 0 ? leftUpdate( d, from ) : from, 0 );
+                moved.addNode( node == 1 ? leftUpdate( d, to ) : to, 1 );
+                moved.addOdometryEdge( 0, 1, measurement, PoseInformation(1.0, 1.0) );
+                moved.edgeResidual( 0, sign > 0 ? r_plus : r_minus );
+            }
+            for ( int i = 0; i < 6; i++ ) {
+                double numeric = ( r_plus(i) - r_minus(i) ) / (2 * h);
+                worst = std::max( worst, fabs( numeric - J[node](i,k) ) );
+            }
+        }
+    }
+    return worst;
+}
+
+int main()
+{
+    srand( 1 );
+    int failures = 0;
+
+    // Residuals from none to large, rotations up to about 60 degrees
+    for ( int trial = 0; trial < 50; trial++ ) {
+        cv::Matx44d from = randomPose( 0.6, 2.0 );
+        cv::Matx44d to = randomPose( 0.6, 2.0 );
+        cv::Matx44d exact = to * from.inv();
+        cv::Matx44d measurement = trial % 2 == 0 ? exact : randomPose( 0.5, 1.0 ) * exact;
+        double error = jacobianError( from, to, measurement );
+        if ( error > 1e-6 ) {
+            printf( "Jacobian trial %d: largest difference %g\n", trial, error );
+            failures++;
+        }
+    }
+
+    // A square loop of five nodes, the last one revisiting the first
+    std::vector<cv::Matx44d> truth;
+    for ( int n = 0; n < 5; n++ ) {
+        cv::Matx61d d = cv::Matx61d::zeros();
+        d(1) = n * M_PI / 2;
+        d(3) = n % 4 == 1 || n % 4 == 2 ? 1.0 : 0.0;
+        d(5) = n % 4 >= 2 ? 1.0 : 0.0;
+        truth.push_back( leftUpdate( d, cv::Matx44d::eye() ) );
+    }
+    PoseGraph graph;
+    for ( int n = 0; n < 5; n++ ) {
+        graph.addNode( n == 0 ? truth[0] : randomPose( 0.1, 0.2 ) * truth[n], n );
+    }
+    for ( int n = 1; n < 5; n++ ) {
+        graph.addOdometryEdge( n - 1, n, truth[n] * truth[n - 1].inv(), PoseInformation(1.0, 1.0) );
+    }
+    graph.addLoopEdge( 0, 4, truth[4] * truth[0].inv(), PoseInformation(10.0, 10.0) );
+    graph.optimize();
+    double pose_error = 0.0;
+    for ( int n = 0; n < 5; n++ ) {
+        cv::Matx44d difference = graph.getPose(n) - truth[n];
+        pose_error = std::max( pose_error, cv::norm( difference ) );
+    }
+    if ( graph.finalCost() > 1e-10 || pose_error > 1e-5 ) {
+        printf( "Loop: cost %g -> %g in %d iterations, pose error %g\n", graph.initialCost(),
+                graph.finalCost(), graph.iterationCount(), pose_error );
+        failures++;
+    }
+
+    printf( "%s\n", failures == 0 ? "posegraph_test passed" : "posegraph_test FAILED" );
+    return failures != 0;
+}
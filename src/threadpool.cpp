@@ -0,0 +1,211 @@
+#include "threadpool.hpp"
+
+#include "parallel.hpp"
+
+// Worker of the calling thread, NULL outside of a pool
+static __thread void *current_worker = NULL;
+
+ThreadPool::ThreadPool(int threads)
+{
+    this->queued = 0;
+    this->stopping = false;
+    this->next_worker = 0;
+    pthread_mutex_init( &idle_lock, NULL );
+    pthread_cond_init( &idle, NULL );
+
+    if ( threads < 1 ) {
+        threads = defaultThreadCount();
+    }
+    for ( int i = 0; i < threads; i++ ) {
+        Worker *worker = new Worker;
+        worker->pool = this;
+        worker->index = i;
+        pthread_mutex_init( &worker->lock, NULL );
+        workers.push_back( worker );
+    }
+    // All deques exist before any worker looks for work to steal
+    for ( size_t i = 0; i < workers.size(); i++ ) {
+        pthread_create( &workers[i]->thread, NULL, run, workers[i] );
+    }
+}
+
+/**
+ * Stops the workers once all queued tasks have run.
+ **/
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock( &idle_lock );
+    stopping = true;
+    pthread_cond_broadcast( &idle );
+    pthread_mutex_unlock( &idle_lock );
+
+    // Every worker steals from every deque until it stops
+    for ( size_t i = 0; i < workers.size(); i++ ) {
+        pthread_join( workers[i]->thread, NULL );
+    }
+    for ( size_t i = 0; i < workers.size(); i++ ) {
+        pthread_mutex_destroy( &workers[i]->lock );
+        delete workers[i];
+    }
+    pthread_cond_destroy( &idle );
+    pthread_mutex_destroy( &idle_lock );
+}
+
+int ThreadPool::size() const
+{
+    return workers.size();
+}
+
+/**
+ * The pool the calling thread works for, NULL when it is not a worker.
+ **/
+ThreadPool *ThreadPool::current()
+{
+    return current_worker != NULL ? ((Worker *) current_worker)->pool : NULL;
+}
+
+void ThreadPool::push(int worker, const Task &task, bool newest)
+{
+    Worker *w = workers[worker];
+    pthread_mutex_lock( &w->lock );
+    if ( newest ) {
+        w->tasks.push_back( task );
+    } else {
+        w->tasks.push_front( task );
+    }
+    pthread_mutex_unlock( &w->lock );
+
+    // Counted before the idle lock is taken, so a worker about to sleep sees it
+    __sync_fetch_and_add( &queued, 1 );
+    pthread_mutex_lock( &idle_lock );
+    pthread_cond_signal( &idle );
+    pthread_mutex_unlock( &idle_lock );
+}
+
+bool ThreadPool::pop(int worker, Task &task)
+{
+    Worker *w = workers[worker];
+    bool found = false;
+    pthread_mutex_lock( &w->lock );
+    if ( !w->tasks.empty() ) {
+        task = w->tasks.back();
+        w->tasks.pop_back();
+        found = true;
+    }
+    pthread_mutex_unlock( &w->lock );
+    if ( found ) {
+        __sync_fetch_and_sub( &queued, 1 );
+    }
+    return found;
+}
+
+/**
+ * Take the oldest task of another worker, trying them in turn starting
+ * after thief.
+ **/
+bool ThreadPool::steal(int thief, Task &task)
+{
+    int n = workers.size();
+    for ( int i = 1; i < n; i++ ) {
+        Worker *w = workers[(thief + i) % n];
+        bool found = false;
+        pthread_mutex_lock( &w->lock );
+        if ( !w->tasks.empty() ) {
+            task = w->tasks.front();
+            w->tasks.pop_front();
+            found = true;
+        }
+        pthread_mutex_unlock( &w->lock );
+        if ( found ) {
+            __sync_fetch_and_sub( &queued, 1 );
+            return true;
+        }
+    }
+    return false;
+}
+
+void *ThreadPool::run(void *argument)
+{
+    Worker *worker = (Worker *) argument;
+    ThreadPool *pool = worker->pool;
+    current_worker = worker;
+
+    Task task;
+    while ( true ) {
+        if ( pool->pop( worker->index, task ) || pool->steal( worker->index, task ) ) {
+            task.function( task.context );
+            continue;
+        }
+        pthread_mutex_lock( &pool->idle_lock );
+        if ( __sync_fetch_and_add( &pool->queued, 0 ) == 0 ) {
+            if ( pool->stopping ) {
+                pthread_mutex_unlock( &pool->idle_lock );
+                break;
+            }
+            pthread_cond_wait( &pool->idle, &pool->idle_lock );
+        }
+        pthread_mutex_unlock( &pool->idle_lock );
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+/**
+ * Queue a task. From a worker it goes to that worker's own deque and is
+ * run next, unless another worker steals it first.
+ **/
+void ThreadPool::submit(TaskFunction function, void *context)
+{
+    Task task = { function, context };
+    Worker *worker = (Worker *) current_worker;
+    if ( worker != NULL && worker->pool == this ) {
+        push( worker->index, task, true );
+    } else {
+        push( __sync_fetch_and_add( &next_worker, 1 ) % workers.size(), task, true );
+    }
+}
+
+/**
+ * Queue a task behind all others of the calling worker, where it is also
+ * first in line to be stolen. For long running jobs that take turns on
+ * the pool, so that one of them can not keep a worker to itself.
+ **/
+void ThreadPool::defer(TaskFunction function, void *context)
+{
+    Task task = { function, context };
+    Worker *worker = (Worker *) current_worker;
+    if ( worker != NULL && worker->pool == this ) {
+        push( worker->index, task, false );
+    } else {
+        push( __sync_fetch_and_add( &next_worker, 1 ) % workers.size(), task, false );
+    }
+}
+
+/**
+ * Run the newest task of the calling worker's own deque, if it runs
+ * function. Returns false if it does not, there is none, or the caller is
+ * not a worker of this pool. Lets a task wait for the subtasks it queued
+ * by running them, without picking up an unrelated long task meanwhile.
+ **/
+bool ThreadPool::runLocal(TaskFunction function)
+{
+    Worker *worker = (Worker *) current_worker;
+    if ( worker == NULL || worker->pool != this ) {
+        return false;
+    }
+    Task task;
+    bool found = false;
+    pthread_mutex_lock( &worker->lock );
+    if ( !worker->tasks.empty() && worker->tasks.back().function == function ) {
+        task = worker->tasks.back();
+        worker->tasks.pop_back();
+        found = true;
+    }
+    pthread_mutex_unlock( &worker->lock );
+    if ( !found ) {
+        return false;
+    }
+    __sync_fetch_and_sub( &queued, 1 );
+    task.function( task.context );
+    return true;
+}
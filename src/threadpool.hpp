@@ -0,0 +1,66 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+/**
+ * Work function for a ThreadPool task. context is passed through untouched.
+ **/
+typedef void (*TaskFunction)(void *context);
+
+/**
+ * A fixed set of worker threads with a task deque each (work stealing).
+ *
+ * A worker runs the newest task of its own deque first, the task it just
+ * queued has its data in the cache. With its own deque empty it steals the
+ * oldest task of another worker, and with nothing to steal it sleeps until
+ * a task is queued. Tasks queued from outside the pool are dealt out round
+ * robin.
+ *
+ * parallelFor called from inside a task queues its chunks on the pool and
+ * helps running them, so nested parallel loops share the workers instead of
+ * starting threads of their own.
+ **/
+class ThreadPool
+{
+    typedef struct {
+        TaskFunction function;
+        void *context;
+    } Task;
+
+    typedef struct {
+        ThreadPool *pool;
+        int index;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        std::deque<Task> tasks;     // back is the newest
+    } Worker;
+
+    std::vector<Worker *> workers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    volatile int queued;            // tasks in the deques
+    volatile bool stopping;
+    unsigned next_worker;           // for tasks from outside the pool
+
+    static void *run(void *argument);
+    void push(int worker, const Task &task, bool newest);
+    bool pop(int worker, Task &task);
+    bool steal(int thief, Task &task);
+
+public:
+    ThreadPool(int threads);
+    ~ThreadPool();
+
+    int size() const;
+    void submit(TaskFunction function, void *context);
+    void defer(TaskFunction function, void *context);
+    bool runLocal(TaskFunction function);
+
+    static ThreadPool *current();
+};
+
+#endif // THREADPOOL_H
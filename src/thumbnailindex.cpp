@@ -0,0 +1,182 @@
+#include "thumbnailindex.hpp"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Sum of squared differences of two zero-mean thumbnails, n a multiple of 8.
+ * Values are within [-255, 255], so differences fit in 16 bits and the 32 bit
+ * sums cannot overflow for thumbnail sized inputs.
+ **/
+static int sumSquaredDifferences(const short *a, const short *b, int n)
+{
+#ifdef __SSE2__
+    __m128i sum = _mm_setzero_si128();
+    for ( int i = 0; i < n; i += 8 ) {
+        __m128i d = _mm_sub_epi16( _mm_loadu_si128( (const __m128i *) (a + i) ),
+                                   _mm_loadu_si128( (const __m128i *) (b + i) ) );
+        sum = _mm_add_epi32( sum, _mm_madd_epi16( d, d ) );
+    }
+    sum = _mm_add_epi32( sum, _mm_shuffle_epi32( sum, _MM_SHUFFLE(1, 0, 3, 2) ) );
+    sum = _mm_add_epi32( sum, _mm_shuffle_epi32( sum, _MM_SHUFFLE(2, 3, 0, 1) ) );
+    return _mm_cvtsi128_si32( sum );
+#else
+    int sum = 0;
+    for ( int i = 0; i < n; i++ ) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+#endif
+}
+
+static bool closer(const std::pair<int, int> &a, const std::pair<int, int> &b)
+{
+    return a.second < b.second;
+}
+
+ThumbnailIndex::ThumbnailIndex(int width, int height, double sigma)
+{
+    this->width = width;
+    this->height = height;
+    this->stride = (width * height + 7) / 8 * 8;
+    this->sigma = sigma;
+    this->query_thumbnail.resize( stride );
+}
+
+/**
+ * Downsample a grayscale image, blur it and subtract its mean, so that a
+ * global change in brightness does not count as a difference.
+ **/
+void ThumbnailIndex::makeThumbnail(const cv::Mat &image, short *thumbnail) const
+{
+    cv::Mat small;
+    cv::resize( image, small, cv::Size(width, height), 0, 0, cv::INTER_AREA );
+    cv::GaussianBlur( small, small, cv::Size(0, 0), sigma );
+
+    int total = 0;
+    for ( int y = 0; y < height; y++ ) {
+        const unsigned char *row = small.ptr<unsigned char>(y);
+        for ( int x = 0; x < width; x++ ) {
+            total += row[x];
+        }
+    }
+    int mean = total / (width * height);
+
+    int i = 0;
+    for ( int y = 0; y < height; y++ ) {
+        const unsigned char *row = small.ptr<unsigned char>(y);
+        for ( int x = 0; x < width; x++ ) {
+            thumbnail[i++] = (short) (row[x] - mean);
+        }
+    }
+    for ( ; i < stride; i++ ) {
+        thumbnail[i] = 0;
+    }
+}
+
+void ThumbnailIndex::clear()
+{
+    thumbnails.clear();
+    ids.clear();
+}
+
+/**
+ * Add the (grayscale) image of a keyframe under the given id.
+ **/
+void ThumbnailIndex::add(const cv::Mat &image, int id)
+{
+    thumbnails.resize( thumbnails.size() + stride );
+    makeThumbnail( image, &thumbnails[thumbnails.size() - stride] );
+    ids.push_back( id );
+}
+
+/**
+ * Add a thumbnail made by another index of the same size (thumbnailStride
+ * values, e.g. from thumbnailData), such as one read from a map file.
+ **/
+void ThumbnailIndex::addThumbnail(const short *thumbnail, int id)
+{
+    thumbnails.insert( thumbnails.end(), thumbnail, thumbnail + stride );
+    ids.push_back( id );
+}
+
+/**
+ * Ids of the max_results keyframes that look most like image, with their
+ * distances, closest first.
+ **/
+int ThumbnailIndex::query(const cv::Mat &image, int max_results, std::vector<std::pair<int, int> > &results)
+{
+    results.clear();
+    if ( ids.empty() ) {
+        return 0;
+    }
+    makeThumbnail( image, &query_thumbnail[0] );
+
+    distances.resize( ids.size() );
+    for ( size_t i = 0; i < ids.size(); i++ ) {
+        distances[i] = std::make_pair( ids[i],
+            sumSquaredDifferences( &query_thumbnail[0], &thumbnails[i * stride], stride ) );
+    }
+
+    int n = std::min( max_results, (int) distances.size() );
+    std::partial_sort( distances.begin(), distances.begin() + n, distances.end(), closer );
+    results.assign( distances.begin(), distances.begin() + n );
+    return n;
+}
+
+int ThumbnailIndex::size() const
+{
+    return ids.size();
+}
+
+int ThumbnailIndex::thumbnailWidth() const
+{
+    return width;
+}
+
+int ThumbnailIndex::thumbnailHeight() const
+{
+    return height;
+}
+
+/**
+ * Values per stored thumbnail, including padding.
+ **/
+int ThumbnailIndex::thumbnailStride() const
+{
+    return stride;
+}
+
+/**
+ * All thumbnails back to back, size() * thumbnailStride() values.
+ **/
+const short *ThumbnailIndex::thumbnailData() const
+{
+    return thumbnails.empty() ? NULL : &thumbnails[0];
+}
+
+const int *ThumbnailIndex::thumbnailIds() const
+{
+    return ids.empty() ? NULL : &ids[0];
+}
+
+/**
+ * Replace the contents by count thumbnails as returned by thumbnailData and
+ * thumbnailIds, stride shorts apart. Fails when they were made at another
+ * thumbnail size or stride.
+ **/
+bool ThumbnailIndex::restore(int width, int height, int stride, int count, const short *data, const int *ids)
+{
+    if ( width != this->width || height != this->height || stride != this->stride ) {
+        return false;
+    }
+    thumbnails.assign( data, data + (size_t) count * stride );
+    this->ids.assign( ids, ids + count );
+    return true;
+}
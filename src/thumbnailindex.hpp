@@ -0,0 +1,51 @@
+#ifndef THUMBNAILINDEX_H
+#define THUMBNAILINDEX_H
+
+#include <opencv2/core/core.hpp>
+
+#include <utility>
+#include <vector>
+
+/**
+ * Index of tiny blurred keyframe images, for relocalization.
+ *
+ * Every keyframe is reduced to a small (40x30 by default), blurred, zero-mean
+ * 16 bit thumbnail, stored back to back in one buffer. A query compares the
+ * thumbnail of the current image to all of them by sum of squared
+ * differences (SSE2 when available), which takes microseconds per keyframe,
+ * and returns the closest keyframes.
+ **/
+class ThumbnailIndex
+{
+    int width;
+    int height;
+    int stride;         // pixels per thumbnail, padded to a multiple of 8
+    double sigma;
+
+    std::vector<short> thumbnails;
+    std::vector<int> ids;
+
+    std::vector<short> query_thumbnail;
+    std::vector<std::pair<int, int> > distances;
+
+    void makeThumbnail(const cv::Mat &image, short *thumbnail) const;
+
+public:
+    ThumbnailIndex(int width = 40, int height = 30, double sigma = 2.5);
+
+    void clear();
+    void add(const cv::Mat &image, int id);
+    void addThumbnail(const short *thumbnail, int id);
+    int query(const cv::Mat &image, int max_results, std::vector<std::pair<int, int> > &results);
+
+    int size() const;
+
+    int thumbnailWidth() const;
+    int thumbnailHeight() const;
+    int thumbnailStride() const;
+    const short *thumbnailData() const;
+    const int *thumbnailIds() const;
+    bool restore(int width, int height, int stride, int count, const short *data, const int *ids);
+};
+
+#endif // THUMBNAILINDEX_H
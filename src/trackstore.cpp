@@ -0,0 +1,255 @@
+#include "trackstore.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <math.h>
+
+TrackStore::TrackStore(const cv::Matx33d &K, int length, int max_age, int max_tracks)
+{
+    this->K = K;
+    this->K_inv = K.inv();
+    this->length = length > 1 ? length : 2;
+    this->max_age = max_age;
+    this->max_tracks = max_tracks;
+}
+
+/**
+ * Pose of keyframe frame_nr, for the sightings made in it. Add it before
+ * adding or extending tracks in that keyframe.
+ **/
+void TrackStore::addFrame(int frame_nr, const cv::Matx34d &pose)
+{
+    poses[frame_nr] = pose;
+}
+
+bool TrackStore::framePose(int frame_nr, cv::Matx34d &pose) const
+{
+    std::map<int, cv::Matx34d>::const_iterator found = poses.find( frame_nr );
+    if ( found == poses.end() ) {
+        return false;
+    }
+    pose = found->second;
+    return true;
+}
+
+/**
+ * Start a track with its first sighting.
+ **/
+void TrackStore::add(int frame_nr, int keypoint, const cv::Point2f &pixel, const cv::Mat &descriptor)
+{
+    int slot = size();
+    if ( descriptor_rows.empty() ) {
+        descriptor_rows.create( std::max( max_tracks, 64 ), descriptor.cols, descriptor.type() );
+    } else if ( slot == descriptor_rows.rows ) {
+        cv::Mat grown( descriptor_rows.rows * 2, descriptor_rows.cols, descriptor_rows.type() );
+        descriptor_rows.copyTo( grown.rowRange( 0, descriptor_rows.rows ) );
+        descriptor_rows = grown;
+    }
+    descriptor.copyTo( descriptor_rows.row( slot ) );
+
+    TrackObservation sighting;
+    sighting.frame_nr = frame_nr;
+    sighting.keypoint = keypoint;
+    sighting.pixel = pixel;
+    sightings.resize( (slot + 1) * length );
+    sightings[slot * length] = sighting;
+    counts.push_back( 1 );
+    last_seen.push_back( frame_nr );
+}
+
+/**
+ * Add a sighting to the track in slot, unless it was seen in frame_nr
+ * already or pixel lies further than max_error pixels from the epipolar
+ * line of its latest sighting. Returns whether it was added.
+ **/
+bool TrackStore::extend(int slot, int frame_nr, int keypoint, const cv::Point2f &pixel,
+                        const cv::Mat &descriptor, double max_error)
+{
+    const TrackObservation &previous = latest( slot );
+    if ( previous.frame_nr == frame_nr ) {
+        return false;
+    }
+    cv::Matx34d previous_pose, current_pose;
+    if ( framePose( previous.frame_nr, previous_pose ) && framePose( frame_nr, current_pose ) ) {
+        // Motion from the previous camera to the current one, E = [t]x R
+        cv::Matx33d R_previous = previous_pose.get_minor<3, 3>(0, 0);
+        cv::Matx33d R_current = current_pose.get_minor<3, 3>(0, 0);
+        cv::Matx33d R = R_current * R_previous.t();
+        cv::Vec3d t = cv::Vec3d( current_pose(0,3), current_pose(1,3), current_pose(2,3) ) -
+                      R * cv::Vec3d( previous_pose(0,3), previous_pose(1,3), previous_pose(2,3) );
+        cv::Matx33d t_skewed(  0,    -t(2),  t(1),
+                               t(2),  0,    -t(0),
+                              -t(1),  t(0),  0 );
+        cv::Matx33d F = K_inv.t() * t_skewed * R * K_inv;
+        cv::Vec3d line = F * cv::Vec3d( previous.pixel.x, previous.pixel.y, 1.0 );
+        double norm = sqrt( line(0) * line(0) + line(1) * line(1) );
+        // Without a baseline there is no epipolar line to check against
+        if ( norm > 1e-12 &&
+             fabs( line(0) * pixel.x + line(1) * pixel.y + line(2) ) / norm > max_error ) {
+            return false;
+        }
+    }
+
+    TrackObservation sighting;
+    sighting.frame_nr = frame_nr;
+    sighting.keypoint = keypoint;
+    sighting.pixel = pixel;
+    sightings[slot * length + counts[slot] % length] = sighting;
+    counts[slot]++;
+    last_seen[slot] = frame_nr;
+    descriptor.copyTo( descriptor_rows.row( slot ) );
+    return true;
+}
+
+int TrackStore::size() const
+{
+    return counts.size();
+}
+
+/**
+ * Latest descriptor of every track, row n belongs to slot n. Shares the
+ * data of the store, valid until the next change.
+ **/
+cv::Mat TrackStore::descriptors() const
+{
+    if ( counts.empty() ) {
+        return cv::Mat();
+    }
+    return descriptor_rows.rowRange( 0, size() );
+}
+
+/**
+ * Sightings the ring buffer of slot holds.
+ **/
+int TrackStore::observationCount(int slot) const
+{
+    return std::min( counts[slot], length );
+}
+
+/**
+ * Sighting i of slot, 0 is the oldest one kept.
+ **/
+const TrackObservation &TrackStore::observation(int slot, int i) const
+{
+    int first = counts[slot] > length ? counts[slot] - length : 0;
+    return sightings[slot * length + (first + i) % length];
+}
+
+const TrackObservation &TrackStore::latest(int slot) const
+{
+    return sightings[slot * length + (counts[slot] - 1) % length];
+}
+
+/**
+ * Direction of the ray through a sighting, in world coordinates.
+ **/
+cv::Vec3d TrackStore::ray(const TrackObservation &sighting) const
+{
+    cv::Matx34d pose;
+    framePose( sighting.frame_nr, pose );
+    cv::Matx33d R = pose.get_minor<3, 3>(0, 0);
+    cv::Vec3d direction = R.t() * ( K_inv * cv::Vec3d( sighting.pixel.x, sighting.pixel.y, 1.0 ) );
+    return direction * ( 1.0 / cv::norm( direction ) );
+}
+
+/**
+ * Angle in radians between the rays of the oldest and the newest sighting
+ * kept of slot, 0 for a track seen once.
+ **/
+double TrackStore::parallax(int slot) const
+{
+    if ( observationCount( slot ) < 2 ) {
+        return 0.0;
+    }
+    double cosine = ray( observation( slot, 0 ) ).dot( ray( latest( slot ) ) );
+    return acos( std::max( -1.0, std::min( 1.0, cosine ) ) );
+}
+
+/**
+ * Slots of the tracks seen in frame_nr whose parallax reached min_parallax
+ * (radians); the others did not change since they were last checked.
+ **/
+void TrackStore::promotable(int frame_nr, double min_parallax, std::vector<int> &slots) const
+{
+    slots.clear();
+    for ( int slot = 0; slot < size(); slot++ ) {
+        if ( last_seen[slot] == frame_nr && parallax( slot ) >= min_parallax ) {
+            slots.push_back( slot );
+        }
+    }
+}
+
+void TrackStore::remove(int slot)
+{
+    int last = size() - 1;
+    if ( slot != last ) {
+        std::copy( sightings.begin() + last * length, sightings.begin() + (last + 1) * length,
+                   sightings.begin() + slot * length );
+        counts[slot] = counts[last];
+        last_seen[slot] = last_seen[last];
+        descriptor_rows.row( last ).copyTo( descriptor_rows.row( slot ) );
+    }
+    sightings.resize( last * length );
+    counts.pop_back();
+    last_seen.pop_back();
+}
+
+/**
+ * Remove the tracks in slots (promoted ones, say). Other tracks may move to
+ * another slot.
+ **/
+void TrackStore::removeTracks(std::vector<int> slots)
+{
+    // From the back, so that no track still to remove gets moved
+    std::sort( slots.begin(), slots.end(), std::greater<int>() );
+    slots.erase( std::unique( slots.begin(), slots.end() ), slots.end() );
+    for ( size_t n = 0; n < slots.size(); n++ ) {
+        remove( slots[n] );
+    }
+}
+
+/**
+ * Drop the tracks not seen for more than max_age keyframes, then the
+ * stalest ones above max_tracks, and the poses no sighting refers to
+ * anymore. Returns the number of tracks dropped.
+ **/
+int TrackStore::expire(int frame_nr)
+{
+    int before = size();
+    std::vector<int> stale;
+    for ( int slot = 0; slot < size(); slot++ ) {
+        if ( frame_nr - last_seen[slot] > max_age ) {
+            stale.push_back( slot );
+        }
+    }
+    removeTracks( stale );
+
+    if ( max_tracks > 0 && size() > max_tracks ) {
+        std::vector<std::pair<int, int> > ages;    // last seen, slot
+        for ( int slot = 0; slot < size(); slot++ ) {
+            ages.push_back( std::make_pair( last_seen[slot], slot ) );
+        }
+        std::nth_element( ages.begin(), ages.begin() + (size() - max_tracks), ages.end() );
+        stale.clear();
+        for ( int n = 0; n < size() - max_tracks; n++ ) {
+            stale.push_back( ages[n].second );
+        }
+        removeTracks( stale );
+    }
+
+    int oldest = frame_nr;
+    for ( int slot = 0; slot < size(); slot++ ) {
+        oldest = std::min( oldest, observation( slot, 0 ).frame_nr );
+    }
+    poses.erase( poses.begin(), poses.lower_bound( oldest ) );
+    return before - size();
+}
+
+void TrackStore::clear()
+{
+    sightings.clear();
+    counts.clear();
+    last_seen.clear();
+    descriptor_rows.release();
+    poses.clear();
+}
@@ -0,0 +1,77 @@
+#ifndef TRACKSTORE_H
+#define TRACKSTORE_H
+
+#include <opencv2/core/core.hpp>
+
+#include <map>
+#include <vector>
+
+/**
+ * One sighting of a candidate track: the keyframe, the index of the
+ * keypoint in that keyframe and its pixel position.
+ **/
+typedef struct {
+    int frame_nr;
+    int keypoint;
+    cv::Point2f pixel;
+} TrackObservation;
+
+/**
+ * Candidate map points: keypoints that are not map points yet, followed
+ * from keyframe to keyframe until they are seen from far enough apart to
+ * triangulate.
+ *
+ * Each track keeps its last length sightings in a ring buffer and the
+ * descriptor of the latest one; the descriptors of all tracks form one
+ * matrix to match against. Tracks not seen for max_age keyframes expire,
+ * and above max_tracks the stalest go first, so the set stays bounded.
+ * Tracks are stored by slot (0 .. size() - 1) and the last one moves into
+ * the slot of a removed one.
+ *
+ * The world to camera poses of the keyframes the sightings were made in
+ * are kept as long as a sighting refers to them. A sighting is only
+ * accepted when it lies on the epipolar line of the previous one, and a
+ * track is ready for promotion once the rays of its oldest and newest
+ * sighting meet at a large enough angle (parallax).
+ **/
+class TrackStore
+{
+    cv::Matx33d K;
+    cv::Matx33d K_inv;
+    int length;
+    int max_age;
+    int max_tracks;
+
+    std::vector<TrackObservation> sightings;    // slot * length + ring position
+    std::vector<int> counts;                    // sightings so far, the ring keeps the last length
+    std::vector<int> last_seen;
+    cv::Mat descriptor_rows;                    // row per slot, rows past size() unused
+    std::map<int, cv::Matx34d> poses;           // keyframe -> world to camera pose
+
+    void remove(int slot);
+    cv::Vec3d ray(const TrackObservation &sighting) const;
+
+public:
+    TrackStore(const cv::Matx33d &K, int length = 8, int max_age = 30, int max_tracks = 20000);
+
+    void addFrame(int frame_nr, const cv::Matx34d &pose);
+    bool framePose(int frame_nr, cv::Matx34d &pose) const;
+
+    void add(int frame_nr, int keypoint, const cv::Point2f &pixel, const cv::Mat &descriptor);
+    bool extend(int slot, int frame_nr, int keypoint, const cv::Point2f &pixel,
+                const cv::Mat &descriptor, double max_error);
+
+    int size() const;
+    cv::Mat descriptors() const;
+    int observationCount(int slot) const;
+    const TrackObservation &observation(int slot, int i) const;
+    const TrackObservation &latest(int slot) const;
+
+    double parallax(int slot) const;
+    void promotable(int frame_nr, double min_parallax, std::vector<int> &slots) const;
+    void removeTracks(std::vector<int> slots);
+    int expire(int frame_nr);
+    void clear();
+};
+
+#endif // TRACKSTORE_H
@@ -0,0 +1,111 @@
+/**
+ * Train the bag of words vocabulary used for loop closure from recorded
+ * image folders (image_0001.png, image_0002.png, ... as written by the
+ * controller), and write it to a file that navigate loads at startup.
+ *
+ * Usage: trainvocabulary [-k branching] [-l levels] [-s step] [-d brisk|orb]
+ *                        [-o output] folder [folder ...]
+ */
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vocabulary.hpp"
+
+static void usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [-k branching] [-l levels] [-s step]"
+              << " [-d brisk|orb] [-o output] folder [folder ...]" << std::endl;
+}
+
+int main( int argc, char* argv[] ) {
+    int k = 10;
+    int levels = 5;
+    int step = 5;
+    std::string detector = "brisk";
+    std::string output = "vocabulary";
+    std::vector<std::string> folders;
+
+    for ( int i = 1; i < argc; i++ ) {
+        std::string arg( argv[i] );
+        if ( arg[0] == '-' && i + 1 < argc ) {
+            std::string value( argv[++i] );
+            if ( arg == "-k" ) {
+                k = atoi( value.c_str() );
+            } else if ( arg == "-l" ) {
+                levels = atoi( value.c_str() );
+            } else if ( arg == "-s" ) {
+                step = atoi( value.c_str() );
+            } else if ( arg == "-d" ) {
+                detector = value;
+            } else if ( arg == "-o" ) {
+                output = value;
+            } else {
+                usage( argv[0] );
+                return 1;
+            }
+        } else {
+            folders.push_back( arg );
+        }
+    }
+    if ( folders.empty() || k < 2 || levels < 1 || step < 1 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    // Same detector settings as navigate, otherwise the words do not match
+    cv::Ptr<cv::Feature2D> features;
+    if ( detector == "brisk" ) {
+        features = new cv::BRISK(60, 4, 1.0f);
+    } else if ( detector == "orb" ) {
+        features = new cv::ORB(60, 4, 1.0f);
+    } else {
+        usage( argv[0] );
+        return 1;
+    }
+
+    std::vector<cv::Mat> descriptors;
+    int total = 0;
+    for ( size_t f = 0; f < folders.size(); f++ ) {
+        for ( int index = 1; ; index += step ) {
+            char filename[256];
+            snprintf( filename, sizeof(filename), "%s/image_%.4d.png", folders[f].c_str(), index );
+            cv::Mat img = cv::imread( filename, CV_LOAD_IMAGE_GRAYSCALE );
+            if ( img.empty() ) {
+                break;
+            }
+            std::vector<cv::KeyPoint> keypoints;
+            cv::Mat image_descriptors;
+            features->detect( img, keypoints );
+            features->compute( img, keypoints, image_descriptors );
+            if ( !image_descriptors.empty() ) {
+                descriptors.push_back( image_descriptors );
+                total += image_descriptors.rows;
+            }
+        }
+        std::cout << folders[f] << ": " << descriptors.size() << " images, "
+                  << total << " descriptors so far." << std::endl;
+    }
+    if ( descriptors.empty() ) {
+        std::cerr << "No images found." << std::endl;
+        return 1;
+    }
+
+    Vocabulary vocabulary;
+    vocabulary.train( descriptors, k, levels );
+    std::cout << "Vocabulary of " << vocabulary.wordCount() << " words." << std::endl;
+
+    if ( !vocabulary.save( output ) ) {
+        std::cerr << "Could not write " << output << "." << std::endl;
+        return 1;
+    }
+    return 0;
+}
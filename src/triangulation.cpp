@@ -0,0 +1,222 @@
+#include "triangulation.hpp"
+
+#include "parallel.hpp"
+
+#include <math.h>
+
+/**
+ * Position of the camera of the world to camera pose [R|t]: -R^T * t.
+ **/
+static cv::Vec3d cameraCenter(const cv::Matx34d &pose)
+{
+    cv::Vec3d center;
+    for ( int i = 0; i < 3; i++ ) {
+        center(i) = -( pose(0,i) * pose(0,3) + pose(1,i) * pose(1,3) + pose(2,i) * pose(2,3) );
+    }
+    return center;
+}
+
+/**
+ * Angle in radians at point between the rays to the cameras of two poses.
+ **/
+double ViewAngle(const cv::Point3d &point, const cv::Matx34d &pose_a, const cv::Matx34d &pose_b)
+{
+    cv::Vec3d X( point.x, point.y, point.z );
+    cv::Vec3d a = X - cameraCenter( pose_a );
+    cv::Vec3d b = X - cameraCenter( pose_b );
+    double norms = cv::norm( a ) * cv::norm( b );
+    if ( norms <= 0 ) {
+        return 0.0;
+    }
+    double cosine = a.dot( b ) / norms;
+    return acos( cosine > 1.0 ? 1.0 : cosine < -1.0 ? -1.0 : cosine );
+}
+
+Triangulator::Triangulator(const cv::Matx33d &K, int iterations)
+{
+    this->K_inv = K.inv();
+    this->focal = 0.5 * ( K(0,0) + K(1,1) );
+    this->iterations = iterations;
+    this->threads = defaultThreadCount();
+}
+
+void Triangulator::clear()
+{
+    poses.clear();
+    points_2d.clear();
+    starts.clear();
+    results.clear();
+    errors.clear();
+    angles.clear();
+    valid_mask.clear();
+}
+
+/**
+ * Start the next point, the views added from here on are its views.
+ * Returns its index.
+ **/
+int Triangulator::addPoint()
+{
+    starts.push_back( poses.size() );
+    return starts.size() - 1;
+}
+
+void Triangulator::addView(const cv::Matx34d &pose, const cv::Point2d &pixel)
+{
+    cv::Vec3d normalized = K_inv * cv::Vec3d( pixel.x, pixel.y, 1.0 );
+    poses.push_back( pose );
+    points_2d.push_back( cv::Point2d( normalized(0) / normalized(2), normalized(1) / normalized(2) ) );
+}
+
+int Triangulator::size() const
+{
+    return starts.size();
+}
+
+int Triangulator::viewCount(int n) const
+{
+    int end = n + 1 < (int) starts.size() ? starts[n + 1] : (int) poses.size();
+    return end - starts[n];
+}
+
+void Triangulator::solveRange(void *context, int begin, int end)
+{
+    Triangulator *triangulator = (Triangulator *) context;
+    for ( int n = begin; n < end; n++ ) {
+        triangulator->solvePoint( n );
+    }
+}
+
+void Triangulator::solvePoint(int n)
+{
+    int first = starts[n];
+    int count = viewCount( n );
+    valid_mask[n] = 0;
+    if ( count < 2 ) {
+        return;
+    }
+
+    // Linear estimate, from the normal matrix of the DLT system
+    cv::Matx44d normal = cv::Matx44d::zeros();
+    for ( int v = first; v < first + count; v++ ) {
+        const cv::Matx34d &P = poses[v];
+        cv::Matx41d rows[2];
+        for ( int j = 0; j < 4; j++ ) {
+            rows[0](j) = points_2d[v].x * P(2,j) - P(0,j);
+            rows[1](j) = points_2d[v].y * P(2,j) - P(1,j);
+        }
+        normal += rows[0] * rows[0].t() + rows[1] * rows[1].t();
+    }
+    cv::Matx41d w;
+    cv::Matx44d u, vt;
+    cv::SVD::compute( normal, w, u, vt );
+    if ( fabs( vt(3,3) ) < 1e-12 ) {
+        // At infinity, no depth to be had from these views
+        return;
+    }
+    cv::Vec3d X( vt(3,0) / vt(3,3), vt(3,1) / vt(3,3), vt(3,2) / vt(3,3) );
+
+    // Gauss-Newton on the reprojection error in normalized coordinates
+    double squared_error = 0.0;
+    int steps = iterations;
+    for ( int iteration = 0; iteration <= steps; iteration++ ) {
+        cv::Matx33d H = cv::Matx33d::zeros();
+        cv::Vec3d g( 0.0, 0.0, 0.0 );
+        squared_error = 0.0;
+        for ( int v = first; v < first + count; v++ ) {
+            const cv::Matx34d &P = poses[v];
+            cv::Matx33d R = P.get_minor<3, 3>(0, 0);
+            cv::Vec3d c = R * X + cv::Vec3d( P(0,3), P(1,3), P(2,3) );
+            if ( c(2) <= 0 ) {
+                // Behind a camera that saw it
+                return;
+            }
+            double ex = c(0) / c(2) - points_2d[v].x;
+            double ey = c(1) / c(2) - points_2d[v].y;
+            squared_error += ex * ex + ey * ey;
+
+            cv::Matx23d dproject( 1.0 / c(2), 0.0, -c(0) / (c(2) * c(2)),
+                                  0.0, 1.0 / c(2), -c(1) / (c(2) * c(2)) );
+            cv::Matx23d J = dproject * R;
+            H += J.t() * J;
+            g += J.t() * cv::Vec2d( ex, ey );
+        }
+        if ( iteration == steps ) {
+            break;
+        }
+        cv::Vec3d step;
+        if ( !cv::solve( H, -g, step, cv::DECOMP_CHOLESKY ) ) {
+            break;
+        }
+        X += step;
+        if ( cv::norm( step ) < 1e-9 * ( 1.0 + cv::norm( X ) ) ) {
+            // Converged, one more pass for the error at the final position
+            steps = iteration + 1;
+        }
+    }
+
+    // Widest angle between two views: the view furthest from the first one,
+    // then the one furthest from that (linear, and exact but for odd layouts)
+    double widest = 0.0;
+    cv::Point3d point( X(0), X(1), X(2) );
+    int from = first;
+    for ( int pass = 0; pass < 2; pass++ ) {
+        int furthest = from;
+        for ( int v = first; v < first + count; v++ ) {
+            double angle = ViewAngle( point, poses[from], poses[v] );
+            if ( angle > widest ) {
+                widest = angle;
+                furthest = v;
+            }
+        }
+        from = furthest;
+    }
+    results[n] = point;
+    errors[n] = focal * sqrt( squared_error / count );
+    angles[n] = widest;
+    valid_mask[n] = 1;
+}
+
+/**
+ * Triangulate all points added since the last clear().
+ **/
+void Triangulator::solve()
+{
+    int n = size();
+    results.assign( n, cv::Point3d( 0, 0, 0 ) );
+    errors.assign( n, 0.0 );
+    angles.assign( n, 0.0 );
+    valid_mask.assign( n, 0 );
+    parallelFor( n, solveRange, this, threads );
+}
+
+/**
+ * Whether point n has a position: it has two views or more, they are not
+ * all parallel, and it lies in front of all of them.
+ **/
+bool Triangulator::valid(int n) const
+{
+    return valid_mask[n] != 0;
+}
+
+const cv::Point3d &Triangulator::point(int n) const
+{
+    return results[n];
+}
+
+/**
+ * RMS reprojection error of point n over its views, in pixels.
+ **/
+double Triangulator::error(int n) const
+{
+    return errors[n];
+}
+
+/**
+ * Widest angle (radians) between two of the views of point n, seen from
+ * the point: how well its depth is determined.
+ **/
+double Triangulator::angle(int n) const
+{
+    return angles[n];
+}
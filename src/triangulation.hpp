@@ -0,0 +1,65 @@
+#ifndef TRIANGULATION_H
+#define TRIANGULATION_H
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+/**
+ * Triangulates many points at once, each from any number of views (a world
+ * to camera pose and the pixel the point was seen at).
+ *
+ * Every view of a point gives two rows of the linear (DLT) system
+ * x * P.row(2) - P.row(0) = 0 and y * P.row(2) - P.row(1) = 0, in normalized
+ * image coordinates. They are summed into the 4x4 normal matrix right away,
+ * so a point costs the same memory however many views it has, and the
+ * singular vector of its smallest singular value is the linear estimate. A
+ * few Gauss-Newton steps on the reprojection error refine it. Points are
+ * independent and solved in parallel.
+ *
+ *     triangulator.clear();
+ *     triangulator.addPoint();
+ *     triangulator.addView( pose_a, pixel_a );
+ *     triangulator.addView( pose_b, pixel_b );
+ *     triangulator.solve();
+ *     if ( triangulator.valid(0) ) { ... triangulator.point(0) ... }
+ **/
+class Triangulator
+{
+    cv::Matx33d K_inv;
+    double focal;
+    int iterations;
+    int threads;
+
+    std::vector<cv::Matx34d> poses;
+    std::vector<cv::Point2d> points_2d;     // normalized image coordinates
+    std::vector<int> starts;                // first view of every point
+
+    std::vector<cv::Point3d> results;
+    std::vector<double> errors;
+    std::vector<double> angles;
+    std::vector<unsigned char> valid_mask;
+
+    static void solveRange(void *context, int begin, int end);
+    void solvePoint(int n);
+
+public:
+    Triangulator(const cv::Matx33d &K, int iterations = 5);
+
+    void clear();
+    int addPoint();
+    void addView(const cv::Matx34d &pose, const cv::Point2d &pixel);
+    int size() const;
+    int viewCount(int n) const;
+
+    void solve();
+
+    bool valid(int n) const;
+    const cv::Point3d &point(int n) const;
+    double error(int n) const;
+    double angle(int n) const;
+};
+
+double ViewAngle(const cv::Point3d &point, const cv::Matx34d &pose_a, const cv::Matx34d &pose_b);
+
+#endif // TRIANGULATION_H
@@ -0,0 +1,395 @@
+#include "vocabulary.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VOCABULARY_MAGIC 0x31434f56   // "VOC1"
+#define MEDIAN_ITERATIONS 10
+
+int HammingDistance(const unsigned char *a, const unsigned char *b, int bytes)
+{
+    int distance = 0;
+    int i = 0;
+    for ( ; i + 8 <= bytes; i += 8 ) {
+        unsigned long long x, y;
+        memcpy( &x, a + i, 8 );
+        memcpy( &y, b + i, 8 );
+        distance += __builtin_popcountll( x ^ y );
+    }
+    for ( ; i < bytes; i++ ) {
+        distance += __builtin_popcount( a[i] ^ b[i] );
+    }
+    return distance;
+}
+
+static unsigned int nextRandom(unsigned int &seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+Vocabulary::Vocabulary()
+{
+    this->k = 0;
+    this->levels = 0;
+    this->bytes = 0;
+}
+
+int Vocabulary::addNode(const unsigned char *center)
+{
+    centers.insert( centers.end(), center, center + bytes );
+    first_child.push_back( -1 );
+    child_count.push_back( 0 );
+    node_word.push_back( -1 );
+    return node_word.size() - 1;
+}
+
+/**
+ * Split the descriptors below node into at most k clusters by k-medians
+ * (seeded like k-means++) and recurse into the clusters. Leaves become words.
+ **/
+void Vocabulary::cluster(int node, std::vector<const unsigned char *> &descriptors, int level)
+{
+    int n = descriptors.size();
+    if ( level == levels || n <= 1 ) {
+        node_word[node] = idf.size();
+        idf.push_back( 0.0f );
+        return;
+    }
+
+    std::vector<std::vector<const unsigned char *> > groups;
+    if ( n <= k ) {
+        groups.resize( n );
+        for ( int i = 0; i < n; i++ ) {
+            groups[i].push_back( descriptors[i] );
+        }
+    } else {
+        unsigned int seed = 0x9e3779b9u ^ (unsigned int) (node * 2654435761u);
+        std::vector<unsigned char> medians( k * bytes );
+        std::vector<int> distance( n );
+        std::vector<int> assignment( n, -1 );
+
+        // Seeding: next center with probability proportional to squared distance
+        memcpy( &medians[0], descriptors[nextRandom(seed) % n], bytes );
+        for ( int i = 0; i < n; i++ ) {
+            distance[i] = HammingDistance( descriptors[i], &medians[0], bytes );
+        }
+        for ( int c = 1; c < k; c++ ) {
+            double total = 0.0;
+            for ( int i = 0; i < n; i++ ) {
+                total += (double) distance[i] * distance[i];
+            }
+            int chosen = nextRandom(seed) % n;
+            if ( total > 0.0 ) {
+                double target = total * (nextRandom(seed) / 4294967296.0);
+                for ( chosen = 0; chosen < n - 1; chosen++ ) {
+                    target -= (double) distance[chosen] * distance[chosen];
+                    if ( target <= 0.0 ) {
+                        break;
+                    }
+                }
+            }
+            memcpy( &medians[c * bytes], descriptors[chosen], bytes );
+            for ( int i = 0; i < n; i++ ) {
+                distance[i] = std::min( distance[i],
+                                        HammingDistance( descriptors[i], &medians[c * bytes], bytes ) );
+            }
+        }
+
+        std::vector<int> bit_count( k * bytes * 8 );
+        std::vector<int> cluster_size( k );
+        for ( int iteration = 0; iteration < MEDIAN_ITERATIONS; iteration++ ) {
+            bool changed = false;
+            for ( int i = 0; i < n; i++ ) {
+                int best = 0;
+                int best_distance = HammingDistance( descriptors[i], &medians[0], bytes );
+                for ( int c = 1; c < k; c++ ) {
+                    int d = HammingDistance( descriptors[i], &medians[c * bytes], bytes );
+                    if ( d < best_distance ) {
+                        best_distance = d;
+                        best = c;
+                    }
+                }
+                changed |= assignment[i] != best;
+                assignment[i] = best;
+            }
+            if ( !changed ) {
+                break;
+            }
+
+            // Median of binary strings: per bit majority
+            std::fill( bit_count.begin(), bit_count.end(), 0 );
+            std::fill( cluster_size.begin(), cluster_size.end(), 0 );
+            for ( int i = 0; i < n; i++ ) {
+                int *count = &bit_count[assignment[i] * bytes * 8];
+                for ( int byte = 0; byte < bytes; byte++ ) {
+                    unsigned char value = descriptors[i][byte];
+                    for ( int bit = 0; bit < 8; bit++ ) {
+                        count[byte * 8 + bit] += (value >> bit) & 1;
+                    }
+                }
+                cluster_size[assignment[i]]++;
+            }
+            for ( int c = 0; c < k; c++ ) {
+                if ( cluster_size[c] == 0 ) {
+                    continue;
+                }
+                const int *count = &bit_count[c * bytes * 8];
+                for ( int byte = 0; byte < bytes; byte++ ) {
+                    unsigned char value = 0;
+                    for ( int bit = 0; bit < 8; bit++ ) {
+                        if ( 2 * count[byte * 8 + bit] > cluster_size[c] ) {
+                            value |= 1 << bit;
+                        }
+                    }
+                    medians[c * bytes + byte] = value;
+                }
+            }
+        }
+
+        groups.resize( k );
+        for ( int i = 0; i < n; i++ ) {
+            groups[assignment[i]].push_back( descriptors[i] );
+        }
+        // Drop empty clusters
+        int used = 0;
+        for ( int c = 0; c < k; c++ ) {
+            if ( !groups[c].empty() ) {
+                groups[used].swap( groups[c] );
+                memcpy( &medians[used * bytes], &medians[c * bytes], bytes );
+                used++;
+            }
+        }
+        groups.resize( used );
+
+        first_child[node] = node_word.size();
+        child_count[node] = used;
+        for ( int c = 0; c < used; c++ ) {
+            addNode( &medians[c * bytes] );
+        }
+        for ( int c = 0; c < used; c++ ) {
+            cluster( first_child[node] + c, groups[c], level + 1 );
+        }
+        return;
+    }
+
+    first_child[node] = node_word.size();
+    child_count[node] = groups.size();
+    for ( size_t c = 0; c < groups.size(); c++ ) {
+        addNode( groups[c][0] );
+    }
+    for ( size_t c = 0; c < groups.size(); c++ ) {
+        cluster( first_child[node] + c, groups[c], level + 1 );
+    }
+}
+
+/**
+ * Build a tree with branching factor k and depth levels from the descriptors
+ * of a set of training images (one CV_8U matrix per image, a row per
+ * descriptor), and weight the words by inverse document frequency.
+ **/
+void Vocabulary::train(const std::vector<cv::Mat> &descriptors, int k, int levels)
+{
+    this->k = k;
+    this->levels = levels;
+    this->bytes = 0;
+    centers.clear();
+    first_child.clear();
+    child_count.clear();
+    node_word.clear();
+    idf.clear();
+
+    std::vector<const unsigned char *> all;
+    for ( size_t i = 0; i < descriptors.size(); i++ ) {
+        if ( descriptors[i].empty() ) {
+            continue;
+        }
+        bytes = descriptors[i].cols;
+        for ( int r = 0; r < descriptors[i].rows; r++ ) {
+            all.push_back( descriptors[i].ptr<unsigned char>(r) );
+        }
+    }
+    if ( all.empty() ) {
+        return;
+    }
+
+    std::vector<unsigned char> root( bytes, 0 );
+    addNode( &root[0] );
+    cluster( 0, all, 0 );
+
+    // idf = log(N / n_i), n_i the number of images containing word i
+    std::vector<int> last_image( idf.size(), -1 );
+    std::vector<int> image_count( idf.size(), 0 );
+    int images = 0;
+    for ( size_t i = 0; i < descriptors.size(); i++ ) {
+        if ( descriptors[i].empty() ) {
+            continue;
+        }
+        for ( int r = 0; r < descriptors[i].rows; r++ ) {
+            int w = word( descriptors[i].ptr<unsigned char>(r) );
+            if ( last_image[w] != (int) i ) {
+                last_image[w] = i;
+                image_count[w]++;
+            }
+        }
+        images++;
+    }
+    for ( size_t w = 0; w < idf.size(); w++ ) {
+        idf[w] = log( (double) images / std::max(image_count[w], 1) );
+    }
+}
+
+bool Vocabulary::save(const std::string &filename) const
+{
+    std::ofstream file( filename.c_str(), std::ios::binary );
+    if ( !file ) {
+        return false;
+    }
+    int header[6] = { VOCABULARY_MAGIC, k, levels, bytes,
+                      (int) node_word.size(), (int) idf.size() };
+    file.write( (const char *) header, sizeof(header) );
+    if ( !node_word.empty() ) {
+        file.write( (const char *) &centers[0], centers.size() );
+        file.write( (const char *) &first_child[0], first_child.size() * sizeof(int) );
+        file.write( (const char *) &child_count[0], child_count.size() * sizeof(int) );
+        file.write( (const char *) &node_word[0], node_word.size() * sizeof(int) );
+    }
+    if ( !idf.empty() ) {
+        file.write( (const char *) &idf[0], idf.size() * sizeof(float) );
+    }
+    return file.good();
+}
+
+/**
+ * Read a vocabulary written by save. Fails, leaving the vocabulary empty,
+ * unless the file holds a whole tree that word() can walk: every inner node
+ * with children further down the node array, every leaf with a word.
+ **/
+bool Vocabulary::load(const std::string &filename)
+{
+    node_word.clear();
+    idf.clear();
+    std::ifstream file( filename.c_str(), std::ios::binary );
+    int header[6];
+    if ( !file.read( (char *) header, sizeof(header) ) || header[0] != VOCABULARY_MAGIC ||
+         header[3] <= 0 || header[4] <= 0 || header[5] <= 0 ) {
+        return false;
+    }
+    int nodes = header[4];
+    int words = header[5];
+
+    // The rest of the file must be as large as the counts claim, before
+    // anything is allocated for them
+    std::streampos start = file.tellg();
+    file.seekg( 0, std::ios::end );
+    uint64_t remaining = (uint64_t) ( file.tellg() - start );
+    file.seekg( start );
+    if ( remaining != (uint64_t) nodes * ( header[3] + 3 * sizeof(int) ) + (uint64_t) words * sizeof(float) ) {
+        return false;
+    }
+    k = header[1];
+    levels = header[2];
+    bytes = header[3];
+
+    centers.resize( (size_t) nodes * bytes );
+    first_child.resize( nodes );
+    child_count.resize( nodes );
+    node_word.resize( nodes );
+    idf.resize( words );
+    file.read( (char *) &centers[0], centers.size() );
+    file.read( (char *) &first_child[0], nodes * sizeof(int) );
+    file.read( (char *) &child_count[0], nodes * sizeof(int) );
+    file.read( (char *) &node_word[0], nodes * sizeof(int) );
+    file.read( (char *) &idf[0], words * sizeof(float) );
+    bool ok = !file.fail();
+    for ( int n = 0; n < nodes && ok; n++ ) {
+        if ( node_word[n] < 0 ) {
+            ok = first_child[n] > n && child_count[n] > 0 && child_count[n] <= nodes - first_child[n];
+        } else {
+            ok = node_word[n] < words;
+        }
+    }
+    if ( !ok ) {
+        node_word.clear();
+        idf.clear();
+    }
+    return ok;
+}
+
+/**
+ * Word of a descriptor: walk down the tree to the nearest child at each level.
+ **/
+int Vocabulary::word(const unsigned char *descriptor) const
+{
+    int node = 0;
+    while ( node_word[node] < 0 ) {
+        int child = first_child[node];
+        int best = child;
+        int best_distance = HammingDistance( descriptor, &centers[child * bytes], bytes );
+        for ( int c = child + 1; c < child + child_count[node]; c++ ) {
+            int d = HammingDistance( descriptor, &centers[c * bytes], bytes );
+            if ( d < best_distance ) {
+                best_distance = d;
+                best = c;
+            }
+        }
+        node = best;
+    }
+    return node_word[node];
+}
+
+/**
+ * tf-idf bag of words vector of an image, from its descriptors.
+ **/
+void Vocabulary::transform(const cv::Mat &descriptors, BowVector &bow) const
+{
+    bow.clear();
+    if ( empty() || descriptors.cols != bytes ) {
+        return;
+    }
+    for ( int r = 0; r < descriptors.rows; r++ ) {
+        bow.push_back( std::make_pair( word( descriptors.ptr<unsigned char>(r) ), 1.0f ) );
+    }
+    std::sort( bow.begin(), bow.end() );
+
+    // Merge equal words, weight by idf, drop words that carry no information
+    size_t out = 0;
+    double total = 0.0;
+    for ( size_t i = 0; i < bow.size(); ) {
+        int w = bow[i].first;
+        size_t j = i;
+        while ( j < bow.size() && bow[j].first == w ) {
+            j++;
+        }
+        float weight = (j - i) * idf[w];
+        if ( weight > 0.0f ) {
+            bow[out++] = std::make_pair( w, weight );
+            total += weight;
+        }
+        i = j;
+    }
+    bow.resize( out );
+    for ( size_t i = 0; i < bow.size(); i++ ) {
+        bow[i].second /= total;
+    }
+}
+
+int Vocabulary::wordCount() const
+{
+    return idf.size();
+}
+
+int Vocabulary::descriptorBytes() const
+{
+    return bytes;
+}
+
+bool Vocabulary::empty() const
+{
+    return node_word.empty();
+}
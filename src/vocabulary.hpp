@@ -0,0 +1,62 @@
+#ifndef VOCABULARY_H
+#define VOCABULARY_H
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Bag of words vector: (word id, weight) pairs sorted by word id, weights
+ * L1 normalized.
+ **/
+typedef std::vector<std::pair<int, float> > BowVector;
+
+/**
+ * Number of differing bits between two binary descriptors of bytes bytes.
+ **/
+int HammingDistance(const unsigned char *a, const unsigned char *b, int bytes);
+
+/**
+ * Vocabulary tree over binary descriptors (BRISK, ORB, FREAK).
+ *
+ * Built offline by hierarchical k-medians: the descriptors are split in k
+ * clusters under the Hamming distance, where the center of a cluster is its
+ * bitwise majority, and each cluster is split again, levels deep. The leaves
+ * are the words, weighted by their inverse document frequency over the
+ * training images. Looking up a word costs k * levels descriptor distances.
+ **/
+class Vocabulary
+{
+    int k;
+    int levels;
+    int bytes;
+
+    // Nodes, node 0 is the root. Children of a node are stored contiguously.
+    std::vector<unsigned char> centers;
+    std::vector<int> first_child;
+    std::vector<int> child_count;
+    std::vector<int> node_word;     // word id of a leaf, -1 for inner nodes
+
+    std::vector<float> idf;         // weight per word
+
+    int addNode(const unsigned char *center);
+    void cluster(int node, std::vector<const unsigned char *> &descriptors, int level);
+
+public:
+    Vocabulary();
+
+    void train(const std::vector<cv::Mat> &descriptors, int k, int levels);
+    bool save(const std::string &filename) const;
+    bool load(const std::string &filename);
+
+    int word(const unsigned char *descriptor) const;
+    void transform(const cv::Mat &descriptors, BowVector &bow) const;
+
+    int wordCount() const;
+    int descriptorBytes() const;
+    bool empty() const;
+};
+
+#endif // VOCABULARY_H
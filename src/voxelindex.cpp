@@ -0,0 +1,345 @@
+#include "voxelindex.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+static const uint64_t EMPTY_KEY = ~(uint64_t) 0;
+
+// Voxel coordinates are stored in 21 bits each
+static const int COORDINATE_OFFSET = 1 << 20;
+
+static bool closer(const std::pair<int, double> &a, const std::pair<int, double> &b)
+{
+    return a.second < b.second;
+}
+
+VoxelIndex::VoxelIndex(double voxel_size)
+{
+    this->used = 0;
+    this->count = 0;
+    setVoxelSize( voxel_size );
+}
+
+/**
+ * Change the voxel size, which empties the index.
+ **/
+void VoxelIndex::setVoxelSize(double size)
+{
+    voxel_size = size;
+    inverse_size = 1.0 / size;
+    clear();
+}
+
+double VoxelIndex::voxelSize() const
+{
+    return voxel_size;
+}
+
+void VoxelIndex::clear()
+{
+    keys.assign( 64, EMPTY_KEY );
+    heads.assign( 64, -1 );
+    used = 0;
+    count = 0;
+    points.clear();
+    point_keys.clear();
+    next.clear();
+    previous.clear();
+    present.clear();
+}
+
+int VoxelIndex::voxelCoordinate(double v) const
+{
+    double c = std::floor( v * inverse_size );
+    // Far away points share the outermost voxels, queries stay correct
+    c = std::max( c, (double) -COORDINATE_OFFSET );
+    c = std::min( c, (double) COORDINATE_OFFSET - 1 );
+    return (int) c;
+}
+
+uint64_t VoxelIndex::voxelKey(int ix, int iy, int iz) const
+{
+    return ( (uint64_t) (ix + COORDINATE_OFFSET) << 42 ) |
+           ( (uint64_t) (iy + COORDINATE_OFFSET) << 21 ) |
+             (uint64_t) (iz + COORDINATE_OFFSET);
+}
+
+uint64_t VoxelIndex::voxelKey(const cv::Point3d &p) const
+{
+    return voxelKey( voxelCoordinate(p.x), voxelCoordinate(p.y), voxelCoordinate(p.z) );
+}
+
+static inline size_t hashKey(uint64_t key, size_t mask)
+{
+    key ^= key >> 29;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (size_t) (key >> 32) & mask;
+}
+
+/**
+ * Slot of a voxel in the table (linear probing), -1 if it is not there.
+ **/
+int VoxelIndex::findSlot(uint64_t key) const
+{
+    size_t mask = keys.size() - 1;
+    for ( size_t s = hashKey(key, mask); ; s = (s + 1) & mask ) {
+        if ( keys[s] == key ) {
+            return s;
+        }
+        if ( keys[s] == EMPTY_KEY ) {
+            return -1;
+        }
+    }
+}
+
+int VoxelIndex::insertSlot(uint64_t key)
+{
+    int found = findSlot( key );
+    if ( found >= 0 ) {
+        return found;
+    }
+    if ( 2 * (used + 1) > (int) keys.size() ) {
+        rehash( 2 * keys.size() );
+    }
+    size_t mask = keys.size() - 1;
+    size_t s = hashKey( key, mask );
+    while ( keys[s] != EMPTY_KEY ) {
+        s = (s + 1) & mask;
+    }
+    keys[s] = key;
+    heads[s] = -1;
+    used++;
+    return s;
+}
+
+/**
+ * Rebuild the table, dropping voxels that have become empty.
+ **/
+void VoxelIndex::rehash(int capacity)
+{
+    std::vector<uint64_t> old_keys;
+    std::vector<int> old_heads;
+    old_keys.swap( keys );
+    old_heads.swap( heads );
+
+    int live = 0;
+    for ( size_t s = 0; s < old_keys.size(); s++ ) {
+        live += old_keys[s] != EMPTY_KEY && old_heads[s] >= 0;
+    }
+    int size = 64;
+    while ( size < capacity && size < 4 * live ) {
+        size *= 2;
+    }
+    while ( size < 2 * live + 2 ) {
+        size *= 2;
+    }
+
+    keys.assign( size, EMPTY_KEY );
+    heads.assign( size, -1 );
+    used = 0;
+    size_t mask = size - 1;
+    for ( size_t o = 0; o < old_keys.size(); o++ ) {
+        if ( old_keys[o] == EMPTY_KEY || old_heads[o] < 0 ) {
+            continue;
+        }
+        size_t s = hashKey( old_keys[o], mask );
+        while ( keys[s] != EMPTY_KEY ) {
+            s = (s + 1) & mask;
+        }
+        keys[s] = old_keys[o];
+        heads[s] = old_heads[o];
+        used++;
+    }
+}
+
+void VoxelIndex::insert(int id, const cv::Point3d &p)
+{
+    if ( id >= (int) present.size() ) {
+        int n = std::max( id + 1, 2 * (int) present.size() );
+        points.resize( n );
+        point_keys.resize( n );
+        next.resize( n, -1 );
+        previous.resize( n, -1 );
+        present.resize( n, 0 );
+    }
+    if ( present[id] ) {
+        move( id, p );
+        return;
+    }
+    uint64_t key = voxelKey( p );
+    int s = insertSlot( key );
+    points[id] = p;
+    point_keys[id] = key;
+    previous[id] = -1;
+    next[id] = heads[s];
+    if ( heads[s] >= 0 ) {
+        previous[heads[s]] = id;
+    }
+    heads[s] = id;
+    present[id] = 1;
+    count++;
+}
+
+bool VoxelIndex::remove(int id)
+{
+    if ( !contains(id) ) {
+        return false;
+    }
+    if ( previous[id] >= 0 ) {
+        next[previous[id]] = next[id];
+    } else {
+        heads[findSlot( point_keys[id] )] = next[id];
+    }
+    if ( next[id] >= 0 ) {
+        previous[next[id]] = previous[id];
+    }
+    present[id] = 0;
+    count--;
+    return true;
+}
+
+/**
+ * Update the position of a point, only relinked when it changes voxel.
+ **/
+void VoxelIndex::move(int id, const cv::Point3d &p)
+{
+    if ( !contains(id) ) {
+        insert( id, p );
+        return;
+    }
+    if ( voxelKey(p) == point_keys[id] ) {
+        points[id] = p;
+        return;
+    }
+    remove( id );
+    insert( id, p );
+}
+
+bool VoxelIndex::contains(int id) const
+{
+    return id >= 0 && id < (int) present.size() && present[id];
+}
+
+int VoxelIndex::size() const
+{
+    return count;
+}
+
+/**
+ * Number of voxels in the table, including ones emptied since the last rehash.
+ **/
+int VoxelIndex::voxelCount() const
+{
+    return used;
+}
+
+/**
+ * Mean of the points of every voxel that holds any, in no particular order:
+ * the points thinned out to one per voxel. Returns the number of centroids.
+ **/
+int VoxelIndex::voxelCentroids(std::vector<cv::Point3d> &centroids) const
+{
+    centroids.clear();
+    for ( size_t s = 0; s < keys.size(); s++ ) {
+        if ( keys[s] == EMPTY_KEY || heads[s] < 0 ) {
+            continue;
+        }
+        cv::Point3d sum( 0, 0, 0 );
+        int n = 0;
+        for ( int id = heads[s]; id >= 0; id = next[id] ) {
+            sum += points[id];
+            n++;
+        }
+        centroids.push_back( sum * (1.0 / n) );
+    }
+    return centroids.size();
+}
+
+void VoxelIndex::visitVoxel(int ix, int iy, int iz, const cv::Point3d &p, double radius2,
+                            std::vector<std::pair<int, double> > &found) const
+{
+    int s = findSlot( voxelKey(ix, iy, iz) );
+    if ( s < 0 ) {
+        return;
+    }
+    for ( int id = heads[s]; id >= 0; id = next[id] ) {
+        cv::Point3d d = points[id] - p;
+        double d2 = d.x * d.x + d.y * d.y + d.z * d.z;
+        if ( d2 <= radius2 ) {
+            found.push_back( std::make_pair( id, d2 ) );
+        }
+    }
+}
+
+/**
+ * Ids of all points within radius of p, in no particular order.
+ **/
+int VoxelIndex::radiusSearch(const cv::Point3d &p, double radius, std::vector<int> &ids) const
+{
+    ids.clear();
+    if ( count == 0 ) {
+        return 0;
+    }
+    std::vector<std::pair<int, double> > found;
+    int x0 = voxelCoordinate( p.x - radius ), x1 = voxelCoordinate( p.x + radius );
+    int y0 = voxelCoordinate( p.y - radius ), y1 = voxelCoordinate( p.y + radius );
+    int z0 = voxelCoordinate( p.z - radius ), z1 = voxelCoordinate( p.z + radius );
+    for ( int ix = x0; ix <= x1; ix++ ) {
+        for ( int iy = y0; iy <= y1; iy++ ) {
+            for ( int iz = z0; iz <= z1; iz++ ) {
+                visitVoxel( ix, iy, iz, p, radius * radius, found );
+            }
+        }
+    }
+    ids.reserve( found.size() );
+    for ( size_t i = 0; i < found.size(); i++ ) {
+        ids.push_back( found[i].first );
+    }
+    return ids.size();
+}
+
+/**
+ * The k points closest to p within max_radius as (id, distance), closest
+ * first. Searches shells of voxels around the voxel of p outward and stops
+ * as soon as no unvisited voxel can hold a closer point.
+ **/
+int VoxelIndex::nearest(const cv::Point3d &p, int k, double max_radius,
+                        std::vector<std::pair<int, double> > &results) const
+{
+    results.clear();
+    if ( count == 0 || k <= 0 ) {
+        return 0;
+    }
+    int cx = voxelCoordinate( p.x ), cy = voxelCoordinate( p.y ), cz = voxelCoordinate( p.z );
+    int rings = (int) std::ceil( max_radius * inverse_size );
+    double radius2 = max_radius * max_radius;
+
+    std::vector<std::pair<int, double> > found;
+    for ( int r = 0; r <= rings; r++ ) {
+        // Voxels at Chebyshev distance r from the center voxel
+        for ( int dx = -r; dx <= r; dx++ ) {
+            for ( int dy = -r; dy <= r; dy++ ) {
+                bool edge = std::abs(dx) == r || std::abs(dy) == r;
+                for ( int dz = -r; dz <= r; dz += edge || r == 0 ? 1 : 2 * r ) {
+                    visitVoxel( cx + dx, cy + dy, cz + dz, p, radius2, found );
+                }
+            }
+        }
+        if ( (int) found.size() >= k ) {
+            std::nth_element( found.begin(), found.begin() + (k - 1), found.end(), closer );
+            // Points beyond ring r are at least r voxels away
+            double bound = r * voxel_size;
+            if ( found[k - 1].second <= bound * bound ) {
+                break;
+            }
+        }
+    }
+
+    int n = std::min( k, (int) found.size() );
+    std::partial_sort( found.begin(), found.begin() + n, found.end(), closer );
+    results.assign( found.begin(), found.begin() + n );
+    for ( int i = 0; i < n; i++ ) {
+        results[i].second = std::sqrt( results[i].second );
+    }
+    return n;
+}
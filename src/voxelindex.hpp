@@ -0,0 +1,71 @@
+#ifndef VOXELINDEX_H
+#define VOXELINDEX_H
+
+#include <opencv2/core/core.hpp>
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Spatial hash over 3d points, for radius and nearest neighbour queries.
+ *
+ * Space is cut in cubic voxels of a fixed size. The voxels that hold points
+ * are kept in an open addressing hash table keyed on the voxel coordinates;
+ * the points of a voxel are chained through a doubly linked list indexed by
+ * point id, so insert, remove and move take constant time. A query only
+ * visits the voxels that overlap the search ball, which for a radius in the
+ * order of the voxel size is 27 voxels whatever the size of the map.
+ *
+ * Ids are small non-negative integers (the stable ids of a Cloud); storage
+ * per id is allocated up to the largest id inserted.
+ **/
+class VoxelIndex
+{
+    double voxel_size;
+    double inverse_size;
+
+    // Hash table over voxels, slots with key EMPTY_KEY are free
+    std::vector<uint64_t> keys;
+    std::vector<int> heads;         // first point of the voxel, -1 if none left
+    int used;                       // slots holding a key
+    int count;                      // points in the index
+
+    // Points by id
+    std::vector<cv::Point3d> points;
+    std::vector<uint64_t> point_keys;
+    std::vector<int> next;
+    std::vector<int> previous;
+    std::vector<unsigned char> present;
+
+    uint64_t voxelKey(int ix, int iy, int iz) const;
+    uint64_t voxelKey(const cv::Point3d &p) const;
+    int voxelCoordinate(double v) const;
+    int findSlot(uint64_t key) const;
+    int insertSlot(uint64_t key);
+    void rehash(int capacity);
+    void visitVoxel(int ix, int iy, int iz, const cv::Point3d &p, double radius2,
+                    std::vector<std::pair<int, double> > &found) const;
+
+public:
+    VoxelIndex(double voxel_size = 0.1);
+
+    void setVoxelSize(double size);
+    double voxelSize() const;
+
+    void clear();
+    void insert(int id, const cv::Point3d &p);
+    bool remove(int id);
+    void move(int id, const cv::Point3d &p);
+
+    bool contains(int id) const;
+    int size() const;
+    int voxelCount() const;
+
+    int radiusSearch(const cv::Point3d &p, double radius, std::vector<int> &ids) const;
+    int nearest(const cv::Point3d &p, int k, double max_radius,
+                std::vector<std::pair<int, double> > &results) const;
+    int voxelCentroids(std::vector<cv::Point3d> &centroids) const;
+};
+
+#endif // VOXELINDEX_H